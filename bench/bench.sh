@@ -0,0 +1,216 @@
+#!/bin/sh
+# Loopback benchmark matrix: for every workload below, start landropd, send
+# a dataset with landrop and measure both sides through bench/procstat.
+# Prints a table and writes the same numbers as TSV, one file per commit,
+# so runs of two commits can be compared with diff or any TSV tool.
+#
+#   make bench                      # builds, then runs this
+#   bench/bench.sh [workload...]    # only the named workloads
+#
+# Environment:
+#   BIN          build to measure (default bin/native, needs procstat too)
+#   PORT         loopback port (default 19520)
+#   DEST         directory the server writes below (default: TMPDIR); a
+#                tmpfs such as /dev/shm keeps disk noise out of the numbers
+#   OUT          results file (default bench/results/<commit>.tsv)
+#   REPS         runs per workload, the median by wall time is kept (3)
+#   SERVER_ARGS  extra landropd options, CLIENT_ARGS extra landrop options
+#   LARGE_MIB    size of the single-file datasets (256)
+#   SMALL_FILES, SMALL_KIB   flat directory of small files (20000 x 4 KiB)
+#   DEEP_DEPTH, DEEP_FANOUT, DEEP_FILES, DEEP_KIB
+#                directory tree: depth, subdirectories per directory, files
+#                per directory and their size (5, 4, 4, 16)
+#
+# Sources are generated once per run and read from the page cache. CPU is
+# user + system time of all threads, per GB of content; syscalls are the
+# read/write family counted by the kernel (see bench/procstat.c).
+set -eu
+
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19520}
+REPS=${REPS:-3}
+SERVER_ARGS=${SERVER_ARGS:-}
+CLIENT_ARGS=${CLIENT_ARGS:-}
+LARGE_MIB=${LARGE_MIB:-256}
+SMALL_FILES=${SMALL_FILES:-20000}
+SMALL_KIB=${SMALL_KIB:-4}
+DEEP_DEPTH=${DEEP_DEPTH:-5}
+DEEP_FANOUT=${DEEP_FANOUT:-4}
+DEEP_FILES=${DEEP_FILES:-4}
+DEEP_KIB=${DEEP_KIB:-16}
+
+# name           dataset  client options
+WORKLOADS='
+large            random
+large_z          random   -z on
+text             text
+text_z           text     -z on
+text_zauto       text     -z auto
+small            small
+small_nobatch    small    -B 0
+deep             deep
+'
+
+for b in landrop landropd procstat; do
+    if [ ! -x "$BIN/$b" ]; then
+        echo "$BIN/$b missing, build first: make bench" >&2
+        exit 1
+    fi
+done
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ "$commit" != unknown ] && ! git diff --quiet HEAD -- 'src/*.[ch]' 2>/dev/null; then
+    commit=$commit-dirty
+fi
+OUT=${OUT:-bench/results/$commit.tsv}
+mkdir -p "$(dirname "$OUT")"
+
+WORK=$(mktemp -d)
+DST=${DEST:-$WORK}/landrop-bench.$$
+SRV_PID=
+stop_server() {
+    if [ -n "$SRV_PID" ]; then
+        kill -INT "$SRV_PID" 2>/dev/null || true
+        wait "$SRV_PID" 2>/dev/null || true
+        SRV_PID=
+    fi
+}
+cleanup() {
+    stop_server
+    rm -rf "$WORK" "$DST"
+}
+trap cleanup EXIT INT TERM
+
+# Datasets, made on first use
+make_tree() { # dir depth (recursing in subshells: sh has no local variables)
+    mkdir -p "$1"
+    n=0
+    while [ $n -lt "$DEEP_FILES" ]; do
+        head -c $((DEEP_KIB * 1024)) /dev/urandom >"$1/f$n"
+        n=$((n + 1))
+    done
+    if [ "$2" -gt 0 ]; then
+        k=0
+        while [ $k -lt "$DEEP_FANOUT" ]; do
+            (make_tree "$1/d$k" $(($2 - 1)))
+            k=$((k + 1))
+        done
+    fi
+}
+
+dataset() { # name -> path
+    p=$WORK/data/$1
+    if [ ! -e "$p" ]; then
+        mkdir -p "$WORK/data"
+        case $1 in
+            random) head -c $((LARGE_MIB * 1024 * 1024)) /dev/urandom >"$p" ;;
+            text)
+                # CSV rows of a fixed pseudo-random sequence, so every run
+                # compresses the same
+                awk -v lim=$((LARGE_MIB * 1024 * 1024)) 'BEGIN {
+                    srand(1)
+                    split("alpha beta gamma delta epsilon zeta eta theta", w, " ")
+                    while (n < lim) {
+                        s = sprintf("%d,%s,%s,%.4f,%d,2024-%02d-%02dT%02d:%02d:%02dZ\n", i++,
+                                    w[int(rand() * 8) + 1], w[int(rand() * 8) + 1], rand() * 1000,
+                                    int(rand() * 100000), int(rand() * 12) + 1, int(rand() * 28) + 1,
+                                    int(rand() * 24), int(rand() * 60), int(rand() * 60))
+                        printf "%s", s
+                        n += length(s)
+                    }
+                }' | head -c $((LARGE_MIB * 1024 * 1024)) >"$p"
+                ;;
+            small)
+                mkdir -p "$p"
+                head -c $((SMALL_FILES * SMALL_KIB * 1024)) /dev/urandom |
+                    (cd "$p" && split -a 6 -b $((SMALL_KIB * 1024)) - f)
+                ;;
+            deep) make_tree "$p" "$DEEP_DEPTH" ;;
+            *) echo "unknown dataset $1" >&2; exit 1 ;;
+        esac
+    fi
+    echo "$p"
+}
+
+# run <dataset path> <client options...>: one transfer, appends
+# "wall files bytes ccpu cr cw scpu sr sw ok" to $WORK/reps
+run_once() {
+    src=$1
+    shift
+    rm -rf "$DST"
+    mkdir -p "$DST"
+    # shellcheck disable=SC2086
+    "$BIN/procstat" "$WORK/server.stat" "$BIN/landropd" -p "$PORT" -d "$DST" $SERVER_ARGS \
+        2>"$WORK/server.log" &
+    SRV_PID=$!
+    i=0
+    while ! grep -q listening "$WORK/server.log" 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/server.log" >&2; exit 1; }
+        sleep 0.1
+    done
+    if [ -d "$src" ]; then
+        set -- -d "$src" "$@"
+    else
+        set -- -f "$src" "$@"
+    fi
+    start=$(date +%s.%N)
+    rc=0
+    # shellcheck disable=SC2086
+    "$BIN/procstat" "$WORK/client.stat" "$BIN/landrop" -h 127.0.0.1 -p "$PORT" "$@" $CLIENT_ARGS \
+        2>"$WORK/client.log" || rc=$?
+    end=$(date +%s.%N)
+    stop_server
+    want=$(find "$src" -type f | wc -l)
+    got=$(find "$DST" -type f ! -name '.*' | wc -l)
+    bytes=$(find "$src" -type f -printf '%s\n' | awk '{ s += $1 } END { printf "%d", s }')
+    ok=1
+    if [ "$rc" -ne 0 ] || [ "$got" -ne "$want" ]; then
+        ok=0
+        echo "transfer failed (exit $rc, $got of $want files):" >&2
+        tail -3 "$WORK/client.log" >&2
+        : >"$WORK/failed"
+    fi
+    read -r cu cs cr cw <"$WORK/client.stat"
+    read -r su ss sr sw <"$WORK/server.stat"
+    awk -v s="$start" -v e="$end" -v f="$want" -v b="$bytes" -v cu="$cu" -v cs="$cs" -v cr="$cr" \
+        -v cw="$cw" -v su="$su" -v ss="$ss" -v sr="$sr" -v sw="$sw" -v ok="$ok" 'BEGIN {
+        printf "%.4f %d %d %.4f %d %d %.4f %d %d %d\n", e - s, f, b, cu + cs, cr, cw, su + ss, sr, sw, ok
+    }' >>"$WORK/reps"
+}
+
+{
+    echo "# landrop bench $commit $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    echo "# $(uname -sr), $(nproc) cpu, $(grep -m1 'model name' /proc/cpuinfo 2>/dev/null | sed 's/.*: //')"
+    echo "# dest $(df -PT "${DEST:-$WORK}" | awk 'NR == 2 { print $2 }'), reps $REPS, server [$SERVER_ARGS], client [$CLIENT_ARGS]"
+    printf 'workload\tfiles\tbytes\twall_s\tMB_s\tfiles_s\tclient_cpu_s_per_GB\tserver_cpu_s_per_GB'
+    printf '\tclient_syscalls\tserver_syscalls\tok\n'
+} >"$OUT"
+
+printf '%-14s %7s %9s %8s %10s %9s %9s %10s %10s\n' workload files MB MB/s files/s \
+    'cCPU/GB' 'sCPU/GB' 'c-sysc' 's-sysc'
+echo "$WORKLOADS" | while read -r name data opts; do
+    [ -n "$name" ] || continue
+    if [ $# -gt 0 ]; then
+        case " $* " in *" $name "*) ;; *) continue ;; esac
+    fi
+    src=$(dataset "$data")
+    : >"$WORK/reps"
+    r=0
+    while [ $r -lt "$REPS" ]; do
+        # shellcheck disable=SC2086
+        run_once "$src" $opts
+        r=$((r + 1))
+    done
+    sort -n "$WORK/reps" | sed -n "$(((REPS + 1) / 2))p" | awk -v n="$name" -v out="$OUT" '{
+        wall = $1; gb = $3 / 1e9
+        mbs = $3 / 1e6 / wall; fps = $2 / wall
+        cpg = gb > 0 ? $4 / gb : 0; spg = gb > 0 ? $7 / gb : 0
+        printf "%s\t%d\t%d\t%.3f\t%.1f\t%.0f\t%.3f\t%.3f\t%d\t%d\t%d\n", n, $2, $3, wall, mbs, fps,
+               cpg, spg, $5 + $6, $8 + $9, $10 >> out
+        printf "%-14s %7d %9.1f %8.1f %10.0f %9.3f %9.3f %10d %10d%s\n", n, $2, $3 / 1e6, mbs, fps,
+               cpg, spg, $5 + $6, $8 + $9, $10 ? "" : "  FAILED"
+    }'
+done
+echo "results in $OUT"
+[ ! -e "$WORK/failed" ]
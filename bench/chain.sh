@@ -0,0 +1,79 @@
+#!/bin/sh
+# Relay chain on loopback: start N landropd nodes, each relaying (-R) to
+# the next, send one file to the first and report how long it took to
+# reach all of them, next to sending it N times from one sender (to the
+# last node, which relays nothing) as without a chain.
+#
+#   bench/chain.sh [nodes] [file_size_mib]
+#
+# BIN (default bin/native) selects the build, PORT the first loopback port
+# (the nodes take PORT, PORT+1, ...) and SERVER_ARGS extra landropd
+# options. The files land under TMPDIR.
+set -eu
+
+NODES=${1:-4}
+SIZE_MIB=${2:-256}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19600}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill -INT "$pid" 2>/dev/null || true
+    done
+    for pid in $PIDS; do
+        wait "$pid" 2>/dev/null || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/src"
+dd if=/dev/urandom of="$WORK/src/payload" bs=1M count="$SIZE_MIB" 2>/dev/null
+
+# Last node first, so every relay finds its next hop listening
+i=$((NODES - 1))
+while [ $i -ge 0 ]; do
+    mkdir -p "$WORK/n$i"
+    relay=
+    [ $i -lt $((NODES - 1)) ] && relay="-R 127.0.0.1:$((PORT + i + 1))"
+    "$BIN/landropd" -q -o -p $((PORT + i)) -d "$WORK/n$i" $relay $SERVER_ARGS 2>"$WORK/n$i.log" &
+    PIDS="$PIDS $!"
+    j=0
+    while ! grep -q listening "$WORK/n$i.log" 2>/dev/null; do
+        j=$((j + 1))
+        [ $j -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/n$i.log" >&2; exit 1; }
+        sleep 0.1
+    done
+    i=$((i - 1))
+done
+
+now() { date +%s.%N; }
+
+start=$(now)
+"$BIN/landrop" -h 127.0.0.1 -p "$PORT" -f "$WORK/src/payload" -n chain 2>"$WORK/client.log"
+chain=$(awk -v s="$start" -v e="$(now)" 'BEGIN { printf "%.2f", e - s }')
+
+start=$(now)
+i=0
+while [ $i -lt "$NODES" ]; do
+    "$BIN/landrop" -h 127.0.0.1 -p $((PORT + NODES - 1)) -f "$WORK/src/payload" -n "direct$i" 2>>"$WORK/client.log"
+    i=$((i + 1))
+done
+direct=$(awk -v s="$start" -v e="$(now)" 'BEGIN { printf "%.2f", e - s }')
+
+ok=0
+i=0
+while [ $i -lt "$NODES" ]; do
+    cmp -s "$WORK/src/payload" "$WORK/n$i/chain" && ok=$((ok + 1))
+    i=$((i + 1))
+done
+echo "nodes=$NODES size=${SIZE_MIB}MiB chain=${chain}s one_by_one=${direct}s intact=$ok/$NODES"
+[ "$ok" -eq "$NODES" ]
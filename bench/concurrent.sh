@@ -0,0 +1,67 @@
+#!/bin/sh
+# Loopback load: start landropd, fire N landrop clients at it at once and
+# report the aggregate throughput.
+#
+#   bench/concurrent.sh [clients] [file_size_mib] [workers]
+#
+# BIN (default bin/native) selects the build, PORT the loopback port and
+# SERVER_ARGS extra landropd options (e.g. -U). The files land under TMPDIR.
+set -eu
+
+CLIENTS=${1:-200}
+SIZE_MIB=${2:-4}
+WORKERS=${3:-1}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19500}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+SRV_PID=
+cleanup() {
+    if [ -n "$SRV_PID" ]; then
+        kill -INT "$SRV_PID" 2>/dev/null || true
+        wait "$SRV_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/src" "$WORK/dst"
+dd if=/dev/urandom of="$WORK/src/payload" bs=1M count="$SIZE_MIB" 2>/dev/null
+
+"$BIN/landropd" -p "$PORT" -d "$WORK/dst" -w "$WORKERS" $SERVER_ARGS 2>"$WORK/server.log" &
+SRV_PID=$!
+i=0
+while ! grep -q listening "$WORK/server.log" 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/server.log" >&2; exit 1; }
+    sleep 0.1
+done
+
+start=$(date +%s.%N)
+pids=
+i=0
+while [ $i -lt "$CLIENTS" ]; do
+    "$BIN/landrop" -h 127.0.0.1 -p "$PORT" -f "$WORK/src/payload" -n "c$i" \
+        2>"$WORK/client.$i.log" &
+    pids="$pids $!"
+    i=$((i + 1))
+done
+fail=0
+for pid in $pids; do
+    wait "$pid" || fail=$((fail + 1))
+done
+end=$(date +%s.%N)
+
+ok=$(ls "$WORK/dst" | wc -l)
+awk -v s="$start" -v e="$end" -v n="$CLIENTS" -v m="$SIZE_MIB" -v ok="$ok" -v f="$fail" 'BEGIN {
+    t = e - s
+    printf "clients=%d size=%dMiB ok=%d failed=%d time=%.2fs throughput=%.1f MiB/s\n",
+           n, m, ok, f, t, (ok * m) / t
+}'
+[ "$fail" -eq 0 ]
@@ -0,0 +1,83 @@
+// Microbenchmark of the CRC-32C kernels: the table version and whatever
+// crc32c() dispatches to on this CPU (SSE4.2 on x86-64, the CRC32
+// extension on aarch64). Build with `make crc32c_bench` (or
+// `make arm64 crc32c_bench`) and run bin/<arch>/crc32c_bench.
+//
+// For each buffer size it prints GB/s and what share of one core hashing a
+// saturated 10 GbE link (1.25 GB/s) would take.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+
+#define LINK_10GBE (10e9 / 8)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Hash buf repeatedly for about min_sec, returns bytes per second
+static double run(uint32_t (*fn)(uint32_t, const void *, size_t), const unsigned char *buf, size_t n,
+                  double min_sec, uint32_t *sink) {
+    uint64_t bytes = 0;
+    uint32_t crc = 0;
+    size_t iters = 1;
+    double t0 = now(), t;
+    for (;;) {
+        for (size_t i = 0; i < iters; ++i)
+            crc = fn(crc, buf, n);
+        bytes += (uint64_t)iters * n;
+        t = now() - t0;
+        if (t >= min_sec)
+            break;
+        iters *= 2;
+    }
+    *sink ^= crc;
+    return (double)bytes / t;
+}
+
+int main(int argc, char **argv) {
+    double min_sec = argc > 1 ? atof(argv[1]) : 0.5;
+    static const size_t sizes[] = { 64, 1024, 64 * 1024, 1024 * 1024 };
+    size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    unsigned char *buf = (unsigned char *)malloc(max + 1);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < max + 1; ++i)
+        buf[i] = (unsigned char)rand();
+
+    // Both kernels must agree, on every path through the interleaved loops
+    // and on unaligned starts
+    int bad = crc32c(0, "123456789", 9) != 0xE3069283u || crc32c_portable(0, "123456789", 9) != 0xE3069283u;
+    for (size_t n = 0; n < 3 * 8192 + 3 * 256 + 64 && !bad; n += 7)
+        bad = crc32c(0, buf + (n & 7), n) != crc32c_portable(0, buf + (n & 7), n);
+    if (bad || crc32c(0, buf + 1, max) != crc32c_portable(0, buf + 1, max)) {
+        fprintf(stderr, "crc32c self-test failed\n");
+        return 1;
+    }
+
+    uint32_t sink = 0;
+    printf("%-14s %10s %10s %14s\n", "kernel", "size", "GB/s", "core@10GbE");
+    for (int k = 0; k < 2; ++k) {
+        const char *name = k == 0 ? "slicing-by-8" : crc32c_impl();
+        uint32_t (*fn)(uint32_t, const void *, size_t) = k == 0 ? crc32c_portable : crc32c;
+        if (k == 1 && strcmp(name, "slicing-by-8") == 0) {
+            printf("(no CRC instruction on this CPU)\n");
+            break;
+        }
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            double rate = run(fn, buf, sizes[i], min_sec, &sink);
+            printf("%-14s %10zu %10.2f %13.1f%%\n", name, sizes[i], rate / 1e9, 100.0 * LINK_10GBE / rate);
+        }
+    }
+    free(buf);
+    return sink == 0xFFFFFFFFu; // keep the results alive
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+# Multicast fan-out on loopback: start N landropd receivers joined to one
+# group, send a file to the group once and report how long it took until
+# all of them had stored it, next to sending it N times over TCP (to the
+# first one) as without multicast.
+#
+#   bench/mcast.sh [receivers] [file_size_mib]
+#
+# BIN (default bin/native) selects the build, PORT the first loopback TCP
+# port (the receivers take PORT, PORT+1, ...), GROUP the multicast group
+# and port, and CLIENT_ARGS extra landrop options for the multicast send
+# (e.g. --rate). The files land under TMPDIR.
+set -eu
+
+RECEIVERS=${1:-3}
+SIZE_MIB=${2:-256}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19700}
+GROUP=${GROUP:-239.77.0.1:19800}
+CLIENT_ARGS=${CLIENT_ARGS:-}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill -INT "$pid" 2>/dev/null || true
+    done
+    for pid in $PIDS; do
+        wait "$pid" 2>/dev/null || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/src"
+dd if=/dev/urandom of="$WORK/src/payload" bs=1M count="$SIZE_MIB" 2>/dev/null
+
+i=0
+while [ $i -lt "$RECEIVERS" ]; do
+    mkdir -p "$WORK/r$i"
+    "$BIN/landropd" -q -o -p $((PORT + i)) -d "$WORK/r$i" -M "$GROUP" --mcast-if 127.0.0.1 2>"$WORK/r$i.log" &
+    PIDS="$PIDS $!"
+    j=0
+    while ! grep -q "Receiving multicast" "$WORK/r$i.log" 2>/dev/null; do
+        j=$((j + 1))
+        [ $j -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/r$i.log" >&2; exit 1; }
+        sleep 0.1
+    done
+    i=$((i + 1))
+done
+
+now() { date +%s.%N; }
+
+start=$(now)
+# shellcheck disable=SC2086
+"$BIN/landrop" -M "$GROUP" --mcast-if 127.0.0.1 --expect "$RECEIVERS" $CLIENT_ARGS -f "$WORK/src/payload" -n fanout \
+    2>"$WORK/client.log" || true
+mcast=$(awk -v s="$start" -v e="$(now)" 'BEGIN { printf "%.2f", e - s }')
+resent=$(tr '\r' '\n' <"$WORK/client.log" | sed -n 's/.*, \([0-9]*\) blocks resent/\1/p')
+
+start=$(now)
+i=0
+while [ $i -lt "$RECEIVERS" ]; do
+    "$BIN/landrop" -h 127.0.0.1 -p "$PORT" -f "$WORK/src/payload" -n "direct$i" 2>>"$WORK/client.log"
+    i=$((i + 1))
+done
+direct=$(awk -v s="$start" -v e="$(now)" 'BEGIN { printf "%.2f", e - s }')
+
+ok=0
+i=0
+while [ $i -lt "$RECEIVERS" ]; do
+    cmp -s "$WORK/src/payload" "$WORK/r$i/fanout" && ok=$((ok + 1))
+    i=$((i + 1))
+done
+echo "receivers=$RECEIVERS size=${SIZE_MIB}MiB multicast=${mcast}s resent=${resent:-?} one_by_one=${direct}s intact=$ok/$RECEIVERS"
+[ "$ok" -eq "$RECEIVERS" ]
@@ -0,0 +1,103 @@
+// Run a command and report what it cost: CPU time (user and system, all
+// threads) and the read/write family system calls it made. Used by
+// bench/bench.sh to measure landrop and landropd from the outside.
+//
+//   procstat <outfile> <command> [args...]
+//
+// When the command exits, one line goes to outfile:
+//   <user seconds> <system seconds> <read syscalls> <write syscalls>
+// The counts are syscr/syscw from /proc/<pid>/io (read, pread, readv,
+// sendfile, copy_file_range and friends count; splice and io_uring do not),
+// read while the command is a zombie so nothing is lost. SIGINT and
+// SIGTERM are passed on to the command; procstat exits with its status.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static volatile pid_t g_child;
+
+static void forward(int sig) {
+    if (g_child > 0)
+        kill(g_child, sig);
+}
+
+// syscr and syscw of a process, 0 if /proc does not say
+static void io_counts(pid_t pid, unsigned long long *rd, unsigned long long *wr) {
+    char path[64], line[128];
+    *rd = *wr = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "syscr:", 6) == 0)
+            *rd = strtoull(line + 6, NULL, 10);
+        else if (strncmp(line, "syscw:", 6) == 0)
+            *wr = strtoull(line + 6, NULL, 10);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <outfile> <command> [args...]\n", argv[0]);
+        return 2;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 2;
+    }
+    if (pid == 0) {
+        execvp(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+    g_child = pid;
+
+    // Wait for the exit but leave the zombie around to read its counters
+    siginfo_t si;
+    for (;;) {
+        memset(&si, 0, sizeof(si));
+        if (waitid(P_PID, (id_t)pid, &si, WEXITED | WNOWAIT) == 0)
+            break;
+        if (errno != EINTR) {
+            perror("waitid");
+            return 2;
+        }
+    }
+    unsigned long long rd, wr;
+    io_counts(pid, &rd, &wr);
+
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return 2;
+        }
+    }
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 2;
+    }
+    fprintf(out, "%.6f %.6f %llu %llu\n", (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6,
+            (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6, rd, wr);
+    fclose(out);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Downloads from landropd -G on loopback: many clients fetching the same
+# artifact at once, one client fetching it in -j ranges, and one session
+# asking for a small file over and over. Prints the throughput (or request
+# rate) of each and how many files the server had to open for it (the rest
+# of the requests found theirs in its file cache).
+#
+#   bench/pull.sh [file_size_mib] [clients] [small_gets]
+#
+# BIN (default bin/native) selects the build, PORT the loopback port,
+# CLIENT_ARGS and SERVER_ARGS extra options for every run (e.g. --psk).
+# Files land under TMPDIR.
+set -eu
+
+SIZE_MIB=${1:-64}
+CLIENTS=${2:-100}
+SMALL=${3:-2000}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19910}
+CLIENT_ARGS=${CLIENT_ARGS:-}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+SERVER=
+cleanup() {
+    if [ -n "$SERVER" ]; then
+        kill -INT "$SERVER" 2>/dev/null || true
+        wait "$SERVER" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/srv" "$WORK/out"
+dd if=/dev/urandom of="$WORK/srv/artifact" bs=1M count="$SIZE_MIB" 2>/dev/null
+head -c 4096 /dev/urandom >"$WORK/srv/small"
+
+# shellcheck disable=SC2086
+"$BIN/landropd" -q -G -p "$PORT" -d "$WORK/srv" -S "$WORK/stats" $SERVER_ARGS 2>"$WORK/server.log" &
+SERVER=$!
+j=0
+while ! grep -q "listening" "$WORK/server.log" 2>/dev/null; do
+    j=$((j + 1))
+    [ $j -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/server.log" >&2; exit 1; }
+    sleep 0.1
+done
+
+now() { date +%s.%N; }
+# Counter from the stats file, which landropd rewrites every second
+counter() {
+    sleep 1.2
+    awk -v n="$1" '$1 == n { print $2 }' "$WORK/stats"
+}
+
+opens0=0
+# report <label> <start> <end> <MiB or requests> <unit>
+report() {
+    opens=$(counter landropd_served_file_opens_total)
+    awk -v l="$1" -v s="$2" -v e="$3" -v n="$4" -v u="$5" -v o=$((opens - opens0)) 'BEGIN {
+        t = e - s
+        if (u == "MiB") printf "%-10s %8.1f MiB/s  %6.2f s  files opened: %d\n", l, n / t, t, o
+        else printf "%-10s %8.0f gets/s  %6.2f s  files opened: %d\n", l, n / t, t, o
+    }'
+    opens0=$opens
+}
+
+echo "size=${SIZE_MIB}MiB clients=$CLIENTS small_gets=$SMALL"
+
+start=$(now)
+pids=
+i=0
+while [ $i -lt "$CLIENTS" ]; do
+    mkdir -p "$WORK/out/$i"
+    # shellcheck disable=SC2086
+    "$BIN/landrop" get -h 127.0.0.1 -p "$PORT" $CLIENT_ARGS -d "$WORK/out/$i" artifact 2>/dev/null &
+    pids="$pids $!"
+    i=$((i + 1))
+done
+for p in $pids; do
+    wait "$p" || { echo "a client failed" >&2; exit 1; }
+done
+end=$(now)
+i=0
+while [ $i -lt "$CLIENTS" ]; do
+    cmp -s "$WORK/srv/artifact" "$WORK/out/$i/artifact" || { echo "copy $i differs" >&2; exit 1; }
+    rm -f "$WORK/out/$i/artifact"
+    i=$((i + 1))
+done
+report fan-out "$start" "$end" $((SIZE_MIB * CLIENTS)) MiB
+
+start=$(now)
+# shellcheck disable=SC2086
+"$BIN/landrop" get -h 127.0.0.1 -p "$PORT" $CLIENT_ARGS -j 4 -d "$WORK/out" artifact 2>/dev/null
+end=$(now)
+cmp -s "$WORK/srv/artifact" "$WORK/out/artifact" || { echo "-j 4 copy differs" >&2; exit 1; }
+report "-j 4" "$start" "$end" "$SIZE_MIB" MiB
+
+names=$(awk -v n="$SMALL" 'BEGIN { for (i = 0; i < n; i++) printf "small " }')
+start=$(now)
+# shellcheck disable=SC2086
+"$BIN/landrop" get -h 127.0.0.1 -p "$PORT" $CLIENT_ARGS -d "$WORK/out" $names 2>/dev/null
+report small "$start" "$(now)" "$SMALL" gets
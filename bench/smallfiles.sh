@@ -0,0 +1,73 @@
+#!/bin/sh
+# Directory of many small files over loopback, once with one frame per file
+# (-B 0) and once packed into batch frames, reporting files per second.
+#
+#   bench/smallfiles.sh [files] [file_size_kib] [batch_threshold]
+#
+# BIN (default bin/native) selects the build, PORT the loopback port. The
+# server writes below DEST (default: a temporary directory); on a journaling
+# filesystem creating the files tends to dominate, a tmpfs such as /dev/shm
+# shows the protocol cost.
+set -eu
+
+FILES=${1:-100000}
+SIZE_KIB=${2:-4}
+THRESHOLD=${3:-65536}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19510}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+DST=${DEST:-$WORK}/landrop-smallfiles.$$
+SRV_PID=
+stop_server() {
+    if [ -n "$SRV_PID" ]; then
+        kill -INT "$SRV_PID" 2>/dev/null || true
+        wait "$SRV_PID" 2>/dev/null || true
+        SRV_PID=
+    fi
+}
+cleanup() {
+    stop_server
+    rm -rf "$WORK" "$DST"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/src"
+head -c $((FILES * SIZE_KIB * 1024)) /dev/urandom | (cd "$WORK/src" && split -a 6 -b $((SIZE_KIB * 1024)) - f)
+
+# run <label> <client args...>
+run() {
+    label=$1
+    shift
+    rm -rf "$DST"
+    mkdir -p "$DST"
+    "$BIN/landropd" -p "$PORT" -d "$DST" 2>"$WORK/server.log" &
+    SRV_PID=$!
+    i=0
+    while ! grep -q listening "$WORK/server.log" 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/server.log" >&2; exit 1; }
+        sleep 0.1
+    done
+    sync
+    start=$(date +%s.%N)
+    rc=0
+    "$BIN/landrop" -h 127.0.0.1 -p "$PORT" -d "$WORK/src" "$@" 2>"$WORK/client.log" || rc=$?
+    end=$(date +%s.%N)
+    stop_server
+    ok=$(ls "$DST" | wc -l)
+    awk -v l="$label" -v s="$start" -v e="$end" -v n="$FILES" -v k="$SIZE_KIB" -v ok="$ok" 'BEGIN {
+        t = e - s
+        printf "%-10s files=%d size=%dKiB ok=%d time=%.2fs rate=%.0f files/s %.1f MiB/s\n",
+               l, n, k, ok, t, ok / t, ok * k / 1024 / t
+    }'
+    [ "$rc" -eq 0 ] && [ "$ok" -eq "$FILES" ]
+}
+
+run per-file -B 0
+run batched -B "$THRESHOLD"
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Encrypted against plaintext on loopback: upload one file to landropd
+# without TLS, with TLS and certificates (a throwaway CA made with the
+# openssl command), and with TLS and a pre-shared key, and print the
+# throughput of each next to where the records were handled (kernel TLS or
+# OpenSSL in userspace).
+#
+#   bench/tls.sh [file_size_mib] [runs]
+#
+# BIN (default bin/native) selects the build, PORT the loopback port,
+# CLIENT_ARGS and SERVER_ARGS extra options for every run (e.g. -C, -U).
+# The best of the runs is reported. Files land under TMPDIR.
+set -eu
+
+SIZE_MIB=${1:-512}
+RUNS=${2:-3}
+BIN=${BIN:-bin/native}
+PORT=${PORT:-19900}
+CLIENT_ARGS=${CLIENT_ARGS:-}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+if [ ! -x "$BIN/landrop" ] || [ ! -x "$BIN/landropd" ]; then
+    echo "build first: make" >&2
+    exit 1
+fi
+command -v openssl >/dev/null || { echo "needs the openssl command for test certificates" >&2; exit 1; }
+
+WORK=$(mktemp -d)
+SERVER=
+stop_server() {
+    if [ -n "$SERVER" ]; then
+        kill -INT "$SERVER" 2>/dev/null || true
+        wait "$SERVER" 2>/dev/null || true
+        SERVER=
+    fi
+}
+cleanup() {
+    stop_server
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# CA, a server certificate for 127.0.0.1 signed by it, and a key to share
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 -subj /CN=landrop-bench-ca \
+    -keyout "$WORK/ca.key" -out "$WORK/ca.pem" 2>/dev/null
+openssl req -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -subj /CN=127.0.0.1 \
+    -keyout "$WORK/srv.key" -out "$WORK/srv.csr" 2>/dev/null
+printf 'subjectAltName=IP:127.0.0.1\n' >"$WORK/ext"
+openssl x509 -req -in "$WORK/srv.csr" -CA "$WORK/ca.pem" -CAkey "$WORK/ca.key" -CAcreateserial -days 1 \
+    -extfile "$WORK/ext" -out "$WORK/srv.pem" 2>/dev/null
+openssl rand -hex 32 >"$WORK/psk"
+
+mkdir -p "$WORK/src" "$WORK/dst"
+dd if=/dev/urandom of="$WORK/src/payload" bs=1M count="$SIZE_MIB" 2>/dev/null
+
+now() { date +%s.%N; }
+
+# run <label> <server TLS options> <client TLS options>
+run() {
+    # shellcheck disable=SC2086
+    "$BIN/landropd" -q -o -p "$PORT" -d "$WORK/dst" $SERVER_ARGS $2 2>"$WORK/server.log" &
+    SERVER=$!
+    j=0
+    while ! grep -q "listening" "$WORK/server.log" 2>/dev/null; do
+        j=$((j + 1))
+        [ $j -gt 50 ] && { echo "landropd did not start" >&2; cat "$WORK/server.log" >&2; exit 1; }
+        sleep 0.1
+    done
+    best=
+    r=0
+    while [ $r -lt "$RUNS" ]; do
+        rm -f "$WORK/dst/payload"
+        start=$(now)
+        # shellcheck disable=SC2086
+        "$BIN/landrop" -h 127.0.0.1 -p "$PORT" $CLIENT_ARGS $3 -f "$WORK/src/payload" 2>"$WORK/client.log"
+        t=$(awk -v s="$start" -v e="$(now)" 'BEGIN { printf "%.3f", e - s }')
+        cmp -s "$WORK/src/payload" "$WORK/dst/payload" || { echo "$1: copy differs" >&2; exit 1; }
+        best=$(awk -v b="${best:-$t}" -v t="$t" 'BEGIN { print (t < b ? t : b) }')
+        r=$((r + 1))
+    done
+    stop_server
+    how=$(sed -n 's/^Encrypted: //p' "$WORK/client.log")
+    awk -v l="$1" -v m="$SIZE_MIB" -v t="$best" -v h="${how:-plaintext}" \
+        'BEGIN { printf "%-6s %8.1f MiB/s  %s\n", l, m / t, h }'
+}
+
+echo "size=${SIZE_MIB}MiB runs=$RUNS"
+run plain "" ""
+run cert "--tls-cert $WORK/srv.pem --tls-key $WORK/srv.key" "--tls-ca $WORK/ca.pem"
+run psk "--psk $WORK/psk" "--psk $WORK/psk"
@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cdc.h"
+
+#include <pthread.h>
+
+#include "common.h"
+#include "delta.h"
+
+// Mask bits come from the top of the gear hash, which depend on the most
+// input bytes. 2^14 = CDC_AVG: two bits more before the average, two less
+// after it (FastCDC's normalization level 2).
+#define MASK_BITS(n) (~0ull << (64 - (n)))
+#define MASK_S MASK_BITS(16)
+#define MASK_L MASK_BITS(12)
+
+// Senders must agree on the table, the server never needs it: a fixed
+// splitmix64 sequence instead of 2 KiB of constants
+static uint64_t g_gear[256];
+static pthread_once_t g_gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+    uint64_t x = 0x6c616e64726f70ull; // "landrop"
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        g_gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_cut(const unsigned char *p, size_t n) {
+    pthread_once(&g_gear_once, gear_init);
+    if (n <= CDC_MIN)
+        return n;
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    size_t mid = end < CDC_AVG ? end : CDC_AVG;
+    uint64_t h = 0;
+    // No boundary can fall inside the first CDC_MIN bytes, so they are not
+    // even hashed; the gear hash forgets everything older than 64 bytes
+    size_t i = CDC_MIN;
+    for (; i < mid; ++i) {
+        h = (h << 1) + g_gear[p[i]];
+        if (!(h & MASK_S))
+            return i + 1;
+    }
+    for (; i < end; ++i) {
+        h = (h << 1) + g_gear[p[i]];
+        if (!(h & MASK_L))
+            return i + 1;
+    }
+    return end;
+}
+
+void cdc_hash(const unsigned char *p, size_t n, unsigned char out[CDC_HASH_LEN]) {
+    put_be64(out, hash64(p, n, 0));
+    put_be64(out + 8, hash64(p, n, 0x9E3779B97F4A7C15ull));
+}
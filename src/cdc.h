@@ -0,0 +1,27 @@
+#ifndef LANDROP_CDC_H
+#define LANDROP_CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-defined chunking (FastCDC). Chunk boundaries are placed where a
+// gear hash over the last 64 bytes hits a mask, so they depend on the
+// content around them and not on its offset: an insertion early in a file
+// only changes the chunks it touches, and identical content shared between
+// files (build outputs, copies, archives) cuts into identical chunks.
+// Normalized chunking uses a stricter mask before CDC_AVG and a looser one
+// after it, which keeps most chunks close to the average.
+#define CDC_MIN (4 * 1024)
+#define CDC_AVG (16 * 1024)
+#define CDC_MAX (64 * 1024)
+
+// Length of the chunk at the start of p, where n bytes are available. Less
+// than CDC_MAX bytes are only ever passed at the end of the data, which
+// then ends the chunk at the latest.
+size_t cdc_cut(const unsigned char *p, size_t n);
+
+// Identity of a chunk: two XXH64 with different seeds, stored big endian
+#define CDC_HASH_LEN 16
+void cdc_hash(const unsigned char *p, size_t n, unsigned char out[CDC_HASH_LEN]);
+
+#endif // LANDROP_CDC_H
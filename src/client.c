@@ -1,24 +1,311 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/random.h>
 #include <time.h>
 
+#include "cdc.h"
 #include "common.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "lz.h"
+#include "mcast.h"
+#include "reader.h"
+#include "shape.h"
+#include "tls.h"
+#include "tune.h"
+#include "walk.h"
+
+// Body transmission: sendfile(2) where available, buffered copy loop otherwise
+#ifdef __linux__
+static bool g_use_sendfile = true;
+#endif
+
+// -j: parallel connections per file
+static int g_jobs = 1;
+#define MAX_JOBS 64
+
+// -c: CRC-32C trailer after every file, checked by the server
+static bool g_checksum = false;
+
+// -z: compress file content on the wire (LFT2_F_COMPRESS)
+enum { Z_OFF, Z_ON, Z_AUTO };
+static int g_zmode = Z_OFF;
+
+// -r: continue interrupted uploads where the server's partial file ends
+static bool g_resume = false;
+
+// -D: update files the server already has by sending only what changed
+static bool g_delta = false;
+// Smaller files are sent whole: the signature round trip costs more
+#define DELTA_MIN_FILE (1024 * 1024)
+
+// -X: send only the chunks of a file the server does not hold anywhere
+static bool g_dedup = false;
+// Smaller files are sent whole: the chunk list round trip costs more
+#define DEDUP_MIN_FILE (256 * 1024)
+
+// -s: send only the files of a directory the server does not already hold
+// in the same version; --sync-crc compares content instead of mtimes
+static bool g_sync = false;
+static bool g_sync_crc = false;
+// Files listed per manifest frame. Their files are sent before the next
+// manifest, which is when the server forgets which ones it asked for.
+#define SYNC_BATCH 1024
+
+// -B: files smaller than this are packed into batch frames, 0 to turn off
+static size_t g_batch_max = 64 * 1024;
+#define BATCH_MAX_THRESHOLD (1024 * 1024)
+
+// --sndbuf, --lowat, --cc: applied to every connection; --probe fills in
+// whatever was not given from a measurement of the path
+static struct sock_tune g_tune;
+static bool g_probe = false;
+// --chunk: bytes per read/write of the copy loop (-C, compression)
+static size_t g_chunk = 64 * 1024;
+#define CHUNK_MAX (16 * 1024 * 1024)
+// Bodies of at least READ_PIPE_MIN that pass through userspace are read
+// ahead by a reader thread (reader.h), in READ_PIPE_BUFS buffers of
+// READ_PIPE_BUF or --chunk, whichever is larger
+#define READ_PIPE_MIN (1024 * 1024)
+#define READ_PIPE_BUF (512 * 1024)
+#define READ_PIPE_BUFS 4
+// Probe rounds double from PROBE_FIRST until one takes PROBE_ROUND_TIME
+#define PROBE_FIRST (256 * 1024)
+#define PROBE_MAX (128 * 1024 * 1024)
+#define PROBE_ROUND_TIME 0.25
+
+// --rate, --rate-conn: most bytes per second sent in total and over each
+// connection. A connection is always driven by one thread, so its bucket
+// is that thread's.
+static bool g_shaping = false;
+static struct bucket g_rate;
+static uint64_t g_rate_conn;
+static uint64_t g_rate_limit;           // for the progress line
+static __thread struct bucket t_rate_conn;
+static __thread bool t_rate_ready;
+
+// -M: send each file once to a multicast group instead of to one server
+static bool g_mcast = false;
+static struct sockaddr_in g_mcast_group;
+static struct in_addr g_mcast_if;       // --mcast-if, INADDR_ANY by default
+static int g_mcast_expect = 0;          // --expect: receivers to wait for
+// Pace of the stream without --rate
+#define MCAST_RATE (100ull * 1024 * 1024)
+#define MCAST_BATCH 32
+// At the end the final meta is repeated every MCAST_END_EVERY seconds.
+// Without --expect the sender stops once the receivers have been quiet for
+// MCAST_QUIET; with it, it gives up after MCAST_GIVEUP without a word.
+#define MCAST_END_EVERY 0.1
+#define MCAST_QUIET 2.0
+#define MCAST_GIVEUP 10.0
+
+// --tls, --psk: every connection to the server goes through TLS. Socket
+// fds are what gets passed around, so their TLS state is looked up by fd
+// (sock_tls()); without TLS nothing is looked up at all.
+static struct tls_ctx *g_tls;
+static pthread_mutex_t g_tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_conn **g_tls_fds;     // indexed by fd
+static int g_tls_nfds;
+static atomic_bool g_tls_told;          // the cipher line was printed
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s -h <host> -p <port> (-f <file> [file ...] [-n <remote_name>] | -d <directory>)\n", prog);
+    fprintf(stderr, "Usage: %s -h <host> -p <port> (-f <file> [file ...] [-n <remote_name>] | -d <directory>) [-C] [-1] [-j <n>] [-r] [-c] [-z on|auto] [-D] [-X] [-B <bytes>] [-s]\n", prog);
+    fprintf(stderr, "       %s get -h <host> -p <port> [-j <n>] [-d <dir>] [-n <local_name>] <name> [name ...]\n", prog);
     fprintf(stderr, "       After -f you can list multiple files without repeating -f.\n");
     fprintf(stderr, "       When multiple files are given, -n is ignored.\n");
+    fprintf(stderr, "  get: download files from a landropd -G into -d (default: here), each in -j ranges\n");
+    fprintf(stderr, "       at once; run it again to resume what was interrupted\n");
+    fprintf(stderr, "  -C: send through a userspace copy loop instead of sendfile(2)\n");
+    fprintf(stderr, "  -1: use LFT1 (one connection per file) even if the server speaks LFT2\n");
+    fprintf(stderr, "  -j: split each large file into N ranges sent over N parallel connections\n");
+    fprintf(stderr, "  -r: resume interrupted uploads instead of starting them over\n");
+    fprintf(stderr, "  -c: verify every file end to end with a CRC-32C checksum\n");
+    fprintf(stderr, "  -z: compress what shrinks; auto stops compressing while it slows the transfer down\n");
+    fprintf(stderr, "  -D: send only the changes to files the server already has (server needs -o, or -s)\n");
+    fprintf(stderr, "  -X: skip content the server already holds in any file (server needs -X)\n");
+    fprintf(stderr, "  -s: with -d, send only files the server lacks or holds in another size or mtime\n");
+    fprintf(stderr, "  --sync-crc: like -s, but compare content (CRC-32C) instead of mtimes\n");
+    fprintf(stderr, "  -B: pack files smaller than this many bytes into batches (default 65536, 0: off)\n");
+    fprintf(stderr, "  --probe: measure the path first and size buffers from its bandwidth-delay product\n");
+    fprintf(stderr, "  --sndbuf <bytes>: socket send buffer (default: kernel autotuning); sizes take k/M/G\n");
+    fprintf(stderr, "  --lowat <bytes>: most unsent data the kernel may queue (TCP_NOTSENT_LOWAT)\n");
+    fprintf(stderr, "  --cc <name>: TCP congestion control, e.g. bbr or cubic\n");
+    fprintf(stderr, "  --chunk <bytes>: copy loop buffer (default 64k, up to 16M)\n");
+    fprintf(stderr, "  --rate <bytes/s>: send (or get) at most this fast in total; --rate-conn: over each connection\n");
+    fprintf(stderr, "  -M <group:port>: send the files to a multicast group of landropd -M receivers (no -h/-p)\n");
+    fprintf(stderr, "  --mcast-if <addr>: interface for -M; --expect <n>: receivers to wait for\n");
+    fprintf(stderr, "  --tls: encrypt with TLS 1.3, checking the server's certificate against --tls-ca <pem>\n");
+    fprintf(stderr, "         (default: the system's CAs); --tls-cert/--tls-key <pem>: certificate to show\n");
+    fprintf(stderr, "  --psk <keyfile>: TLS with a key shared with the server instead of certificates\n");
+}
+
+// Up to want bytes that the rate limits allow, waiting until they do
+static size_t rate_grant(size_t want) {
+    if (!g_shaping)
+        return want;
+    if (!t_rate_ready) {
+        bucket_init(&t_rate_conn, g_rate_conn);
+        t_rate_ready = true;
+    }
+    struct bucket *b[2] = { &g_rate, &t_rate_conn };
+    return bucket_wait(b, 2, want);
+}
+
+static struct tls_conn *sock_tls(int fd) {
+    if (!g_tls)
+        return NULL;
+    pthread_mutex_lock(&g_tls_lock);
+    struct tls_conn *t = fd < g_tls_nfds ? g_tls_fds[fd] : NULL;
+    pthread_mutex_unlock(&g_tls_lock);
+    return t;
+}
+
+static int sock_tls_add(int fd, struct tls_conn *t) {
+    pthread_mutex_lock(&g_tls_lock);
+    if (fd >= g_tls_nfds) {
+        int n = g_tls_nfds ? g_tls_nfds : 64;
+        while (n <= fd)
+            n *= 2;
+        struct tls_conn **a = (struct tls_conn **)realloc(g_tls_fds, (size_t)n * sizeof(*a));
+        if (!a) {
+            pthread_mutex_unlock(&g_tls_lock);
+            return -1;
+        }
+        memset(a + g_tls_nfds, 0, (size_t)(n - g_tls_nfds) * sizeof(*a));
+        g_tls_fds = a;
+        g_tls_nfds = n;
+    }
+    g_tls_fds[fd] = t;
+    pthread_mutex_unlock(&g_tls_lock);
+    return 0;
+}
+
+// send() and recv() on a connection to the server, through TLS if it is on
+static ssize_t sock_send(int fd, const void *p, size_t n, int flags) {
+    struct tls_conn *t = sock_tls(fd);
+    return t ? tls_write(t, p, n, (flags & MSG_MORE) != 0) : send(fd, p, n, flags);
+}
+
+static ssize_t sock_recv(int fd, void *p, size_t n, int flags) {
+    struct tls_conn *t = sock_tls(fd);
+    if (!t || tls_kernel_rx(t))
+        return recv(fd, p, n, flags);
+    // OpenSSL on a blocking socket: only read if a record has started to
+    // arrive, the rest of it is on its way
+    if ((flags & MSG_DONTWAIT) && tls_pending(t) == 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    return tls_read(t, p, n);
+}
+
+// write_full() and read_full() for the connections to the server
+static int sock_write_full(int fd, const void *p, size_t n) {
+    if (!sock_tls(fd))
+        return write_full(fd, p, n);
+    for (size_t off = 0; off < n;) {
+        ssize_t r = sock_send(fd, (const char *)p + off, n - off, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t)r;
+    }
+    return 0;
+}
+
+static int sock_read_full(int fd, void *p, size_t n) {
+    if (!sock_tls(fd))
+        return read_full(fd, p, n);
+    for (size_t off = 0; off < n;) {
+        ssize_t r = sock_recv(fd, (char *)p + off, n - off, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = EPIPE; // unexpected EOF
+            return -1;
+        }
+        off += (size_t)r;
+    }
+    return 0;
+}
+
+// Whether sendfile() to fd puts the file on the wire as it should: not
+// while OpenSSL has to encrypt what goes out
+static bool sock_zero_copy(int fd) {
+    struct tls_conn *t = sock_tls(fd);
+    return !t || tls_kernel_tx(t);
+}
+
+static void sock_close(int fd) {
+    struct tls_conn *t = sock_tls(fd);
+    if (t) {
+        pthread_mutex_lock(&g_tls_lock);
+        g_tls_fds[fd] = NULL;
+        pthread_mutex_unlock(&g_tls_lock);
+        tls_conn_free(t);
+    }
+    close(fd);
+}
+
+// Handshake on the new connection cfd. -1 (errno EPROTO, cfd closed) if
+// it fails.
+static int sock_tls_start(int cfd) {
+    struct tls_conn *t = tls_conn_new(g_tls, cfd);
+    if (!t || tls_handshake(t) != 1 || sock_tls_add(cfd, t) < 0) {
+        tls_conn_free(t);
+        close(cfd);
+        errno = EPROTO;
+        return -1;
+    }
+    if (!atomic_exchange(&g_tls_told, true)) {
+        char desc[128];
+        tls_describe(t, desc, sizeof(desc));
+        fprintf(stderr, "Encrypted: %s\n", desc);
+    }
+    return 0;
+}
+
+// write_full() within the rate limits
+static int send_data(int fd, const void *p, size_t n) {
+    while (n > 0) {
+        size_t k = rate_grant(n);
+        if (sock_write_full(fd, p, k) < 0)
+            return -1;
+        p = (const char *)p + k;
+        n -= k;
+    }
+    return 0;
 }
 
 static int connect_to(const char *host, const char *port) {
@@ -37,8 +324,11 @@ static int connect_to(const char *host, const char *port) {
         cfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
         if (cfd < 0) 
             continue;
+        tune_apply(cfd, &g_tune);
         if (connect(cfd, ai->ai_addr, ai->ai_addrlen) == 0) {
             freeaddrinfo(res);
+            if (g_tls && sock_tls_start(cfd) < 0)
+                return -1;
             return cfd;
         }
         close(cfd);
@@ -48,124 +338,444 @@ static int connect_to(const char *host, const char *port) {
     return -1;
 }
 
-static double now_sec(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
-}
+struct session;
 
-static void human_bytes(double v, char *out, size_t n) {
-    const char *u[] = {"B", "KiB", "MiB", "GiB", "TiB"};
-    int i = 0;
-    while (v >= 1024.0 && i < 4) { 
-        v /= 1024.0; 
-        i++; 
-    }
-    snprintf(out, n, "%.1f %s", v, u[i]);
-}
+// Where files go: an LFT2 session when the server speaks it, otherwise one
+// LFT1 connection per file.
+struct sender {
+    const char *host;
+    const char *port;
+    struct session *sess;
+};
+
+// Progress of one file. With -j several streams feed the same bar, so the
+// byte count is atomic and whoever holds the lock redraws it. A file sent as
+// part of a directory has a parent: the directory's bar, which counts for
+// all of its senders, and draws nothing of its own.
+struct progress {
+    uint64_t total;
+    _Atomic uint64_t done;
+    _Atomic uint64_t wire;      // bytes on the wire, less than done when compressed
+    double t0;
+    double last;
+    pthread_mutex_t lock;
+    struct progress *parent;
+    struct walk *walk;          // set for a directory's bar
+    _Atomic uint64_t files;     // files of the directory sent so far
+    _Atomic uint64_t skipped;   // of those, found up to date by -s
+};
 
-static void print_progress(uint64_t done, uint64_t total, double elapsed) {
-    double pct = total ? (100.0 * (double)done / (double)total) : 100.0;
-    int barw = 40;
-    int fill = (int)(pct / 100.0 * barw + 0.5);
-    if (fill > barw) 
-        fill = barw;
+static void progress_init(struct progress *p, uint64_t total, struct progress *parent) {
+    p->total = total;
+    atomic_init(&p->done, 0);
+    atomic_init(&p->wire, 0);
+    atomic_init(&p->files, 0);
+    atomic_init(&p->skipped, 0);
+    p->t0 = p->last = now_sec();
+    pthread_mutex_init(&p->lock, NULL);
+    p->parent = parent;
+    p->walk = NULL;
+}
 
-    char bar[41];
-    for (int i = 0; i < barw; ++i) 
-        bar[i] = (i < fill) ? '=' : ' ';
-    bar[barw] = '\0';
-    double bps = elapsed > 0 ? (double)done / elapsed : 0.0;
-    char spd[32], dstr[32], tstr[32];
-    human_bytes(bps, spd, sizeof(spd));
+// A directory's bar: files sent of those found so far (a percentage once
+// the walk is over), bytes and rates
+static void print_tree_progress(struct progress *p, uint64_t files, uint64_t done, uint64_t wire, double t) {
+    double elapsed = t - p->t0;
+    uint64_t found = walk_found(p->walk);
+    char spd[32], dstr[32], wstr[32] = "";
+    human_bytes(elapsed > 0 ? (double)done / elapsed : 0.0, spd, sizeof(spd));
     human_bytes((double)done, dstr, sizeof(dstr));
-    human_bytes((double)total, tstr, sizeof(tstr));
-    fprintf(stderr, "\r[%-40s] %6.2f%%  %s/s  %s/%s", bar, pct, spd, dstr, tstr);
+    if (wire != done) {
+        char wtot[24];
+        human_bytes((double)wire, wtot, sizeof(wtot));
+        snprintf(wstr, sizeof(wstr), "  wire %s", wtot);
+    }
+    char lim[48] = "";
+    if (g_rate_limit > 0) {
+        char l[24];
+        human_bytes((double)g_rate_limit, l, sizeof(l));
+        snprintf(lim, sizeof(lim), " (limit %s/s)", l);
+    }
+    if (walk_done(p->walk))
+        fprintf(stderr, "\r%6.2f%%  %llu/%llu files  %.0f files/s  %s  %s/s%s%s   ",
+                found ? 100.0 * (double)files / (double)found : 100.0, (unsigned long long)files,
+                (unsigned long long)found, elapsed > 0 ? (double)files / elapsed : 0.0, dstr, spd, lim, wstr);
+    else
+        fprintf(stderr, "\rscanning  %llu/%llu+ files  %.0f files/s  %s  %s/s%s%s   ", (unsigned long long)files,
+                (unsigned long long)found, elapsed > 0 ? (double)files / elapsed : 0.0, dstr, spd, lim, wstr);
     fflush(stderr);
 }
 
-// Forward decls
-static int send_one_file(const char *host, const char *port_str, const char *file, const char *remote_name);
-
-#include <dirent.h>
-#include <limits.h>
+static void progress_destroy(struct progress *p) {
+    pthread_mutex_destroy(&p->lock);
+}
 
-static int is_dot_or_dotdot(const char *name) {
-    return (strcmp(name, ".") == 0 || strcmp(name, "..") == 0);
+// n bytes of content sent as wire bytes
+static void progress_add(struct progress *p, uint64_t n, uint64_t wire) {
+    uint64_t done = atomic_fetch_add(&p->done, n) + n;
+    uint64_t w = atomic_fetch_add(&p->wire, wire) + wire;
+    if (p->parent) {
+        progress_add(p->parent, n, wire);
+        return;
+    }
+    if (pthread_mutex_trylock(&p->lock) != 0)
+        return;
+    double t = now_sec();
+    if (p->walk) {
+        if (t - p->last >= 0.1) {
+            print_tree_progress(p, atomic_load(&p->files), done, w, t);
+            p->last = t;
+        }
+    } else if (t - p->last >= 0.1 || done == p->total) {
+        print_progress(done, p->total, w == done ? done : w, t - p->t0, g_rate_limit);
+        p->last = t;
+    }
+    pthread_mutex_unlock(&p->lock);
 }
 
-static int send_directory_recursive(const char *host, const char *port_str, const char *root, const char *subrel) {
-    char path[PATH_MAX];
-    if (subrel && subrel[0] != '\0') {
-        if (snprintf(path, sizeof(path), "%s/%s", root, subrel) >= (int)sizeof(path)) {
-            fprintf(stderr, "Path too long: %s/%s\n", root, subrel);
+#ifdef __linux__
+// Hand the file to the socket with sendfile(2): no stdio, no userspace copy.
+// Chunked so that progress is still reported at the usual cadence.
+// Returns 0 when done, 1 if sendfile is unusable for this pair of fds and
+// nothing was sent yet (caller falls back to the copy loop), -1 on error.
+static int send_body_sendfile(int cfd, int fd, uint64_t start, uint64_t len, uint64_t *sent, struct progress *prog) {
+    const size_t CHUNK = 1024 * 1024;
+    off_t off = (off_t)(start + *sent);
+    // sendfile() reads the file synchronously; asking for the pages ahead
+    // of time lets the disk work while it waits for the socket
+    uint64_t end = start + len, hinted = (uint64_t)off;
+    bool hint = len - *sent >= READ_PIPE_MIN;
+    if (hint)
+        (void)posix_fadvise(fd, off, (off_t)(end - hinted), POSIX_FADV_SEQUENTIAL);
+    while (*sent < len) {
+        uint64_t left = len - *sent;
+        size_t want = rate_grant(left > CHUNK ? CHUNK : (size_t)left);
+        uint64_t ahead = (uint64_t)off + READER_AHEAD < end ? (uint64_t)off + READER_AHEAD : end;
+        if (hint && hinted < ahead && (ahead >= hinted + CHUNK || ahead == end)) {
+            (void)posix_fadvise(fd, (off_t)hinted, (off_t)(ahead - hinted), POSIX_FADV_WILLNEED);
+            hinted = ahead;
+        }
+        ssize_t r = sendfile(cfd, fd, &off, want);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (*sent == 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                return 1;
+            perror("sendfile");
             return -1;
         }
-    } else {
-        if (snprintf(path, sizeof(path), "%s", root) >= (int)sizeof(path)) {
-            fprintf(stderr, "Path too long: %s\n", root);
+        if (r == 0) {
+            fprintf(stderr, "\nFile shrank while sending\n");
             return -1;
         }
+        *sent += (uint64_t)r;
+        progress_add(prog, (uint64_t)r, (uint64_t)r);
     }
+    return 0;
+}
+#endif
+
+// Where the bytes of a body come from when they pass through userspace: a
+// reader thread for large bodies, plain preads into one buffer for the
+// rest. Either way pieces of LFT2_ZCHUNK can be taken without ever
+// straddling two buffers, since both buffer sizes are multiples of it.
+struct body_src {
+    int fd;
+    uint64_t off, left;         // pread path: next offset, bytes still to read
+    struct reader *rd;
+    bool held;                  // a reader buffer is in use
+    const unsigned char *cur;   // what is left of the current buffer
+    size_t avail;
+    unsigned char *buf;         // pread path
+    size_t bufsz;
+};
+
+static size_t round_zchunk(size_t n) {
+    return (n + LFT2_ZCHUNK - 1) / LFT2_ZCHUNK * LFT2_ZCHUNK;
+}
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        perror("opendir");
+static int body_src_open(struct body_src *b, int fd, uint64_t start, uint64_t len) {
+    memset(b, 0, sizeof(*b));
+    b->fd = fd;
+    b->off = start;
+    b->left = len;
+    if (len >= READ_PIPE_MIN) {
+        size_t bufsz = round_zchunk(g_chunk > READ_PIPE_BUF ? g_chunk : READ_PIPE_BUF);
+        if ((b->rd = reader_start(fd, start, len, bufsz, READ_PIPE_BUFS)))
+            return 0;
+        // No thread: read inline, as for a small body
+    }
+    b->bufsz = round_zchunk(g_chunk);
+    if (b->bufsz > len)
+        b->bufsz = (size_t)len;
+    b->buf = (unsigned char *)malloc(b->bufsz ? b->bufsz : 1);
+    if (!b->buf) {
+        perror("malloc");
         return -1;
     }
-    int rc = 0;
-    struct dirent *de;
-    while ((de = readdir(dir)) != NULL) {
-        if (is_dot_or_dotdot(de->d_name)) 
-            continue;
+    return 0;
+}
 
-        char child_rel[PATH_MAX];
-        if (subrel && subrel[0] != '\0') {
-            if (snprintf(child_rel, sizeof(child_rel), "%s/%s", subrel, de->d_name) >= (int)sizeof(child_rel)) {
-                fprintf(stderr, "Relative path too long (skip): %s/%s\n", subrel, de->d_name);
-                rc = -1;
-                continue;
-            }
+// Up to max bytes of the body with *p pointing at them, valid until the next
+// call. Returns 0 at the end, -1 on a read error (reported).
+static ssize_t body_src_next(struct body_src *b, const unsigned char **p, size_t max) {
+    if (b->avail == 0) {
+        ssize_t n;
+        if (b->rd) {
+            if (b->held)
+                reader_release(b->rd);
+            n = reader_next(b->rd, &b->cur);
+            b->held = n > 0;
         } else {
-            if (snprintf(child_rel, sizeof(child_rel), "%s", de->d_name) >= (int)sizeof(child_rel)) {
-                fprintf(stderr, "Relative path too long (skip): %s\n", de->d_name);
-                rc = -1;
-                continue;
+            n = b->left > b->bufsz ? (ssize_t)b->bufsz : (ssize_t)b->left;
+            if (n > 0 && pread_full(b->fd, b->buf, (size_t)n, (int64_t)b->off) < 0)
+                n = -1;
+            b->cur = b->buf;
+            if (n > 0) {
+                b->off += (uint64_t)n;
+                b->left -= (uint64_t)n;
             }
         }
+        if (n <= 0) {
+            if (n < 0 && errno == ENODATA)
+                fprintf(stderr, "\nFile shrank while sending\n");
+            else if (n < 0)
+                perror("read file");
+            return n;
+        }
+        b->avail = (size_t)n;
+    }
+    size_t n = b->avail < max ? b->avail : max;
+    *p = b->cur;
+    b->cur += n;
+    b->avail -= n;
+    return (ssize_t)n;
+}
+
+static void body_src_close(struct body_src *b) {
+    if (b->rd)
+        reader_stop(b->rd);
+    free(b->buf);
+}
 
-        char child_path[PATH_MAX];
-        if (snprintf(child_path, sizeof(child_path), "%s/%s", root, child_rel) >= (int)sizeof(child_path)) {
-            fprintf(stderr, "Path too long (skip): %s/%s\n", root, child_rel);
+// Plain read/write loop, resuming at start + *sent. With crc, each piece is
+// hashed while it sits in the buffer.
+static int send_body_copy(int cfd, int fd, uint64_t start, uint64_t len, uint64_t *sent,
+                          struct progress *prog, uint32_t *crc) {
+    struct body_src src;
+    if (body_src_open(&src, fd, start + *sent, len - *sent) < 0)
+        return -1;
+    int rc = 0;
+    while (*sent < len) {
+        const unsigned char *p;
+        ssize_t r = body_src_next(&src, &p, SIZE_MAX);
+        if (r <= 0) {
+            if (r == 0)
+                fprintf(stderr, "\nFile shrank while sending\n");
             rc = -1;
-            continue;
+            break;
         }
-
-        struct stat st;
-        if (stat(child_path, &st) != 0) {
-            perror("stat");
+        if (crc)
+            *crc = crc32c(*crc, p, (size_t)r);
+        if (send_data(cfd, p, (size_t)r) < 0) {
+            perror("send data");
             rc = -1;
-            continue;
+            break;
         }
-        if (S_ISDIR(st.st_mode)) {
-            if (send_directory_recursive(host, port_str, root, child_rel) != 0)
-                rc = -1;
-        } else if (S_ISREG(st.st_mode)) {
-            // Use relative path as remote name (slashes will be sanitized server-side)
-            fprintf(stderr, "Sending: %s\n", child_rel);
-            if (send_one_file(host, port_str, child_path, child_rel) != 0)
-                rc = -1;
+        *sent += (uint64_t)r;
+        progress_add(prog, (uint64_t)r, (uint64_t)r);
+    }
+    body_src_close(&src);
+    return rc;
+}
+
+// Compression state of one session. Each chunk is compressed if that is on
+// and kept only if it shrinks; a chunk that does not shrink makes the next
+// few go out raw without trying (1, 2, 4 ... up to 32). In auto mode the
+// costs are measured over windows of chunks: compressing pays while the CPU
+// time it takes per byte of content is below the send time it saves, i.e.
+// while the link and not the CPU is the limit. Write times alone mislead
+// while the socket buffer is still filling up, so a send queue that stays
+// at least half full also counts as a link-bound window.
+#define Z_WINDOW 64     // chunks between auto mode decisions
+#define Z_RETRY 16      // windows off before auto mode measures again
+
+struct zstate {
+    int mode;                   // Z_ON or Z_AUTO
+    bool enabled;
+    unsigned skip, backoff;
+    unsigned chunks, idle;
+    double t_comp, t_send;      // seconds compressing / in write() this window
+    uint64_t in, out;           // content offered to the compressor, its wire size
+    uint64_t sent;              // wire bytes this window
+    double comp_cost, ratio;    // per content byte and wire/content, last measured
+    unsigned char *rbuf;        // chunk header + raw content
+    unsigned char *zbuf;        // chunk header + compressed content
+};
+
+static struct zstate *zstate_new(int mode) {
+    struct zstate *z = (struct zstate *)calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+    z->mode = mode;
+    z->enabled = true;
+    z->backoff = 1;
+    z->ratio = 1.0;
+    z->rbuf = (unsigned char *)malloc(LFT2_ZHDR_LEN + LFT2_ZCHUNK);
+    z->zbuf = (unsigned char *)malloc(LFT2_ZHDR_LEN + LZ_BOUND(LFT2_ZCHUNK));
+    if (!z->rbuf || !z->zbuf) {
+        free(z->rbuf);
+        free(z->zbuf);
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static void zstate_free(struct zstate *z) {
+    if (!z)
+        return;
+    free(z->rbuf);
+    free(z->zbuf);
+    free(z);
+}
+
+// Whether the kernel still holds at least half a send buffer of our data
+static bool link_backed_up(int cfd) {
+#ifdef __linux__
+    int queued = 0, sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    if (ioctl(cfd, TIOCOUTQ, &queued) == 0 && getsockopt(cfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0)
+        return queued > sndbuf / 4; // SO_SNDBUF reports twice the usable size
+#else
+    (void)cfd;
+#endif
+    return false;
+}
+
+// End of a window: in auto mode, decide whether the next one compresses
+static void zstate_window(struct zstate *z, int cfd) {
+    if (z->in > 0) {
+        z->comp_cost = z->t_comp / (double)z->in;
+        z->ratio = (double)z->out / (double)z->in;
+    }
+    if (z->mode == Z_AUTO) {
+        double send_cost = z->sent ? z->t_send / (double)z->sent : 0.0;
+        bool worth = z->comp_cost < (1.0 - z->ratio) * send_cost;
+        // Compressed output backing up means the compressor outruns the link
+        if (z->enabled && z->in > 0 && z->ratio < 1.0 && link_backed_up(cfd))
+            worth = true;
+        if (z->enabled && !worth) {
+            z->enabled = false;
+            z->idle = 0;
+        } else if (!z->enabled && (worth || ++z->idle >= Z_RETRY)) {
+            // The link got slower, or the data may have changed
+            z->enabled = true;
+            z->skip = 0;
+            z->backoff = 1;
+        }
+    }
+    z->chunks = 0;
+    z->t_comp = z->t_send = 0;
+    z->in = z->out = z->sent = 0;
+}
+
+// Body as LFT2_F_COMPRESS chunks, read from fd or, if fd is -1, from mem
+static int send_body_chunked(int cfd, int fd, const unsigned char *mem, uint64_t start, uint64_t len,
+                             struct progress *prog, uint32_t *crc, struct zstate *z) {
+    uint64_t sent = 0;
+    struct body_src src;
+    if (fd >= 0 && body_src_open(&src, fd, start, len) < 0)
+        return -1;
+    int rc = 0;
+    while (sent < len) {
+        size_t want = len - sent > LFT2_ZCHUNK ? LFT2_ZCHUNK : (size_t)(len - sent);
+        unsigned char *raw = z->rbuf + LFT2_ZHDR_LEN;
+        if (fd < 0) {
+            memcpy(raw, mem + start + sent, want);
         } else {
-            // skip non-regular files
+            const unsigned char *p;
+            ssize_t r = body_src_next(&src, &p, want);
+            if (r != (ssize_t)want) {
+                if (r >= 0)
+                    fprintf(stderr, "\nFile shrank while sending\n");
+                rc = -1;
+                break;
+            }
+            memcpy(raw, p, want);
+        }
+        if (crc)
+            *crc = crc32c(*crc, raw, want);
+
+        unsigned char *msg = z->rbuf;
+        size_t mlen = want;
+        uint32_t flag = 0;
+        if (z->enabled && z->skip == 0) {
+            double t0 = now_sec();
+            // Less than 1/16 saved is not worth the decompression
+            size_t c = lz_compress(raw, want, z->zbuf + LFT2_ZHDR_LEN, want - want / 16);
+            z->t_comp += now_sec() - t0;
+            z->in += want;
+            z->out += c ? c : want;
+            if (c) {
+                msg = z->zbuf;
+                mlen = c;
+                flag = LFT2_Z_COMPRESSED;
+                z->backoff = 1;
+            } else {
+                z->skip = z->backoff;
+                if (z->backoff < 32)
+                    z->backoff *= 2;
+            }
+        } else if (z->skip > 0) {
+            z->skip--;
         }
+        put_be32(msg, (uint32_t)mlen | flag);
+        double t0 = now_sec();
+        if (send_data(cfd, msg, LFT2_ZHDR_LEN + mlen) < 0) {
+            perror("send data");
+            rc = -1;
+            break;
+        }
+        z->t_send += now_sec() - t0;
+        z->sent += LFT2_ZHDR_LEN + mlen;
+        sent += want;
+        progress_add(prog, want, LFT2_ZHDR_LEN + mlen);
+        if (++z->chunks == Z_WINDOW)
+            zstate_window(z, cfd);
     }
-    closedir(dir);
+    if (fd >= 0)
+        body_src_close(&src);
     return rc;
 }
 
-static int send_one_file(const char *host, const char *port_str, const char *file, const char *remote_name) {
+// Send exactly len bytes of fd, starting at offset start, as a message body.
+// If crc is given it is updated with the content, which takes the copy loop:
+// the bytes have to pass through the CPU once either way. With z the body
+// goes out as compression chunks.
+static int send_body(int cfd, int fd, uint64_t start, uint64_t len, struct progress *prog, uint32_t *crc,
+                     struct zstate *z) {
+    uint64_t sent = 0;
+    if (len == 0)
+        return 0;
+    if (z)
+        return send_body_chunked(cfd, fd, NULL, start, len, prog, crc, z);
+#ifdef __linux__
+    if (g_use_sendfile && !crc && sock_zero_copy(cfd)) {
+        int rc = send_body_sendfile(cfd, fd, start, len, &sent, prog);
+        if (rc <= 0)
+            return rc;
+    }
+#endif
+    return send_body_copy(cfd, fd, start, len, &sent, prog, crc);
+}
+
+// One file over its own LFT1 connection, file relative to dirfd. With a
+// parent progress (a directory) the bar and the success line are left to it.
+static int send_one_file(const char *host, const char *port_str, int dirfd, const char *file,
+                         const char *remote_name, struct progress *parent) {
     struct stat st;
-    if (stat(file, &st) != 0) {
+    if (fstatat(dirfd, file, &st, 0) != 0) {
         perror("stat file");
         return 1;
     }
@@ -177,12 +787,16 @@ static int send_one_file(const char *host, const char *port_str, const char *fil
 
     const char *base = remote_name ? remote_name : path_basename(file);
     char sname[4096];
-    if (sanitize_filename(base, sname, sizeof(sname)) != 0) {
+    if (sanitize_path(base, sname, sizeof(sname)) != 0) {
         fprintf(stderr, "Invalid remote name\n");
         return 1;
     }
     size_t name_len = strlen(sname);
-    if (name_len == 0 || name_len > 4096) {
+    if (name_len == 0) {
+        fprintf(stderr, "Invalid remote name\n");
+        return 1;
+    }
+    if (name_len > 4096) {
         fprintf(stderr, "Remote name too long\n");
         return 1;
     }
@@ -193,166 +807,2489 @@ static int send_one_file(const char *host, const char *port_str, const char *fil
         return 1;
     }
 
-    if (write_full(cfd, LANDROP_MAGIC, LANDROP_MAGIC_LEN) < 0) {
+    if (sock_write_full(cfd, LANDROP_MAGIC, LANDROP_MAGIC_LEN) < 0) {
         perror("send magic");
-        close(cfd);
+        sock_close(cfd);
         return 1;
     }
 
     uint64_t be_size = host_to_be64(filesize);
     uint16_t be_namelen = htons((uint16_t)name_len);
-    if (write_full(cfd, &be_size, sizeof(be_size)) < 0) {
+    if (sock_write_full(cfd, &be_size, sizeof(be_size)) < 0) {
         perror("send size");
-        close(cfd);
+        sock_close(cfd);
         return 1;
     }
-    if (write_full(cfd, &be_namelen, sizeof(be_namelen)) < 0) {
+    if (sock_write_full(cfd, &be_namelen, sizeof(be_namelen)) < 0) {
         perror("send name len");
-        close(cfd);
+        sock_close(cfd);
         return 1;
     }
-    if (write_full(cfd, sname, name_len) < 0) {
+    if (sock_write_full(cfd, sname, name_len) < 0) {
         perror("send name");
-        close(cfd);
-        return 1;
-    }
-
-    FILE *fp = fopen(file, "rb");
-    if (!fp) {
-        perror("fopen file");
-        close(cfd);
+        sock_close(cfd);
         return 1;
     }
 
-    const size_t BUF_SZ = 64 * 1024;
-    char *buf = (char *)malloc(BUF_SZ);
-    if (!buf) {
-        perror("malloc");
-        fclose(fp);
-        close(cfd);
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open file");
+        sock_close(cfd);
         return 1;
     }
-
-    size_t r;
-    uint64_t sent = 0;
-    double t0 = now_sec();
-    double last = t0;
-    while ((r = fread(buf, 1, BUF_SZ, fp)) > 0) {
-        if (write_full(cfd, buf, r) < 0) {
-            perror("send data");
-            free(buf);
-            fclose(fp);
-            close(cfd);
-            return 1;
-        }
-        sent += (uint64_t)r;
-        double t = now_sec();
-        if (t - last >= 0.1 || sent == filesize) {
-            print_progress(sent, filesize, t - t0);
-            last = t;
-        }
-    }
-    if (ferror(fp)) {
-        perror("fread");
-        free(buf);
-        fclose(fp);
-        close(cfd);
+    struct progress prog;
+    progress_init(&prog, filesize, parent);
+    int brc = send_body(cfd, fd, 0, filesize, &prog, NULL, NULL);
+    progress_destroy(&prog);
+    close(fd);
+    if (brc < 0) {
+        sock_close(cfd);
         return 1;
     }
-    free(buf);
-    fclose(fp);
 
     unsigned char status;
-    if (read_full(cfd, &status, 1) < 0) {
+    if (sock_read_full(cfd, &status, 1) < 0) {
         perror("recv status");
-        close(cfd);
+        sock_close(cfd);
         return 1;
     }
-    close(cfd);
+    sock_close(cfd);
     if (status != 0) {
-        fprintf(stderr, "\nServer reported error (code %u)\n", (unsigned)status);
+        fprintf(stderr, "\nServer reported error for %s (code %u)\n", sname, (unsigned)status);
         return 1;
     }
-    fprintf(stderr, "\nFile sent successfully (%s, %lu bytes)\n", sname, (unsigned long)filesize);
+    if (!parent)
+        fprintf(stderr, "\nFile sent successfully (%s, %lu bytes)\n", sname, (unsigned long)filesize);
     return 0;
 }
 
-int main(int argc, char **argv) {
-    const char *host = NULL;
-    const char *port_str = NULL;
-    const char *remote_name = NULL;
-    const char *dir = NULL;
+// LFT2 frames sent but not acknowledged yet. Bounds the bookkeeping and how
+// far the client may run ahead of the server.
+#define SESSION_WINDOW 1024
 
-    // Collect multiple -f occurrences
-    const char *files[1024];
-    int files_count = 0;
+struct session {
+    int fd;
+    uint32_t features;
+    uint32_t next_seq;          // seq of the next file frame
+    uint32_t acked;             // acks received so far == seq of the oldest pending frame
+    char *names[SESSION_WINDOW];
+    uint64_t sizes[SESSION_WINDOW];
+    unsigned char rbuf[LFT2_OFFER_LEN * 64];
+    size_t rlen;
+    int failed;                 // files the server reported as failed
+    bool stale;                 // last dedup frame: reused content changed, send it whole
+    bool quiet;                 // no per-file success lines (stripes, directories)
+    struct progress *prog;      // parent of every file's progress, if set
+    struct zstate *z;           // set if LFT2_F_COMPRESS was accepted
+    // Last resume offer
+    unsigned char offer_status;
+    uint64_t offer_have;
+    uint32_t offer_crc;
+    // Last signature list
+    unsigned char sig_status;
+    uint32_t sig_block;
+    uint64_t sig_count;
+    unsigned char *sigs;
+    // Last chunk bitmap
+    unsigned char have_status;
+    uint32_t have_count;
+    unsigned char *have_bits;
+    struct batch *batch;        // set if LFT2_F_BATCH was accepted
+};
 
-    int opt;
-    while ((opt = getopt(argc, argv, "h:p:f:n:d:")) != -1) {
-        switch (opt) {
-            case 'h': host = optarg; break;
-            case 'p': port_str = optarg; break;
-            case 'f':
-                if (files_count < (int)(sizeof(files)/sizeof(files[0]))) {
-                    files[files_count++] = optarg;
-                } else {
-                    fprintf(stderr, "Too many files specified with -f\n");
-                    return 1;
-                }
-                // Also accept subsequent non-option args as files until next option
-                while (optind < argc && argv[optind][0] != '-') {
-                    if (files_count < (int)(sizeof(files)/sizeof(files[0]))) {
-                        files[files_count++] = argv[optind++];
-                    } else {
-                        fprintf(stderr, "Too many files specified with -f\n");
-                        return 1;
-                    }
-                }
-                break;
-            case 'n': remote_name = optarg; break;
-            case 'd': dir = optarg; break;
-            default: usage(argv[0]); return 1;
-        }
+// Small files collected for the next batch frame. The buffers are
+// allocated once per session and reused for every batch.
+struct batch {
+    uint32_t count;
+    size_t ilen, dlen;
+    unsigned char *index;       // LFT2_BATCH_MAX_INDEX bytes
+    unsigned char *data;        // LFT2_BATCH_MAX_DATA bytes
+};
+
+static struct batch *batch_new(void) {
+    struct batch *b = (struct batch *)calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    b->index = (unsigned char *)malloc(LFT2_BATCH_MAX_INDEX);
+    b->data = (unsigned char *)malloc(LFT2_BATCH_MAX_DATA);
+    if (!b->index || !b->data) {
+        free(b->index);
+        free(b->data);
+        free(b);
+        return NULL;
     }
-    if (!host || !port_str || (files_count == 0 && !dir)) {
-        usage(argv[0]);
-        return 1;
+    return b;
+}
+
+static void batch_free(struct batch *b) {
+    if (!b)
+        return;
+    free(b->index);
+    free(b->data);
+    free(b);
+}
+
+// Connect and exchange hellos. Returns 0 with *out set, 1 if the server only
+// speaks LFT1 (it hung up on the hello), -1 on error.
+static int session_open(const char *host, const char *port_str, uint32_t features, struct session **out) {
+    int cfd = connect_to(host, port_str);
+    if (cfd < 0) {
+        perror("connect");
+        return -1;
     }
-    if (files_count > 0 && dir) {
-        fprintf(stderr, "Specify either -f or -d, not both.\n");
-        return 1;
+    // Frames are written header-then-body with MSG_MORE, so Nagle would only
+    // add latency to the last segment of each burst.
+    int one = 1;
+    (void)setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    unsigned char hello[LFT2_HELLO_LEN];
+    memcpy(hello, LANDROP_MAGIC2, LANDROP_MAGIC_LEN);
+    put_be32(hello + LANDROP_MAGIC_LEN, features);
+    if (sock_write_full(cfd, hello, sizeof(hello)) < 0) {
+        perror("send hello");
+        sock_close(cfd);
+        return -1;
+    }
+    if (sock_read_full(cfd, hello, sizeof(hello)) < 0) {
+        int e = errno;
+        sock_close(cfd);
+        if (e == EPIPE || e == ECONNRESET)
+            return 1;
+        errno = e;
+        perror("recv hello");
+        return -1;
+    }
+    if (memcmp(hello, LANDROP_MAGIC2, LANDROP_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Unexpected hello from server\n");
+        sock_close(cfd);
+        return -1;
+    }
+    struct session *s = (struct session *)calloc(1, sizeof(*s));
+    if (!s) {
+        perror("calloc session");
+        sock_close(cfd);
+        return -1;
     }
+    s->fd = cfd;
+    s->features = get_be32(hello + LANDROP_MAGIC_LEN) & features;
+    if ((s->features & LFT2_F_COMPRESS) && !(s->z = zstate_new(g_zmode))) {
+        perror("compression buffers");
+        sock_close(cfd);
+        free(s);
+        return -1;
+    }
+    if ((s->features & LFT2_F_BATCH) && !(s->batch = batch_new())) {
+        perror("batch buffers");
+        zstate_free(s->z);
+        sock_close(cfd);
+        free(s);
+        return -1;
+    }
+    *out = s;
+    return 0;
+}
 
-    if (dir) {
-        if (remote_name) {
-            fprintf(stderr, "Warning: -n ignored when using -d (directory mode).\n");
-        }
-        struct stat st;
-        if (stat(dir, &st) != 0) { 
-            perror("stat dir"); 
-            return 1; 
-        }
-        if (!S_ISDIR(st.st_mode)) { 
-            fprintf(stderr, "Not a directory: %s\n", dir); 
-            return 1; 
-        }
-        int rc = send_directory_recursive(host, port_str, dir, "");
-        return rc == 0 ? 0 : 1;
+// Length of the server message starting with type byte t, 0 if unknown
+static size_t session_msg_len(unsigned char t) {
+    switch (t) {
+        case LFT2_MSG_ACK: return LFT2_ACK_LEN;
+        case LFT2_MSG_OFFER: return LFT2_OFFER_LEN;
+        case LFT2_MSG_SIGS: return LFT2_SIGS_HDR_LEN; // followed by the signatures
+        case LFT2_MSG_HAVE: return LFT2_HAVE_HDR_LEN; // followed by the bitmap
+        default: return 0;
     }
+}
 
-    // File mode: one or multiple files
-    if (files_count == 1) {
-        return send_one_file(host, port_str, files[0], remote_name);
+static int session_on_msg(struct session *s, const unsigned char *m) {
+    if (m[0] == LFT2_MSG_OFFER) {
+        s->offer_status = m[5];
+        s->offer_have = get_be64(m + 6);
+        s->offer_crc = get_be32(m + 14);
+    } else if (m[0] == LFT2_MSG_SIGS) {
+        s->sig_status = m[5];
+        s->sig_block = get_be32(m + 6);
+    } else if (m[0] == LFT2_MSG_HAVE) {
+        s->have_status = m[5];
+    } else if (m[0] != LFT2_MSG_ACK) {
+        fprintf(stderr, "\nUnexpected message 0x%02x from server\n", m[0]);
+        return -1;
+    }
+    uint32_t seq = get_be32(m + 1);
+    if (seq != s->acked || s->acked == s->next_seq) {
+        fprintf(stderr, "\nOut of order ack %u (expected %u)\n", seq, s->acked);
+        return -1;
     }
+    unsigned slot = seq % SESSION_WINDOW;
+    if (m[0] == LFT2_MSG_ACK && m[5] == LANDROP_ST_STALE) {
+        s->stale = true;
+    } else if (m[5] != LANDROP_ST_OK) {
+        fprintf(stderr, "\nServer reported error for %s (code %u)\n", s->names[slot], (unsigned)m[5]);
+        s->failed++;
+    } else if (!s->quiet && m[0] == LFT2_MSG_ACK) {
+        fprintf(stderr, "\nFile sent successfully (%s, %lu bytes)\n", s->names[slot], (unsigned long)s->sizes[slot]);
+    }
+    free(s->names[slot]);
+    s->names[slot] = NULL;
+    s->acked++;
+    return 0;
+}
 
-    if (remote_name) {
-        fprintf(stderr, "Warning: -n is ignored when sending multiple files with -f.\n");
+// len bytes that follow a message header of hlen bytes at m into dst, of
+// which avail bytes (header included) are buffered; the rest is read
+// straight off the socket. Returns how many buffered bytes past the header
+// it used, or (size_t)-1.
+static size_t session_recv_tail(struct session *s, const unsigned char *m, size_t hlen, size_t avail,
+                                unsigned char *dst, size_t len) {
+    size_t have = avail - hlen;
+    if (have > len)
+        have = len;
+    memcpy(dst, m + hlen, have);
+    if (sock_read_full(s->fd, dst + have, len - have) < 0) {
+        perror(m[0] == LFT2_MSG_SIGS ? "recv signatures" : "recv chunk bitmap");
+        return (size_t)-1;
     }
-    int overall_rc = 0;
-    for (int i = 0; i < files_count; ++i) {
-        int rc = send_one_file(host, port_str, files[i], NULL);
-        if (rc != 0)
-            overall_rc = 1;
+    return have;
+}
+
+// The signatures after a LFT2_MSG_SIGS header at m (see session_recv_tail)
+static size_t session_recv_sigs(struct session *s, const unsigned char *m, size_t avail) {
+    uint64_t count = get_be64(m + 10);
+    free(s->sigs);
+    s->sigs = NULL;
+    s->sig_count = 0;
+    if (count == 0)
+        return 0;
+    if (count > UINT32_MAX || !(s->sigs = (unsigned char *)malloc(count * DELTA_SIG_LEN))) {
+        fprintf(stderr, "\nCannot take %llu block signatures\n", (unsigned long long)count);
+        return (size_t)-1;
+    }
+    size_t used = session_recv_tail(s, m, LFT2_SIGS_HDR_LEN, avail, s->sigs, (size_t)count * DELTA_SIG_LEN);
+    if (used != (size_t)-1)
+        s->sig_count = count;
+    return used;
+}
+
+// The bitmap after a LFT2_MSG_HAVE header at m (see session_recv_tail)
+static size_t session_recv_have(struct session *s, const unsigned char *m, size_t avail) {
+    uint32_t count = get_be32(m + 6);
+    free(s->have_bits);
+    s->have_bits = NULL;
+    s->have_count = 0;
+    if (count == 0)
+        return 0;
+    size_t len = ((size_t)count + 7) / 8;
+    if (count > LFT2_DEDUP_MAX_CHUNKS || !(s->have_bits = (unsigned char *)malloc(len))) {
+        fprintf(stderr, "\nCannot take a bitmap of %u chunks\n", (unsigned)count);
+        return (size_t)-1;
+    }
+    size_t used = session_recv_tail(s, m, LFT2_HAVE_HDR_LEN, avail, s->have_bits, len);
+    if (used != (size_t)-1)
+        s->have_count = count;
+    return used;
+}
+
+// Collect acks. Without block only what has already arrived is consumed;
+// with block it waits for at least one more message.
+static int session_recv(struct session *s, bool block) {
+    for (;;) {
+        ssize_t r = sock_recv(s->fd, s->rbuf + s->rlen, sizeof(s->rbuf) - s->rlen, block ? 0 : MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!block && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            perror("recv ack");
+            return -1;
+        }
+        if (r == 0) {
+            fprintf(stderr, "\nServer closed the session\n");
+            return -1;
+        }
+        s->rlen += (size_t)r;
+        size_t off = 0;
+        while (s->rlen > off) {
+            size_t mlen = session_msg_len(s->rbuf[off]);
+            if (mlen == 0) {
+                fprintf(stderr, "\nUnexpected message 0x%02x from server\n", s->rbuf[off]);
+                return -1;
+            }
+            if (s->rlen - off < mlen)
+                break;
+            if (s->rbuf[off] == LFT2_MSG_SIGS || s->rbuf[off] == LFT2_MSG_HAVE) {
+                size_t extra = s->rbuf[off] == LFT2_MSG_SIGS ? session_recv_sigs(s, s->rbuf + off, s->rlen - off)
+                                                              : session_recv_have(s, s->rbuf + off, s->rlen - off);
+                if (extra == (size_t)-1)
+                    return -1;
+                mlen += extra;
+            }
+            if (session_on_msg(s, s->rbuf + off) < 0)
+                return -1;
+            off += mlen;
+        }
+        memmove(s->rbuf, s->rbuf + off, s->rlen - off);
+        s->rlen -= off;
+        if (block && off > 0)
+            return 0;
+    }
+}
+
+// Block until at most max_inflight frames are unacknowledged
+static int session_wait(struct session *s, uint32_t max_inflight) {
+    while (s->next_seq - s->acked > max_inflight) {
+        if (session_recv(s, true) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// write_full() for a piece of a frame; with more, the kernel may hold it
+// back to fill a segment with what follows
+static int send_more(int fd, const void *p, size_t n, bool more) {
+    for (size_t off = 0; off < n;) {
+        ssize_t r = sock_send(fd, (const char *)p + off, n - off, more ? MSG_MORE : 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t)r;
+    }
+    return 0;
+}
+
+// Send a frame header followed by len bytes of fd from offset start, and
+// remember it until its ack arrives. Returns 0 or -1 (session unusable).
+static int session_send_frame(struct session *s, const unsigned char *hdr, size_t hlen,
+                              const char *name, int fd, uint64_t start, uint64_t len,
+                              struct progress *prog) {
+    if (session_wait(s, SESSION_WINDOW - 1) < 0)
+        return -1;
+    unsigned slot = s->next_seq % SESSION_WINDOW;
+    s->names[slot] = strdup(name);
+    s->sizes[slot] = len;
+    if (!s->names[slot]) {
+        perror("strdup");
+        return -1;
+    }
+    if (send_more(s->fd, hdr, hlen, len > 0) < 0) {
+        perror("send frame");
+        return -1;
+    }
+    s->next_seq++;
+    // Every frame with content gets the trailer, even an empty one
+    if ((s->features & LFT2_F_CHECKSUM) && LFT2_FRAME_HAS_CONTENT(hdr[0])) {
+        uint32_t crc = 0;
+        unsigned char trailer[LFT2_TRAILER_LEN];
+        if (send_body(s->fd, fd, start, len, prog, &crc, s->z) < 0)
+            return -1;
+        put_be32(trailer, crc);
+        if (sock_write_full(s->fd, trailer, sizeof(trailer)) < 0) {
+            perror("send checksum");
+            return -1;
+        }
+    } else if (send_body(s->fd, fd, start, len, prog, NULL, s->z) < 0) {
+        return -1;
+    }
+    return session_recv(s, false);
+}
+
+// --probe: send rounds of filler, doubling in size until one takes
+// PROBE_ROUND_TIME, and take the goodput of the last round (send to ack) as
+// the path's bandwidth. The RTT and what limited the sender come from the
+// kernel. Returns 0 or -1 (session unusable).
+static int session_probe(struct session *s, struct tune_probe *p) {
+    static const unsigned char zeros[64 * 1024];
+    bool quiet = s->quiet;
+    s->quiet = true;
+    memset(p, 0, sizeof(*p));
+    for (uint64_t n = PROBE_FIRST;; n *= 2) {
+        unsigned char hdr[1 + 8];
+        hdr[0] = LFT2_FRAME_PROBE;
+        put_be64(hdr + 1, n);
+        unsigned slot = s->next_seq % SESSION_WINDOW;
+        s->names[slot] = strdup("(probe)");
+        s->sizes[slot] = n;
+        if (!s->names[slot]) {
+            perror("strdup");
+            return -1;
+        }
+        double t0 = now_sec();
+        if (send_more(s->fd, hdr, sizeof(hdr), true) < 0) {
+            perror("send probe");
+            return -1;
+        }
+        s->next_seq++;
+        for (uint64_t left = n; left > 0;) {
+            size_t k = rate_grant(left > sizeof(zeros) ? sizeof(zeros) : (size_t)left);
+            if (send_more(s->fd, zeros, k, left > k) < 0) {
+                perror("send probe");
+                return -1;
+            }
+            left -= k;
+        }
+        if (session_wait(s, 0) < 0)
+            return -1;
+        double t = now_sec() - t0;
+        if (t >= PROBE_ROUND_TIME || n >= PROBE_MAX) {
+            p->rate = (double)n / t;
+            break;
+        }
+    }
+    s->quiet = quiet;
+    if (tune_measure(s->fd, p) < 0)
+        perror("TCP_INFO");
+    return 0;
+}
+
+// Resumable upload: ask the server what it already holds of this version of
+// the file, check that prefix against our copy and send the rest. Same
+// return values as session_send_file.
+static int session_resume_file(struct session *s, int fd, const struct stat *st, const char *sname) {
+    uint64_t filesize = (uint64_t)st->st_size;
+    uint64_t mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000u + (uint64_t)st->st_mtim.tv_nsec;
+    size_t name_len = strlen(sname);
+    unsigned char hdr[1 + 8 + 8 + 8 + 2 + 4096];
+
+    hdr[0] = LFT2_FRAME_QUERY;
+    put_be64(hdr + 1, filesize);
+    put_be64(hdr + 9, mtime_ns);
+    put_be16(hdr + 17, (uint16_t)name_len);
+    memcpy(hdr + 19, sname, name_len);
+    if (session_send_frame(s, hdr, 19 + name_len, sname, -1, 0, 0, NULL) < 0 || session_wait(s, 0) < 0)
+        return -1;
+    if (s->offer_status != LANDROP_ST_OK)
+        return 0; // already counted as failed by session_on_msg
+
+    uint64_t have = s->offer_have;
+    if (have > 0) {
+        uint32_t crc;
+        if (crc32c_fd_prefix(fd, have, &crc, NULL) != 0 || crc != s->offer_crc) {
+            fprintf(stderr, "Partial copy of %s on the server does not match, sending it all\n", sname);
+            have = 0;
+        } else {
+            char hb[32];
+            human_bytes((double)have, hb, sizeof(hb));
+            fprintf(stderr, "Resuming %s at %s\n", sname, hb);
+        }
+    }
+
+    hdr[0] = LFT2_FRAME_RFILE;
+    put_be64(hdr + 1, filesize);
+    put_be64(hdr + 9, mtime_ns);
+    put_be64(hdr + 17, have);
+    put_be16(hdr + 25, (uint16_t)name_len);
+    memcpy(hdr + 27, sname, name_len);
+
+    struct progress prog;
+    progress_init(&prog, filesize, s->prog);
+    atomic_store(&prog.done, have);
+    int rc = session_send_frame(s, hdr, 27 + name_len, sname, fd, have, filesize - have, &prog);
+    progress_destroy(&prog);
+    return rc < 0 ? -1 : 0;
+}
+
+// Delta ops go out through a small buffer; literals of any size are
+// written straight from the file window behind whatever is buffered.
+struct delta_out {
+    int fd;
+    unsigned char buf[64 * 1024];
+    size_t len;
+    uint64_t wire;
+    // Pending run of consecutive old blocks, merged into one copy op
+    uint64_t run_first;
+    uint32_t run_len;
+};
+
+static int delta_out_flush(struct delta_out *o) {
+    if (o->len > 0 && send_data(o->fd, o->buf, o->len) < 0) {
+        perror("send delta");
+        return -1;
+    }
+    o->wire += o->len;
+    o->len = 0;
+    return 0;
+}
+
+static int delta_out_run(struct delta_out *o) {
+    if (o->run_len == 0)
+        return 0;
+    if (sizeof(o->buf) - o->len < 1 + 8 + 4 && delta_out_flush(o) < 0)
+        return -1;
+    o->buf[o->len] = LFT2_DOP_COPY;
+    put_be64(o->buf + o->len + 1, o->run_first);
+    put_be32(o->buf + o->len + 9, o->run_len);
+    o->len += 1 + 8 + 4;
+    o->run_len = 0;
+    return 0;
+}
+
+static int delta_out_lit(struct delta_out *o, const unsigned char *p, size_t n) {
+    if (n == 0)
+        return 0;
+    if (delta_out_run(o) < 0)
+        return -1;
+    if (sizeof(o->buf) - o->len < 1 + 4 + n && delta_out_flush(o) < 0)
+        return -1;
+    o->buf[o->len] = LFT2_DOP_LIT;
+    put_be32(o->buf + o->len + 1, (uint32_t)n);
+    o->len += 1 + 4;
+    if (sizeof(o->buf) - o->len >= n) {
+        memcpy(o->buf + o->len, p, n);
+        o->len += n;
+        return 0;
+    }
+    if (delta_out_flush(o) < 0 || send_data(o->fd, p, n) < 0) {
+        perror("send delta");
+        return -1;
+    }
+    o->wire += n;
+    return 0;
+}
+
+static int delta_out_copy(struct delta_out *o, uint64_t block) {
+    if (o->run_len > 0 && o->run_first + o->run_len == block && o->run_len < UINT32_MAX) {
+        o->run_len++;
+        return 0;
+    }
+    if (delta_out_run(o) < 0)
+        return -1;
+    o->run_first = block;
+    o->run_len = 1;
+    return 0;
+}
+
+// Weak checksum -> blocks with it, as chains through next[]
+struct delta_index {
+    uint32_t mask;
+    uint32_t *head;     // block + 1, 0 for none
+    uint32_t *next;
+};
+
+static inline uint32_t delta_index_slot(const struct delta_index *ix, uint32_t weak) {
+    return (weak * 2654435761u) >> 7 & ix->mask;
+}
+
+static int delta_index_build(struct delta_index *ix, const unsigned char *sigs, uint32_t count) {
+    uint32_t n = 1024;
+    while (n < count * 2u && n < (1u << 30))
+        n <<= 1;
+    ix->mask = n - 1;
+    ix->head = (uint32_t *)calloc(n, sizeof(uint32_t));
+    ix->next = (uint32_t *)malloc((size_t)count * sizeof(uint32_t));
+    if (!ix->head || !ix->next) {
+        free(ix->head);
+        free(ix->next);
+        return -1;
+    }
+    // Inserted backwards so each chain lists the lowest block first
+    for (uint32_t i = count; i-- > 0;) {
+        uint32_t h = delta_index_slot(ix, get_be32(sigs + (size_t)i * DELTA_SIG_LEN));
+        ix->next[i] = ix->head[h];
+        ix->head[h] = i + 1;
+    }
+    return 0;
+}
+
+// Old block matching the window at p, preferring the one that extends the
+// pending copy run. -1 if none.
+static int64_t delta_match(const struct delta_index *ix, const unsigned char *sigs, uint32_t weak,
+                           const unsigned char *p, uint32_t block, uint64_t prefer) {
+    bool hashed = false;
+    uint64_t strong = 0;
+    int64_t found = -1;
+    for (uint32_t e = ix->head[delta_index_slot(ix, weak)]; e; e = ix->next[e - 1]) {
+        const unsigned char *sig = sigs + (size_t)(e - 1) * DELTA_SIG_LEN;
+        if (get_be32(sig) != weak)
+            continue;
+        if (!hashed) {
+            strong = hash64(p, block, 0);
+            hashed = true;
+        }
+        if (get_be64(sig + 4) != strong)
+            continue;
+        if (e - 1 == prefer)
+            return (int64_t)prefer;
+        if (found < 0)
+            found = e - 1;
+    }
+    return found;
+}
+
+// Window over the new file: big enough that literal runs and block matches
+// see several blocks at a time
+#define DELTA_WINDOW (8 * 1024 * 1024)
+
+// Send the ops that turn the server's copy into ours
+static int delta_stream(struct session *s, int fd, uint64_t filesize, const struct delta_index *ix,
+                        struct progress *prog) {
+    uint32_t block = s->sig_block;
+    size_t cap = DELTA_WINDOW > 2 * (size_t)block ? DELTA_WINDOW : 2 * (size_t)block;
+    unsigned char *buf = (unsigned char *)malloc(cap);
+    struct delta_out *o = (struct delta_out *)calloc(1, sizeof(*o));
+    if (!buf || !o) {
+        perror("malloc");
+        free(buf);
+        free(o);
+        return -1;
+    }
+    o->fd = s->fd;
+    uint64_t rd = 0;            // file offset read up to
+    uint64_t base = 0;          // file offset of buf[0]
+    size_t avail = 0, pos = 0, lit = 0;
+    uint64_t shown = 0, shown_wire = 0;
+    uint32_t crc = 0;
+    struct rollsum rs;
+    bool summed = false;
+    int rc = -1;
+
+    for (;;) {
+        if (avail - pos <= block && rd < filesize) {
+            // Out of lookahead: ship the pending literals and slide
+            if (delta_out_lit(o, buf + lit, pos - lit) < 0)
+                goto out;
+            memmove(buf, buf + pos, avail - pos);
+            base += pos;
+            avail -= pos;
+            pos = lit = 0;
+            while (avail < cap && rd < filesize) {
+                size_t want = cap - avail;
+                if (filesize - rd < want)
+                    want = (size_t)(filesize - rd);
+                ssize_t r = pread(fd, buf + avail, want, (off_t)rd);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0) {
+                    if (r < 0)
+                        perror("read file");
+                    else
+                        fprintf(stderr, "\nFile shrank while sending\n");
+                    goto out;
+                }
+                crc = crc32c(crc, buf + avail, (size_t)r);
+                avail += (size_t)r;
+                rd += (uint64_t)r;
+            }
+            progress_add(prog, base - shown, o->wire - shown_wire);
+            shown = base;
+            shown_wire = o->wire;
+        }
+        if (avail - pos < block)
+            break;
+        if (!summed) {
+            rollsum_init(&rs, buf + pos, block);
+            summed = true;
+        }
+        uint64_t prefer = o->run_len ? o->run_first + o->run_len : UINT64_MAX;
+        int64_t m = delta_match(ix, s->sigs, rollsum_digest(&rs), buf + pos, block, prefer);
+        if (m >= 0) {
+            if (delta_out_lit(o, buf + lit, pos - lit) < 0 || delta_out_copy(o, (uint64_t)m) < 0)
+                goto out;
+            pos += block;
+            lit = pos;
+            summed = false;
+            continue;
+        }
+        if (pos + block >= avail)
+            break; // end of file: the rest is literal
+        rollsum_roll(&rs, buf[pos], buf[pos + block]);
+        pos++;
+    }
+    if (delta_out_lit(o, buf + lit, avail - lit) < 0 || delta_out_run(o) < 0)
+        goto out;
+    if (sizeof(o->buf) - o->len < 1 + 4 && delta_out_flush(o) < 0)
+        goto out;
+    o->buf[o->len] = LFT2_DOP_END;
+    put_be32(o->buf + o->len + 1, crc);
+    o->len += 1 + 4;
+    if (delta_out_flush(o) < 0)
+        goto out;
+    progress_add(prog, filesize - shown, o->wire - shown_wire);
+    rc = 0;
+out:
+    free(buf);
+    free(o);
+    return rc;
+}
+
+// Delta upload: fetch the signatures of the server's copy and send our file
+// as references to its blocks plus literal bytes. Returns 0 once sent (or
+// refused, which the ack accounting has counted), 1 if there is nothing to
+// delta against and the file should go whole, -1 if the session is unusable.
+static int session_delta_file(struct session *s, int fd, const struct stat *st, const char *sname) {
+    uint64_t filesize = (uint64_t)st->st_size;
+    size_t name_len = strlen(sname);
+    unsigned char hdr[1 + 8 + 4 + 2 + 4096];
+
+    hdr[0] = LFT2_FRAME_SIGREQ;
+    put_be64(hdr + 1, filesize);
+    put_be16(hdr + 9, (uint16_t)name_len);
+    memcpy(hdr + 11, sname, name_len);
+    if (session_send_frame(s, hdr, 11 + name_len, sname, -1, 0, 0, NULL) < 0 || session_wait(s, 0) < 0)
+        return -1;
+    if (s->sig_status != LANDROP_ST_OK)
+        return 0;
+    if (s->sig_count == 0)
+        return 1;
+
+    struct delta_index ix;
+    if (delta_index_build(&ix, s->sigs, (uint32_t)s->sig_count) < 0) {
+        perror("delta index");
+        return 1;
+    }
+    hdr[0] = LFT2_FRAME_DELTA;
+    put_be64(hdr + 1, filesize);
+    put_be32(hdr + 9, s->sig_block);
+    put_be16(hdr + 13, (uint16_t)name_len);
+    memcpy(hdr + 15, sname, name_len);
+    int rc = session_send_frame(s, hdr, 15 + name_len, sname, -1, 0, 0, NULL);
+    if (rc == 0) {
+        // The ack names the file's size, not the empty frame body
+        s->sizes[(s->next_seq - 1) % SESSION_WINDOW] = filesize;
+        struct progress prog;
+        progress_init(&prog, filesize, s->prog);
+        rc = delta_stream(s, fd, filesize, &ix, &prog);
+        if (rc == 0 && !s->quiet) {
+            char wb[32];
+            human_bytes((double)atomic_load(&prog.wire), wb, sizeof(wb));
+            fprintf(stderr, "\nDelta of %s: %s sent\n", sname, wb);
+        }
+        progress_destroy(&prog);
+    }
+    free(ix.head);
+    free(ix.next);
+    free(s->sigs);
+    s->sigs = NULL;
+    s->sig_count = 0;
+    return rc < 0 ? -1 : 0;
+}
+
+// Cut the file into content-defined chunks and list them as a chunks frame
+// wants them, behind room bytes left for the frame header. NULL if the file
+// cannot be read or has more chunks than the server takes.
+static unsigned char *dedup_chunk_list(int fd, uint64_t filesize, size_t room, uint32_t *count) {
+    unsigned char *buf = (unsigned char *)malloc(DELTA_WINDOW);
+    size_t cap = room + 1024 * LFT2_CHUNK_ENTRY_LEN;
+    unsigned char *list = (unsigned char *)malloc(cap);
+    uint64_t rd = 0;
+    size_t avail = 0, pos = 0;
+    uint32_t n = 0;
+    if (!buf || !list) {
+        perror("malloc");
+        goto fail;
+    }
+    (void)posix_fadvise(fd, 0, (off_t)filesize, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        // cdc_cut() must see a whole maximum chunk except at the end
+        if (avail - pos < CDC_MAX && rd < filesize) {
+            memmove(buf, buf + pos, avail - pos);
+            avail -= pos;
+            pos = 0;
+            while (avail < DELTA_WINDOW && rd < filesize) {
+                size_t want = DELTA_WINDOW - avail;
+                if (filesize - rd < want)
+                    want = (size_t)(filesize - rd);
+                ssize_t r = pread(fd, buf + avail, want, (off_t)rd);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0) {
+                    if (r < 0)
+                        perror("read file");
+                    else
+                        fprintf(stderr, "\nFile shrank while reading\n");
+                    goto fail;
+                }
+                avail += (size_t)r;
+                rd += (uint64_t)r;
+            }
+        }
+        if (pos == avail)
+            break;
+        if (n == LFT2_DEDUP_MAX_CHUNKS)
+            goto fail;
+        if (room + ((size_t)n + 1) * LFT2_CHUNK_ENTRY_LEN > cap) {
+            unsigned char *l = (unsigned char *)realloc(list, cap * 2);
+            if (!l) {
+                perror("realloc");
+                goto fail;
+            }
+            list = l;
+            cap *= 2;
+        }
+        size_t len = cdc_cut(buf + pos, avail - pos);
+        unsigned char *e = list + room + (size_t)n * LFT2_CHUNK_ENTRY_LEN;
+        cdc_hash(buf + pos, len, e);
+        put_be32(e + CDC_HASH_LEN, (uint32_t)len);
+        put_be32(e + CDC_HASH_LEN + 4, crc32c(0, buf + pos, len));
+        n++;
+        pos += len;
+    }
+    free(buf);
+    *count = n;
+    return list;
+fail:
+    free(buf);
+    free(list);
+    return NULL;
+}
+
+// Dedup upload: list the file's chunks, learn which ones the server holds
+// in any of its files, and send only the others. Returns 0 once sent (or
+// refused, which the ack accounting has counted), 1 if the file should go
+// whole, -1 if the session is unusable. When the server reused chunks we
+// wait for its ack: it checks them again while copying and answers
+// LANDROP_ST_STALE if one changed, and then the file goes whole too.
+static int session_dedup_file(struct session *s, int fd, const struct stat *st, const char *sname) {
+    uint64_t filesize = (uint64_t)st->st_size;
+    size_t name_len = strlen(sname);
+    size_t hlen = 1 + 8 + 4 + 2 + name_len;
+    uint32_t count = 0;
+    unsigned char *frame = dedup_chunk_list(fd, filesize, hlen, &count);
+    if (!frame)
+        return 1;
+    frame[0] = LFT2_FRAME_CHUNKS;
+    put_be64(frame + 1, filesize);
+    put_be32(frame + 9, count);
+    put_be16(frame + 13, (uint16_t)name_len);
+    memcpy(frame + 15, sname, name_len);
+    if (session_send_frame(s, frame, hlen + (size_t)count * LFT2_CHUNK_ENTRY_LEN, sname, -1, 0, 0, NULL) < 0 ||
+        session_wait(s, 0) < 0) {
+        free(frame);
+        return -1;
+    }
+    if (s->have_status != LANDROP_ST_OK) {
+        free(frame);
+        return 0;
+    }
+    if (s->have_count != count) {
+        fprintf(stderr, "\nServer answered for %u chunks instead of %u\n", (unsigned)s->have_count,
+                (unsigned)count);
+        free(frame);
+        return -1;
+    }
+
+    // Same header, now followed by the chunks the server lacks
+    frame[0] = LFT2_FRAME_DEDUP;
+    int rc = session_send_frame(s, frame, hlen, sname, -1, 0, 0, NULL);
+    if (rc == 0) {
+        // The ack names the file's size, not the empty frame body
+        s->sizes[(s->next_seq - 1) % SESSION_WINDOW] = filesize;
+        struct progress prog;
+        progress_init(&prog, filesize, s->prog);
+        uint64_t off = 0, sent = 0;
+        uint32_t have = 0;
+        for (uint32_t i = 0; i < count && rc == 0;) {
+            const unsigned char *e = frame + hlen + (size_t)i * LFT2_CHUNK_ENTRY_LEN;
+            uint64_t len = get_be32(e + CDC_HASH_LEN);
+            if (s->have_bits[i / 8] & (1u << (i % 8))) {
+                progress_add(&prog, len, 0);
+                have++;
+                off += len;
+                i++;
+                continue;
+            }
+            // A run of missing chunks goes out in one piece
+            uint64_t run = 0;
+            do {
+                run += get_be32(frame + hlen + (size_t)i * LFT2_CHUNK_ENTRY_LEN + CDC_HASH_LEN);
+                i++;
+            } while (i < count && !(s->have_bits[i / 8] & (1u << (i % 8))));
+            rc = send_body(s->fd, fd, off, run, &prog, NULL, NULL);
+            off += run;
+            sent += run;
+        }
+        if (rc == 0 && have > 0)
+            rc = session_wait(s, 0);
+        if (rc == 0 && s->stale) {
+            s->stale = false;
+            fprintf(stderr, "\nContent of %s changed on the server meanwhile, sending it whole\n", sname);
+            rc = 1;
+        } else if (rc == 0 && !s->quiet) {
+            char sb[32];
+            human_bytes((double)sent, sb, sizeof(sb));
+            fprintf(stderr, "\nDedup of %s: %s sent, %u of %u chunks already on the server\n", sname, sb,
+                    (unsigned)have, (unsigned)count);
+        }
+        progress_destroy(&prog);
+    }
+    free(frame);
+    free(s->have_bits);
+    s->have_bits = NULL;
+    s->have_count = 0;
+    return rc < 0 ? -1 : rc;
+}
+
+// Send the collected small files as one batch frame, each registered under
+// its own sequence number. Returns 0 or -1 (session unusable).
+static int session_batch_flush(struct session *s) {
+    struct batch *b = s->batch;
+    if (!b || b->count == 0)
+        return 0;
+    if (session_wait(s, SESSION_WINDOW - b->count) < 0)
+        return -1;
+    const unsigned char *p = b->index;
+    for (uint32_t i = 0; i < b->count; ++i) {
+        unsigned slot = (s->next_seq + i) % SESSION_WINDOW;
+        uint16_t namelen = get_be16(p + 8);
+        s->sizes[slot] = get_be64(p);
+        s->names[slot] = strndup((const char *)p + 10, namelen);
+        if (!s->names[slot]) {
+            perror("strndup");
+            return -1;
+        }
+        p += 10 + namelen;
+    }
+    unsigned char hdr[1 + 4 + 4 + 8];
+    hdr[0] = LFT2_FRAME_BATCH;
+    put_be32(hdr + 1, b->count);
+    put_be32(hdr + 5, (uint32_t)b->ilen);
+    put_be64(hdr + 9, b->dlen);
+    if (send_more(s->fd, hdr, sizeof(hdr), true) < 0 || send_more(s->fd, b->index, b->ilen, true) < 0) {
+        perror("send batch");
+        return -1;
+    }
+    s->next_seq += b->count;
+
+    struct progress prog;
+    progress_init(&prog, b->dlen, s->prog);
+    uint32_t crc = 0;
+    uint32_t *crcp = (s->features & LFT2_F_CHECKSUM) ? &crc : NULL;
+    int rc = 0;
+    if (s->z) {
+        rc = send_body_chunked(s->fd, -1, b->data, 0, b->dlen, &prog, crcp, s->z);
+    } else {
+        if (crcp)
+            crc = crc32c(0, b->data, b->dlen);
+        rc = send_data(s->fd, b->data, b->dlen);
+        if (rc < 0)
+            perror("send batch");
+        else
+            progress_add(&prog, b->dlen, b->dlen);
+    }
+    progress_destroy(&prog);
+    if (rc == 0 && crcp) {
+        unsigned char trailer[LFT2_TRAILER_LEN];
+        put_be32(trailer, crc);
+        rc = sock_write_full(s->fd, trailer, sizeof(trailer));
+        if (rc < 0)
+            perror("send checksum");
+    }
+    b->count = 0;
+    b->ilen = b->dlen = 0;
+    return rc < 0 ? -1 : session_recv(s, false);
+}
+
+// Read a small file into the current batch, sending the batch first if the
+// file does not fit. Same return values as session_send_file.
+static int session_batch_add(struct session *s, int fd, uint64_t size, const char *sname) {
+    struct batch *b = s->batch;
+    size_t namelen = strlen(sname);
+    if (b->count == LFT2_BATCH_MAX_FILES || b->dlen + size > LFT2_BATCH_MAX_DATA ||
+        b->ilen + 10 + namelen > LFT2_BATCH_MAX_INDEX) {
+        if (session_batch_flush(s) < 0)
+            return -1;
+    }
+    for (size_t got = 0; got < size;) {
+        ssize_t r = pread(fd, b->data + b->dlen + got, (size_t)size - got, (off_t)got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            if (r < 0)
+                perror("read file");
+            else
+                fprintf(stderr, "File shrank while reading: %s\n", sname);
+            return 1;
+        }
+        got += (size_t)r;
+    }
+    unsigned char *e = b->index + b->ilen;
+    put_be64(e, size);
+    put_be16(e + 8, (uint16_t)namelen);
+    memcpy(e + 10, sname, namelen);
+    b->ilen += 10 + namelen;
+    b->dlen += size;
+    b->count++;
+    return 0;
+}
+
+// Queue one file frame, file relative to dirfd. Returns 0 once the body is
+// on the wire (the ack comes later), 1 if the file was skipped locally, -1
+// if the session is unusable.
+static int session_send_file(struct session *s, int dirfd, const char *file, const char *remote_name) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open file");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not a regular file: %s\n", file);
+        close(fd);
+        return 1;
+    }
+    uint64_t filesize = (uint64_t)st.st_size;
+
+    const char *base = remote_name ? remote_name : path_basename(file);
+    unsigned char hdr[1 + 8 + 2 + 4096];
+    char *sname = (char *)hdr + 11;
+    if (sanitize_path(base, sname, 4096) != 0 || sname[0] == '\0') {
+        fprintf(stderr, "Invalid remote name\n");
+        close(fd);
+        return 1;
+    }
+    if (s->batch && filesize < g_batch_max) {
+        int rc = session_batch_add(s, fd, filesize, sname);
+        close(fd);
+        return rc;
+    }
+    if ((s->features & LFT2_F_DEDUP) && filesize >= DEDUP_MIN_FILE) {
+        int rc = session_dedup_file(s, fd, &st, sname);
+        if (rc <= 0) {
+            close(fd);
+            return rc;
+        }
+    }
+    if ((s->features & LFT2_F_DELTA) && filesize >= DELTA_MIN_FILE) {
+        int rc = session_delta_file(s, fd, &st, sname);
+        if (rc <= 0) {
+            close(fd);
+            return rc;
+        }
+    }
+    if (s->features & LFT2_F_RESUME) {
+        int rc = session_resume_file(s, fd, &st, sname);
+        close(fd);
+        return rc;
+    }
+    size_t name_len = strlen(sname);
+    hdr[0] = LFT2_FRAME_FILE;
+    put_be64(hdr + 1, filesize);
+    put_be16(hdr + 9, (uint16_t)name_len);
+
+    struct progress prog;
+    progress_init(&prog, filesize, s->prog);
+    int rc = session_send_frame(s, hdr, 11 + name_len, sname, fd, 0, filesize, &prog);
+    progress_destroy(&prog);
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
+
+static int session_finish(struct session *s);
+
+// Striping (-j): one file split into ranges, each sent on its own session
+#define STRIPE_ALIGN (1024 * 1024)
+
+struct stripe_job {
+    const char *host;
+    const char *port;
+    const char *file;
+    const char *sname;
+    uint64_t id;
+    uint64_t filesize;
+    uint64_t off;
+    uint64_t len;
+    uint16_t index;
+    uint16_t count;
+    struct progress *prog;
+    int rc;
+    pthread_t thread;
+};
+
+static void *stripe_main(void *arg) {
+    struct stripe_job *j = (struct stripe_job *)arg;
+    j->rc = 1;
+    int fd = open(j->file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open file");
+        return NULL;
+    }
+    struct session *s = NULL;
+    uint32_t features = LFT2_F_STRIPE | (g_checksum ? LFT2_F_CHECKSUM : 0) | (g_zmode ? LFT2_F_COMPRESS : 0);
+    if (session_open(j->host, j->port, features, &s) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (!(s->features & LFT2_F_STRIPE)) {
+        fprintf(stderr, "Server refused striping\n");
+        session_finish(s);
+        close(fd);
+        return NULL;
+    }
+    s->quiet = true;
+
+    size_t name_len = strlen(j->sname);
+    unsigned char hdr[1 + 4 * 8 + 2 + 2 + 4096];
+    hdr[0] = LFT2_FRAME_STRIPE;
+    put_be64(hdr + 1, j->id);
+    put_be64(hdr + 9, j->filesize);
+    put_be64(hdr + 17, j->off);
+    put_be64(hdr + 25, j->len);
+    put_be16(hdr + 33, j->count);
+    put_be16(hdr + 35, (uint16_t)name_len);
+    memcpy(hdr + 37, j->sname, name_len);
+    char label[4096 + 32];
+    snprintf(label, sizeof(label), "%s [stripe %u/%u]", j->sname, (unsigned)j->index + 1, (unsigned)j->count);
+
+    int rc = session_send_frame(s, hdr, 37 + name_len, label, fd, j->off, j->len, j->prog);
+    close(fd);
+    int frc = session_finish(s);
+    j->rc = (rc == 0 && frc == 0) ? 0 : 1;
+    return NULL;
+}
+
+static uint64_t random_id(void) {
+    uint64_t id = 0;
+    if (getrandom(&id, sizeof(id), 0) != (ssize_t)sizeof(id))
+        id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^ (uint64_t)(now_sec() * 1e9);
+    return id;
+}
+
+// Send one file as nstripes byte ranges over parallel connections.
+// Returns 0 on success, 1 on failure.
+static int send_striped(struct sender *snd, const char *file, const char *remote_name,
+                        uint64_t filesize, unsigned nstripes) {
+    const char *base = remote_name ? remote_name : path_basename(file);
+    char sname[4096];
+    if (sanitize_path(base, sname, sizeof(sname)) != 0 || sname[0] == '\0') {
+        fprintf(stderr, "Invalid remote name\n");
+        return 1;
+    }
+    // Rounding the stripes up to the alignment may leave fewer of them
+    uint64_t per = (filesize / nstripes + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+    nstripes = (unsigned)((filesize + per - 1) / per);
+    struct stripe_job *jobs = (struct stripe_job *)calloc(nstripes, sizeof(*jobs));
+    if (!jobs) {
+        perror("calloc");
+        return 1;
+    }
+    struct progress prog;
+    progress_init(&prog, filesize, NULL);
+
+    uint64_t id = random_id();
+    unsigned started = 0;
+    for (unsigned i = 0; i < nstripes; ++i) {
+        struct stripe_job *j = &jobs[i];
+        j->host = snd->host;
+        j->port = snd->port;
+        j->file = file;
+        j->sname = sname;
+        j->id = id;
+        j->filesize = filesize;
+        j->off = (uint64_t)i * per;
+        j->len = i + 1 == nstripes ? filesize - j->off : per;
+        j->index = (uint16_t)i;
+        j->count = (uint16_t)nstripes;
+        j->prog = &prog;
+        int rc = pthread_create(&j->thread, NULL, stripe_main, j);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            break;
+        }
+        started++;
+    }
+    int result = started == nstripes ? 0 : 1;
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].rc != 0)
+            result = 1;
+    }
+    progress_destroy(&prog);
+    free(jobs);
+    if (result == 0)
+        fprintf(stderr, "\nFile sent successfully (%s, %lu bytes, %u stripes)\n",
+                sname, (unsigned long)filesize, nstripes);
+    else
+        fprintf(stderr, "\nStriped transfer of %s failed\n", sname);
+    return result;
+}
+
+// End the session and wait for the remaining acks. Returns the number of
+// files the server did not store, or -1 if the session broke down.
+static int session_finish(struct session *s) {
+    int rc = 0;
+    unsigned char end = LFT2_FRAME_END;
+    if (session_batch_flush(s) < 0) {
+        rc = -1;
+    } else if (sock_write_full(s->fd, &end, 1) < 0) {
+        perror("send end");
+        rc = -1;
+    } else if (session_wait(s, 0) < 0) {
+        rc = -1;
+    }
+    if (rc == 0)
+        rc = s->failed;
+    for (uint32_t i = s->acked; i != s->next_seq; ++i)
+        free(s->names[i % SESSION_WINDOW]);
+    zstate_free(s->z);
+    free(s->sigs);
+    free(s->have_bits);
+    batch_free(s->batch);
+    sock_close(s->fd);
+    free(s);
+    return rc;
+}
+
+// Returns 0 on success, 1 if this file failed, -1 if nothing more can be sent
+static int send_file(struct sender *snd, const char *file, const char *remote_name) {
+    // Resumable, delta and dedup uploads go over the single session, never striped
+    if (g_jobs > 1 && snd->sess && (snd->sess->features & LFT2_F_STRIPE) &&
+        !(snd->sess->features & (LFT2_F_RESUME | LFT2_F_DELTA | LFT2_F_DEDUP))) {
+        struct stat st;
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+            uint64_t n = (uint64_t)st.st_size / STRIPE_ALIGN;
+            if (n > (uint64_t)g_jobs)
+                n = (uint64_t)g_jobs;
+            if (n >= 2)
+                return send_striped(snd, file, remote_name, (uint64_t)st.st_size, (unsigned)n);
+        }
+    }
+    if (snd->sess)
+        return session_send_file(snd->sess, AT_FDCWD, file, remote_name);
+    return send_one_file(snd->host, snd->port, AT_FDCWD, file, remote_name, NULL) == 0 ? 0 : 1;
+}
+
+// landrop get: files a landropd -G holds, fetched as -j byte ranges over
+// parallel sessions into a hidden partial file next to the destination. A
+// sidecar keeps how far each range got, so an interrupted download carries
+// on where its ranges stopped when run again, as long as the server still
+// holds the same version (size and mtime); otherwise it starts over. The
+// sidecar is written after the data it accounts for, which holds when the
+// process is killed, not across a power cut.
+#define GET_STATE_MAGIC "LGT1"
+#define GET_STATE_HDR (4 + 8 + 8 + 4)
+#define GET_STATE_RANGE (8 + 8 + 8)
+
+struct get_range {
+    uint64_t start, end;        // [start, end) of the file
+    uint64_t done;              // bytes of it in the partial file
+};
+
+struct get_job {
+    const char *host;
+    const char *port;
+    const char *sname;
+    struct session *s;          // borrowed (the first range), or opened here
+    uint64_t filesize;
+    uint64_t mtime_ns;
+    struct get_range *r;
+    unsigned index;
+    int fd;                     // partial file
+    int state_fd;               // sidecar
+    struct progress *prog;
+    int rc;
+    bool started;
+    pthread_t thread;
+};
+
+// Ask for len bytes of sname from off and read the reply's header. Returns
+// its status byte with the file's size and mtime and the length that
+// follows, or -1 if the session broke down.
+static int session_get(struct session *s, const char *sname, uint64_t off, uint64_t len, uint64_t *size,
+                       uint64_t *mtime_ns, uint64_t *got) {
+    size_t name_len = strlen(sname);
+    unsigned char hdr[1 + 8 + 8 + 2 + 4096];
+    hdr[0] = LFT2_FRAME_GET;
+    put_be64(hdr + 1, off);
+    put_be64(hdr + 9, len);
+    put_be16(hdr + 17, (uint16_t)name_len);
+    memcpy(hdr + 19, sname, name_len);
+    if (sock_write_full(s->fd, hdr, 19 + name_len) < 0) {
+        perror("send get");
+        return -1;
+    }
+    unsigned char m[LFT2_DATA_HDR_LEN];
+    if (sock_read_full(s->fd, m, sizeof(m)) < 0) {
+        perror("recv data");
+        return -1;
+    }
+    if (m[0] != LFT2_MSG_DATA || get_be32(m + 1) != s->next_seq) {
+        fprintf(stderr, "\nUnexpected reply 0x%02x from server\n", m[0]);
+        return -1;
+    }
+    s->next_seq++;
+    s->acked++;
+    *size = get_be64(m + 6);
+    *mtime_ns = get_be64(m + 14);
+    *got = get_be64(m + 30);
+    if (m[5] == LANDROP_ST_OK && (get_be64(m + 22) != off || *got > len)) {
+        fprintf(stderr, "\nServer sent another range than asked for\n");
+        return -1;
+    }
+    return m[5];
+}
+
+// One range: ask for what is missing of it and write it to the partial file
+// as it comes, noting the progress in the sidecar
+static void *get_main(void *arg) {
+    struct get_job *j = (struct get_job *)arg;
+    j->rc = 1;
+    struct session *s = j->s;
+    if (!s && session_open(j->host, j->port, LFT2_F_PULL, &s) != 0)
+        return NULL;
+    unsigned char *buf = (unsigned char *)malloc(g_chunk);
+    struct get_range *r = j->r;
+    uint64_t off = r->start + r->done;
+    uint64_t size, mtime, len;
+    int st = buf ? session_get(s, j->sname, off, r->end - off, &size, &mtime, &len) : -1;
+    if (!buf)
+        perror("malloc");
+    if (st > 0)
+        fprintf(stderr, "\nServer reported error for %s (code %u)\n", j->sname, (unsigned)st);
+    if (st == LANDROP_ST_OK && (size != j->filesize || mtime != j->mtime_ns || len != r->end - off)) {
+        // A range of another version would make a file that never existed
+        fprintf(stderr, "\n%s changed on the server during the download\n", j->sname);
+        st = -1;
+    }
+    uint64_t left = st == LANDROP_ST_OK ? len : 0;
+    while (left > 0) {
+        size_t n = left > g_chunk ? g_chunk : (size_t)left;
+        n = rate_grant(n);
+        ssize_t k = sock_recv(s->fd, buf, n, 0);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            if (k == 0)
+                errno = EPIPE;
+            perror("recv file data");
+            break;
+        }
+        unsigned char done[8];
+        put_be64(done, r->done + (uint64_t)k);
+        if (pwrite_full(j->fd, buf, (size_t)k, (int64_t)off) < 0 ||
+            pwrite_full(j->state_fd, done, sizeof(done),
+                        GET_STATE_HDR + (int64_t)j->index * GET_STATE_RANGE + 16) < 0) {
+            perror("write file data");
+            break;
+        }
+        off += (uint64_t)k;
+        left -= (uint64_t)k;
+        r->done += (uint64_t)k;
+        progress_add(j->prog, (uint64_t)k, (uint64_t)k);
+    }
+    free(buf);
+    j->rc = st == LANDROP_ST_OK && left == 0 ? 0 : 1;
+    // The borrowed session is the caller's to end; after a failure it may be
+    // out of step, so it goes as well
+    if (!j->s || j->rc != 0) {
+        session_finish(s);
+        j->s = NULL;
+    }
+    return NULL;
+}
+
+// The ranges of an interrupted download of this version of the file from
+// the sidecar at fd, or 0 if there is none to go on with
+static unsigned get_state_load(int fd, uint64_t size, uint64_t mtime_ns, struct get_range *r) {
+    unsigned char b[GET_STATE_HDR + MAX_JOBS * GET_STATE_RANGE];
+    ssize_t n = pread(fd, b, sizeof(b), 0);
+    if (n < GET_STATE_HDR || memcmp(b, GET_STATE_MAGIC, 4) != 0 || get_be64(b + 4) != size ||
+        get_be64(b + 12) != mtime_ns)
+        return 0;
+    uint32_t count = get_be32(b + 20);
+    if (count == 0 || count > MAX_JOBS || (size_t)n < GET_STATE_HDR + count * GET_STATE_RANGE)
+        return 0;
+    uint64_t next = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *p = b + GET_STATE_HDR + i * GET_STATE_RANGE;
+        r[i].start = get_be64(p);
+        r[i].end = get_be64(p + 8);
+        r[i].done = get_be64(p + 16);
+        // The ranges must cover the file in order, or the sidecar is not ours
+        if (r[i].start != next || r[i].end < r[i].start || r[i].done > r[i].end - r[i].start)
+            return 0;
+        next = r[i].end;
+    }
+    return next == size ? count : 0;
+}
+
+static int get_state_save(int fd, uint64_t size, uint64_t mtime_ns, const struct get_range *r, unsigned count) {
+    unsigned char b[GET_STATE_HDR + MAX_JOBS * GET_STATE_RANGE];
+    memcpy(b, GET_STATE_MAGIC, 4);
+    put_be64(b + 4, size);
+    put_be64(b + 12, mtime_ns);
+    put_be32(b + 20, count);
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned char *p = b + GET_STATE_HDR + i * GET_STATE_RANGE;
+        put_be64(p, r[i].start);
+        put_be64(p + 8, r[i].end);
+        put_be64(p + 16, r[i].done);
+    }
+    size_t len = GET_STATE_HDR + count * GET_STATE_RANGE;
+    if (pwrite_full(fd, b, len, 0) < 0 || ftruncate(fd, (off_t)len) < 0)
+        return -1;
+    return 0;
+}
+
+// Download name (a path on the server) into dir, as local_name or under its
+// own last component, over s and -j - 1 more sessions. Returns 0 on
+// success, 1 if this file failed, -1 if s broke down (it is ended then).
+static int get_file(struct session *s, const char *host, const char *port, const char *name, const char *dir,
+                    const char *local_name) {
+    char sname[4096];
+    if (sanitize_path(name, sname, sizeof(sname)) != 0 || sname[0] == '\0') {
+        fprintf(stderr, "Invalid remote name: %s\n", name);
+        return 1;
+    }
+    uint64_t size, mtime_ns, len;
+    int st = session_get(s, sname, 0, 0, &size, &mtime_ns, &len);
+    if (st < 0) {
+        session_finish(s);
+        return -1;
+    }
+    if (st != LANDROP_ST_OK) {
+        fprintf(stderr, "Server reported error for %s (code %u)\n", sname, (unsigned)st);
+        return 1;
+    }
+    const char *leaf = local_name ? local_name : path_basename(sname);
+    char path[8192], part[8192], state[8192];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, leaf) >= (int)sizeof(path)) {
+        fprintf(stderr, "Local path too long\n");
+        return 1;
+    }
+    // The partial file and the sidecar sit in the destination's directory
+    const char *slash = strrchr(path, '/');
+    if (snprintf(part, sizeof(part), "%.*s/.%s.lget", (int)(slash - path), path, slash + 1) >= (int)sizeof(part) ||
+        snprintf(state, sizeof(state), "%s.ranges", part) >= (int)sizeof(state)) {
+        fprintf(stderr, "Local path too long\n");
+        return 1;
+    }
+    int fd = open(part, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    int state_fd = fd < 0 ? -1 : open(state, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0 || state_fd < 0) {
+        perror("open partial file");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    struct get_range ranges[MAX_JOBS];
+    struct stat pst;
+    unsigned count = fstat(fd, &pst) == 0 && (uint64_t)pst.st_size == size
+                         ? get_state_load(state_fd, size, mtime_ns, ranges) : 0;
+    uint64_t have = 0;
+    if (count > 0) {
+        for (unsigned i = 0; i < count; ++i)
+            have += ranges[i].done;
+        char hb[32], sb[32];
+        human_bytes((double)have, hb, sizeof(hb));
+        human_bytes((double)size, sb, sizeof(sb));
+        fprintf(stderr, "Resuming %s at %s of %s\n", sname, hb, sb);
+    } else {
+        // Ranges on STRIPE_ALIGN boundaries, as many as -j asks for and the
+        // size allows
+        uint64_t n = size / STRIPE_ALIGN;
+        if (n > (uint64_t)g_jobs)
+            n = (uint64_t)g_jobs;
+        if (n < 1)
+            n = 1;
+        uint64_t per = (size / n + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+        count = per ? (unsigned)((size + per - 1) / per) : 1;
+        for (unsigned i = 0; i < count; ++i) {
+            ranges[i].start = (uint64_t)i * per;
+            ranges[i].end = i + 1 == count ? size : ranges[i].start + per;
+            ranges[i].done = 0;
+        }
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0 ||
+            get_state_save(state_fd, size, mtime_ns, ranges, count) < 0) {
+            perror("create partial file");
+            close(fd);
+            close(state_fd);
+            return 1;
+        }
+    }
+
+    struct progress prog;
+    progress_init(&prog, size - have, NULL);
+    struct get_job jobs[MAX_JOBS];
+    memset(jobs, 0, sizeof(jobs));
+    struct get_job *borrower = NULL;
+    int result = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        if (ranges[i].done == ranges[i].end - ranges[i].start)
+            continue;
+        struct get_job *j = &jobs[i];
+        j->host = host;
+        j->port = port;
+        j->sname = sname;
+        // The first range still missing goes over the session we have
+        if (!borrower) {
+            borrower = j;
+            j->s = s;
+        }
+        j->filesize = size;
+        j->mtime_ns = mtime_ns;
+        j->r = &ranges[i];
+        j->index = i;
+        j->fd = fd;
+        j->state_fd = state_fd;
+        j->prog = &prog;
+        int rc = pthread_create(&j->thread, NULL, get_main, j);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            result = 1;
+            break;
+        }
+        j->started = true;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (!jobs[i].started)
+            continue;
+        pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].rc != 0)
+            result = 1;
+    }
+    // A range that failed on our session ended it
+    bool lost = borrower && borrower->started && !borrower->s;
+    progress_destroy(&prog);
+    close(state_fd);
+    if (close(fd) < 0 && result == 0) {
+        perror("close partial file");
+        result = 1;
+    }
+    if (result == 0) {
+        struct timespec ts[2] = {
+            { 0, UTIME_OMIT },
+            { (time_t)(mtime_ns / 1000000000u), (long)(mtime_ns % 1000000000u) },
+        };
+        if (utimensat(AT_FDCWD, part, ts, 0) < 0 || rename(part, path) < 0) {
+            perror("rename partial file");
+            result = 1;
+        } else {
+            unlink(state);
+            fprintf(stderr, "\nFile received successfully (%s, %lu bytes, %u range%s)\n", path,
+                    (unsigned long)size, count, count == 1 ? "" : "s");
+        }
+    } else {
+        fprintf(stderr, "\nDownload of %s failed; run again to resume it\n", sname);
+    }
+    return lost ? -1 : result;
+}
+
+// Every name in turn, over one session to start from. Returns the exit code.
+static int get_files(const char *host, const char *port, const char *dir, const char *local_name,
+                     char *const *names, int count) {
+    struct session *s = NULL;
+    int rc = session_open(host, port, LFT2_F_PULL, &s);
+    if (rc < 0)
+        return 1;
+    if (rc > 0 || !(s->features & LFT2_F_PULL)) {
+        fprintf(stderr, "Server does not serve downloads (landropd -G)\n");
+        if (s)
+            session_finish(s);
+        return 1;
+    }
+    if (local_name && count > 1) {
+        fprintf(stderr, "Warning: -n is ignored when getting multiple files.\n");
+        local_name = NULL;
+    }
+    int result = 0;
+    for (int i = 0; i < count; ++i) {
+        rc = get_file(s, host, port, names[i], dir, local_name);
+        if (rc != 0)
+            result = 1;
+        if (rc < 0)
+            return 1;
+    }
+    if (session_finish(s) != 0)
+        result = 1;
+    return result;
+}
+
+// Directories: WALK_THREADS threads list the tree while -j senders take
+// files off the walk's queue, each over its own session (or its own LFT1
+// connections). The queue holds at most WALK_QUEUE paths, so the walk never
+// runs far ahead of the senders and a huge tree is never all in memory.
+#define WALK_THREADS 4
+#define WALK_QUEUE 4096
+
+struct dir_sender {
+    struct sender *snd;
+    struct walk *walk;
+    struct progress *prog;
+    struct session *sess;       // NULL: LFT1
+    int failed;                 // files that could not be sent
+    bool lost;                  // the session broke down
+    pthread_t thread;
+};
+
+// Count the outcome of one file (as session_send_file() returns it). False
+// once nothing more can be sent.
+static bool dir_sender_count(struct dir_sender *d, int rc) {
+    if (rc < 0) {
+        // Session lost: the other senders stop too, as a single one would
+        d->lost = true;
+        walk_cancel(d->walk);
+        return false;
+    }
+    if (rc > 0)
+        d->failed++;
+    else
+        atomic_fetch_add(&d->prog->files, 1);
+    progress_add(d->prog, 0, 0);
+    return true;
+}
+
+// A file of the tree as listed in a manifest
+struct sync_entry {
+    char *rel;                  // relative to the walk's root
+    char *sname;                // remote name, as sanitize_path() makes it
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t crc;
+};
+
+static int sync_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const struct sync_entry *)a)->sname, ((const struct sync_entry *)b)->sname);
+}
+
+// Take the next file off the walk for a manifest. Returns 1 with e filled
+// in, 0 if the file cannot be listed (counted as failed), -1 once the walk
+// is over.
+static int sync_entry_next(struct dir_sender *d, struct sync_entry *e) {
+    int rootfd = walk_rootfd(d->walk);
+    char *rel = walk_next(d->walk);
+    if (!rel)
+        return -1;
+    char sname[4096];
+    struct stat st;
+    int fd = openat(rootfd, rel, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open file");
+    } else if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not a regular file: %s\n", rel);
+    } else if (sanitize_path(rel, sname, sizeof(sname)) != 0 || sname[0] == '\0') {
+        fprintf(stderr, "Invalid remote name\n");
+    } else if (g_sync_crc && crc32c_fd_prefix(fd, (uint64_t)st.st_size, &e->crc, NULL) != 0) {
+        perror("read file");
+    } else if (!(e->sname = strdup(sname))) {
+        perror("strdup");
+    } else {
+        close(fd);
+        e->rel = rel;
+        e->size = (uint64_t)st.st_size;
+        e->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+        return 1;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(rel);
+    dir_sender_count(d, 1);
+    return 0;
+}
+
+// Encode entries (sorted by name) as a manifest frame into frame. Returns
+// the frame's length.
+static size_t sync_manifest(const struct sync_entry *es, uint32_t n, unsigned char *frame) {
+    size_t tail = 8 + 8 + (g_sync_crc ? 4 : 0);
+    unsigned char *p = frame + 1 + 4 + 4 + 1;
+    const char *prev = "";
+    for (uint32_t i = 0; i < n; ++i) {
+        const char *name = es[i].sname;
+        size_t keep = 0;
+        while (prev[keep] && prev[keep] == name[keep])
+            keep++;
+        size_t rest = strlen(name + keep);
+        put_be16(p, (uint16_t)keep);
+        put_be16(p + 2, (uint16_t)rest);
+        memcpy(p + 4, name + keep, rest);
+        p += 4 + rest;
+        put_be64(p, es[i].size);
+        put_be64(p + 8, es[i].mtime_ns);
+        if (g_sync_crc)
+            put_be32(p + 16, es[i].crc);
+        p += tail;
+        prev = name;
+    }
+    size_t len = (size_t)(p - frame);
+    frame[0] = LFT2_FRAME_MANIFEST;
+    put_be32(frame + 1, n);
+    put_be32(frame + 5, (uint32_t)(len - 10));
+    frame[9] = g_sync_crc ? LFT2_MANIFEST_F_CRC : 0;
+    return len;
+}
+
+// -s: list the files in manifests of up to SYNC_BATCH entries and send
+// only those the server does not have yet
+static void dir_sync(struct dir_sender *d) {
+    struct session *s = d->sess;
+    int rootfd = walk_rootfd(d->walk);
+    struct sync_entry *es = (struct sync_entry *)calloc(SYNC_BATCH, sizeof(*es));
+    unsigned char *frame = (unsigned char *)malloc(1 + 4 + 4 + 1 + LFT2_MANIFEST_MAX_LEN);
+    if (!es || !frame) {
+        perror("manifest buffers");
+        free(es);
+        free(frame);
+        d->lost = true;
+        walk_cancel(d->walk);
+        return;
+    }
+    // Room for the longest entry, so a manifest never outgrows the limit
+    const size_t most = 4 + 4096 + 8 + 8 + 4;
+    bool more = true;
+    while (more) {
+        uint32_t n = 0;
+        size_t room = 0;
+        while (n < SYNC_BATCH && room + most <= LFT2_MANIFEST_MAX_LEN) {
+            int rc = sync_entry_next(d, &es[n]);
+            if (rc < 0) {
+                more = false;
+                break;
+            }
+            if (rc > 0)
+                room += 4 + strlen(es[n++].sname) + 8 + 8 + 4;
+        }
+        if (n == 0)
+            continue;
+        qsort(es, n, sizeof(*es), sync_entry_cmp);
+        size_t len = sync_manifest(es, n, frame);
+        // Files still batched from the last manifest go first: it is the
+        // last one the server knows them by
+        bool ok = session_batch_flush(s) == 0 &&
+                  session_send_frame(s, frame, len, "manifest", -1, 0, 0, NULL) == 0 && session_wait(s, 0) == 0;
+        if (ok && s->have_status == LANDROP_ST_OK && s->have_count != n) {
+            fprintf(stderr, "\nServer answered for %u files instead of %u\n", (unsigned)s->have_count, (unsigned)n);
+            ok = false;
+        }
+        // Dedup answers come in the same place: keep the bitmap aside
+        unsigned char fresh[SYNC_BATCH / 8];
+        memset(fresh, 0, sizeof(fresh));
+        if (ok && s->have_count)
+            memcpy(fresh, s->have_bits, (n + 7) / 8);
+        free(s->have_bits);
+        s->have_bits = NULL;
+        s->have_count = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            if (ok && (fresh[i / 8] & (1u << (i % 8)))) {
+                atomic_fetch_add(&d->prog->skipped, 1);
+                ok = dir_sender_count(d, 0);
+            } else if (ok) {
+                ok = dir_sender_count(d, session_send_file(s, rootfd, es[i].rel, es[i].rel));
+            }
+            free(es[i].rel);
+            free(es[i].sname);
+        }
+        if (!ok) {
+            d->lost = true;
+            walk_cancel(d->walk);
+            break;
+        }
+    }
+    free(es);
+    free(frame);
+}
+
+static void *dir_sender_main(void *arg) {
+    struct dir_sender *d = (struct dir_sender *)arg;
+    if (d->sess && (d->sess->features & LFT2_F_SYNC)) {
+        dir_sync(d);
+        return NULL;
+    }
+    int rootfd = walk_rootfd(d->walk);
+    char *rel;
+    while ((rel = walk_next(d->walk)) != NULL) {
+        // The relative path is the remote name (slashes are sanitized)
+        int rc = d->sess ? session_send_file(d->sess, rootfd, rel, rel)
+                         : send_one_file(d->snd->host, d->snd->port, rootfd, rel, rel, d->prog);
+        free(rel);
+        if (!dir_sender_count(d, rc))
+            break;
+    }
+    return NULL;
+}
+
+// Send every regular file below dir. The first sender uses the session in
+// snd; the others open their own. Returns 0 if all files were sent, -1 if not.
+static int send_directory(struct sender *snd, const char *dir) {
+    struct walk *walk = walk_start(dir, WALK_THREADS, WALK_QUEUE);
+    if (!walk) {
+        perror("open directory");
+        return -1;
+    }
+    struct progress prog;
+    progress_init(&prog, 0, NULL);
+    prog.walk = walk;
+    struct dir_sender *ds = (struct dir_sender *)calloc((size_t)g_jobs, sizeof(*ds));
+    if (!ds) {
+        perror("calloc");
+        walk_finish(walk);
+        progress_destroy(&prog);
+        return -1;
+    }
+    int n = 0;
+    for (; n < g_jobs; ++n) {
+        struct dir_sender *d = &ds[n];
+        d->snd = snd;
+        d->walk = walk;
+        d->prog = &prog;
+        if (n == 0) {
+            d->sess = snd->sess;
+        } else if (snd->sess && session_open(snd->host, snd->port, snd->sess->features & ~LFT2_F_PROBE,
+                                             &d->sess) != 0) {
+            fprintf(stderr, "Continuing with %d senders\n", n);
+            break;
+        }
+        if (d->sess) {
+            d->sess->quiet = true;
+            d->sess->prog = &prog;
+        }
+        int rc = pthread_create(&d->thread, NULL, dir_sender_main, d);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            if (n > 0 && d->sess)
+                session_finish(d->sess);
+            break;
+        }
+    }
+    if (n == 0)
+        walk_cancel(walk);
+    int failed = 0;
+    bool lost = false;
+    for (int i = 0; i < n; ++i) {
+        struct dir_sender *d = &ds[i];
+        pthread_join(d->thread, NULL);
+        failed += d->failed;
+        lost |= d->lost;
+        // Collect the acks (and send the last batch) while the bar still counts
+        if (i > 0) {
+            int frc = d->sess ? session_finish(d->sess) : 0;
+            if (frc < 0)
+                lost = true;
+            else
+                failed += frc;
+        } else if (d->sess && session_batch_flush(d->sess) < 0) {
+            lost = true;
+        }
+    }
+    if (snd->sess)
+        snd->sess->prog = NULL;
+    print_tree_progress(&prog, atomic_load(&prog.files), atomic_load(&prog.done), atomic_load(&prog.wire), now_sec());
+    char bytes[32];
+    human_bytes((double)atomic_load(&prog.done), bytes, sizeof(bytes));
+    uint64_t skipped = atomic_load(&prog.skipped);
+    uint64_t sent = atomic_load(&prog.files) - skipped;
+    fprintf(stderr, "\nSent %llu files (%s) in %.2f s with %d sender%s", (unsigned long long)sent, bytes,
+            now_sec() - prog.t0, n, n == 1 ? "" : "s");
+    if (g_sync)
+        fprintf(stderr, ", %llu up to date", (unsigned long long)skipped);
+    fputc('\n', stderr);
+    failed += walk_finish(walk);
+    free(ds);
+    progress_destroy(&prog);
+    return failed || lost || n == 0 ? -1 : 0;
+}
+
+// Receiver that reported on a multicast file
+struct mcast_rcvr {
+    struct sockaddr_in addr;
+    unsigned char status;
+};
+
+// One file going out to the group (-M)
+struct mcast_tx {
+    int fd;
+    uint32_t sid;
+    const unsigned char *data;
+    uint64_t size;
+    uint32_t nblocks;
+    unsigned char meta[MCAST_DGRAM_MAX];
+    size_t metalen;
+    uint64_t *repair;           // bit per block, set by NACKs until sent again
+    uint32_t nrepair, cursor;   // blocks set; where the next repair scan starts
+    uint64_t resent;
+    struct mcast_rcvr *rcvrs;
+    int nrcvrs, cap;
+    double heard;               // last NACK or first status of a receiver
+};
+
+// Datagrams for the given blocks, paced by the rate limits
+static int mcast_send_blocks(struct mcast_tx *t, const uint32_t *blocks, int n) {
+    unsigned char hdrs[MCAST_BATCH][MCAST_DATA_LEN];
+    struct iovec iov[MCAST_BATCH][2];
+    struct mmsghdr msgs[MCAST_BATCH];
+    size_t need = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; ++i) {
+        uint64_t off = (uint64_t)blocks[i] * MCAST_BLOCK;
+        size_t len = t->size - off < MCAST_BLOCK ? (size_t)(t->size - off) : MCAST_BLOCK;
+        mcast_put_hdr(hdrs[i], MCAST_MSG_DATA, t->sid);
+        put_be32(hdrs[i] + MCAST_HDR_LEN, blocks[i]);
+        iov[i][0].iov_base = hdrs[i];
+        iov[i][0].iov_len = MCAST_DATA_LEN;
+        iov[i][1].iov_base = (void *)(t->data + off);
+        iov[i][1].iov_len = len;
+        msgs[i].msg_hdr.msg_name = &g_mcast_group;
+        msgs[i].msg_hdr.msg_namelen = sizeof(g_mcast_group);
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+        need += MCAST_DATA_LEN + len;
+    }
+    while (need > 0)
+        need -= rate_grant(need);
+    for (int done = 0; done < n;) {
+        int r = sendmmsg(t->fd, msgs + done, (unsigned)(n - done), 0);
+        if (r < 0) {
+            if (errno == EINTR || errno == ENOBUFS)
+                continue;
+            perror("send multicast");
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+static int mcast_send_meta(struct mcast_tx *t) {
+    if (sendto(t->fd, t->meta, t->metalen, 0, (const struct sockaddr *)&g_mcast_group, sizeof(g_mcast_group)) < 0 &&
+        errno != ENOBUFS) {
+        perror("send multicast");
+        return -1;
+    }
+    return 0;
+}
+
+static void mcast_on_reply(struct mcast_tx *t, const unsigned char *m, size_t len, const struct sockaddr_in *from) {
+    if (len < MCAST_HDR_LEN + 1 || memcmp(m, MCAST_MAGIC, 4) != 0 || get_be32(m + 5) != t->sid)
+        return;
+    // Only news counts: a receiver repeats its status for every final meta
+    if (m[4] == MCAST_MSG_NACK && len >= MCAST_HDR_LEN + 2) {
+        t->heard = now_sec();
+        unsigned count = get_be16(m + MCAST_HDR_LEN);
+        if (len < MCAST_HDR_LEN + 2 + (size_t)count * 8)
+            return;
+        for (unsigned i = 0; i < count; ++i) {
+            uint32_t first = get_be32(m + MCAST_HDR_LEN + 2 + i * 8);
+            uint32_t blocks = get_be32(m + MCAST_HDR_LEN + 6 + i * 8);
+            for (uint64_t b = first; b < (uint64_t)first + blocks && b < t->nblocks; ++b) {
+                uint64_t bit = 1ull << (b % 64);
+                if (!(t->repair[b / 64] & bit)) {
+                    t->repair[b / 64] |= bit;
+                    t->nrepair++;
+                }
+            }
+        }
+    } else if (m[4] == MCAST_MSG_STATUS) {
+        for (int i = 0; i < t->nrcvrs; ++i) {
+            if (t->rcvrs[i].addr.sin_addr.s_addr == from->sin_addr.s_addr && t->rcvrs[i].addr.sin_port == from->sin_port)
+                return;
+        }
+        if (t->nrcvrs == t->cap) {
+            int cap = t->cap ? 2 * t->cap : 16;
+            struct mcast_rcvr *r = (struct mcast_rcvr *)realloc(t->rcvrs, (size_t)cap * sizeof(*r));
+            if (!r)
+                return;
+            t->rcvrs = r;
+            t->cap = cap;
+        }
+        t->heard = now_sec();
+        t->rcvrs[t->nrcvrs].addr = *from;
+        t->rcvrs[t->nrcvrs].status = m[MCAST_HDR_LEN];
+        t->nrcvrs++;
+        char a[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from->sin_addr, a, sizeof(a));
+        if (m[MCAST_HDR_LEN] != LANDROP_ST_OK)
+            fprintf(stderr, "\nReceiver %s:%u reported error (code %u)\n", a, (unsigned)ntohs(from->sin_port),
+                    (unsigned)m[MCAST_HDR_LEN]);
+    }
+}
+
+// Take in whatever the receivers sent, waiting up to timeout_ms for the first
+static void mcast_poll(struct mcast_tx *t, int timeout_ms) {
+    struct pollfd pfd = { t->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return;
+    unsigned char m[MCAST_DGRAM_MAX];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t flen = sizeof(from);
+        ssize_t r = recvfrom(t->fd, m, sizeof(m), MSG_DONTWAIT, (struct sockaddr *)&from, &flen);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        mcast_on_reply(t, m, (size_t)r, &from);
+    }
+}
+
+// Send up to MCAST_BATCH of the NACKed blocks again, in file order from
+// where the last repair stopped
+static int mcast_repair(struct mcast_tx *t) {
+    uint32_t blocks[MCAST_BATCH];
+    int n = 0;
+    uint32_t words = (t->nblocks + 63) / 64, start = t->cursor / 64;
+    for (uint32_t i = 0; i <= words && n < MCAST_BATCH && t->nrepair > 0; ++i) {
+        uint32_t w = (start + i) % words;
+        while (t->repair[w] && n < MCAST_BATCH) {
+            int bit = __builtin_ctzll(t->repair[w]);
+            t->repair[w] &= t->repair[w] - 1;
+            t->nrepair--;
+            blocks[n++] = w * 64 + (uint32_t)bit;
+        }
+        t->cursor = w * 64;
+    }
+    t->resent += (uint64_t)n;
+    return n ? mcast_send_blocks(t, blocks, n) : 0;
+}
+
+// -M: stream one file to the group, repair what the receivers NACK and
+// collect their statuses. The stream is paced at --rate (MCAST_RATE by
+// default): UDP backs off for nobody. Waits for --expect receivers, or
+// without it until they fall quiet. Returns 0 if every receiver that
+// answered stored the file (and there were enough of them), 1 otherwise.
+static int send_mcast_file(const char *path, const char *remote_name) {
+    const char *name = remote_name ? remote_name : path_basename(path);
+    size_t nlen = strlen(name);
+    if (nlen == 0 || nlen > MCAST_DGRAM_MAX - MCAST_META_LEN) {
+        fprintf(stderr, "Bad file name for multicast: %s\n", name);
+        return 1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size / MCAST_BLOCK >= UINT32_MAX) {
+        fprintf(stderr, "Not a regular file, or too large for multicast: %s\n", path);
+        close(fd);
+        return 1;
+    }
+    struct mcast_tx t;
+    memset(&t, 0, sizeof(t));
+    t.size = (uint64_t)st.st_size;
+    t.nblocks = (uint32_t)((t.size + MCAST_BLOCK - 1) / MCAST_BLOCK);
+    void *map = NULL;
+    if (t.size > 0) {
+        map = mmap(NULL, (size_t)t.size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return 1;
+        }
+        (void)madvise(map, (size_t)t.size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    t.data = (const unsigned char *)map;
+    t.repair = (uint64_t *)calloc((t.nblocks + 63) / 64 + 1, sizeof(uint64_t));
+    t.fd = mcast_open_tx(g_mcast_if);
+    int rc = 1;
+    if (!t.repair || t.fd < 0 || getrandom(&t.sid, sizeof(t.sid), 0) != (ssize_t)sizeof(t.sid))
+        goto out;
+    mcast_put_hdr(t.meta, MCAST_MSG_META, t.sid);
+    put_be64(t.meta + MCAST_HDR_LEN, t.size);
+    t.meta[MCAST_HDR_LEN + 8] = 0;
+    put_be32(t.meta + MCAST_HDR_LEN + 9, 0);
+    put_be16(t.meta + MCAST_HDR_LEN + 13, (uint16_t)nlen);
+    memcpy(t.meta + MCAST_META_LEN, name, nlen);
+    t.metalen = MCAST_META_LEN + nlen;
+
+    // Data in order, with the repairs NACKs ask for in between
+    double t0 = now_sec();
+    struct progress prog;
+    progress_init(&prog, t.size, NULL);
+    uint32_t crc = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (mcast_send_meta(&t) < 0)
+            goto out_prog;
+    }
+    for (uint32_t b = 0; b < t.nblocks;) {
+        uint32_t blocks[MCAST_BATCH];
+        int n = 0;
+        while (n < MCAST_BATCH && b < t.nblocks)
+            blocks[n++] = b++;
+        uint64_t off = (uint64_t)blocks[0] * MCAST_BLOCK;
+        uint64_t end = (uint64_t)b * MCAST_BLOCK < t.size ? (uint64_t)b * MCAST_BLOCK : t.size;
+        crc = crc32c(crc, t.data + off, (size_t)(end - off));
+        if (mcast_send_blocks(&t, blocks, n) < 0)
+            goto out_prog;
+        progress_add(&prog, end - off, end - off);
+        if (b % MCAST_META_EVERY < MCAST_BATCH && mcast_send_meta(&t) < 0)
+            goto out_prog;
+        mcast_poll(&t, 0);
+        if (t.nrepair > 0 && mcast_repair(&t) < 0)
+            goto out_prog;
+    }
+
+    // Then the end: the checksum goes out with the final meta, which asks
+    // every receiver for a NACK or its status, until all have reported
+    t.meta[MCAST_HDR_LEN + 8] = MCAST_F_END;
+    put_be32(t.meta + MCAST_HDR_LEN + 9, crc);
+    double ended = now_sec(), last_end = 0;
+    t.heard = ended;
+    for (;;) {
+        if (t.nrepair > 0) {
+            if (mcast_repair(&t) < 0)
+                goto out_prog;
+            mcast_poll(&t, 0);
+            continue;
+        }
+        double now = now_sec();
+        if (g_mcast_expect > 0 && t.nrcvrs >= g_mcast_expect)
+            break;
+        if (now - t.heard >= (g_mcast_expect > 0 ? MCAST_GIVEUP : MCAST_QUIET))
+            break;
+        if (now - last_end >= MCAST_END_EVERY) {
+            if (mcast_send_meta(&t) < 0)
+                goto out_prog;
+            last_end = now;
+        }
+        mcast_poll(&t, (int)((last_end + MCAST_END_EVERY - now) * 1000) + 1);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < t.nrcvrs; ++i)
+        failed += t.rcvrs[i].status != LANDROP_ST_OK;
+    double el = now_sec() - t0;
+    char spd[32];
+    human_bytes(el > 0 ? (double)t.size / el : 0.0, spd, sizeof(spd));
+    fprintf(stderr, "\nMulticast %s (%llu bytes): stored by %d receiver%s, %d failed; %.2f s, %s/s, %llu blocks resent\n",
+            name, (unsigned long long)t.size, t.nrcvrs - failed, t.nrcvrs - failed == 1 ? "" : "s", failed, el, spd,
+            (unsigned long long)t.resent);
+    if (t.nrcvrs == 0)
+        fprintf(stderr, "No receiver answered\n");
+    else if (t.nrcvrs < g_mcast_expect)
+        fprintf(stderr, "Only %d of %d receivers answered\n", t.nrcvrs, g_mcast_expect);
+    rc = failed || t.nrcvrs == 0 || t.nrcvrs < g_mcast_expect ? 1 : 0;
+out_prog:
+    progress_destroy(&prog);
+out:
+    if (t.fd >= 0)
+        close(t.fd);
+    free(t.repair);
+    free(t.rcvrs);
+    if (map)
+        munmap(map, (size_t)t.size);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *host = NULL;
+    const char *port_str = NULL;
+    const char *remote_name = NULL;
+    const char *dir = NULL;
+
+    // Collect multiple -f occurrences
+    const char *files[1024];
+    int files_count = 0;
+
+    bool lft1_only = false;
+
+    // A server closing on us must fail that transfer's write, not kill the
+    // other senders and the summary with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // landrop get ...: download from the server instead
+    bool get = argc > 1 && strcmp(argv[1], "get") == 0;
+    if (get) {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    enum { OPT_PROBE = 256, OPT_SNDBUF, OPT_LOWAT, OPT_CC, OPT_CHUNK, OPT_RATE, OPT_RATE_CONN, OPT_MCAST_IF, OPT_EXPECT,
+           OPT_SYNC_CRC, OPT_TLS, OPT_TLS_CA, OPT_TLS_CERT, OPT_TLS_KEY, OPT_PSK };
+    static const struct option longopts[] = {
+        { "probe", no_argument, NULL, OPT_PROBE },
+        { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+        { "lowat", required_argument, NULL, OPT_LOWAT },
+        { "cc", required_argument, NULL, OPT_CC },
+        { "chunk", required_argument, NULL, OPT_CHUNK },
+        { "rate", required_argument, NULL, OPT_RATE },
+        { "rate-conn", required_argument, NULL, OPT_RATE_CONN },
+        { "mcast-if", required_argument, NULL, OPT_MCAST_IF },
+        { "expect", required_argument, NULL, OPT_EXPECT },
+        { "sync-crc", no_argument, NULL, OPT_SYNC_CRC },
+        { "tls", no_argument, NULL, OPT_TLS },
+        { "tls-ca", required_argument, NULL, OPT_TLS_CA },
+        { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+        { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+        { "psk", required_argument, NULL, OPT_PSK },
+        { NULL, 0, NULL, 0 },
+    };
+    bool tls_on = false;
+    struct tls_opts tls;
+    memset(&tls, 0, sizeof(tls));
+    bool tuned = false;
+    uint64_t rate = 0;
+    uint64_t size;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h:p:f:n:d:C1j:rcz:DXB:M:s", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port_str = optarg; break;
+            case 'f':
+                if (files_count < (int)(sizeof(files)/sizeof(files[0]))) {
+                    files[files_count++] = optarg;
+                } else {
+                    fprintf(stderr, "Too many files specified with -f\n");
+                    return 1;
+                }
+                // Also accept subsequent non-option args as files until next option
+                while (optind < argc && argv[optind][0] != '-') {
+                    if (files_count < (int)(sizeof(files)/sizeof(files[0]))) {
+                        files[files_count++] = argv[optind++];
+                    } else {
+                        fprintf(stderr, "Too many files specified with -f\n");
+                        return 1;
+                    }
+                }
+                break;
+            case 'n': remote_name = optarg; break;
+            case 'd': dir = optarg; break;
+            case 'C':
+#ifdef __linux__
+                g_use_sendfile = false;
+#endif
+                break;
+            case '1': lft1_only = true; break;
+            case 'r': g_resume = true; break;
+            case 'c': g_checksum = true; break;
+            case 'D': g_delta = true; break;
+            case 'X': g_dedup = true; break;
+            case 's': g_sync = true; break;
+            case OPT_SYNC_CRC: g_sync = g_sync_crc = true; break;
+            case 'B': {
+                char *end;
+                unsigned long long v = strtoull(optarg, &end, 10);
+                if (*end != '\0' || v > BATCH_MAX_THRESHOLD) {
+                    fprintf(stderr, "-B takes a size in bytes of at most %d\n", BATCH_MAX_THRESHOLD);
+                    return 1;
+                }
+                g_batch_max = (size_t)v;
+                break;
+            }
+            case 'z':
+                if (strcmp(optarg, "on") == 0) {
+                    g_zmode = Z_ON;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    g_zmode = Z_AUTO;
+                } else if (strcmp(optarg, "off") == 0) {
+                    g_zmode = Z_OFF;
+                } else {
+                    fprintf(stderr, "-z takes on, auto or off\n");
+                    return 1;
+                }
+                break;
+            case 'j':
+                g_jobs = atoi(optarg);
+                if (g_jobs < 1 || g_jobs > MAX_JOBS) {
+                    fprintf(stderr, "-j must be between 1 and %d\n", MAX_JOBS);
+                    return 1;
+                }
+                break;
+            case OPT_PROBE: g_probe = true; break;
+            case OPT_SNDBUF:
+            case OPT_LOWAT:
+                if (parse_size(optarg, &size) < 0 || size == 0 || size > TUNE_MAX_BUF) {
+                    fprintf(stderr, "Bad size: %s\n", optarg);
+                    return 1;
+                }
+                *(opt == OPT_SNDBUF ? &g_tune.sndbuf : &g_tune.lowat) = (int)size;
+                tuned = true;
+                break;
+            case OPT_CC:
+                if (strlen(optarg) >= sizeof(g_tune.cc)) {
+                    fprintf(stderr, "Bad congestion control name: %s\n", optarg);
+                    return 1;
+                }
+                strcpy(g_tune.cc, optarg);
+                tuned = true;
+                break;
+            case OPT_CHUNK:
+                if (parse_size(optarg, &size) < 0 || size < 64 * 1024 || size > CHUNK_MAX) {
+                    fprintf(stderr, "--chunk must be between 64k and 16M\n");
+                    return 1;
+                }
+                g_chunk = (size_t)size;
+                tuned = true;
+                break;
+            case OPT_RATE:
+            case OPT_RATE_CONN:
+                if (parse_size(optarg, &size) < 0 || size == 0) {
+                    fprintf(stderr, "Bad rate: %s\n", optarg);
+                    return 1;
+                }
+                *(opt == OPT_RATE ? &rate : &g_rate_conn) = size;
+                g_shaping = true;
+                break;
+            case 'M':
+                if (mcast_parse(optarg, &g_mcast_group) < 0) {
+                    fprintf(stderr, "-M takes a multicast group and port, e.g. 239.1.2.3:9100\n");
+                    return 1;
+                }
+                g_mcast = true;
+                break;
+            case OPT_MCAST_IF:
+                if (mcast_parse_if(optarg, &g_mcast_if) < 0) {
+                    fprintf(stderr, "Bad interface address: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_EXPECT:
+                g_mcast_expect = atoi(optarg);
+                if (g_mcast_expect < 1) {
+                    fprintf(stderr, "--expect takes a number of receivers\n");
+                    return 1;
+                }
+                break;
+            case OPT_TLS: tls_on = true; break;
+            case OPT_TLS_CA: tls.ca = optarg; tls_on = true; break;
+            case OPT_TLS_CERT: tls.cert = optarg; tls_on = true; break;
+            case OPT_TLS_KEY: tls.key = optarg; tls_on = true; break;
+            case OPT_PSK: tls.psk = optarg; tls_on = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (get && g_mcast) {
+        fprintf(stderr, "get fetches from one server, leave out -M\n");
+        return 1;
+    }
+    if (g_mcast && tls_on) {
+        fprintf(stderr, "-M cannot be encrypted, leave out --tls and --psk\n");
+        return 1;
+    }
+    if (g_mcast) {
+        if (dir || files_count == 0) {
+            fprintf(stderr, "-M sends files given with -f\n");
+            return 1;
+        }
+        if (!rate)
+            rate = MCAST_RATE;
+        bucket_init(&g_rate, rate);
+        g_shaping = true;
+        g_rate_limit = rate;
+        if (remote_name && files_count > 1)
+            fprintf(stderr, "Warning: -n is ignored when sending multiple files with -f.\n");
+        int overall_rc = 0;
+        for (int i = 0; i < files_count; ++i)
+            overall_rc |= send_mcast_file(files[i], files_count == 1 ? remote_name : NULL);
+        return overall_rc;
+    }
+    if (get ? !host || !port_str || optind >= argc || files_count > 0 || g_sync
+            : !host || !port_str || (files_count == 0 && !dir)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (files_count > 0 && dir) {
+        fprintf(stderr, "Specify either -f or -d, not both.\n");
+        return 1;
+    }
+    if (g_sync && !dir) {
+        fprintf(stderr, "-s syncs a directory given with -d\n");
+        return 1;
+    }
+    if (tls_on) {
+        tls.host = host;
+        g_tls = tls_ctx_new(false, &tls);
+        if (!g_tls)
+            return 1;
+    }
+    if (g_shaping) {
+        bucket_init(&g_rate, rate);
+        // What the -j connections together may reach
+        g_rate_limit = g_rate_conn * (uint64_t)g_jobs;
+        if (rate && (!g_rate_limit || rate < g_rate_limit))
+            g_rate_limit = rate;
+    }
+    if (get)
+        return get_files(host, port_str, dir ? dir : ".", remote_name, argv + optind, argc - optind);
+
+    struct sender snd = { host, port_str, NULL };
+    if (!lft1_only) {
+        uint32_t features = (g_jobs > 1 ? LFT2_F_STRIPE : 0) | (g_resume ? LFT2_F_RESUME : 0) |
+                            (g_checksum ? LFT2_F_CHECKSUM : 0) | (g_zmode ? LFT2_F_COMPRESS : 0) |
+                            (g_delta ? LFT2_F_DELTA : 0) | (g_batch_max ? LFT2_F_BATCH : 0) |
+                            (g_probe ? LFT2_F_PROBE : 0) | (g_dedup ? LFT2_F_DEDUP : 0) |
+                            (g_sync ? LFT2_F_SYNC : 0);
+        int rc = session_open(host, port_str, features, &snd.sess);
+        if (rc < 0)
+            return 1;
+        if (rc > 0)
+            fprintf(stderr, "Server only speaks LFT1, using one connection per file\n");
+        if (rc == 0 && g_resume && !(snd.sess->features & LFT2_F_RESUME))
+            fprintf(stderr, "Server cannot resume uploads, sending whole files\n");
+    }
+
+    if (g_checksum && !(snd.sess && (snd.sess->features & LFT2_F_CHECKSUM)))
+        fprintf(stderr, "Checksums need an LFT2 server that supports them, sending without\n");
+    if (g_zmode && !(snd.sess && (snd.sess->features & LFT2_F_COMPRESS)))
+        fprintf(stderr, "Compression needs an LFT2 server that supports it, sending without\n");
+    if (g_delta && !(snd.sess && (snd.sess->features & LFT2_F_DELTA)))
+        fprintf(stderr, "Delta transfers need an LFT2 server running with -o (or -s), sending whole files\n");
+    if (g_dedup && !(snd.sess && (snd.sess->features & LFT2_F_DEDUP)))
+        fprintf(stderr, "Dedup needs an LFT2 server running with -X, sending whole files\n");
+    if (g_sync && !(snd.sess && (snd.sess->features & LFT2_F_SYNC)))
+        fprintf(stderr, "Sync needs an LFT2 server that supports it, sending every file\n");
+    struct tune_probe probe;
+    memset(&probe, 0, sizeof(probe));
+    if (g_probe && !snd.sess) {
+        fprintf(stderr, "Probing needs an LFT2 server, using the settings given\n");
+    } else if (g_probe) {
+        // An older server cannot take filler: size from the handshake RTT alone
+        if (!(snd.sess->features & LFT2_F_PROBE))
+            fprintf(stderr, "Server cannot be probed, tuning from the round-trip time only\n");
+        if ((snd.sess->features & LFT2_F_PROBE) ? session_probe(snd.sess, &probe) < 0
+                                                : tune_measure(snd.sess->fd, &probe) < 0) {
+            session_finish(snd.sess);
+            return 1;
+        }
+        tune_choose(&probe, &g_tune, &g_chunk);
+        tune_apply(snd.sess->fd, &g_tune);
+        if (probe.rwnd_limited > 0.2) {
+            char hint[32];
+            human_bytes(2 * probe.rate * probe.rtt, hint, sizeof(hint));
+            fprintf(stderr, "The receiver's window was the limit %.0f%% of the time: try landropd --rcvbuf %s\n",
+                    probe.rwnd_limited * 100, hint);
+        }
+        tuned = true;
+    }
+
+    int overall_rc = 0;
+    if (dir) {
+        if (remote_name) {
+            fprintf(stderr, "Warning: -n ignored when using -d (directory mode).\n");
+        }
+        struct stat st;
+        if (stat(dir, &st) != 0) { 
+            perror("stat dir"); 
+            overall_rc = 1;
+        } else if (!S_ISDIR(st.st_mode)) { 
+            fprintf(stderr, "Not a directory: %s\n", dir); 
+            overall_rc = 1;
+        } else if (send_directory(&snd, dir) != 0) {
+            overall_rc = 1;
+        }
+    } else if (files_count == 1) {
+        // File mode: one or multiple files
+        if (send_file(&snd, files[0], remote_name) != 0)
+            overall_rc = 1;
+    } else {
+        if (remote_name) {
+            fprintf(stderr, "Warning: -n is ignored when sending multiple files with -f.\n");
+        }
+        for (int i = 0; i < files_count; ++i) {
+            int rc = send_file(&snd, files[i], NULL);
+            if (rc != 0)
+                overall_rc = 1;
+            if (rc < 0)
+                break;
+        }
+    }
+
+    if (tuned && snd.sess) {
+        char desc[160], rate[32], bdp[32], chunk[32];
+        tune_describe(snd.sess->fd, desc, sizeof(desc));
+        human_bytes((double)g_chunk, chunk, sizeof(chunk));
+        if (probe.rate > 0) {
+            human_bytes(probe.rate, rate, sizeof(rate));
+            human_bytes(probe.rate * probe.rtt, bdp, sizeof(bdp));
+            fprintf(stderr, "\nTuning: rtt %.3f ms, probed %s/s, bdp %s; %s, chunk %s\n", probe.rtt * 1e3, rate,
+                    bdp, desc, chunk);
+        } else if (g_probe) {
+            fprintf(stderr, "\nTuning: rtt %.3f ms; %s, chunk %s\n", probe.rtt * 1e3, desc, chunk);
+        } else {
+            fprintf(stderr, "\nTuning: %s, chunk %s\n", desc, chunk);
+        }
     }
+    if (snd.sess && session_finish(snd.sess) != 0)
+        overall_rc = 1;
     return overall_rc;
 }
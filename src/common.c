@@ -2,7 +2,9 @@
 #include "common.h"
 
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 int read_full(int fd, void *buf, size_t n) {
@@ -41,6 +43,44 @@ int write_full(int fd, const void *buf, size_t n) {
     return 0;
 }
 
+int pread_full(int fd, void *buf, size_t n, int64_t off) {
+    char *p = (char *)buf;
+    size_t left = n;
+    while (left > 0) {
+        ssize_t r = pread(fd, p, left, (off_t)off);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = ENODATA;
+            return -1;
+        }
+        p += r;
+        off += r;
+        left -= (size_t)r;
+    }
+    return 0;
+}
+
+int pwrite_full(int fd, const void *buf, size_t n, int64_t off) {
+    const char *p = (const char *)buf;
+    size_t left = n;
+    while (left > 0) {
+        ssize_t r = pwrite(fd, p, left, (off_t)off);
+        if (r < 0) {
+            if (errno == EINTR) 
+                continue;
+            return -1;
+        }
+        p += r;
+        off += r;
+        left -= (size_t)r;
+    }
+    return 0;
+}
+
 uint64_t host_to_be64(uint64_t x) {
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     return __builtin_bswap64(x);
@@ -57,32 +97,117 @@ uint64_t be64_to_host(uint64_t x) {
 #endif
 }
 
+void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+void put_be32(unsigned char *p, uint32_t v) {
+    put_be16(p, (uint16_t)(v >> 16));
+    put_be16(p + 2, (uint16_t)v);
+}
+
+void put_be64(unsigned char *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)get_be16(p) << 16) | get_be16(p + 2);
+}
+
+uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
 const char *path_basename(const char *path) {
     const char *slash = strrchr(path, '/');
     return slash ? slash + 1 : path;
 }
 
-int sanitize_filename(const char *name, char *out, size_t out_sz) {
+int sanitize_path(const char *name, char *out, size_t out_sz) {
     if (!name || !out || out_sz == 0) {
         errno = EINVAL;
         return -1;
     }
-    // reject names with ".." to avoid traversal
-    if (strstr(name, "..") != NULL) {
-        errno = EINVAL;
-        return -1;
-    }
     size_t len = strlen(name);
-    if (len + 1 > out_sz) {
-        errno = ENAMETOOLONG;
+    if (strstr(name, "..") != NULL || (len > 0 && name[len - 1] == '/')) {
+        errno = EINVAL;
         return -1;
     }
-    for (size_t i = 0; i < len; ++i) {
-        char c = name[i];
-        if (c == '/' || c == '\\') 
-            c = '_';
-        out[i] = c;
+    size_t n = 0;
+    for (const char *p = name; *p;) {
+        while (*p == '/')
+            p++;
+        size_t k = strcspn(p, "/");
+        if (k == 0 || (k == 1 && p[0] == '.')) {
+            p += k;
+            continue;
+        }
+        if (n + (n > 0) + k + 1 > out_sz) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (n > 0)
+            out[n++] = '/';
+        for (size_t i = 0; i < k; ++i)
+            out[n++] = p[i] == '\\' ? '_' : p[i];
+        p += k;
     }
-    out[len] = '\0';
+    out[n] = '\0';
     return 0;
 }
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void human_bytes(double v, char *out, size_t n) {
+    const char *u[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int i = 0;
+    while (v >= 1024.0 && i < 4) { 
+        v /= 1024.0; 
+        i++; 
+    }
+    snprintf(out, n, "%.1f %s", v, u[i]);
+}
+
+void print_progress(uint64_t done, uint64_t total, uint64_t wire, double elapsed, uint64_t limit) {
+    double pct = total ? (100.0 * (double)done / (double)total) : 100.0;
+    int barw = 40;
+    int fill = (int)(pct / 100.0 * barw + 0.5);
+    if (fill > barw) 
+        fill = barw;
+
+    char bar[41];
+    for (int i = 0; i < barw; ++i) 
+        bar[i] = (i < fill) ? '=' : ' ';
+    bar[barw] = '\0';
+    double bps = elapsed > 0 ? (double)done / elapsed : 0.0;
+    char spd[32], dstr[32], tstr[32];
+    human_bytes(bps, spd, sizeof(spd));
+    human_bytes((double)done, dstr, sizeof(dstr));
+    human_bytes((double)total, tstr, sizeof(tstr));
+    char lim[48] = "";
+    if (limit > 0) {
+        char l[32];
+        human_bytes((double)limit, l, sizeof(l));
+        snprintf(lim, sizeof(lim), " (limit %s/s)", l);
+    }
+    if (wire == done) {
+        fprintf(stderr, "\r[%-40s] %6.2f%%  %s/s%s  %s/%s", bar, pct, spd, lim, dstr, tstr);
+    } else {
+        char wspd[32], wstr[32];
+        human_bytes(elapsed > 0 ? (double)wire / elapsed : 0.0, wspd, sizeof(wspd));
+        human_bytes((double)wire, wstr, sizeof(wstr));
+        fprintf(stderr, "\r[%-40s] %6.2f%%  %s/s%s  %s/%s  wire %s/s %s", bar, pct, spd, lim, dstr, tstr, wspd,
+                wstr);
+    }
+    fflush(stderr);
+}
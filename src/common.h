@@ -5,25 +5,231 @@
 #include <stddef.h>
 
 #define LANDROP_MAGIC "LFT1"
+#define LANDROP_MAGIC2 "LFT2"
 #define LANDROP_MAGIC_LEN 4
 
 // Protocol:
 // [4 bytes magic] [8 bytes filesize be64] [2 bytes filename_len be16] [filename bytes] [file content]
+// Reply: 1 byte status, then the server closes.
+
+// LFT2 session protocol: one connection carries many files.
+// Client hello: "LFT2" [be32 requested feature bits]
+// Server hello: "LFT2" [be32 accepted feature bits] (a subset of the request)
+// Client frames, each starting with a 1-byte type:
+//   LFT2_FRAME_FILE: [be64 filesize] [be16 filename_len] [filename bytes] [file content]
+//   LFT2_FRAME_STRIPE (needs LFT2_F_STRIPE): [be64 transfer id] [be64 filesize]
+//                    [be64 offset] [be64 length] [be16 stripe count]
+//                    [be16 filename_len] [filename bytes] [length bytes of content]
+//     One byte range of a file sent over several connections at once. The
+//     stripes of a file share the transfer id; each one is acked only after
+//     all of them have been stored.
+//   LFT2_FRAME_QUERY (needs LFT2_F_RESUME): [be64 filesize] [be64 mtime ns]
+//                    [be16 filename_len] [filename bytes]
+//     Asks how much of this version (size + mtime) of the file the server
+//     already holds from an interrupted upload. Answered by LFT2_MSG_OFFER.
+//   LFT2_FRAME_RFILE (needs LFT2_F_RESUME): [be64 filesize] [be64 mtime ns]
+//                    [be64 offset] [be16 filename_len] [filename bytes]
+//                    [filesize - offset bytes of content]
+//     Like a file frame, but the data lands in a partial file that survives
+//     a broken connection and is renamed into place once complete.
+//   LFT2_FRAME_SIGREQ (needs LFT2_F_DELTA): [be64 filesize] [be16 filename_len]
+//                    [filename bytes]
+//     Asks for the block signatures of the server's copy of the file,
+//     answered by LFT2_MSG_SIGS. A delta frame for the file follows.
+//   LFT2_FRAME_DELTA (needs LFT2_F_DELTA): [be64 filesize] [be32 block size]
+//                    [be16 filename_len] [filename bytes] [ops]
+//     The new content as a list of ops against the old copy:
+//       LFT2_DOP_LIT:  [be32 n] [n bytes of new content]
+//       LFT2_DOP_COPY: [be64 first block] [be32 blocks] from the old copy
+//       LFT2_DOP_END:  [be32 crc32c of the whole new file]
+//     The server rebuilds the file next to the old one and renames it over.
+//   LFT2_FRAME_BATCH (needs LFT2_F_BATCH): [be32 count] [be32 index_len]
+//                    [be64 data_len] [index] [data_len bytes of content]
+//     Many small files in one frame. The index lists count entries of
+//     [be64 filesize] [be16 filename_len] [filename bytes]; the content is
+//     theirs, concatenated in index order. Every file takes its own
+//     sequence number and gets its own ack.
+//   LFT2_FRAME_PROBE (needs LFT2_F_PROBE): [be64 length] [length bytes]
+//     Filler the server reads and throws away, acked like a file; the client
+//     times these to measure the path (landrop --probe).
+//   LFT2_FRAME_CHUNKS (needs LFT2_F_DEDUP): [be64 filesize] [be32 count]
+//                    [be16 filename_len] [filename bytes]
+//                    [count x (16-byte chunk hash, be32 length, be32 crc32c)]
+//     The file cut into content-defined chunks (cdc.h), answered by
+//     LFT2_MSG_HAVE with the chunks the server already holds in any of its
+//     files. A dedup frame for the file follows.
+//   LFT2_FRAME_DEDUP (needs LFT2_F_DEDUP): [be64 filesize] [be32 count]
+//                    [be16 filename_len] [filename bytes]
+//                    [content of the chunks the server lacks, in file order]
+//     The server assembles the file from its own copies of the other
+//     chunks, checks every chunk that arrived against its CRC and renames
+//     the result into place.
+//   LFT2_FRAME_MANIFEST (needs LFT2_F_SYNC): [be32 count] [be32 length]
+//                    [1 byte flags] [length bytes of entries]
+//     Part of a directory the client is about to sync, count entries of
+//     [be16 bytes shared with the previous path] [be16 suffix_len]
+//     [suffix bytes] [be64 filesize] [be64 mtime ns], plus [be32 crc32c of
+//     the content] with LFT2_MANIFEST_F_CRC. Sorted paths share most of
+//     their directory with the one before, which is then not repeated.
+//     Answered by LFT2_MSG_HAVE with a bit set for every file the
+//     server holds in that version (same size and mtime, or same size and
+//     CRC); the client sends the others, which the server may then replace
+//     without -o and stamps with the mtime listed.
+//   LFT2_FRAME_GET (needs LFT2_F_PULL): [be64 offset] [be64 length]
+//                    [be16 filename_len] [filename bytes]
+//     Asks for length bytes from offset of a file the server holds (the
+//     name is a path as an upload would have stored it), LFT2_GET_TO_END for
+//     all of it from there, 0 for only its size and mtime. Answered by
+//     LFT2_MSG_DATA. A client fetching one file over several connections
+//     checks that every range came from the same version.
+//   LFT2_FRAME_END:  no payload; the server flushes its acks and closes
+// With LFT2_F_COMPRESS, the content of those frames is sent as chunks of
+// LFT2_ZCHUNK bytes (the last one shorter), each [be32 length, top bit set
+// if compressed] [length bytes: the chunk as is, or lz.h compressed]. The
+// sender decides per chunk, so data that does not shrink goes out as is.
+// With LFT2_F_CHECKSUM, every frame that carries content (file, stripe,
+// resumable file, batch) is followed by [be32 crc32c of that content], and the
+// server answers a mismatch with LANDROP_ST_CHECKSUM instead of keeping it.
+// Server messages, each starting with a 1-byte type:
+//   LFT2_MSG_ACK:    [be32 seq] [1 byte status]
+//   LFT2_MSG_OFFER:  [be32 seq] [1 byte status] [be64 bytes held] [be32 crc32c of them]
+//   LFT2_MSG_SIGS:   [be32 seq] [1 byte status] [be32 block size] [be64 count]
+//                    [count x (be32 rolling checksum, be64 XXH64)] (see delta.h)
+//   LFT2_MSG_HAVE:   [be32 seq] [1 byte status] [be32 count]
+//                    [(count + 7) / 8 bytes, bit i % 8 of byte i / 8 set if
+//                    the server holds chunk i (or manifest entry i)]
+//   LFT2_MSG_DATA:   [be32 seq] [1 byte status] [be64 filesize] [be64 mtime ns]
+//                    [be64 offset] [be64 length] [length bytes of content]
+//                    The range asked for, cut at the end of the file;
+//                    LANDROP_ST_RANGE if the offset is past it. Content is
+//                    sent as is, whatever LFT2_F_COMPRESS and
+//                    LFT2_F_CHECKSUM say.
+// Files are numbered from 0 in the order they are sent; acks come back in the
+// same order but asynchronously, so the client keeps sending while earlier
+// files are still being acknowledged. A server that only knows LFT1 closes
+// the connection on the hello, and the client falls back to LFT1.
+#define LFT2_HELLO_LEN (LANDROP_MAGIC_LEN + 4)
+
+#define LFT2_FRAME_END  0x00
+#define LFT2_FRAME_FILE 0x01
+#define LFT2_FRAME_STRIPE 0x02
+#define LFT2_FRAME_QUERY  0x03
+#define LFT2_FRAME_RFILE  0x04
+#define LFT2_FRAME_SIGREQ 0x05
+#define LFT2_FRAME_DELTA  0x06
+#define LFT2_FRAME_BATCH  0x07
+#define LFT2_FRAME_PROBE  0x08
+#define LFT2_FRAME_CHUNKS 0x09
+#define LFT2_FRAME_DEDUP  0x0a
+#define LFT2_FRAME_MANIFEST 0x0b
+#define LFT2_FRAME_GET    0x0c
+
+// Length of a get frame asking for everything from the offset on
+#define LFT2_GET_TO_END UINT64_MAX
+
+#define LFT2_DOP_END  0x00
+#define LFT2_DOP_LIT  0x01
+#define LFT2_DOP_COPY 0x02
+
+// Frames whose content is followed by a checksum trailer / sent in
+// compression chunks when those features are on
+#define LFT2_FRAME_HAS_CONTENT(t) \
+    ((t) == LFT2_FRAME_FILE || (t) == LFT2_FRAME_STRIPE || (t) == LFT2_FRAME_RFILE || (t) == LFT2_FRAME_BATCH)
+
+// Feature bits
+#define LFT2_F_STRIPE   (1u << 0)
+#define LFT2_F_RESUME   (1u << 1)
+#define LFT2_F_CHECKSUM (1u << 2)
+#define LFT2_F_COMPRESS (1u << 3)
+#define LFT2_F_DELTA    (1u << 4)
+#define LFT2_F_BATCH    (1u << 5)
+#define LFT2_F_PROBE    (1u << 6)
+#define LFT2_F_DEDUP    (1u << 7)
+#define LFT2_F_SYNC     (1u << 8)
+#define LFT2_F_PULL     (1u << 9)
+
+// Chunk list entries of a chunks frame, and the limits the server holds
+// them to (the list is kept in memory until the dedup frame)
+#define LFT2_CHUNK_ENTRY_LEN  (16 + 4 + 4)
+#define LFT2_DEDUP_MAX_CHUNKS (4u << 20)
+#define LFT2_DEDUP_MAX_CHUNK  (64 * 1024)
+
+// Limits of one batch frame; the whole frame is buffered by the server
+#define LFT2_BATCH_MAX_FILES 512
+#define LFT2_BATCH_MAX_DATA  (4 * 1024 * 1024)
+#define LFT2_BATCH_MAX_INDEX (LFT2_BATCH_MAX_FILES * (8 + 2 + 4096))
+
+// Limits of one manifest frame, which the server also buffers whole
+#define LFT2_MANIFEST_MAX_ENTRIES 4096
+#define LFT2_MANIFEST_MAX_LEN     (4 * 1024 * 1024)
+#define LFT2_MANIFEST_F_CRC       0x01
+
+#define LFT2_TRAILER_LEN 4
+
+#define LFT2_ZCHUNK        65536
+#define LFT2_ZHDR_LEN      4
+#define LFT2_Z_COMPRESSED  0x80000000u
+
+#define LFT2_MSG_ACK    0x01
+#define LFT2_ACK_LEN    (1 + 4 + 1)
+#define LFT2_MSG_OFFER  0x02
+#define LFT2_OFFER_LEN  (1 + 4 + 1 + 8 + 4)
+#define LFT2_MSG_SIGS   0x03
+#define LFT2_SIGS_HDR_LEN (1 + 4 + 1 + 4 + 8)
+#define LFT2_MSG_HAVE   0x04
+#define LFT2_HAVE_HDR_LEN (1 + 4 + 1 + 4)
+#define LFT2_MSG_DATA   0x05
+#define LFT2_DATA_HDR_LEN (1 + 4 + 1 + 8 + 8 + 8 + 8)
+
+// Status byte values (LFT1 reply and LFT2 acks)
+#define LANDROP_ST_OK       0
+#define LANDROP_ST_BADNAME  1   // rejected filename
+#define LANDROP_ST_OPEN     2   // cannot open destination / already exists
+#define LANDROP_ST_IO       3   // write to destination failed (or, on a relay, the next hop missed the file)
+#define LANDROP_ST_CHECKSUM 4   // content did not match the sender's checksum
+#define LANDROP_ST_STALE    5   // dedup: content reused here changed, send the file whole
+#define LANDROP_ST_RANGE    6   // get: offset past the end of the file
 
 // Returns 0 on success, -1 on error (errno set)
 int read_full(int fd, void *buf, size_t n);
 int write_full(int fd, const void *buf, size_t n);
+// pread_full fails with ENODATA if the file ends first
+int pread_full(int fd, void *buf, size_t n, int64_t off);
+int pwrite_full(int fd, const void *buf, size_t n, int64_t off);
 
 // Endian helpers for 64-bit
 uint64_t host_to_be64(uint64_t x);
 uint64_t be64_to_host(uint64_t x);
 
+// Big-endian field accessors for building/parsing frames in byte buffers
+void put_be16(unsigned char *p, uint16_t v);
+void put_be32(unsigned char *p, uint32_t v);
+void put_be64(unsigned char *p, uint64_t v);
+uint16_t get_be16(const unsigned char *p);
+uint32_t get_be32(const unsigned char *p);
+uint64_t get_be64(const unsigned char *p);
+
 // Get basename of a path (does not modify input)
 const char *path_basename(const char *path);
 
-// Sanitize a filename into out buffer (replaces '/' with '_', rejects "..")
+// Sanitize a relative path into out buffer: keeps '/' between directory
+// names, drops empty and "." components and leading slashes, and replaces
+// '\' with '_'. Names containing ".." (no way out of the destination) or
+// ending in '/' are rejected. The result may be empty if nothing is left.
 // Returns 0 on success, -1 on invalid name or overflow.
-int sanitize_filename(const char *name, char *out, size_t out_sz);
+int sanitize_path(const char *name, char *out, size_t out_sz);
+
+// Monotonic clock in seconds
+double now_sec(void);
+
+// Format a byte count with binary units ("12.3 MiB")
+void human_bytes(double v, char *out, size_t n);
+
+// Render the "\r[====   ] pct speed done/total" line on stderr. done and
+// total count file content; when compression makes the bytes on the wire
+// differ from that, wire is shown alongside, and a rate limit (bytes per
+// second, 0: none) after the speed.
+void print_progress(uint64_t done, uint64_t total, uint64_t wire, double elapsed, uint64_t limit);
 
 #endif // LANDROP_COMMON_H
 
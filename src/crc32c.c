@@ -0,0 +1,286 @@
+#define _POSIX_C_SOURCE 200809L
+#include "crc32c.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t g_table[8][256];
+static pthread_once_t g_table_once = PTHREAD_ONCE_INIT;
+
+// Picked once at startup: the CRC instruction if the CPU has it, else tables
+static uint32_t (*g_crc32c_fn)(uint32_t, const void *, size_t);
+static const char *g_crc32c_name;
+
+static void crc32c_init_tables(void) {
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; ++i)
+            c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        g_table[0][b] = c;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t c = g_table[0][b];
+        for (int k = 1; k < 8; ++k) {
+            c = g_table[0][c & 0xff] ^ (c >> 8);
+            g_table[k][b] = c;
+        }
+    }
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t n) {
+    pthread_once(&g_table_once, crc32c_init_tables);
+    const unsigned char *p = (const unsigned char *)buf;
+    crc = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = g_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+    while (n >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = g_table[7][lo & 0xff] ^ g_table[6][(lo >> 8) & 0xff] ^
+              g_table[5][(lo >> 16) & 0xff] ^ g_table[4][lo >> 24] ^
+              g_table[3][hi & 0xff] ^ g_table[2][(hi >> 8) & 0xff] ^
+              g_table[1][(hi >> 16) & 0xff] ^ g_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        crc = g_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+    return ~crc;
+}
+
+// The hardware versions are compiled with a per-function target attribute,
+// so the binary still runs on CPUs without the instruction and the Makefile
+// needs no -m flags.
+#if defined(__x86_64__)
+#define CRC32C_HW_NAME "sse4.2"
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+
+CRC32C_TARGET static inline uint32_t hw_crc8(uint32_t c, unsigned char b) {
+    return _mm_crc32_u8(c, b);
+}
+
+CRC32C_TARGET static inline uint32_t hw_crc64(uint32_t c, const unsigned char *p) {
+    return (uint32_t)_mm_crc32_u64(c, *(const uint64_t *)(const void *)p);
+}
+
+static int crc32c_hw_usable(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+#define CRC32C_HW_NAME "armv8-crc"
+#define CRC32C_TARGET __attribute__((target("+crc")))
+
+CRC32C_TARGET static inline uint32_t hw_crc8(uint32_t c, unsigned char b) {
+    return __crc32cb(c, b);
+}
+
+CRC32C_TARGET static inline uint32_t hw_crc64(uint32_t c, const unsigned char *p) {
+    return __crc32cd(c, *(const uint64_t *)(const void *)p);
+}
+
+static int crc32c_hw_usable(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+// GF(2) 32x32 matrix helpers, used to build the zeros tables
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; ++n)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Operator that feeds len zero bytes through the CRC register. Only the
+// highest set bit of len counts, so len must be a power of two.
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY; // one zero bit
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+    // Each square doubles the count, the first one lands on one zero byte
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    for (int n = 0; n < 32; ++n)
+        even[n] = odd[n];
+}
+
+void crc32c_shift_init(struct crc32c_shift *s, size_t len) {
+    uint32_t op[32];
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; ++n) {
+        s->t[0][n] = gf2_matrix_times(op, n);
+        s->t[1][n] = gf2_matrix_times(op, n << 8);
+        s->t[2][n] = gf2_matrix_times(op, n << 16);
+        s->t[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(const struct crc32c_shift *s, uint32_t crc) {
+    return s->t[0][crc & 0xff] ^ s->t[1][(crc >> 8) & 0xff] ^
+           s->t[2][(crc >> 16) & 0xff] ^ s->t[3][crc >> 24];
+}
+
+// Feeding B through the register is linear: what A leaves behind, moved
+// over len(B) zero bytes, plus what B produces on its own. The pre and post
+// inversions cancel out.
+uint32_t crc32c_combine(const struct crc32c_shift *s, uint32_t crc_a, uint32_t crc_b) {
+    return crc32c_shift(s, crc_a) ^ crc_b;
+}
+
+
+#ifdef CRC32C_HW_NAME
+// One CRC instruction has a latency of about three cycles but the CPU can
+// start one per cycle, so a single dependency chain leaves two thirds of the
+// unit idle. The data is cut into three interleaved streams whose CRCs are
+// merged by "shifting" the earlier ones over the later blocks with the
+// zeros tables above (the CRC of a block followed by n zero bytes).
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static struct crc32c_shift g_zeros_long;
+static struct crc32c_shift g_zeros_short;
+
+CRC32C_TARGET static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t n) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32_t c0 = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        c0 = hw_crc8(c0, *p++);
+        n--;
+    }
+    while (n >= 3 * CRC32C_LONG) {
+        uint32_t c1 = 0, c2 = 0;
+        const unsigned char *end = p + CRC32C_LONG;
+        do {
+            c0 = hw_crc64(c0, p);
+            c1 = hw_crc64(c1, p + CRC32C_LONG);
+            c2 = hw_crc64(c2, p + 2 * CRC32C_LONG);
+            p += 8;
+        } while (p < end);
+        c0 = crc32c_shift(&g_zeros_long, c0) ^ c1;
+        c0 = crc32c_shift(&g_zeros_long, c0) ^ c2;
+        p += 2 * CRC32C_LONG;
+        n -= 3 * CRC32C_LONG;
+    }
+    while (n >= 3 * CRC32C_SHORT) {
+        uint32_t c1 = 0, c2 = 0;
+        const unsigned char *end = p + CRC32C_SHORT;
+        do {
+            c0 = hw_crc64(c0, p);
+            c1 = hw_crc64(c1, p + CRC32C_SHORT);
+            c2 = hw_crc64(c2, p + 2 * CRC32C_SHORT);
+            p += 8;
+        } while (p < end);
+        c0 = crc32c_shift(&g_zeros_short, c0) ^ c1;
+        c0 = crc32c_shift(&g_zeros_short, c0) ^ c2;
+        p += 2 * CRC32C_SHORT;
+        n -= 3 * CRC32C_SHORT;
+    }
+    while (n >= 8) {
+        c0 = hw_crc64(c0, p);
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        c0 = hw_crc8(c0, *p++);
+        n--;
+    }
+    return ~c0;
+}
+#endif
+
+static pthread_once_t g_dispatch_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_pick(void) {
+    g_crc32c_fn = crc32c_portable;
+    g_crc32c_name = "slicing-by-8";
+#ifdef CRC32C_HW_NAME
+    if (crc32c_hw_usable() && getenv("LANDROP_CRC32C_PORTABLE") == NULL) {
+        crc32c_shift_init(&g_zeros_long, CRC32C_LONG);
+        crc32c_shift_init(&g_zeros_short, CRC32C_SHORT);
+        g_crc32c_fn = crc32c_hw;
+        g_crc32c_name = CRC32C_HW_NAME;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+    pthread_once(&g_dispatch_once, crc32c_pick);
+    return g_crc32c_fn(crc, buf, n);
+}
+
+const char *crc32c_impl(void) {
+    pthread_once(&g_dispatch_once, crc32c_pick);
+    return g_crc32c_name;
+}
+
+int crc32c_fd_prefix(int fd, uint64_t len, uint32_t *out, const volatile sig_atomic_t *stop) {
+    const size_t BUF_SZ = 1024 * 1024;
+    unsigned char *buf = (unsigned char *)malloc(BUF_SZ);
+    if (!buf)
+        return -1;
+    uint32_t crc = 0;
+    uint64_t off = 0;
+    while (off < len) {
+        if (stop && *stop) {
+            free(buf);
+            errno = EINTR;
+            return -1;
+        }
+        size_t want = len - off > BUF_SZ ? BUF_SZ : (size_t)(len - off);
+        ssize_t r = pread(fd, buf, want, (off_t)off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            if (r == 0)
+                errno = EPIPE;
+            free(buf);
+            return -1;
+        }
+        crc = crc32c(crc, buf, (size_t)r);
+        off += (uint64_t)r;
+    }
+    free(buf);
+    *out = crc;
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef LANDROP_CRC32C_H
+#define LANDROP_CRC32C_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli). Start with crc = 0 and feed the data in any
+// number of pieces: crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m).
+// Uses the SSE4.2 or ARMv8 CRC32 instructions when the CPU has them
+// (LANDROP_CRC32C_PORTABLE in the environment forces the table version).
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
+
+// The table-driven version, same results on every CPU
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t n);
+
+// Name of the implementation crc32c() dispatches to
+const char *crc32c_impl(void);
+
+// Combining CRCs without the data: for any B of the length s was set up
+// for (a power of two), crc32c_combine(s, crc(A), crc(B)) == crc(A B).
+struct crc32c_shift {
+    uint32_t t[4][256];
+};
+void crc32c_shift_init(struct crc32c_shift *s, size_t len);
+uint32_t crc32c_combine(const struct crc32c_shift *s, uint32_t crc_a, uint32_t crc_b);
+
+// CRC-32C of bytes [0, len) of fd, read with pread so the file offset is
+// left alone. If stop is given and becomes non-zero the scan is abandoned.
+// Returns 0 on success, -1 on read error, short file or stop.
+int crc32c_fd_prefix(int fd, uint64_t len, uint32_t *out, const volatile sig_atomic_t *stop);
+
+#endif // LANDROP_CRC32C_H
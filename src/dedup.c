@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include "dedup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "delta.h"
+
+// Index file: "LDX1" [be32 files] [be64 chunks], then per file
+// [be64 size] [be64 mtime ns] [be64 inode] [be16 name length] [name], then
+// per chunk [16-byte hash] [be32 file] [be32 crc] [be64 offset << 16 | length - 1]
+#define DEDUP_MAGIC "LDX1"
+#define DEDUP_FILE_LEN (8 + 8 + 8 + 2)
+#define DEDUP_ENTRY_LEN (DEDUP_HASH_LEN + 4 + 4 + 8)
+
+// Slots are never fewer, and the table doubles once three quarters are used
+#define DEDUP_MIN_SLOTS (64 * 1024)
+// Same for the table of file names
+#define DEDUP_MIN_NAMES 1024
+
+// The offset takes the top 48 bits of pos and the length minus one the
+// bottom 16, which keeps a slot at 32 bytes
+#define POS(off, len) ((off) << 16 | ((uint64_t)(len) - 1))
+_Static_assert(LFT2_DEDUP_MAX_CHUNK <= 65536, "a chunk length must fit 16 bits");
+
+struct slot {
+    uint64_t h0, h1;
+    uint64_t pos;
+    uint32_t file;              // 0: empty
+    uint32_t crc;
+};
+
+// The version of a file its chunks were taken from
+struct dfile {
+    char *name;                 // NULL once a newer file took the name
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime_ns;
+    bool gone;                  // seen changed or overwritten since
+};
+
+struct dedup_index {
+    pthread_mutex_t lock;
+    pthread_mutex_t save_lock;  // one dedup_save() at a time
+    int dirfd;
+    char *path;
+    char *tmp;
+    struct slot *slots;
+    uint64_t mask;
+    uint64_t count;
+    struct dfile *files;        // file id n is files[n - 1]
+    uint32_t nfiles;
+    uint32_t fcap;
+    uint32_t ngone;
+    // Newest file id stored under each name, open addressing on hash64()
+    // of the name; 0: empty. Names are never removed, only repointed.
+    uint32_t *names;
+    uint32_t nmask;
+    uint32_t nnames;
+    bool dirty;
+};
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static bool same_version(const struct dfile *f, const struct stat *st) {
+    return S_ISREG(st->st_mode) && f->size == (uint64_t)st->st_size && f->ino == (uint64_t)st->st_ino &&
+           f->mtime_ns == mtime_ns(st);
+}
+
+// Linear probing; the table is never full, so this ends at the key or a hole
+static struct slot *find(struct dedup_index *ix, uint64_t h0, uint64_t h1) {
+    for (uint64_t i = h0 & ix->mask;; i = (i + 1) & ix->mask) {
+        struct slot *s = &ix->slots[i];
+        if (s->file == 0 || (s->h0 == h0 && s->h1 == h1))
+            return s;
+    }
+}
+
+// Rehash without the chunks of files that are gone, doubling the table only
+// while the rest would fill more than half of it. A daemon replacing its
+// files with -o keeps the table the size of what is live.
+static int grow(struct dedup_index *ix) {
+    struct slot *old = ix->slots;
+    uint64_t oldn = ix->mask + 1;
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < oldn; ++i)
+        live += old[i].file && !ix->files[old[i].file - 1].gone;
+    uint64_t n = oldn;
+    while ((live + 1) * 2 > n)
+        n *= 2;
+    ix->slots = (struct slot *)calloc(n, sizeof(struct slot));
+    if (!ix->slots) {
+        ix->slots = old;
+        return -1;
+    }
+    ix->mask = n - 1;
+    for (uint64_t i = 0; i < oldn; ++i) {
+        if (old[i].file && !ix->files[old[i].file - 1].gone)
+            *find(ix, old[i].h0, old[i].h1) = old[i];
+    }
+    ix->count = live;
+    free(old);
+    return 0;
+}
+
+// A chunk seen again keeps its older location unless that file is gone:
+// every chunk has one location only, and moving it to each new copy would
+// lose it as soon as the newest copy changes, with older ones still intact
+static int insert(struct dedup_index *ix, const unsigned char *hash, uint64_t pos, uint32_t file, uint32_t crc) {
+    if ((ix->count + 1) * 4 > (ix->mask + 1) * 3 && grow(ix) < 0)
+        return -1;
+    struct slot *s = find(ix, get_be64(hash), get_be64(hash + 8));
+    if (s->file == 0)
+        ix->count++;
+    else if (!ix->files[s->file - 1].gone)
+        return 0;
+    s->h0 = get_be64(hash);
+    s->h1 = get_be64(hash + 8);
+    s->pos = pos;
+    s->file = file;
+    s->crc = crc;
+    return 0;
+}
+
+static void mark_gone(struct dedup_index *ix, uint32_t file) {
+    if (!ix->files[file - 1].gone) {
+        ix->files[file - 1].gone = true;
+        ix->ngone++;
+    }
+}
+
+// The name table entry for name: its newest file id, or the hole to put it in
+static uint32_t *find_name(struct dedup_index *ix, const char *name) {
+    for (uint32_t i = (uint32_t)hash64(name, strlen(name), 0) & ix->nmask;; i = (i + 1) & ix->nmask) {
+        uint32_t *e = &ix->names[i];
+        if (*e == 0 || strcmp(ix->files[*e - 1].name, name) == 0)
+            return e;
+    }
+}
+
+static int grow_names(struct dedup_index *ix) {
+    uint32_t n = (ix->nmask + 1) * 2;
+    uint32_t *old = ix->names;
+    uint32_t oldn = ix->nmask + 1;
+    ix->names = (uint32_t *)calloc(n, sizeof(uint32_t));
+    if (!ix->names) {
+        ix->names = old;
+        return -1;
+    }
+    ix->nmask = n - 1;
+    for (uint32_t i = 0; i < oldn; ++i) {
+        if (old[i])
+            *find_name(ix, ix->files[old[i] - 1].name) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// New file id, 0 if out of memory
+static uint32_t add_file(struct dedup_index *ix, const char *name, const struct stat *st) {
+    if (ix->nfiles == ix->fcap) {
+        uint32_t cap = ix->fcap ? ix->fcap * 2 : 256;
+        struct dfile *f = (struct dfile *)realloc(ix->files, cap * sizeof(*f));
+        if (!f)
+            return 0;
+        ix->files = f;
+        ix->fcap = cap;
+    }
+    if ((ix->nnames + 1) * 4 > (ix->nmask + 1) * 3 && grow_names(ix) < 0)
+        return 0;
+    struct dfile *f = &ix->files[ix->nfiles];
+    if (!(f->name = strdup(name)))
+        return 0;
+    f->gone = false;
+    f->size = (uint64_t)st->st_size;
+    f->ino = (uint64_t)st->st_ino;
+    f->mtime_ns = mtime_ns(st);
+    // A file stored again under the same name replaces the older version,
+    // whose name nothing looks up any more
+    uint32_t *e = find_name(ix, name);
+    if (*e) {
+        mark_gone(ix, *e);
+        free(ix->files[*e - 1].name);
+        ix->files[*e - 1].name = NULL;
+    } else
+        ix->nnames++;
+    *e = ++ix->nfiles;
+    return *e;
+}
+
+static void reset(struct dedup_index *ix) {
+    for (uint32_t i = 0; i < ix->nfiles; ++i)
+        free(ix->files[i].name);
+    ix->nfiles = 0;
+    ix->ngone = 0;
+    memset(ix->slots, 0, (ix->mask + 1) * sizeof(struct slot));
+    ix->count = 0;
+    memset(ix->names, 0, (ix->nmask + 1) * sizeof(uint32_t));
+    ix->nnames = 0;
+}
+
+// Returns the number of files dropped as changed, or -1 if the index is damaged.
+// Only the files still there as indexed and their chunks are kept, so what
+// was forgotten while the index was last written does not come back.
+static int load(struct dedup_index *ix, FILE *f) {
+    unsigned char b[DEDUP_ENTRY_LEN];
+    char name[4096 + 1];
+    if (fread(b, 1, 16, f) != 16 || memcmp(b, DEDUP_MAGIC, 4) != 0)
+        return -1;
+    uint32_t nfiles = get_be32(b + 4);
+    uint64_t count = get_be64(b + 8);
+    // Old file id -> new one, 0 for the files that changed
+    uint32_t *map = (uint32_t *)calloc((size_t)nfiles + 1, sizeof(uint32_t));
+    if (!map)
+        return -1;
+    int dropped = 0;
+    for (uint32_t i = 0; i < nfiles; ++i) {
+        if (fread(b, 1, DEDUP_FILE_LEN, f) != DEDUP_FILE_LEN)
+            goto bad;
+        uint16_t len = get_be16(b + 24);
+        if (len == 0 || len > 4096 || fread(name, 1, len, f) != len)
+            goto bad;
+        name[len] = '\0';
+        struct dfile want = { name, get_be64(b), get_be64(b + 16), (int64_t)get_be64(b + 8), false };
+        struct stat st;
+        if (fstatat(ix->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && same_version(&want, &st))
+            map[i + 1] = add_file(ix, name, &st);
+        else
+            dropped++;
+    }
+    // An older index may name a file twice; only the last one counts
+    for (uint32_t i = 1; i <= nfiles; ++i) {
+        if (map[i] && ix->files[map[i] - 1].gone)
+            map[i] = 0;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        if (fread(b, 1, DEDUP_ENTRY_LEN, f) != DEDUP_ENTRY_LEN)
+            goto bad;
+        uint32_t file = get_be32(b + DEDUP_HASH_LEN);
+        if (file > nfiles)
+            goto bad;
+        if (map[file] && insert(ix, b, get_be64(b + DEDUP_HASH_LEN + 8), map[file],
+                                get_be32(b + DEDUP_HASH_LEN + 4)) < 0)
+            goto bad;
+    }
+    free(map);
+    // Dropped files leave entries behind that nothing refers to
+    ix->dirty = dropped > 0 || ix->ngone > 0;
+    return dropped;
+bad:
+    free(map);
+    return -1;
+}
+
+struct dedup_index *dedup_open(const char *dir, const char *name) {
+    struct dedup_index *ix = (struct dedup_index *)calloc(1, sizeof(*ix));
+    if (!ix)
+        return NULL;
+    size_t n = strlen(dir) + 1 + strlen(name) + 5;
+    ix->path = (char *)malloc(n);
+    ix->tmp = (char *)malloc(n);
+    ix->slots = (struct slot *)calloc(DEDUP_MIN_SLOTS, sizeof(struct slot));
+    ix->mask = DEDUP_MIN_SLOTS - 1;
+    ix->names = (uint32_t *)calloc(DEDUP_MIN_NAMES, sizeof(uint32_t));
+    ix->nmask = DEDUP_MIN_NAMES - 1;
+    ix->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!ix->path || !ix->tmp || !ix->slots || !ix->names || ix->dirfd < 0) {
+        int e = ix->dirfd < 0 ? errno : ENOMEM;
+        if (ix->dirfd >= 0)
+            close(ix->dirfd);
+        free(ix->path);
+        free(ix->tmp);
+        free(ix->slots);
+        free(ix->names);
+        free(ix);
+        errno = e;
+        return NULL;
+    }
+    snprintf(ix->path, n, "%s/%s", dir, name);
+    snprintf(ix->tmp, n, "%s/%s.tmp", dir, name);
+    pthread_mutex_init(&ix->lock, NULL);
+    pthread_mutex_init(&ix->save_lock, NULL);
+    FILE *f = fopen(ix->path, "rb");
+    if (!f) {
+        if (errno != ENOENT)
+            perror(ix->path);
+        return ix;
+    }
+    int dropped = load(ix, f);
+    fclose(f);
+    if (dropped < 0) {
+        fprintf(stderr, "Dedup index %s is damaged, starting a new one\n", ix->path);
+        reset(ix);
+        ix->dirty = true;
+    } else if (dropped > 0) {
+        fprintf(stderr, "Dedup index: %d file%s changed since indexed, forgotten\n", dropped,
+                dropped == 1 ? "" : "s");
+    }
+    return ix;
+}
+
+void dedup_lookup(struct dedup_index *ix, const unsigned char *hashes, size_t stride, uint32_t count,
+                  struct dedup_loc *locs) {
+    pthread_mutex_lock(&ix->lock);
+    for (uint32_t i = 0; i < count; ++i, hashes += stride) {
+        const struct slot *s = find(ix, get_be64(hashes), get_be64(hashes + 8));
+        locs[i].file = s->file && !ix->files[s->file - 1].gone ? s->file : 0;
+        locs[i].len = (uint32_t)(s->pos & 0xffff) + 1;
+        locs[i].off = s->pos >> 16;
+        locs[i].crc = s->crc;
+    }
+    pthread_mutex_unlock(&ix->lock);
+}
+
+int dedup_file_open(struct dedup_index *ix, uint32_t file) {
+    char name[4096 + 1];
+    struct dfile want;
+    pthread_mutex_lock(&ix->lock);
+    if (file == 0 || file > ix->nfiles || ix->files[file - 1].gone) {
+        pthread_mutex_unlock(&ix->lock);
+        return -1;
+    }
+    want = ix->files[file - 1];
+    snprintf(name, sizeof(name), "%s", want.name);
+    pthread_mutex_unlock(&ix->lock);
+    int fd = openat(ix->dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !same_version(&want, &st))) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        // Its chunks may be found again in the next file that has them
+        pthread_mutex_lock(&ix->lock);
+        mark_gone(ix, file);
+        pthread_mutex_unlock(&ix->lock);
+    }
+    return fd;
+}
+
+void dedup_forget(struct dedup_index *ix, uint32_t file) {
+    pthread_mutex_lock(&ix->lock);
+    if (file > 0 && file <= ix->nfiles)
+        mark_gone(ix, file);
+    pthread_mutex_unlock(&ix->lock);
+}
+
+int dedup_add(struct dedup_index *ix, const char *name, const struct stat *st, const unsigned char *list,
+              uint32_t count) {
+    pthread_mutex_lock(&ix->lock);
+    uint32_t file = add_file(ix, name, st);
+    int rc = file ? 0 : -1;
+    uint64_t off = 0;
+    for (uint32_t i = 0; i < count && rc == 0; ++i, list += LFT2_CHUNK_ENTRY_LEN) {
+        uint32_t len = get_be32(list + DEDUP_HASH_LEN);
+        rc = insert(ix, list, POS(off, len), file, get_be32(list + DEDUP_HASH_LEN + 4));
+        off += len;
+    }
+    ix->dirty = true;
+    pthread_mutex_unlock(&ix->lock);
+    return rc;
+}
+
+// The index as written to disk, without the files that are gone and their
+// chunks; the live files are numbered again from 1 in order. NULL if out
+// of memory.
+static unsigned char *snapshot(struct dedup_index *ix, size_t *len) {
+    uint32_t *map = (uint32_t *)calloc((size_t)ix->nfiles + 1, sizeof(uint32_t));
+    if (!map)
+        return NULL;
+    size_t n = 16;
+    uint32_t nfiles = 0;
+    for (uint32_t i = 0; i < ix->nfiles; ++i) {
+        if (!ix->files[i].gone) {
+            map[i + 1] = ++nfiles;
+            n += DEDUP_FILE_LEN + strlen(ix->files[i].name);
+        }
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i <= ix->mask; ++i)
+        count += map[ix->slots[i].file] != 0;
+    n += count * DEDUP_ENTRY_LEN;
+    unsigned char *buf = (unsigned char *)malloc(n);
+    if (!buf) {
+        free(map);
+        return NULL;
+    }
+    unsigned char *b = buf;
+    memcpy(b, DEDUP_MAGIC, 4);
+    put_be32(b + 4, nfiles);
+    put_be64(b + 8, count);
+    b += 16;
+    for (uint32_t i = 0; i < ix->nfiles; ++i) {
+        const struct dfile *d = &ix->files[i];
+        if (d->gone)
+            continue;
+        size_t nlen = strlen(d->name);
+        put_be64(b, d->size);
+        put_be64(b + 8, (uint64_t)d->mtime_ns);
+        put_be64(b + 16, d->ino);
+        put_be16(b + 24, (uint16_t)nlen);
+        memcpy(b + DEDUP_FILE_LEN, d->name, nlen);
+        b += DEDUP_FILE_LEN + nlen;
+    }
+    for (uint64_t i = 0; i <= ix->mask; ++i) {
+        const struct slot *s = &ix->slots[i];
+        if (!map[s->file])
+            continue;
+        put_be64(b, s->h0);
+        put_be64(b + 8, s->h1);
+        put_be32(b + DEDUP_HASH_LEN, map[s->file]);
+        put_be32(b + DEDUP_HASH_LEN + 4, s->crc);
+        put_be64(b + DEDUP_HASH_LEN + 8, s->pos);
+        b += DEDUP_ENTRY_LEN;
+    }
+    free(map);
+    *len = n;
+    return buf;
+}
+
+// Copied under the lock, which takes a few milliseconds per million chunks,
+// and written after it is released, so uploads do not wait for the disk.
+// The copy is compacted, and loading it compacts the table in memory.
+int dedup_save(struct dedup_index *ix) {
+    pthread_mutex_lock(&ix->save_lock);
+    pthread_mutex_lock(&ix->lock);
+    unsigned char *buf = NULL;
+    size_t len = 0;
+    bool dirty = ix->dirty;
+    if (dirty) {
+        buf = snapshot(ix, &len);
+        ix->dirty = buf == NULL;
+    }
+    pthread_mutex_unlock(&ix->lock);
+    int rc = 0;
+    if (dirty) {
+        FILE *f = buf ? fopen(ix->tmp, "wb") : NULL;
+        rc = f && fwrite(buf, 1, len, f) == len ? 0 : -1;
+        if (f && fclose(f) != 0)
+            rc = -1;
+        if (rc < 0 || rename(ix->tmp, ix->path) < 0) {
+            perror(ix->path);
+            unlink(ix->tmp);
+            rc = -1;
+            // Try again next time
+            pthread_mutex_lock(&ix->lock);
+            ix->dirty = true;
+            pthread_mutex_unlock(&ix->lock);
+        }
+        free(buf);
+    }
+    pthread_mutex_unlock(&ix->save_lock);
+    return rc;
+}
+
+void dedup_size(struct dedup_index *ix, uint64_t *chunks, uint32_t *files) {
+    pthread_mutex_lock(&ix->lock);
+    *chunks = ix->count;
+    *files = ix->nfiles - ix->ngone;
+    pthread_mutex_unlock(&ix->lock);
+}
+
+void dedup_close(struct dedup_index *ix) {
+    dedup_save(ix);
+    reset(ix);
+    pthread_mutex_destroy(&ix->lock);
+    pthread_mutex_destroy(&ix->save_lock);
+    close(ix->dirfd);
+    free(ix->files);
+    free(ix->slots);
+    free(ix->names);
+    free(ix->path);
+    free(ix->tmp);
+    free(ix);
+}
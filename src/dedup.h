@@ -0,0 +1,62 @@
+#ifndef LANDROP_DEDUP_H
+#define LANDROP_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Chunk index of the server (-X): which content-defined chunks it holds,
+// and where, across every file that arrived through dedup frames. Entries
+// live in one open-addressing table of 32-byte slots (no allocation per
+// chunk), so millions of chunks cost tens of megabytes. The index is kept
+// in a file in the destination directory between runs. It is only a hint:
+// a file that changed after it was indexed is recognized by its size, mtime
+// and inode and its chunks are no longer offered.
+// All functions are thread-safe.
+
+struct dedup_index;
+
+#define DEDUP_HASH_LEN 16
+
+// Where one chunk is: file id, byte range and CRC-32C of the content
+struct dedup_loc {
+    uint32_t file;              // 0: not held
+    uint32_t len;
+    uint64_t off;
+    uint32_t crc;
+};
+
+// Load dir/name, dropping the files that changed or disappeared since, or
+// start empty if there is none. NULL (errno set) only if dir cannot be
+// opened or memory runs out; an unreadable index is reported and ignored.
+struct dedup_index *dedup_open(const char *dir, const char *name);
+
+// Find count chunks whose hashes are stride bytes apart, starting at hashes
+void dedup_lookup(struct dedup_index *ix, const unsigned char *hashes, size_t stride, uint32_t count,
+                  struct dedup_loc *locs);
+
+// Open an indexed file for reading if it is still the version its chunks
+// came from; -1 otherwise
+int dedup_file_open(struct dedup_index *ix, uint32_t file);
+
+// Stop offering the chunks of a file found to differ from what was indexed
+// although its size, mtime and inode did not change
+void dedup_forget(struct dedup_index *ix, uint32_t file);
+
+// Record a file just stored under name (relative to the directory, st its
+// fstat() when it was complete) and its count chunks, as listed in a chunks
+// frame (LFT2_CHUNK_ENTRY_LEN bytes each, in file order). Returns 0 or -1.
+int dedup_add(struct dedup_index *ix, const char *name, const struct stat *st, const unsigned char *list,
+              uint32_t count);
+
+// Write the index back if it changed. Returns 0 or -1 (reported).
+int dedup_save(struct dedup_index *ix);
+
+// Chunks and files indexed
+void dedup_size(struct dedup_index *ix, uint64_t *chunks, uint32_t *files);
+
+// Save and free
+void dedup_close(struct dedup_index *ix);
+
+#endif // LANDROP_DEDUP_H
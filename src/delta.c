@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+#include "delta.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "crc32c.h"
+
+uint32_t delta_block_size(uint64_t size) {
+    uint32_t b = DELTA_MIN_BLOCK;
+    while (b < DELTA_MAX_BLOCK && (uint64_t)b * b < size)
+        b <<= 1;
+    return b;
+}
+
+void rollsum_init(struct rollsum *r, const unsigned char *p, uint32_t len) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+        a += p[i];
+        b += (len - i) * (uint32_t)p[i];
+    }
+    r->a = a;
+    r->b = b;
+    r->len = len;
+}
+
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t rd64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t rd32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    acc += in * P2;
+    acc = rotl64(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * P1 + P4;
+}
+
+// Little-endian reads: the hash only has to agree between our own builds,
+// which all run on little-endian CPUs (x86-64, aarch64)
+uint64_t hash64(const void *data, size_t n, uint64_t seed) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + n;
+    uint64_t h;
+    if (n >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xxh_round(v1, rd64(p));
+            v2 = xxh_round(v2, rd64(p + 8));
+            v3 = xxh_round(v3, rd64(p + 16));
+            v4 = xxh_round(v4, rd64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    h += (uint64_t)n;
+    while (end - p >= 8) {
+        h ^= xxh_round(0, rd64(p));
+        h = rotl64(h, 27) * P1 + P4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)rd32(p) * P1;
+        h = rotl64(h, 23) * P2 + P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (uint64_t)*p++ * P5;
+        h = rotl64(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+int delta_signatures(int fd, uint32_t block, uint64_t count, unsigned char *sigs, uint32_t *crcs,
+                     const volatile sig_atomic_t *stop) {
+    // Several blocks per read keeps the syscall count down for small blocks
+    size_t per = block >= DELTA_MAX_BLOCK ? 1 : DELTA_MAX_BLOCK / block;
+    unsigned char *buf = (unsigned char *)malloc(per * block);
+    if (!buf)
+        return -1;
+    for (uint64_t i = 0; i < count;) {
+        if (stop && *stop) {
+            free(buf);
+            errno = EINTR;
+            return -1;
+        }
+        size_t nb = count - i < per ? (size_t)(count - i) : per;
+        size_t want = nb * block;
+        for (size_t got = 0; got < want;) {
+            ssize_t r = pread(fd, buf + got, want - got, (off_t)(i * block + got));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                if (r == 0)
+                    errno = EPIPE;
+                free(buf);
+                return -1;
+            }
+            got += (size_t)r;
+        }
+        for (size_t k = 0; k < nb; ++k, ++i) {
+            const unsigned char *b = buf + k * block;
+            struct rollsum rs;
+            rollsum_init(&rs, b, block);
+            put_be32(sigs + i * DELTA_SIG_LEN, rollsum_digest(&rs));
+            put_be64(sigs + i * DELTA_SIG_LEN + 4, hash64(b, block, 0));
+            crcs[i] = crc32c(0, b, block);
+        }
+    }
+    free(buf);
+    return 0;
+}
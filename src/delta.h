@@ -0,0 +1,52 @@
+#ifndef LANDROP_DELTA_H
+#define LANDROP_DELTA_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Delta transfers (rsync's algorithm). The receiver cuts its old copy into
+// fixed blocks and sends a weak rolling checksum and a strong hash of each.
+// The sender slides a window over the new file; wherever the weak checksum
+// of the window matches a block and the strong hash confirms it, it sends a
+// reference to that block instead of the bytes.
+
+#define DELTA_MIN_BLOCK 4096
+#define DELTA_MAX_BLOCK (1024 * 1024)
+
+// Wire size of one block signature: [be32 weak] [be64 strong]
+#define DELTA_SIG_LEN 12
+
+// Block size for an old file of size bytes: about sqrt(size), a power of
+// two between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK
+uint32_t delta_block_size(uint64_t size);
+
+// rsync's rolling checksum over a window of len bytes
+struct rollsum {
+    uint32_t a, b;
+    uint32_t len;
+};
+
+void rollsum_init(struct rollsum *r, const unsigned char *p, uint32_t len);
+
+// Slide the window one byte: out leaves at the front, in enters at the back
+static inline void rollsum_roll(struct rollsum *r, unsigned char out, unsigned char in) {
+    r->a += (uint32_t)in - (uint32_t)out;
+    r->b += r->a - r->len * (uint32_t)out;
+}
+
+static inline uint32_t rollsum_digest(const struct rollsum *r) {
+    return (r->a & 0xffff) | (r->b << 16);
+}
+
+// Strong block hash (XXH64)
+uint64_t hash64(const void *p, size_t n, uint64_t seed);
+
+// Signatures of the count full blocks of fd: DELTA_SIG_LEN bytes each into
+// sigs, and the CRC-32C of each block into crcs (for checking the rebuilt
+// file without reading it back). Stops early if *stop becomes non-zero.
+// Returns 0 or -1.
+int delta_signatures(int fd, uint32_t block, uint64_t count, unsigned char *sigs, uint32_t *crcs,
+                     const volatile sig_atomic_t *stop);
+
+#endif // LANDROP_DELTA_H
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "dircache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+
+#if defined(__NR_openat2) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define HAVE_OPENAT2 1
+#endif
+#endif
+
+// One open directory. Entries are found by path in a chained hash table
+// and by fd in a table indexed by fd; all of them are on one list in order
+// of last use, the least recent at the tail.
+struct dent {
+    char *path;                 // relative to the root, "" for the root
+    uint32_t hash;
+    int fd;
+    int refs;                   // dircache_get() callers holding it
+    struct dent *hnext;
+    struct dent *prev, *next;
+};
+
+struct dircache {
+    pthread_mutex_t lock;
+    struct dent **buckets;
+    uint32_t mask;
+    struct dent **byfd;
+    int nbyfd;
+    struct dent *head, *tail;
+    size_t count, max;
+    struct dent *root;          // never closed
+#ifdef HAVE_OPENAT2
+    bool no_openat2;            // the kernel said ENOSYS
+#endif
+};
+
+static uint32_t path_hash(const char *path, size_t len) {
+    return crc32c(0, path, len);
+}
+
+static void lru_unlink(struct dircache *dc, struct dent *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        dc->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        dc->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(struct dircache *dc, struct dent *e) {
+    e->next = dc->head;
+    if (dc->head)
+        dc->head->prev = e;
+    dc->head = e;
+    if (!dc->tail)
+        dc->tail = e;
+}
+
+static struct dent *find(struct dircache *dc, const char *path, size_t len, uint32_t h) {
+    for (struct dent *e = dc->buckets[h & dc->mask]; e; e = e->hnext) {
+        if (e->hash == h && strncmp(e->path, path, len) == 0 && e->path[len] == '\0')
+            return e;
+    }
+    return NULL;
+}
+
+static void evict(struct dircache *dc, struct dent *e) {
+    for (struct dent **pp = &dc->buckets[e->hash & dc->mask]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+    }
+    lru_unlink(dc, e);
+    dc->byfd[e->fd] = NULL;
+    close(e->fd);
+    free(e->path);
+    free(e);
+    dc->count--;
+}
+
+// Close the least recently used directories nobody holds (other than keep)
+// while there are more than max
+static void trim(struct dircache *dc, const struct dent *keep) {
+    for (struct dent *e = dc->tail; e && dc->count > dc->max;) {
+        struct dent *prev = e->prev;
+        if (e->refs == 0 && e != dc->root && e != keep)
+            evict(dc, e);
+        e = prev;
+    }
+}
+
+// Take over fd as the directory path (len bytes of it). NULL if memory
+// runs out, with fd closed.
+static struct dent *insert(struct dircache *dc, const char *path, size_t len, uint32_t h, int fd) {
+    struct dent *e = (struct dent *)calloc(1, sizeof(*e));
+    char *p = (char *)malloc(len + 1);
+    if (fd >= dc->nbyfd && e && p) {
+        int n = dc->nbyfd ? dc->nbyfd : 64;
+        while (n <= fd)
+            n *= 2;
+        struct dent **t = (struct dent **)realloc(dc->byfd, (size_t)n * sizeof(*t));
+        if (t) {
+            memset(t + dc->nbyfd, 0, (size_t)(n - dc->nbyfd) * sizeof(*t));
+            dc->byfd = t;
+            dc->nbyfd = n;
+        }
+    }
+    if (!e || !p || fd >= dc->nbyfd) {
+        free(e);
+        free(p);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(p, path, len);
+    p[len] = '\0';
+    e->path = p;
+    e->hash = h;
+    e->fd = fd;
+    e->hnext = dc->buckets[h & dc->mask];
+    dc->buckets[h & dc->mask] = e;
+    dc->byfd[fd] = e;
+    lru_push(dc, e);
+    dc->count++;
+    trim(dc, e);
+    return e;
+}
+
+// Open (or with create, create and then open) the directory name in
+// parent, never through a symlink
+static int open_child(int parent, const char *name, bool create) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(parent, name, flags);
+    if (fd >= 0 || errno != ENOENT || !create)
+        return fd;
+    if (mkdirat(parent, name, 0755) < 0 && errno != EEXIST)
+        return -1;
+    return openat(parent, name, flags);
+}
+
+// The directory path (its first len bytes), from the cache or opened
+// below the nearest cached ancestor. Called with the lock held.
+static struct dent *lookup(struct dircache *dc, const char *path, size_t len, bool create) {
+    if (len == 0)
+        return dc->root;
+    uint32_t h = path_hash(path, len);
+    struct dent *e = find(dc, path, len, h);
+    if (e) {
+        lru_unlink(dc, e);
+        lru_push(dc, e);
+        return e;
+    }
+    int fd = -1;
+#ifdef HAVE_OPENAT2
+    // One lookup for the whole path if it already exists
+    if (!dc->no_openat2) {
+        char p[4096];
+        if (len < sizeof(p)) {
+            memcpy(p, path, len);
+            p[len] = '\0';
+            struct open_how how;
+            memset(&how, 0, sizeof(how));
+            how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+            fd = (int)syscall(__NR_openat2, dc->root->fd, p, &how, sizeof(how));
+            if (fd < 0 && errno == ENOSYS)
+                dc->no_openat2 = true;
+            else if (fd < 0 && errno != ENOENT)
+                return NULL;
+        }
+    }
+#endif
+    if (fd < 0) {
+        // Step by step from the parent, creating what is missing
+        size_t cut = len;
+        while (cut > 0 && path[cut - 1] != '/')
+            cut--;
+        struct dent *parent = lookup(dc, path, cut > 0 ? cut - 1 : 0, create);
+        if (!parent)
+            return NULL;
+        char name[256];
+        if (len - cut >= sizeof(name)) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        memcpy(name, path + cut, len - cut);
+        name[len - cut] = '\0';
+        // The parent may be the least recently used entry: hold it so that
+        // making room for the child does not close it under us
+        parent->refs++;
+        fd = open_child(parent->fd, name, create);
+        parent->refs--;
+        if (fd < 0)
+            return NULL;
+    }
+    return insert(dc, path, len, h, fd);
+}
+
+struct dircache *dircache_open(const char *root, size_t max) {
+    struct dircache *dc = (struct dircache *)calloc(1, sizeof(*dc));
+    if (!dc)
+        return NULL;
+    uint32_t n = 16;
+    while (n < 2 * max)
+        n *= 2;
+    dc->mask = n - 1;
+    dc->max = max + 1;
+    dc->buckets = (struct dent **)calloc(n, sizeof(*dc->buckets));
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!dc->buckets || fd < 0) {
+        int e = errno;
+        if (fd >= 0)
+            close(fd);
+        free(dc->buckets);
+        free(dc);
+        errno = e;
+        return NULL;
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->root = insert(dc, "", 0, path_hash("", 0), fd);
+    if (!dc->root) {
+        dircache_close(dc);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return dc;
+}
+
+static int get(struct dircache *dc, const char *path, const char **leaf, bool create) {
+    const char *slash = strrchr(path, '/');
+    *leaf = slash ? slash + 1 : path;
+    // Files at the top need no lookup at all
+    if (!slash)
+        return dc->root->fd;
+    pthread_mutex_lock(&dc->lock);
+    struct dent *e = lookup(dc, path, (size_t)(slash - path), create);
+    int fd = -1;
+    if (e) {
+        e->refs++;
+        fd = e->fd;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return fd;
+}
+
+int dircache_get(struct dircache *dc, const char *path, const char **leaf) {
+    return get(dc, path, leaf, true);
+}
+
+int dircache_find(struct dircache *dc, const char *path, const char **leaf) {
+    return get(dc, path, leaf, false);
+}
+
+void dircache_put(struct dircache *dc, int fd) {
+    if (fd < 0 || fd == dc->root->fd)
+        return;
+    pthread_mutex_lock(&dc->lock);
+    struct dent *e = fd < dc->nbyfd ? dc->byfd[fd] : NULL;
+    if (e && --e->refs == 0)
+        trim(dc, NULL);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dircache_close(struct dircache *dc) {
+    if (!dc)
+        return;
+    while (dc->head)
+        evict(dc, dc->head);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->buckets);
+    free(dc->byfd);
+    free(dc);
+}
@@ -0,0 +1,38 @@
+#ifndef LANDROP_DIRCACHE_H
+#define LANDROP_DIRCACHE_H
+
+#include <stddef.h>
+
+// Directories under the destination, opened relative to it and kept open,
+// so that files landing in a tree are created with openat() in their
+// directory instead of walking (and mkdir-ing) the whole path every time.
+// Every directory is opened from its parent without following symlinks
+// (openat2() with RESOLVE_BENEATH where the kernel has it), so nothing
+// outside the root is reached whatever the tree holds. Up to max
+// directories stay open; the least recently used one that nobody holds is
+// closed to make room.
+// All functions are thread-safe.
+
+struct dircache;
+
+// Cache for the directory root. NULL (errno set) if root cannot be opened
+// or memory runs out.
+struct dircache *dircache_open(const char *root, size_t max);
+
+// Directory holding the last component of path, a relative path as
+// sanitize_path() makes it, created (0755) with the directories above it
+// as needed. *leaf points at the last component within path. Returns a
+// directory fd to use until dircache_put(), or -1 (errno set: ENOTDIR if a
+// component is a file, ELOOP if it is a symlink).
+int dircache_get(struct dircache *dc, const char *path, const char **leaf);
+
+// The same for reading: nothing is created, a missing directory is ENOENT
+int dircache_find(struct dircache *dc, const char *path, const char **leaf);
+
+// Done with an fd from dircache_get() or dircache_find(). -1 is ignored.
+void dircache_put(struct dircache *dc, int fd);
+
+// Close everything. No fd from dircache_get() may be in use.
+void dircache_close(struct dircache *dc);
+
+#endif // LANDROP_DIRCACHE_H
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "fdcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "stats.h"
+
+// An entry is trusted this long after the path last matched it
+#define REVALIDATE_NS 1000000000ull
+
+// One open file. Entries are found by path in a chained hash table and by
+// fd in a table indexed by fd; the cached ones are on one list in order of
+// last use, the least recent at the tail. An entry found stale or
+// forgotten while held leaves the table and the list and is closed at its
+// last fdcache_put().
+struct fent {
+    char *path;
+    uint32_t hash;
+    int fd;
+    int refs;                   // fdcache_get() callers holding it
+    bool gone;                  // out of the table, closed once nobody holds it
+    struct stat st;
+    uint64_t checked;           // stats_now_ns() the path last matched st
+    struct fent *hnext;
+    struct fent *prev, *next;
+};
+
+struct fdcache {
+    pthread_mutex_t lock;
+    struct dircache *dirs;
+    struct fent **buckets;
+    uint32_t mask;
+    struct fent **byfd;
+    int nbyfd;
+    struct fent *head, *tail;
+    size_t count, max;
+};
+
+static void lru_unlink(struct fdcache *fc, struct fent *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        fc->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        fc->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(struct fdcache *fc, struct fent *e) {
+    e->next = fc->head;
+    if (fc->head)
+        fc->head->prev = e;
+    fc->head = e;
+    if (!fc->tail)
+        fc->tail = e;
+}
+
+static struct fent *find(struct fdcache *fc, const char *path, uint32_t h) {
+    for (struct fent *e = fc->buckets[h & fc->mask]; e; e = e->hnext) {
+        if (e->hash == h && strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+// Take e out of the table and the list; it is freed by whoever drops the
+// last reference
+static void unhash(struct fdcache *fc, struct fent *e) {
+    for (struct fent **pp = &fc->buckets[e->hash & fc->mask]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+    }
+    lru_unlink(fc, e);
+    e->gone = true;
+    fc->count--;
+}
+
+static void destroy(struct fdcache *fc, struct fent *e) {
+    fc->byfd[e->fd] = NULL;
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+// Close the least recently used files nobody holds while there are more
+// than max
+static void trim(struct fdcache *fc) {
+    for (struct fent *e = fc->tail; e && fc->count > fc->max;) {
+        struct fent *prev = e->prev;
+        if (e->refs == 0) {
+            unhash(fc, e);
+            destroy(fc, e);
+        }
+        e = prev;
+    }
+}
+
+// Room in byfd for fd. Called with the lock held.
+static bool byfd_fit(struct fdcache *fc, int fd) {
+    if (fd < fc->nbyfd)
+        return true;
+    int n = fc->nbyfd ? fc->nbyfd : 64;
+    while (n <= fd)
+        n *= 2;
+    struct fent **t = (struct fent **)realloc(fc->byfd, (size_t)n * sizeof(*t));
+    if (!t)
+        return false;
+    memset(t + fc->nbyfd, 0, (size_t)(n - fc->nbyfd) * sizeof(*t));
+    fc->byfd = t;
+    fc->nbyfd = n;
+    return true;
+}
+
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Whether path still names the file e holds, unchanged
+static bool still_there(struct fdcache *fc, const struct fent *e) {
+    const char *leaf;
+    int dfd = dircache_find(fc->dirs, e->path, &leaf);
+    if (dfd < 0)
+        return false;
+    struct stat st;
+    int rc = fstatat(dfd, leaf, &st, AT_SYMLINK_NOFOLLOW);
+    dircache_put(fc->dirs, dfd);
+    return rc == 0 && same_file(&st, &e->st);
+}
+
+// Open path for reading, never through a symlink, if it is a regular file
+static int open_file(struct fdcache *fc, const char *path, struct stat *st) {
+    const char *leaf;
+    int dfd = dircache_find(fc->dirs, path, &leaf);
+    if (dfd < 0)
+        return -1;
+    // O_NONBLOCK: a FIFO in the tree must not hang the worker on open
+    int fd = openat(dfd, leaf, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    int err = errno;
+    dircache_put(fc->dirs, dfd);
+    if (fd < 0) {
+        errno = err;
+        return -1;
+    }
+    if (fstat(fd, st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st->st_mode) ? EISDIR : EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+struct fdcache *fdcache_open(struct dircache *dirs, size_t max) {
+    struct fdcache *fc = (struct fdcache *)calloc(1, sizeof(*fc));
+    if (!fc)
+        return NULL;
+    uint32_t n = 16;
+    while (n < 2 * max)
+        n *= 2;
+    fc->mask = n - 1;
+    fc->max = max;
+    fc->dirs = dirs;
+    fc->buckets = (struct fent **)calloc(n, sizeof(*fc->buckets));
+    if (!fc->buckets) {
+        free(fc);
+        return NULL;
+    }
+    pthread_mutex_init(&fc->lock, NULL);
+    return fc;
+}
+
+int fdcache_get(struct fdcache *fc, const char *path, struct stat *st, bool *hit) {
+    uint32_t h = crc32c(0, path, strlen(path));
+    uint64_t now = stats_now_ns();
+    pthread_mutex_lock(&fc->lock);
+    struct fent *e = find(fc, path, h);
+    bool fresh = false;
+    if (e) {
+        e->refs++;
+        lru_unlink(fc, e);
+        lru_push(fc, e);
+        fresh = now - e->checked < REVALIDATE_NS;
+    }
+    pthread_mutex_unlock(&fc->lock);
+    if (e) {
+        // The check stats the path, which is not worth holding everybody
+        // else up for
+        bool same = fresh || still_there(fc, e);
+        pthread_mutex_lock(&fc->lock);
+        if (same) {
+            if (!fresh)
+                e->checked = now;
+            *st = e->st;
+            *hit = true;
+            pthread_mutex_unlock(&fc->lock);
+            return e->fd;
+        }
+        if (!e->gone)
+            unhash(fc, e);
+        pthread_mutex_unlock(&fc->lock);
+        fdcache_put(fc, e->fd);
+    }
+
+    *hit = false;
+    int fd = open_file(fc, path, st);
+    if (fd < 0)
+        return -1;
+    struct fent *n = (struct fent *)calloc(1, sizeof(*n));
+    char *p = strdup(path);
+    pthread_mutex_lock(&fc->lock);
+    e = find(fc, path, h);
+    if (e && same_file(&e->st, st)) {
+        // Somebody else opened it meanwhile: share theirs
+        e->refs++;
+        pthread_mutex_unlock(&fc->lock);
+        free(n);
+        free(p);
+        close(fd);
+        return e->fd;
+    }
+    if (!n || !p || !byfd_fit(fc, fd)) {
+        // Served uncached: fdcache_put() closes what it does not know
+        pthread_mutex_unlock(&fc->lock);
+        free(n);
+        free(p);
+        return fd;
+    }
+    if (e) {
+        unhash(fc, e);
+        if (e->refs == 0)
+            destroy(fc, e);
+    }
+    n->path = p;
+    n->hash = h;
+    n->fd = fd;
+    n->refs = 1;
+    n->st = *st;
+    n->checked = now;
+    n->hnext = fc->buckets[h & fc->mask];
+    fc->buckets[h & fc->mask] = n;
+    fc->byfd[fd] = n;
+    lru_push(fc, n);
+    fc->count++;
+    trim(fc);
+    pthread_mutex_unlock(&fc->lock);
+    return fd;
+}
+
+void fdcache_put(struct fdcache *fc, int fd) {
+    if (fd < 0)
+        return;
+    pthread_mutex_lock(&fc->lock);
+    struct fent *e = fd < fc->nbyfd ? fc->byfd[fd] : NULL;
+    if (!e)
+        close(fd);
+    else if (--e->refs == 0 && e->gone)
+        destroy(fc, e);
+    else if (e->refs == 0)
+        trim(fc);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+void fdcache_forget(struct fdcache *fc, const char *path) {
+    uint32_t h = crc32c(0, path, strlen(path));
+    pthread_mutex_lock(&fc->lock);
+    struct fent *e = find(fc, path, h);
+    if (e) {
+        unhash(fc, e);
+        if (e->refs == 0)
+            destroy(fc, e);
+    }
+    pthread_mutex_unlock(&fc->lock);
+}
+
+void fdcache_close(struct fdcache *fc) {
+    if (!fc)
+        return;
+    while (fc->head) {
+        struct fent *e = fc->head;
+        unhash(fc, e);
+        destroy(fc, e);
+    }
+    pthread_mutex_destroy(&fc->lock);
+    free(fc->buckets);
+    free(fc->byfd);
+    free(fc);
+}
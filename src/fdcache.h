@@ -0,0 +1,45 @@
+#ifndef LANDROP_FDCACHE_H
+#define LANDROP_FDCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+
+// Files under the destination served to downloads, kept open with their
+// fstat() results, so a file many clients fetch is opened and stat-ed once
+// instead of once per request. Files are opened through the dircache's
+// directories without following symlinks, and only regular files are
+// served. An entry older than a second is checked against the path again
+// (same inode, size and mtime) before it is used, so a file replaced or
+// changed by anybody else is picked up within that time; the server's own
+// uploads drop the entry at once (fdcache_forget()). Up to max files stay
+// open; the least recently used one that nobody holds is closed to make
+// room.
+// All functions are thread-safe.
+
+struct fdcache;
+
+// Cache for the files below dirs, which must outlive it. NULL if memory
+// runs out.
+struct fdcache *fdcache_open(struct dircache *dirs, size_t max);
+
+// Open file at path, a relative path as sanitize_path() makes it, with its
+// stat into *st; *hit tells whether it came from the cache. Returns an fd
+// to read with pread() or sendfile() (never through its file offset) until
+// fdcache_put(), or -1 (errno set: EISDIR or EINVAL if it is not a regular
+// file, ELOOP if it is a symlink).
+int fdcache_get(struct fdcache *fc, const char *path, struct stat *st, bool *hit);
+
+// Done with an fd from fdcache_get()
+void fdcache_put(struct fdcache *fc, int fd);
+
+// The file at path is being replaced: the next fdcache_get() opens it again.
+// Holders of the old fd keep reading the old file.
+void fdcache_forget(struct fdcache *fc, const char *path);
+
+// Close everything. No fd from fdcache_get() may be in use.
+void fdcache_close(struct fdcache *fc);
+
+#endif // LANDROP_FDCACHE_H
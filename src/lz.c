@@ -0,0 +1,190 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// LZ4 block format: a sequence is
+//   [token: literal length (high nibble), match length - 4 (low nibble)]
+//   [more literal length bytes if the nibble is 15, each 255 means "more"]
+//   [literals] [le16 match offset] [more match length bytes, same scheme]
+// The last sequence has literals only. Matches are at least 4 bytes, the
+// last 5 bytes are always literals and no match starts in the last 12.
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define HASH_LOG 12
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Number of equal bytes at p and ref, p stopping before limit
+static inline size_t lz_match_len(const unsigned char *p, const unsigned char *ref, const unsigned char *limit) {
+    const unsigned char *start = p;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (limit - p >= 8) {
+        uint64_t a, b;
+        memcpy(&a, p, 8);
+        memcpy(&b, ref, 8);
+        if (a != b)
+            return (size_t)(p - start) + (size_t)(__builtin_ctzll(a ^ b) >> 3);
+        p += 8;
+        ref += 8;
+    }
+#endif
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return (size_t)(p - start);
+}
+
+// Length field continuation: 255, 255, ..., remainder
+static unsigned char *put_len(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Emit a sequence; match_len == 0 means the final literals-only one.
+// Returns the new output position, or NULL if it would overflow oend.
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit, size_t lit_len,
+                              size_t offset, size_t match_len) {
+    if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1)
+        return NULL;
+    unsigned char *token = op++;
+    size_t ml = match_len ? match_len - MIN_MATCH : 0;
+    *token = (unsigned char)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+        op = put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+    if (ml >= 15)
+        op = put_len(op, ml - 15);
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+    size_t anchor = 0;
+    if (n > LZ_MAX_INPUT)
+        return 0;
+
+    if (n > MF_LIMIT) {
+        uint16_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof(table));
+        size_t mflimit = n - MF_LIMIT;
+        size_t matchlimit = n - LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < mflimit) {
+            uint32_t seq = read32(in + ip);
+            uint32_t h = lz_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint16_t)ip;
+            if (ref >= ip || read32(in + ref) != seq) {
+                // The longer nothing matches, the bigger the steps: data
+                // that does not compress costs little time
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t len = lz_match_len(in + ip + MIN_MATCH, in + ref + MIN_MATCH, in + matchlimit) + MIN_MATCH;
+            op = put_seq(op, oend, in + anchor, ip - anchor, ip - ref, len);
+            if (!op)
+                return 0;
+            ip += len;
+            anchor = ip;
+            if (ip - 2 < mflimit)
+                table[lz_hash(read32(in + ip - 2))] = (uint16_t)(ip - 2);
+        }
+    }
+    op = put_seq(op, oend, in + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+// Read a length continuation; returns -1 if it runs past the input
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t n, void *dst, size_t want) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + n;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned char *op = out;
+    unsigned char *oend = out + want;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(&ip, iend, &lit) < 0)
+            return -1;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+            return -1;
+        // Short runs are the common case: one fixed-size copy when both
+        // buffers have the room, trimmed by advancing only lit
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break; // last sequence
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && get_len(&ip, iend, &len) < 0)
+            return -1;
+        len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < len)
+            return -1;
+        const unsigned char *ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= len + 8) {
+            // 8 bytes at a time, overshooting into space written later
+            unsigned char *end = op + len;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < end);
+            op = end;
+        } else if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            while (len--)
+                *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
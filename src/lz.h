@@ -0,0 +1,24 @@
+#ifndef LANDROP_LZ_H
+#define LANDROP_LZ_H
+
+#include <stddef.h>
+
+// Fast LZ77 block codec producing the LZ4 block format, so the output can
+// also be read with liblz4's LZ4_decompress_safe(). Built for speed over
+// ratio: one greedy pass, no entropy coding.
+
+// Largest input lz_compress() accepts (offsets and the match table are 16 bit)
+#define LZ_MAX_INPUT 65536
+
+// Worst case compressed size of n input bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress n bytes (n <= LZ_MAX_INPUT) of src into dst. Returns the
+// compressed size, or 0 if it would not fit in cap bytes.
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Decompress a block that must expand to exactly want bytes. Returns 0, or
+// -1 if the block is malformed or has a different size.
+int lz_decompress(const void *src, size_t n, void *dst, size_t want);
+
+#endif // LANDROP_LZ_H
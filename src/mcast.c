@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include "mcast.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// The socket buffer is what absorbs a burst while the receiver is busy
+// writing; anything beyond it is lost and costs a NACK round trip
+#define MCAST_RCVBUF (8 * 1024 * 1024)
+
+int mcast_parse(const char *spec, struct sockaddr_in *addr) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || (size_t)(colon - spec) >= sizeof(host))
+        return -1;
+    memcpy(host, spec, (size_t)(colon - spec));
+    host[colon - spec] = '\0';
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) != 1 || !IN_MULTICAST(ntohl(addr->sin_addr.s_addr)))
+        return -1;
+    return 0;
+}
+
+int mcast_parse_if(const char *s, struct in_addr *ifaddr) {
+    return inet_pton(AF_INET, s, ifaddr) == 1 ? 0 : -1;
+}
+
+int mcast_open_rx(const struct sockaddr_in *group, struct in_addr ifaddr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int yes = 1, buf = MCAST_RCVBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+        perror("setsockopt REUSEADDR");
+    // Above rmem_max where the process may, and rmem_max otherwise
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf, sizeof(buf)) < 0)
+        (void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    // Bound to the group, so that other groups on the port stay out
+    if (bind(fd, (const struct sockaddr *)group, sizeof(*group)) < 0) {
+        perror("bind multicast");
+        close(fd);
+        return -1;
+    }
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group->sin_addr;
+    mreq.imr_interface = ifaddr;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("join multicast group");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int mcast_open_tx(struct in_addr ifaddr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (ifaddr.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0) {
+        perror("setsockopt IP_MULTICAST_IF");
+        close(fd);
+        return -1;
+    }
+    // Receivers on this host get the stream too
+    unsigned char loop = 1;
+    (void)setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    return fd;
+}
+
+void mcast_put_hdr(unsigned char *p, unsigned char type, uint32_t session) {
+    memcpy(p, MCAST_MAGIC, 4);
+    p[4] = type;
+    put_be32(p + 5, session);
+}
@@ -0,0 +1,63 @@
+#ifndef LANDROP_MCAST_H
+#define LANDROP_MCAST_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Multicast fan-out (landrop -M, landropd -M): one sender streams a file
+// to a UDP group and every landropd that joined it stores a copy. Every
+// datagram starts with [4 bytes "LFTM"] [1 byte type] [be32 session id];
+// the sender picks a random session id per file.
+// Sender to the group:
+//   MCAST_MSG_META: [be64 filesize] [1 byte flags] [be32 crc32c of the file]
+//                   [be16 filename_len] [filename bytes]
+//     Names the file. Sent before the data, again every MCAST_META_EVERY
+//     blocks for receivers that missed it, and once the data is all out
+//     with MCAST_F_END and the checksum set, repeated until the receivers
+//     have reported.
+//   MCAST_MSG_DATA: [be32 block] [MCAST_BLOCK bytes of content, the last
+//                   block shorter] at offset block * MCAST_BLOCK
+// Receiver to the sender's address, from a socket of its own:
+//   MCAST_MSG_NACK: [be16 count] [count x (be32 first block, be32 blocks)]
+//     Blocks it is missing. The sender sends them to the group again.
+//   MCAST_MSG_STATUS: [1 byte status], the LANDROP_ST_* of an LFT1/LFT2
+//     upload, in answer to every MCAST_F_END meta once the file is stored
+//     or refused.
+#define MCAST_MAGIC "LFTM"
+#define MCAST_HDR_LEN 9
+#define MCAST_MSG_META   0x01
+#define MCAST_MSG_DATA   0x02
+#define MCAST_MSG_NACK   0x03
+#define MCAST_MSG_STATUS 0x04
+#define MCAST_F_END 0x01
+#define MCAST_META_LEN (MCAST_HDR_LEN + 8 + 1 + 4 + 2)
+
+// Payload per datagram: with the headers it stays within a 1500 byte MTU
+#define MCAST_BLOCK 1400
+#define MCAST_DATA_LEN (MCAST_HDR_LEN + 4)
+// Largest datagram either side sends
+#define MCAST_DGRAM_MAX 1500
+#define MCAST_NACK_MAX ((MCAST_DGRAM_MAX - MCAST_HDR_LEN - 2) / 8)
+#define MCAST_META_EVERY 1024
+
+// "group:port" into addr. Returns 0, or -1 if it is not an IPv4 multicast
+// address and a port.
+int mcast_parse(const char *spec, struct sockaddr_in *addr);
+
+// Interface address for --mcast-if (INADDR_ANY: the kernel's choice).
+// Returns 0 or -1.
+int mcast_parse_if(const char *s, struct in_addr *ifaddr);
+
+// Socket that receives the group's datagrams on its port, shared with
+// other receivers on this host. Returns the fd or -1.
+int mcast_open_rx(const struct sockaddr_in *group, struct in_addr ifaddr);
+
+// Socket that sends to the group through ifaddr; its own unicast address
+// is where the receivers answer. Returns the fd or -1.
+int mcast_open_tx(struct in_addr ifaddr);
+
+// Header of a datagram into p
+void mcast_put_hdr(unsigned char *p, unsigned char type, uint32_t session);
+
+#endif // LANDROP_MCAST_H
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include "reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+struct reader {
+    int fd;
+    uint64_t pos, end;          // next offset the thread reads, end of the range
+    size_t bufsz;
+    int nbufs;
+    unsigned char *mem;         // nbufs buffers back to back
+    size_t *len;
+    int head;                   // the consumer's next buffer
+    int filled;                 // buffers ready for the consumer
+    int err;                    // errno of a failed read
+    bool eof;                   // the thread has read the whole range
+    bool stop;
+    bool threaded;              // the thread was started (not for an empty range)
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_t thread;
+};
+
+static void *reader_main(void *arg) {
+    struct reader *r = (struct reader *)arg;
+    (void)posix_fadvise(r->fd, (off_t)r->pos, (off_t)(r->end - r->pos), POSIX_FADV_SEQUENTIAL);
+    uint64_t hinted = r->pos;
+    int tail = 0;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->filled == r->nbufs && !r->stop)
+            pthread_cond_wait(&r->cv, &r->lock);
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop)
+            break;
+        size_t n = r->end - r->pos > r->bufsz ? r->bufsz : (size_t)(r->end - r->pos);
+        // Keep READER_AHEAD requested beyond what we are about to read, in
+        // steps of at least a buffer so the hints stay cheap
+        uint64_t want = r->pos + READER_AHEAD < r->end ? r->pos + READER_AHEAD : r->end;
+        if (want >= hinted + r->bufsz || (want == r->end && hinted < want)) {
+            (void)posix_fadvise(r->fd, (off_t)hinted, (off_t)(want - hinted), POSIX_FADV_WILLNEED);
+            hinted = want;
+        }
+        unsigned char *buf = r->mem + (size_t)tail * r->bufsz;
+        int rc = pread_full(r->fd, buf, n, (int64_t)r->pos);
+        int e = errno;
+        pthread_mutex_lock(&r->lock);
+        if (rc < 0) {
+            r->err = e;
+        } else {
+            r->len[tail] = n;
+            r->filled++;
+            r->pos += n;
+            r->eof = r->pos == r->end;
+        }
+        pthread_cond_broadcast(&r->cv);
+        pthread_mutex_unlock(&r->lock);
+        if (rc < 0 || r->pos == r->end)
+            break;
+        tail = (tail + 1) % r->nbufs;
+    }
+    return NULL;
+}
+
+struct reader *reader_start(int fd, uint64_t start, uint64_t len, size_t bufsz, int nbufs) {
+    struct reader *r = (struct reader *)calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->fd = fd;
+    r->pos = start;
+    r->end = start + len;
+    r->bufsz = bufsz;
+    r->nbufs = nbufs;
+    r->mem = (unsigned char *)malloc(bufsz * (size_t)nbufs);
+    r->len = (size_t *)calloc((size_t)nbufs, sizeof(size_t));
+    r->eof = len == 0;
+    if (!r->mem || !r->len) {
+        free(r->mem);
+        free(r->len);
+        free(r);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cv, NULL);
+    int rc = len ? pthread_create(&r->thread, NULL, reader_main, r) : 0;
+    if (rc != 0) {
+        pthread_cond_destroy(&r->cv);
+        pthread_mutex_destroy(&r->lock);
+        free(r->mem);
+        free(r->len);
+        free(r);
+        errno = rc;
+        return NULL;
+    }
+    r->threaded = len > 0;
+    return r;
+}
+
+ssize_t reader_next(struct reader *r, const unsigned char **p) {
+    pthread_mutex_lock(&r->lock);
+    while (r->filled == 0 && !r->eof && !r->err)
+        pthread_cond_wait(&r->cv, &r->lock);
+    ssize_t n;
+    if (r->filled > 0) {
+        *p = r->mem + (size_t)r->head * r->bufsz;
+        n = (ssize_t)r->len[r->head];
+    } else if (r->err) {
+        errno = r->err;
+        n = -1;
+    } else {
+        n = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+void reader_release(struct reader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % r->nbufs;
+    r->filled--;
+    pthread_cond_broadcast(&r->cv);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void reader_stop(struct reader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cv);
+    pthread_mutex_unlock(&r->lock);
+    if (r->threaded)
+        pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->cv);
+    pthread_mutex_destroy(&r->lock);
+    free(r->mem);
+    free(r->len);
+    free(r);
+}
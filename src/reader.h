@@ -0,0 +1,35 @@
+#ifndef LANDROP_READER_H
+#define LANDROP_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Read-ahead pipeline: a thread reads a range of a file into a ring of
+// buffers while the caller sends (hashes, compresses) the ones already
+// filled, so disk and network are busy at the same time. The thread also
+// tells the kernel the access is sequential and asks for data a few
+// megabytes beyond the ring, to keep the device queue full.
+
+struct reader;
+
+// Read len bytes of fd from start through nbufs buffers of bufsz bytes.
+// Returns NULL (errno set) if the thread or its buffers cannot be had.
+struct reader *reader_start(int fd, uint64_t start, uint64_t len, size_t bufsz, int nbufs);
+
+// The next buffer in file order: its length, with *p pointing at it. 0 at
+// the end of the range, -1 on a read error (errno set; ENODATA if the file
+// ended early). The buffer stays valid until reader_release().
+ssize_t reader_next(struct reader *r, const unsigned char **p);
+
+// Give the buffer of the last reader_next() back for refilling
+void reader_release(struct reader *r);
+
+// Stop the thread, wherever it is, and free everything
+void reader_stop(struct reader *r);
+
+// How far beyond the current position reads are requested in advance
+// (POSIX_FADV_WILLNEED), by the thread and by sendfile() senders alike
+#define READER_AHEAD (8 * 1024 * 1024)
+
+#endif // LANDROP_READER_H
@@ -1,226 +1,4500 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <time.h>
 
 #include "common.h"
+#include "crc32c.h"
+#include "dedup.h"
+#include "delta.h"
+#include "dircache.h"
+#include "fdcache.h"
+#include "lz.h"
+#include "mcast.h"
+#include "shape.h"
+#include "stats.h"
+#include "tls.h"
+#include "tune.h"
+#include "uring.h"
+
+// Default and smallest size of the worker's copy buffer (--chunk)
+#define BUF_SZ (64 * 1024)
+#define BUF_SZ_MAX (16 * 1024 * 1024)
+_Static_assert(BUF_SZ >= LFT2_ZCHUNK, "a decompressed chunk must fit the worker buffer");
+#define MAX_EVENTS 64
+#define MAX_WORKERS 64
+// Body bytes moved per readiness event before yielding to the other
+// connections of the same worker (epoll is level-triggered, so we get
+// called again for whatever is left in the socket).
+#define BODY_BUDGET (16 * BUF_SZ)
+// Same for content copied from files already here (old blocks of a delta,
+// known chunks of a dedup transfer), which needs no socket input at all
+#define LOCAL_COPY_BUDGET (32 * 1024 * 1024)
+
+// Chunk index of -X, in the destination directory. Uploads by that name are
+// refused so nobody can overwrite it.
+#define DEDUP_INDEX ".landrop-dedup"
+// Files one dedup transfer may take chunks from; chunks held in any others
+// are sent again
+#define DEDUP_MAX_SOURCES 64
+// Seconds between saves of a changed index (it is also saved on exit)
+#define DEDUP_SAVE_INTERVAL 30
+// Directories below the destination kept open (dircache.h)
+#define DIR_CACHE 256
+// Files kept open for downloads (-G, fdcache.h)
+#define FILE_CACHE 256
+
+// io_uring engine (-U): large plain bodies are received through registered
+// buffers and fixed files, each connection in one of URING_SLOTS slots with
+// a buffer of its own. A body goes in rounds: one submission queues a chain
+// of URING_CHAIN linked recv -> write pairs, the link keeping the receives
+// in order, and only the chain's last write posts a completion unless
+// something fails (IOSQE_CQE_SKIP_SUCCESS). So a submission and a wakeup
+// move URING_CHAIN * URING_BUF bytes, and the submissions of every
+// connection with a round to start go to the kernel together. Bodies
+// without a free slot use the epoll loop as before.
+#define URING_SLOTS 16
+#define URING_CHAIN 4
+#define URING_BUF (256 * 1024)
+#define URING_MIN_BODY (512 * 1024)
+#define URING_ENTRIES 256
+// user_data: the conn pointer with the operation's place in the chain below it
+#define UTAG(c, i) ((uint64_t)(uintptr_t)(c) | (uint64_t)(i))
+_Static_assert(2 * URING_CHAIN <= 8, "chain position must fit below the conn pointer's alignment");
+_Static_assert(2 * URING_CHAIN * URING_SLOTS <= URING_ENTRIES, "every slot must be able to queue a chain");
+
+// O_DIRECT writes (-I) for plain files of at least DIRECT_MIN_SIZE: content
+// is gathered in an aligned DIRECT_BUF buffer and written a buffer at a
+// time, so every write is aligned; the tail goes through the page cache.
+// Each worker keeps up to DIRECT_POOL spare buffers.
+#define DIRECT_MIN_SIZE (16 * 1024 * 1024)
+#define DIRECT_BUF (1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define DIRECT_POOL 8
 
 static volatile sig_atomic_t g_stop = 0;
-static void on_sigint(int sig) { 
-    (void)sig; 
-    g_stop = 1; 
+static void on_sigint(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> -d <dest_dir> [-o] [-w <workers>] [-C] [-U] [-I] [-X] [-G] [-q] [-S <stats_file>]\n"
+                    "          [-R <host:port>] [-M <group:port> [--mcast-if <addr>]] [--rcvbuf <bytes>] [--chunk <bytes>]\n"
+                    "          [--rate <bytes/s>] [--rate-conn <bytes/s>] [--rate-ip <bytes/s>]\n"
+                    "          [--tls-cert <pem> --tls-key <pem> [--tls-ca <pem>] | --psk <keyfile>]\n", prog);
+    fprintf(stderr, "  -p: TCP port to listen on\n");
+    fprintf(stderr, "  -d: destination directory to save files\n");
+    fprintf(stderr, "  -o: overwrite existing files (default: fail if exists)\n");
+    fprintf(stderr, "  -w: worker threads, each with its own epoll set (default: 1)\n");
+    fprintf(stderr, "  -C: receive through a userspace buffer instead of splice(2)\n");
+    fprintf(stderr, "  -U: receive large files through io_uring (falls back if the kernel lacks it)\n");
+    fprintf(stderr, "  -I: write large files with O_DIRECT, bypassing the page cache\n");
+    fprintf(stderr, "  -X: index received chunks so clients with -X skip content already here\n");
+    fprintf(stderr, "  -G: also serve the files under dest_dir to landrop get\n");
+    fprintf(stderr, "  -R: relay: pass every upload on to the landropd at host:port while storing it\n");
+    fprintf(stderr, "  -M: also take files sent to this multicast group (landrop -M), joined on --mcast-if\n");
+    fprintf(stderr, "  -q: no progress line\n");
+    fprintf(stderr, "  -S: write counters and latency histograms to this file every second (Prometheus text)\n");
+    fprintf(stderr, "  --rcvbuf: socket receive buffer (default: kernel autotuning); sizes take k/M/G\n");
+    fprintf(stderr, "  --chunk: copy buffer per read when not splicing (default: 64k, up to 16M)\n");
+    fprintf(stderr, "  --rate: receive at most this many bytes per second in total (k/M/G)\n");
+    fprintf(stderr, "  --rate-conn: the same for each connection\n");
+    fprintf(stderr, "  --rate-ip: the same for each client address, over all its connections\n");
+    fprintf(stderr, "  --tls-cert, --tls-key: accept only TLS 1.3 clients (landrop --tls), with this certificate\n");
+    fprintf(stderr, "  --tls-ca: and only clients with a certificate from these CAs\n");
+    fprintf(stderr, "  --psk: accept only TLS clients holding the same key (at least 16 bytes) instead\n");
+}
+
+struct server_cfg {
+    const char *dest_dir;
+    bool overwrite;
+    bool use_splice;
+    bool use_uring;
+    bool direct;
+    bool dedup;
+    bool serve;             // -G: answer get frames
+    bool quiet;
+    const char *stats_path;
+    const char *relay;      // next hop, "host:port"
+    bool mcast;             // -M: g_mcast_group is joined
+    int nworkers;
+    size_t chunk;           // worker copy buffer
+    struct sock_tune tune;  // applied to the listening socket, inherited by clients
+    uint64_t rate, rate_conn, rate_ip;  // bytes per second, 0: unlimited
+};
+
+static struct server_cfg g_cfg;
+static struct dedup_index *g_dedup;     // with -X
+static struct dircache *g_dirs;         // directories under dest_dir
+static struct fdcache *g_files;         // files served to downloads, with -G
+static struct tls_ctx *g_tls;           // with --tls-cert or --psk
+static struct sockaddr_storage g_relay_addr;    // with -R
+static socklen_t g_relay_addrlen;
+
+// Rate limits (--rate, --rate-conn, --rate-ip): every read from a client
+// draws on the global bucket, the one of its address and its own. While
+// any limit is set, the connections of a worker also read in turns of
+// g_quantum bytes (conn_allow()).
+static bool g_shaping;
+static size_t g_quantum;
+static struct bucket g_rate;
+static uint64_t g_shape_limit;          // the lowest limit, what one upload gets at most
+
+// Bucket of one client address, shared by its connections on every worker
+struct ip_rate {
+    struct ip_rate *next;
+    struct in_addr addr;
+    int refs;
+    struct bucket b;
+};
+static pthread_mutex_t g_ip_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ip_rate *g_ip_rates;      // looked up once per connection
+
+// Number of connections currently receiving a body. The progress bar is only
+// drawn while a single transfer is running; with several at once the lines
+// would just overwrite each other.
+static atomic_int g_active;
+
+// Per-connection protocol state. Each state names what we are waiting for.
+enum conn_state {
+    CS_TLS,         // TLS handshake (--tls-cert, --psk)
+    CS_MAGIC,       // protocol magic: LFT1 or LFT2
+    CS_HEADER,      // LFT1: filesize and name length
+    CS_HELLO,       // LFT2: requested feature bits
+    CS_FRAME,       // LFT2: type byte of the next frame
+    CS_FILE_HDR,    // LFT2 file frame: filesize and name length
+    CS_STRIPE_HDR,  // LFT2 stripe frame: transfer id, sizes, range, name length
+    CS_QUERY_HDR,   // LFT2 resume query: filesize, mtime, name length
+    CS_RFILE_HDR,   // LFT2 resumable file: filesize, mtime, offset, name length
+    CS_DELTA_HDR,   // LFT2 signature request or delta frame: filesize, (block size,) name length
+    CS_BATCH_HDR,   // LFT2 batch: file count, index and data lengths
+    CS_BATCH_INDEX, // LFT2 batch: sizes and names of the files
+    CS_PROBE_HDR,   // LFT2 probe: length of the filler
+    CS_CHUNKS_HDR,  // LFT2 chunk list or dedup frame: filesize, chunk count, name length
+    CS_CHUNK_LIST,  // LFT2 chunk list: hashes, lengths and CRCs
+    CS_MANIFEST_HDR, // LFT2 manifest: entry count, length, flags
+    CS_MANIFEST,    // LFT2 manifest: the entries
+    CS_GET_HDR,     // LFT2 get: offset, length, name length
+    CS_NAME,        // filename bytes
+    CS_BODY,        // file content
+    CS_TRAILER,     // LFT2 checksum trailer after the content
+    CS_DISCARD,     // LFT2: content of a file we rejected, read and dropped
+    CS_SEND,        // LFT2 get: the range asked for, to the client
+    CS_DELTA_OP,    // LFT2 delta: type byte of the next op
+    CS_DELTA_ARG,   // LFT2 delta: arguments of the op
+    CS_DELTA_LIT,   // LFT2 delta: literal bytes
+    CS_DEDUP_NEXT,  // LFT2 dedup: on to the next chunk (no input needed)
+    CS_DEDUP_LIT,   // LFT2 dedup: content of a chunk we lacked
+    CS_LOCAL_COPY,  // delta blocks copied from the old file
+    CS_DEDUP_COPY,  // LFT2 dedup: chunks we hold, read, checked and written
+    CS_STRIPE_WAIT, // stripe stored, waiting for the other stripes of the file
+    CS_OFFLOAD,     // blocking work running on a helper thread, fd not polled
+    CS_URING,       // body being received by the worker's io_uring ring
+    CS_CLOSING,     // flush queued replies, then close
+};
+
+// Bytes queued for the client (status byte, hello, acks)
+struct outbuf {
+    unsigned char *data;
+    size_t len;
+    size_t off;
+    size_t cap;
+};
+
+// Relay (-R): every connection gets its own connection to the next hop.
+// Whatever the client sends is passed on as it is read, and the client
+// only sees a reply once the next hop has sent its own for the same file.
+struct relay {
+    int fd;                 // -1 once closed
+    bool connecting;
+    bool eof;               // the next hop closed its side
+    bool dead;              // lost: its files fail with LANDROP_ST_IO
+    bool hello;             // LFT2 hellos merged, acks follow
+    uint32_t events;        // epoll interest of fd
+    struct outbuf out;      // client bytes the next hop has not taken yet
+    struct outbuf mine;     // our replies waiting for the next hop's
+    struct outbuf theirs;   // and the other way round
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    int proto;              // 1 or 2 once the magic is known
+    uint32_t features;      // LFT2 features accepted in the hello
+    uint32_t seq;           // LFT2: number of the current file frame
+    unsigned char hdr[64];
+    unsigned char frame;    // LFT2 frame type being received
+    char name[4096 + 1];
+    size_t have;            // bytes of the current header field received so far
+    uint16_t namelen;
+    uint64_t filesize;
+    uint64_t bodylen;       // body bytes announced for this frame
+    uint64_t left;          // body bytes still expected
+    int out_fd;             // destination file while in CS_BODY, else -1
+    char sname[4096];       // path below dest_dir, as sanitize_path() made it
+    char path[8192];        // its last component, the file's name in dfd
+    int dfd;                // directory of path (and part) from g_dirs, -1 if none
+    unsigned char status;   // status of the file being discarded
+    bool active;            // counted in g_active
+    bool splice;            // body goes socket -> pipe -> file
+    bool csum;              // body is followed by a CRC-32C trailer
+    uint32_t crc;           // CRC-32C of the body so far
+    bool zip;               // body arrives as LFT2_F_COMPRESS chunks
+    bool zpayload;          // chunk header read, payload next
+    uint32_t zlen;          // payload length of the current chunk
+    unsigned char *zbuf;    // chunk header + payload, allocated on first use
+    unsigned char *dbuf;    // O_DIRECT staging buffer from the worker pool
+    size_t dlen;            // bytes in dbuf not written yet
+    uint64_t wire;          // chunk bytes received for this body
+    uint64_t pdone, pwire;  // body and wire bytes already counted in the stats
+    uint32_t events;        // current epoll interest
+    struct outbuf out;
+    struct relay *relay;    // with -R
+    struct tls_conn *tls;   // with g_tls
+    double t0;
+    struct worker *owner;
+    // Striped transfers: out_fd is borrowed from xfer and written at woff
+    struct xfer *xfer;
+    uint64_t xfer_id;
+    bool joined;                // the stripe got into its transfer, which counts the file
+    uint16_t nstripes;
+    loff_t woff;
+    struct conn *wait_next;     // xfer->waiters
+    struct conn *note_next;     // owner's mailbox
+    unsigned char note_status;
+    bool noted;
+    // Blocking work handed to a helper thread (CS_OFFLOAD)
+    void (*offload_fn)(struct conn *c);
+    int (*offload_done)(struct conn *c);
+    bool offloaded;
+    // Resumable uploads: body goes to part and is renamed into path at the end
+    bool resumable;
+    uint64_t mtime_ns;
+    uint64_t roff;              // offset the body starts at
+    char part[8192];            // name in dfd
+    uint64_t offer_have;
+    uint32_t offer_crc;
+    // Delta transfers: the old file, kept from the signature request until
+    // the delta frame that follows it
+    struct delta_base *base;
+    uint32_t dblock;            // block size announced in the delta frame
+    unsigned char dop;          // op being read
+    int copy_fd;                // CS_LOCAL_COPY source
+    uint64_t copy_off, copy_left;
+    uint64_t dlit;              // literal bytes of this delta
+    bool yielded;               // queued on our own mailbox to carry on copying
+    // Dedup transfers: the chunk list, kept from the chunks frame until the
+    // dedup frame that follows it
+    struct dedup_plan *plan;
+    uint32_t dcount;            // chunks announced in the frame
+    uint32_t dchunk;            // next chunk to place
+    uint32_t dcopy_end;         // CS_DEDUP_COPY: chunks dchunk..dcopy_end - 1
+    uint64_t dreused;           // bytes taken from files here
+    // Batches: index and content are collected in the arena, which is kept
+    // for the next batch, and written out once complete
+    bool batch;
+    uint32_t bcount;
+    uint32_t blen_index;
+    unsigned char *arena;
+    size_t arena_cap;
+    size_t arena_len;
+    // Sync: the last manifest, what we answered and which files may replace
+    // what is here (the arena holds the entries until they are scanned)
+    struct sync_list *sync;
+    // Downloads: the file served (from g_files) and what is left of the
+    // range, which starts out as the one asked for
+    int src_fd;                 // -1 if none
+    uint64_t src_off, src_left;
+    // io_uring body (CS_URING)
+    unsigned uslot;
+    unsigned uops;              // operations in the current chain
+    unsigned uinflight;         // of those, not completed yet (all or none)
+    uint64_t uchain_len;        // body bytes the chain moves
+    uint32_t ulast;             // length of its last write
+    uint64_t urecv_left;        // body bytes not asked for yet
+    uint64_t uoff;              // file offset of the next receive
+    int uerr;                   // errno of the first failure
+    bool utouched;
+    struct conn *unext;
+    // Rate limits
+    struct bucket rate;         // --rate-conn
+    struct ip_rate *ip;         // --rate-ip
+    size_t turn;                // bytes left of the current turn
+    bool queued;                // waiting in the worker's queue for the next one
+    bool hup;                   // the peer is gone: reads no longer wait
+    uint64_t wake;              // not before then (shape_now())
+    uint64_t qsince;
+    struct conn *qnext;
+    struct conn *prev, *next;
+};
+
+// Old copy of a file being updated by delta: its signatures go to the
+// client, the per-block CRCs stay here to check the rebuilt file
+struct delta_base {
+    int fd;                     // -1 if there is nothing usable to delta against
+    uint32_t block;
+    uint64_t count;             // full blocks; a short tail is never matched
+    unsigned char *sigs;        // freed once sent
+    uint32_t *crcs;
+    struct crc32c_shift shift;  // CRC-32C combine over one block
+    mode_t mode;                // permissions the rebuilt file takes over
+    char sname[4096];
+};
+
+// A file announced by a chunks frame: its chunk list, where each chunk is
+// here and the files they will be copied from
+struct dedup_plan {
+    uint64_t filesize;
+    uint32_t count;
+    unsigned char *list;        // count x LFT2_CHUNK_ENTRY_LEN, as received
+    struct dedup_loc *locs;
+    int8_t *src;                // index into srcfd, -1 if the chunk must be sent
+    unsigned char *bits;        // the LFT2_MSG_HAVE bitmap
+    uint32_t have;
+    int nsrc;
+    uint32_t srcid[DEDUP_MAX_SOURCES];
+    int srcfd[DEDUP_MAX_SOURCES];
+    char sname[4096];
+};
+
+// Files of a manifest the client is going to send, by name: the mtime to
+// give each once stored, and whether it may replace what is there now
+struct sync_want {
+    char *sname;                // NULL: free slot
+    uint64_t mtime_ns;
+    bool replace;
+};
+
+struct sync_list {
+    uint32_t count;             // manifest entries
+    uint32_t len;
+    unsigned char flags;
+    bool bad;                   // entries did not decode
+    uint32_t fresh;             // of them up to date
+    unsigned char *bits;        // the LFT2_MSG_HAVE bitmap: set if up to date
+    uint32_t mask;
+    struct sync_want *want;     // open addressing on crc32c of the name
+};
+
+// One file delivered as byte ranges over several connections, which may
+// live on different workers. The connection that stores the last stripe
+// closes the file and wakes the others through their workers' mailboxes,
+// so every stripe is acknowledged only once the whole file is there.
+struct xfer {
+    uint64_t id;
+    uint64_t filesize;
+    uint16_t nstripes;
+    uint16_t ended;             // stripes finished, successfully or not
+    uint16_t receiving;         // stripes attached and still in their body
+    uint64_t bytes;             // bytes of the stripes that arrived intact
+    bool failed;
+    unsigned char fail_status;  // status reported when failed, LANDROP_ST_IO if 0
+    bool finalized;
+    int fd;
+    int refs;                   // connections pointing at this transfer
+    double last_activity;
+    char sname[4096];
+    char path[8192];            // name in dfd
+    int dfd;                    // held from g_dirs until finalized
+    struct conn *waiters;
+    struct xfer *next;
+};
+
+// Transfers with stripes missing and nothing arriving are given up after this
+#define XFER_TIMEOUT 60.0
+
+static pthread_mutex_t g_xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xfer *g_xfers;
+
+// LFT2 feature bits this server can accept
+#define LFT2_SERVER_FEATURES \
+    (LFT2_F_STRIPE | LFT2_F_RESUME | LFT2_F_CHECKSUM | LFT2_F_COMPRESS | LFT2_F_DELTA | LFT2_F_BATCH | \
+     LFT2_F_PROBE | LFT2_F_DEDUP | LFT2_F_SYNC | LFT2_F_PULL)
+
+// Stop reading from a client that does not collect its acks
+#define OUT_HIGH (256 * 1024)
+
+// Or while this much of its data waits for the next hop (-R)
+#define RELAY_HIGH (4 * 1024 * 1024)
+// Features a relay passes on: frames answered by plain acks. Offers,
+// signatures and chunk bitmaps describe what this node holds, which says
+// nothing about the nodes behind it.
+#define LFT2_RELAY_FEATURES (LFT2_F_STRIPE | LFT2_F_CHECKSUM | LFT2_F_COMPRESS | LFT2_F_BATCH | LFT2_F_PROBE)
+// epoll data.ptr of a connection's socket to the next hop: the conn
+// pointer with the low bit set
+#define RELAY_TAG(c) ((void *)((uintptr_t)(c) | 1))
+
+struct worker {
+    int id;
+    int epfd;
+    int lfd;
+    pthread_t thread;
+    char *buf;              // scratch for body chunks, shared by the worker's connections
+    int pipe[2];            // splice staging pipe, always empty between calls
+    size_t pipe_sz;
+    int evfd;               // wakes the worker when its mailbox has entries
+    pthread_mutex_t mbox_lock;
+    struct conn *mbox;      // connections other threads have finished waiting for
+    int offloads;           // connections in CS_OFFLOAD
+    // io_uring engine, when -U is given and the kernel has it
+    bool uring;
+    struct uring ring;
+    int ring_evfd;          // signalled on completions, in the epoll set
+    unsigned char *ubufs;   // URING_SLOTS registered buffers, one per slot
+    uint32_t uslots;        // free slots
+    unsigned char *dpool[DIRECT_POOL];  // spare O_DIRECT buffers
+    int ndpool;
+    struct stats st;
+    // Upload of the last connection here to become active, for the
+    // progress line the main thread draws (written here, read there)
+    uint64_t nactive;       // active connections of this worker
+    uint64_t prog_total, prog_done, prog_wire, prog_t0_us;
+    double last_sweep;
+    struct conn *conns;
+    // Events of the current epoll_wait() batch, for conn_close()
+    struct epoll_event *evs;
+    int nevs;
+    // Connections waiting for their next turn under the rate limits, in order
+    struct conn *qhead, *qtail;
+    unsigned qlen;
+};
+
+// epoll data.ptr of the worker's non-connection fds
+static char g_listener_tag, g_mailbox_tag, g_ring_tag;
+
+// Size we ask for the splice pipe; the kernel may cap it (pipe-max-size)
+#define PIPE_SZ (1024 * 1024)
+
+static int worker_pipe_open(struct worker *w) {
+    if (pipe2(w->pipe, O_CLOEXEC) < 0) {
+        w->pipe[0] = w->pipe[1] = -1;
+        return -1;
+    }
+    (void)fcntl(w->pipe[1], F_SETPIPE_SZ, PIPE_SZ);
+    int sz = fcntl(w->pipe[1], F_GETPIPE_SZ);
+    w->pipe_sz = sz > 0 ? (size_t)sz : BUF_SZ;
+    return 0;
+}
+
+static void worker_pipe_close(struct worker *w) {
+    if (w->pipe[0] >= 0)
+        close(w->pipe[0]);
+    if (w->pipe[1] >= 0)
+        close(w->pipe[1]);
+    w->pipe[0] = w->pipe[1] = -1;
+}
+
+// Throw away a pipe that may still hold another connection's bytes
+static void worker_pipe_reset(struct worker *w) {
+    worker_pipe_close(w);
+    if (worker_pipe_open(w) < 0)
+        perror("pipe");
+}
+
+static int ensure_dir(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        return S_ISDIR(st.st_mode) ? 0 : -1;
+    }
+    if (errno != ENOENT)
+        return -1;
+    return mkdir(path, 0755);
+}
+
+static void conn_set_active(struct conn *c, bool on) {
+    if (c->active == on)
+        return;
+    struct worker *w = c->owner;
+    c->active = on;
+    if (on) {
+        c->pdone = c->pwire = 0;
+        __atomic_store_n(&w->prog_total, c->bodylen, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->prog_done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->prog_wire, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->prog_t0_us, (uint64_t)(c->t0 * 1e6), __ATOMIC_RELAXED);
+        stat_add(&w->nactive, 1);
+        atomic_fetch_add(&g_active, 1);
+    } else {
+        stat_add(&w->nactive, (uint64_t)-1);
+        atomic_fetch_sub(&g_active, 1);
+    }
+}
+
+// Latency sampling costs two clock reads per call, so only with -S
+static inline uint64_t lat_start(void) {
+    return g_cfg.stats_path ? stats_now_ns() : 0;
+}
+
+static inline void lat_end(struct worker *w, int which, uint64_t t0) {
+    if (t0)
+        hist_add(&w->st.hist[which], stats_now_ns() - t0);
+}
+
+// Hand c back to its owning worker with a status, from any thread
+// (stripe finalization, offload helpers).
+static void mailbox_post(struct conn *c, unsigned char status) {
+    struct worker *w = c->owner;
+    pthread_mutex_lock(&w->mbox_lock);
+    c->note_status = status;
+    c->noted = true;
+    c->note_next = w->mbox;
+    w->mbox = c;
+    pthread_mutex_unlock(&w->mbox_lock);
+    uint64_t one = 1;
+    if (write(w->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+// Forget a pending notice for a connection that is going away
+static void mailbox_purge(struct worker *w, struct conn *c) {
+    pthread_mutex_lock(&w->mbox_lock);
+    if (c->noted) {
+        for (struct conn **pp = &w->mbox; *pp; pp = &(*pp)->note_next) {
+            if (*pp == c) {
+                *pp = c->note_next;
+                break;
+            }
+        }
+        c->noted = false;
+    }
+    pthread_mutex_unlock(&w->mbox_lock);
+}
+
+// Close the file and tell every waiting stripe the outcome. The file is
+// counted once, in the stats of w, the worker this runs on.
+// Returns the status. Called with g_xfer_lock held.
+static unsigned char xfer_finalize_locked(struct worker *w, struct xfer *t) {
+    unsigned char status = LANDROP_ST_OK;
+    if (t->failed || t->ended < t->nstripes || t->bytes != t->filesize)
+        status = t->fail_status ? t->fail_status : LANDROP_ST_IO;
+    if (close(t->fd) < 0) {
+        perror("close dest");
+        status = LANDROP_ST_IO;
+    }
+    t->fd = -1;
+    if (status != LANDROP_ST_OK)
+        unlinkat(t->dfd, t->path, 0);
+    else
+        fprintf(stderr, "\nReceived %s (%lu bytes, %u stripes)\n", t->sname,
+                (unsigned long)t->filesize, (unsigned)t->nstripes);
+    dircache_put(g_dirs, t->dfd);
+    t->dfd = -1;
+    t->finalized = true;
+    stat_add(status == LANDROP_ST_OK ? &w->st.files_ok : &w->st.files_failed, 1);
+    for (struct xfer **pp = &g_xfers; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+    for (struct conn *c = t->waiters; c; c = c->wait_next)
+        mailbox_post(c, status);
+    t->waiters = NULL;
+    return status;
+}
+
+// One stripe is over. Returns the transfer status if this was the last one,
+// -1 otherwise. Called with g_xfer_lock held.
+static int xfer_stripe_end_locked(struct worker *w, struct xfer *t, bool ok, uint64_t len) {
+    t->receiving--;
+    t->ended++;
+    if (ok)
+        t->bytes += len;
+    else
+        t->failed = true;
+    t->last_activity = now_sec();
+    if (t->ended < t->nstripes)
+        return -1;
+    return xfer_finalize_locked(w, t);
+}
+
+static void xfer_put_locked(struct xfer *t) {
+    if (--t->refs == 0 && t->finalized)
+        free(t);
+}
+
+// Give up on transfers whose missing stripes never showed up
+static void xfer_sweep(struct worker *w) {
+    double now = now_sec();
+    pthread_mutex_lock(&g_xfer_lock);
+    struct xfer *t = g_xfers;
+    while (t) {
+        struct xfer *next = t->next;
+        if (t->receiving == 0 && now - t->last_activity > XFER_TIMEOUT) {
+            fprintf(stderr, "Striped transfer of %s timed out (%u of %u stripes)\n",
+                    t->sname, (unsigned)t->ended, (unsigned)t->nstripes);
+            t->failed = true;
+            xfer_finalize_locked(w, t);
+            if (t->refs == 0)
+                free(t);
+        }
+        t = next;
+    }
+    pthread_mutex_unlock(&g_xfer_lock);
+}
+
+// Detach a connection from its transfer after its stripe was acknowledged
+static void conn_xfer_release(struct conn *c) {
+    pthread_mutex_lock(&g_xfer_lock);
+    xfer_put_locked(c->xfer);
+    pthread_mutex_unlock(&g_xfer_lock);
+    c->xfer = NULL;
+    c->out_fd = -1;
+}
+
+static void delta_base_free(struct delta_base *b) {
+    if (!b)
+        return;
+    if (b->fd >= 0)
+        close(b->fd);
+    free(b->sigs);
+    free(b->crcs);
+    free(b);
+}
+
+static void relay_free(struct relay *r) {
+    if (!r)
+        return;
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r->out.data);
+    free(r->mine.data);
+    free(r->theirs.data);
+    free(r);
+}
+
+static void dedup_plan_free(struct dedup_plan *p) {
+    if (!p)
+        return;
+    for (int i = 0; i < p->nsrc; ++i) {
+        if (p->srcfd[i] >= 0)
+            close(p->srcfd[i]);
+    }
+    free(p->list);
+    free(p->locs);
+    free(p->src);
+    free(p->bits);
+    free(p);
+}
+
+static void sync_list_free(struct sync_list *l) {
+    if (!l)
+        return;
+    if (l->want) {
+        for (uint32_t i = 0; i <= l->mask; ++i)
+            free(l->want[i].sname);
+    }
+    free(l->want);
+    free(l->bits);
+    free(l);
+}
+
+static struct sync_want *sync_find(const struct sync_list *l, const char *sname) {
+    if (!l || !l->want)
+        return NULL;
+    for (uint32_t i = crc32c(0, sname, strlen(sname)) & l->mask;; i = (i + 1) & l->mask) {
+        struct sync_want *e = &l->want[i];
+        if (!e->sname || strcmp(e->sname, sname) == 0)
+            return e->sname ? e : NULL;
+    }
+}
+
+// Whether the current file may replace one that exists: always with -o,
+// otherwise only if the last manifest asked for it
+static bool conn_may_replace(const struct conn *c) {
+    if (g_cfg.overwrite)
+        return true;
+    const struct sync_want *e = sync_find(c->sync, c->sname);
+    return e && e->replace;
+}
+
+static unsigned char *worker_dbuf_get(struct worker *w) {
+    if (w->ndpool > 0)
+        return w->dpool[--w->ndpool];
+    void *p = NULL;
+    if (posix_memalign(&p, DIRECT_ALIGN, DIRECT_BUF) != 0)
+        return NULL;
+    return (unsigned char *)p;
+}
+
+// Return the connection's O_DIRECT buffer to its worker's pool
+static void conn_dbuf_put(struct conn *c) {
+    if (!c->dbuf)
+        return;
+    struct worker *w = c->owner;
+    if (w->ndpool < DIRECT_POOL)
+        w->dpool[w->ndpool++] = c->dbuf;
+    else
+        free(c->dbuf);
+    c->dbuf = NULL;
+    c->dlen = 0;
+}
+
+// Bucket of a client address for --rate-ip, shared with its other
+// connections. NULL (no limit per address) if it cannot be had.
+static struct ip_rate *ip_rate_get(struct in_addr addr) {
+    if (!g_cfg.rate_ip)
+        return NULL;
+    pthread_mutex_lock(&g_ip_lock);
+    struct ip_rate *r;
+    for (r = g_ip_rates; r; r = r->next) {
+        if (r->addr.s_addr == addr.s_addr)
+            break;
+    }
+    if (!r && (r = (struct ip_rate *)calloc(1, sizeof(*r)))) {
+        r->addr = addr;
+        bucket_init(&r->b, g_cfg.rate_ip);
+        r->next = g_ip_rates;
+        g_ip_rates = r;
+    }
+    if (r)
+        r->refs++;
+    pthread_mutex_unlock(&g_ip_lock);
+    return r;
+}
+
+static void ip_rate_put(struct ip_rate *r) {
+    if (!r)
+        return;
+    pthread_mutex_lock(&g_ip_lock);
+    if (--r->refs == 0) {
+        for (struct ip_rate **pp = &g_ip_rates; *pp; pp = &(*pp)->next) {
+            if (*pp == r) {
+                *pp = r->next;
+                break;
+            }
+        }
+        free(r);
+    }
+    pthread_mutex_unlock(&g_ip_lock);
+}
+
+// Park c until its next turn, not before wake. Its socket is left out of
+// the epoll set meanwhile (conn_drive()); worker_shape_run() drives it again.
+static void shape_enqueue(struct conn *c, uint64_t wake) {
+    struct worker *w = c->owner;
+    c->queued = true;
+    c->wake = wake;
+    c->qsince = shape_now();
+    c->qnext = NULL;
+    if (w->qtail)
+        w->qtail->qnext = c;
+    else
+        w->qhead = c;
+    w->qtail = c;
+    w->qlen++;
+}
+
+static void shape_unqueue(struct conn *c) {
+    struct worker *w = c->owner;
+    if (!c->queued)
+        return;
+    struct conn *prev = NULL;
+    for (struct conn *q = w->qhead; q; prev = q, q = q->qnext) {
+        if (q != c)
+            continue;
+        if (prev)
+            prev->qnext = c->qnext;
+        else
+            w->qhead = c->qnext;
+        if (w->qtail == c)
+            w->qtail = prev;
+        w->qlen--;
+        break;
+    }
+    c->queued = false;
+}
+
+// How much of want c may read now under the rate limits, charged to its
+// buckets. Connections take turns of g_quantum bytes: one that has used
+// its turn, or that the buckets hold back, goes to the back of the queue
+// and 0 is returned. Reads smaller than what was allowed hand the rest
+// back with conn_refund().
+static size_t conn_allow(struct conn *c, size_t want) {
+    if (c->hup)
+        return want; // nothing left to pace, only to drain
+    if (c->queued)
+        return 0;
+    if (c->turn == 0) {
+        shape_enqueue(c, 0);
+        return 0;
+    }
+    if (want > c->turn)
+        want = c->turn;
+    struct bucket *b[3] = { &g_rate, c->ip ? &c->ip->b : NULL, &c->rate };
+    uint64_t now = shape_now(), wait = 0;
+    size_t n = bucket_take(b, 3, want, now, &wait);
+    if (n == 0) {
+        shape_enqueue(c, now + wait);
+        return 0;
+    }
+    c->turn -= n;
+    return n;
+}
+
+static void conn_refund(struct conn *c, size_t n) {
+    if (c->hup || n == 0)
+        return;
+    struct bucket *b[3] = { &g_rate, c->ip ? &c->ip->b : NULL, &c->rate };
+    bucket_give(b, 3, n);
+    c->turn += n;
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    if (c->state == CS_URING && c->uinflight > 0) {
+        // The ring still owns our buffer and fds: end the receive under way
+        // or the next one in the chain, which fails the rest of it, and
+        // close once everything in flight has completed
+        if (!c->uerr) {
+            c->uerr = ECONNABORTED;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    if (c->resumable && c->out_fd >= 0) {
+        // Keep what arrived under the partial name for the next attempt
+        close(c->out_fd);
+        c->out_fd = -1;
+        fprintf(stderr, "\nKeeping %lu bytes of %s for resume\n",
+                (unsigned long)(c->roff + c->bodylen - c->left), c->sname);
+    }
+    if (c->xfer) {
+        pthread_mutex_lock(&g_xfer_lock);
+        if (c->state == CS_BODY || c->state == CS_TRAILER) {
+            xfer_stripe_end_locked(w, c->xfer, false, 0);
+        } else if (c->state == CS_STRIPE_WAIT) {
+            for (struct conn **pp = &c->xfer->waiters; *pp; pp = &(*pp)->wait_next) {
+                if (*pp == c) {
+                    *pp = c->wait_next;
+                    break;
+                }
+            }
+        }
+        xfer_put_locked(c->xfer);
+        pthread_mutex_unlock(&g_xfer_lock);
+        c->xfer = NULL;
+        c->out_fd = -1;
+    }
+    mailbox_purge(w, c);
+    if (c->out_fd >= 0) {
+        // Incomplete upload: never leave a truncated file behind. A delta
+        // or dedup transfer was being assembled next to the destination,
+        // which stays as it was.
+        close(c->out_fd);
+        unlinkat(c->dfd, c->frame == LFT2_FRAME_DELTA || c->frame == LFT2_FRAME_DEDUP ? c->part : c->path, 0);
+    }
+    dircache_put(g_dirs, c->dfd);
+    if (c->src_fd >= 0)
+        fdcache_put(g_files, c->src_fd);
+    shape_unqueue(c);
+    ip_rate_put(c->ip);
+    conn_dbuf_put(c);
+    delta_base_free(c->base);
+    dedup_plan_free(c->plan);
+    sync_list_free(c->sync);
+    relay_free(c->relay);
+    tls_conn_free(c->tls);
+    conn_set_active(c, false);
+    close(c->fd);
+    free(c->out.data);
+    free(c->zbuf);
+    free(c->arena);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        w->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    stat_add(&w->st.open, (uint64_t)-1);
+    // Events for c still waiting in this batch must not reach it
+    for (int i = 0; i < w->nevs; ++i) {
+        if (w->evs[i].data.ptr == c || w->evs[i].data.ptr == RELAY_TAG(c))
+            w->evs[i].data.ptr = NULL;
+    }
+    free(c);
+}
+
+static int conn_watch(struct worker *w, struct conn *c, uint32_t events) {
+    if (c->events == events)
+        return 0;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+static size_t outbuf_pending(const struct outbuf *o) {
+    return o->len - o->off;
+}
+
+static size_t conn_pending(const struct conn *c) {
+    return outbuf_pending(&c->out);
+}
+
+static int outbuf_put(struct outbuf *o, const void *p, size_t n) {
+    if (o->off > 0 && o->off == o->len)
+        o->off = o->len = 0;
+    if (o->len + n > o->cap) {
+        if (o->off > 0) {
+            memmove(o->data, o->data + o->off, o->len - o->off);
+            o->len -= o->off;
+            o->off = 0;
+        }
+        size_t cap = o->cap ? o->cap : 256;
+        while (o->len + n > cap)
+            cap *= 2;
+        unsigned char *d = (unsigned char *)realloc(o->data, cap);
+        if (!d) {
+            perror("realloc outbuf");
+            return -1;
+        }
+        o->data = d;
+        o->cap = cap;
+    }
+    memcpy(o->data + o->len, p, n);
+    o->len += n;
+    return 0;
+}
+
+// The next hop is lost for this connection: stop passing data on. Files it
+// has not acknowledged are reported with our own status from now on (its
+// replies so far still count, e.g. an LFT1 refusal sent before it closed).
+static void relay_fail(struct relay *r, const char *what) {
+    if (r->dead)
+        return;
+    fprintf(stderr, "\nRelay to %s: %s%s%s; files of this connection are only stored here\n", g_cfg.relay, what,
+            errno ? ": " : "", errno ? strerror(errno) : "");
+    r->dead = true;
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    r->out.off = r->out.len = 0;
+}
+
+// Send as much of the queue as the next hop takes
+static void relay_flush(struct conn *c) {
+    struct relay *r = c->relay;
+    while (!r->dead && !r->connecting && r->out.off < r->out.len) {
+        ssize_t n = write(r->fd, r->out.data + r->out.off, r->out.len - r->out.off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                relay_fail(r, "send");
+            return;
+        }
+        r->out.off += (size_t)n;
+        stat_add(&c->owner->st.relayed, (uint64_t)n);
+    }
+}
+
+// Pass bytes just read from the client on to the next hop. They go straight
+// to its socket if nothing is queued before them; whatever it does not
+// take waits in the queue, and reading from the client pauses above
+// RELAY_HIGH.
+static void relay_forward(struct conn *c, const void *p, size_t n) {
+    struct relay *r = c->relay;
+    if (r->dead)
+        return;
+    if (r->eof) {
+        errno = 0;
+        relay_fail(r, "connection closed by the next hop");
+        return;
+    }
+    const unsigned char *b = (const unsigned char *)p;
+    while (n > 0 && !r->connecting && outbuf_pending(&r->out) == 0) {
+        ssize_t k = write(r->fd, b, n);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            relay_fail(r, "send");
+            return;
+        }
+        stat_add(&c->owner->st.relayed, (uint64_t)k);
+        b += k;
+        n -= (size_t)k;
+    }
+    if (n > 0 && outbuf_put(&r->out, b, n) < 0) {
+        errno = ENOMEM;
+        relay_fail(r, "queue");
+    }
+}
+
+// Collect the next hop's replies
+static void relay_recv(struct relay *r) {
+    unsigned char buf[4096];
+    while (!r->dead && !r->eof) {
+        ssize_t n = read(r->fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                relay_fail(r, "recv");
+            return;
+        }
+        if (n == 0) {
+            // Normal after the last reply; relay_merge() notices if any is missing
+            r->eof = true;
+            close(r->fd);
+            r->fd = -1;
+            return;
+        }
+        if (outbuf_put(&r->theirs, buf, (size_t)n) < 0) {
+            errno = ENOMEM;
+            relay_fail(r, "recv");
+        }
+    }
+}
+
+// Length of the next reply on a relayed connection: the LFT1 status byte,
+// the LFT2 hello, then acks (nothing else is accepted on a relay)
+static size_t relay_msg_len(const struct conn *c) {
+    if (c->proto == 1)
+        return 1;
+    return c->relay->hello ? LFT2_ACK_LEN : LFT2_HELLO_LEN;
+}
+
+// Pair our replies with the next hop's, in order, and queue the combined
+// reply for the client: the features both accepted, and for each file our
+// failure if we had one, else the status from further down the chain.
+// Without a next hop a file fails with LANDROP_ST_IO even though it is
+// stored here, since the rest of the chain never got it; st.relay_missed
+// counts those.
+static int relay_merge(struct conn *c) {
+    struct relay *r = c->relay;
+    for (;;) {
+        size_t n = relay_msg_len(c);
+        if (outbuf_pending(&r->mine) < n)
+            return 0;
+        const unsigned char *d = NULL;
+        if (outbuf_pending(&r->theirs) >= n) {
+            d = r->theirs.data + r->theirs.off;
+        } else if (!r->dead) {
+            if (!r->eof)
+                return 0;
+            errno = 0;
+            relay_fail(r, "connection closed before all files were acknowledged");
+        }
+        unsigned char *m = r->mine.data + r->mine.off;
+        if (d && (c->proto == 1 ? false
+                  : !r->hello ? memcmp(d, LANDROP_MAGIC2, LANDROP_MAGIC_LEN) != 0
+                              : d[0] != LFT2_MSG_ACK || get_be32(d + 1) != get_be32(m + 1))) {
+            errno = 0;
+            relay_fail(r, "unexpected reply");
+            r->theirs.off = r->theirs.len = 0;
+            d = NULL;
+        }
+        if (c->proto == 2 && !r->hello) {
+            if (d)
+                put_be32(m + LANDROP_MAGIC_LEN, get_be32(m + LANDROP_MAGIC_LEN) & get_be32(d + LANDROP_MAGIC_LEN));
+            r->hello = true;
+        } else {
+            unsigned char *st = &m[n - 1];
+            if (*st == LANDROP_ST_OK && d)
+                *st = d[n - 1];
+            else if (*st == LANDROP_ST_OK) {
+                stat_add(&c->owner->st.relay_missed, 1);
+                *st = LANDROP_ST_IO;
+            }
+        }
+        if (outbuf_put(&c->out, m, n) < 0)
+            return -1;
+        r->mine.off += n;
+        if (d)
+            r->theirs.off += n;
+    }
+}
+
+// Client bytes waiting for the next hop
+static size_t relay_backlog(const struct conn *c) {
+    return c->relay ? outbuf_pending(&c->relay->out) : 0;
+}
+
+// Nothing left to pass on or to wait for before the connection may close
+static bool relay_idle(const struct conn *c) {
+    return !c->relay || (outbuf_pending(&c->relay->mine) == 0 && relay_backlog(c) == 0);
+}
+
+static int relay_watch(struct worker *w, struct conn *c) {
+    struct relay *r = c->relay;
+    if (!r || r->fd < 0)
+        return 0;
+    uint32_t want = EPOLLIN | (r->connecting || outbuf_pending(&r->out) > 0 ? EPOLLOUT : 0);
+    if (r->events == want)
+        return 0;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = RELAY_TAG(c);
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, r->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    r->events = want;
+    return 0;
+}
+
+static int conn_queue(struct conn *c, const void *p, size_t n) {
+    if (c->relay) {
+        // Held back until the next hop has answered the same message
+        if (outbuf_put(&c->relay->mine, p, n) < 0)
+            return -1;
+        return relay_merge(c);
+    }
+    return outbuf_put(&c->out, p, n);
+}
+
+// Write as much of the queue as the socket takes; with more, the kernel
+// holds it back to go out with what follows (MSG_MORE). -1 on error.
+static int conn_flush_more(struct conn *c, bool more) {
+    struct outbuf *o = &c->out;
+    while (o->off < o->len) {
+        ssize_t r = c->tls ? tls_write(c->tls, o->data + o->off, o->len - o->off, more)
+                           : send(c->fd, o->data + o->off, o->len - o->off, more ? MSG_MORE : 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("send reply");
+            return -1;
+        }
+        o->off += (size_t)r;
+    }
+    return 0;
+}
+
+static int conn_flush(struct conn *c) {
+    return conn_flush_more(c, false);
+}
+
+// Whether the socket carries the client's bytes as they are, for splice()
+// and io_uring: no TLS, or the kernel has its records
+static bool conn_raw_rx(const struct conn *c) {
+    return !c->tls || tls_kernel_rx(c->tls);
+}
+
+// read() from the client (through TLS if it is on), within the rate
+// limits; with -R whatever arrives goes on to the next hop
+static ssize_t conn_read(struct conn *c, void *buf, size_t n) {
+    if (g_shaping) {
+        size_t k = conn_allow(c, n);
+        if (k == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        n = k;
+    }
+    ssize_t r = c->tls ? tls_read(c->tls, buf, n) : read(c->fd, buf, n);
+    if (g_shaping)
+        conn_refund(c, r > 0 ? n - (size_t)r : n);
+    if (r > 0 && c->relay)
+        relay_forward(c, buf, (size_t)r);
+    return r;
+}
+
+// Accumulate exactly n bytes into dst across readiness events.
+// Returns 1 when complete, 0 if the socket would block, -1 on error/EOF.
+static int conn_fill(struct conn *c, void *dst, size_t n, const char *what) {
+    while (c->have < n) {
+        ssize_t r = conn_read(c, (char *)dst + c->have, n - c->have);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror(what);
+            return -1;
+        }
+        if (r == 0) {
+            // Closing between messages is not worth a message
+            if (c->have > 0 || (c->state != CS_MAGIC && c->state != CS_FRAME)) {
+                errno = EPIPE;
+                perror(what);
+            }
+            return -1;
+        }
+        c->have += (size_t)r;
+    }
+    c->have = 0;
+    return 1;
+}
+
+static void conn_count_file(struct conn *c, unsigned char status) {
+    struct worker *w = c->owner;
+    if (c->proto == 2 && c->frame == LFT2_FRAME_PROBE)
+        return;
+    if (c->proto == 2 && c->frame == LFT2_FRAME_STRIPE) {
+        stat_add(&w->st.stripes, 1);
+        // A transfer counts its file when it is finalized. Stripes turned
+        // away before joining one leave it to the first stripe's.
+        if (!c->joined && c->woff == 0)
+            stat_add(&w->st.files_failed, 1);
+    } else if (status == LANDROP_ST_OK)
+        stat_add(&w->st.files_ok, 1);
+    else
+        stat_add(&w->st.files_failed, 1);
+    // Downloads must not go on serving what was there before
+    if (status == LANDROP_ST_OK && g_files)
+        fdcache_forget(g_files, c->sname);
+    if (status == LANDROP_ST_OK && g_cfg.stats_path)
+        hist_add(&w->st.hist[STATS_TRANSFER], (uint64_t)((now_sec() - c->t0) * 1e9));
+}
+
+// A file a manifest asked for is stored: give it the sender's mtime, so the
+// next sync finds it up to date
+static void conn_sync_stamp(struct conn *c) {
+    const struct sync_want *e = sync_find(c->sync, c->sname);
+    if (!e)
+        return;
+    struct timespec ts[2] = {
+        { 0, UTIME_OMIT },
+        { (time_t)(e->mtime_ns / 1000000000u), (long)(e->mtime_ns % 1000000000u) },
+    };
+    if (utimensat(c->dfd, c->path, ts, AT_SYMLINK_NOFOLLOW) < 0)
+        perror("set mtime");
+}
+
+// Report the outcome of the current file: the LFT1 status byte (after which
+// the connection is done) or an LFT2 ack, then on to the next frame. A
+// resume query is answered with an offer and a signature request with the
+// signatures instead.
+static int conn_file_done(struct conn *c, unsigned char status) {
+    if (c->proto == 1) {
+        conn_count_file(c, status);
+        c->state = CS_CLOSING;
+        return conn_queue(c, &status, 1);
+    }
+    if (c->frame == LFT2_FRAME_SIGREQ) {
+        struct delta_base *b = c->base;
+        uint64_t count = status == LANDROP_ST_OK && b && b->fd >= 0 ? b->count : 0;
+        unsigned char m[LFT2_SIGS_HDR_LEN];
+        m[0] = LFT2_MSG_SIGS;
+        put_be32(m + 1, c->seq);
+        m[5] = status;
+        put_be32(m + 6, count ? b->block : 0);
+        put_be64(m + 10, count);
+        c->seq++;
+        c->state = CS_FRAME;
+        if (conn_queue(c, m, sizeof(m)) < 0 || (count && conn_queue(c, b->sigs, count * DELTA_SIG_LEN) < 0))
+            return -1;
+        if (b) {
+            free(b->sigs);
+            b->sigs = NULL;
+        }
+        return 0;
+    }
+    if (c->frame == LFT2_FRAME_CHUNKS || c->frame == LFT2_FRAME_MANIFEST) {
+        // The chunks of the file we hold, or the files of the manifest
+        bool chunks = c->frame == LFT2_FRAME_CHUNKS;
+        uint32_t count = 0;
+        const unsigned char *bits = NULL;
+        if (status == LANDROP_ST_OK && chunks && c->plan) {
+            count = c->plan->count;
+            bits = c->plan->bits;
+        } else if (status == LANDROP_ST_OK && !chunks && c->sync) {
+            count = c->sync->count;
+            bits = c->sync->bits;
+        }
+        unsigned char m[LFT2_HAVE_HDR_LEN];
+        m[0] = LFT2_MSG_HAVE;
+        put_be32(m + 1, c->seq);
+        m[5] = status;
+        put_be32(m + 6, count);
+        c->seq++;
+        c->state = CS_FRAME;
+        if (conn_queue(c, m, sizeof(m)) < 0 || (count && conn_queue(c, bits, (count + 7) / 8) < 0))
+            return -1;
+        // No dedup frame follows a refusal
+        if (chunks && status != LANDROP_ST_OK) {
+            dedup_plan_free(c->plan);
+            c->plan = NULL;
+        }
+        return 0;
+    }
+    if (c->frame == LFT2_FRAME_GET) {
+        // The range we are about to send (CS_SEND), or why there is none
+        bool ok = status == LANDROP_ST_OK;
+        unsigned char m[LFT2_DATA_HDR_LEN];
+        m[0] = LFT2_MSG_DATA;
+        put_be32(m + 1, c->seq);
+        m[5] = status;
+        put_be64(m + 6, c->filesize);
+        put_be64(m + 14, c->mtime_ns);
+        put_be64(m + 22, ok ? c->src_off : 0);
+        put_be64(m + 30, ok ? c->src_left : 0);
+        c->seq++;
+        c->state = CS_FRAME;
+        if (ok)
+            stat_add(&c->owner->st.gets, 1);
+        if (ok && c->src_left > 0) {
+            c->state = CS_SEND;
+        } else if (c->src_fd >= 0) {
+            fdcache_put(g_files, c->src_fd);
+            c->src_fd = -1;
+        }
+        return conn_queue(c, m, sizeof(m));
+    }
+    if (c->frame == LFT2_FRAME_QUERY) {
+        unsigned char m[LFT2_OFFER_LEN];
+        m[0] = LFT2_MSG_OFFER;
+        put_be32(m + 1, c->seq);
+        m[5] = status;
+        put_be64(m + 6, status == LANDROP_ST_OK ? c->offer_have : 0);
+        put_be32(m + 14, status == LANDROP_ST_OK ? c->offer_crc : 0);
+        c->seq++;
+        c->state = CS_FRAME;
+        return conn_queue(c, m, sizeof(m));
+    }
+    if (status == LANDROP_ST_OK && c->sync &&
+        (LFT2_FRAME_HAS_CONTENT(c->frame) || c->frame == LFT2_FRAME_DELTA || c->frame == LFT2_FRAME_DEDUP))
+        conn_sync_stamp(c);
+    conn_count_file(c, status);
+    unsigned char ack[LFT2_ACK_LEN];
+    ack[0] = LFT2_MSG_ACK;
+    put_be32(ack + 1, c->seq);
+    ack[5] = status;
+    c->seq++;
+    c->state = CS_FRAME;
+    return conn_queue(c, ack, sizeof(ack));
+}
+
+static int conn_on_magic(struct conn *c) {
+    if (memcmp(c->hdr, LANDROP_MAGIC, LANDROP_MAGIC_LEN) == 0) {
+        c->proto = 1;
+        c->state = CS_HEADER;
+        return 0;
+    }
+    if (memcmp(c->hdr, LANDROP_MAGIC2, LANDROP_MAGIC_LEN) == 0) {
+        c->proto = 2;
+        c->state = CS_HELLO;
+        return 0;
+    }
+    fprintf(stderr, "Invalid magic from client\n");
+    return -1;
+}
+
+static int conn_on_hello(struct conn *c) {
+    c->features = get_be32(c->hdr) & LFT2_SERVER_FEATURES;
+    // A delta replaces the existing file, which needs -o or a sync asking
+    // for that file (conn_may_replace())
+    if (!g_cfg.overwrite && !(c->features & LFT2_F_SYNC))
+        c->features &= ~LFT2_F_DELTA;
+    if (!g_dedup)
+        c->features &= ~LFT2_F_DEDUP;
+    if (!g_files)
+        c->features &= ~LFT2_F_PULL;
+    if (c->relay)
+        c->features &= LFT2_RELAY_FEATURES;
+    unsigned char hello[LFT2_HELLO_LEN];
+    memcpy(hello, LANDROP_MAGIC2, LANDROP_MAGIC_LEN);
+    put_be32(hello + LANDROP_MAGIC_LEN, c->features);
+    c->state = CS_FRAME;
+    return conn_queue(c, hello, sizeof(hello));
+}
+
+static int conn_on_frame(struct conn *c) {
+    c->frame = c->hdr[0];
+    switch (c->frame) {
+        case LFT2_FRAME_FILE:
+            c->state = CS_FILE_HDR;
+            return 0;
+        case LFT2_FRAME_STRIPE:
+            if (!(c->features & LFT2_F_STRIPE))
+                break;
+            c->state = CS_STRIPE_HDR;
+            return 0;
+        case LFT2_FRAME_QUERY:
+            if (!(c->features & LFT2_F_RESUME))
+                break;
+            c->state = CS_QUERY_HDR;
+            return 0;
+        case LFT2_FRAME_RFILE:
+            if (!(c->features & LFT2_F_RESUME))
+                break;
+            c->state = CS_RFILE_HDR;
+            return 0;
+        case LFT2_FRAME_SIGREQ:
+        case LFT2_FRAME_DELTA:
+            if (!(c->features & LFT2_F_DELTA))
+                break;
+            c->state = CS_DELTA_HDR;
+            return 0;
+        case LFT2_FRAME_BATCH:
+            if (!(c->features & LFT2_F_BATCH))
+                break;
+            c->state = CS_BATCH_HDR;
+            return 0;
+        case LFT2_FRAME_PROBE:
+            if (!(c->features & LFT2_F_PROBE))
+                break;
+            c->state = CS_PROBE_HDR;
+            return 0;
+        case LFT2_FRAME_CHUNKS:
+        case LFT2_FRAME_DEDUP:
+            if (!(c->features & LFT2_F_DEDUP))
+                break;
+            c->state = CS_CHUNKS_HDR;
+            return 0;
+        case LFT2_FRAME_MANIFEST:
+            if (!(c->features & LFT2_F_SYNC))
+                break;
+            c->state = CS_MANIFEST_HDR;
+            return 0;
+        case LFT2_FRAME_GET:
+            if (!(c->features & LFT2_F_PULL))
+                break;
+            c->state = CS_GET_HDR;
+            return 0;
+        case LFT2_FRAME_END:
+            c->state = CS_CLOSING;
+            return 0;
+        default:
+            break;
+    }
+    fprintf(stderr, "Unknown frame type 0x%02x\n", c->hdr[0]);
+    return -1;
+}
+
+// filesize and name length, shared by the LFT1 header and LFT2 file frames
+static int conn_on_file_header(struct conn *c) {
+    c->filesize = get_be64(c->hdr);
+    c->bodylen = c->filesize;
+    c->namelen = get_be16(c->hdr + 8);
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    c->state = CS_NAME;
+    return 0;
+}
+
+// Resume query and resumable file frames:
+// [be64 filesize] [be64 mtime] ([be64 offset] for RFILE) [be16 name length]
+static int conn_on_resume_header(struct conn *c) {
+    c->filesize = get_be64(c->hdr);
+    c->mtime_ns = get_be64(c->hdr + 8);
+    size_t pos = 16;
+    c->roff = 0;
+    if (c->frame == LFT2_FRAME_RFILE) {
+        c->roff = get_be64(c->hdr + 16);
+        pos = 24;
+    }
+    c->namelen = get_be16(c->hdr + pos);
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    if (c->roff > c->filesize) {
+        fprintf(stderr, "Bad resume offset\n");
+        return -1;
+    }
+    c->bodylen = c->frame == LFT2_FRAME_RFILE ? c->filesize - c->roff : 0;
+    c->state = CS_NAME;
+    return 0;
+}
+
+// Signature request and delta frames:
+// [be64 filesize] ([be32 block size] for DELTA) [be16 name length]
+static int conn_on_delta_header(struct conn *c) {
+    c->filesize = get_be64(c->hdr);
+    size_t pos = 8;
+    c->dblock = 0;
+    if (c->frame == LFT2_FRAME_DELTA) {
+        c->dblock = get_be32(c->hdr + 8);
+        pos = 12;
+    }
+    c->namelen = get_be16(c->hdr + pos);
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    c->bodylen = 0;
+    c->state = CS_NAME;
+    return 0;
+}
+
+// Chunk list and dedup frames: [be64 filesize] [be32 chunk count] [be16 name length]
+static int conn_on_chunks_header(struct conn *c) {
+    c->filesize = get_be64(c->hdr);
+    c->dcount = get_be32(c->hdr + 8);
+    c->namelen = get_be16(c->hdr + 12);
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    if (c->dcount > LFT2_DEDUP_MAX_CHUNKS || (c->dcount == 0) != (c->filesize == 0)) {
+        fprintf(stderr, "Bad chunk count\n");
+        return -1;
+    }
+    c->bodylen = c->frame == LFT2_FRAME_CHUNKS ? (uint64_t)c->dcount * LFT2_CHUNK_ENTRY_LEN : 0;
+    c->state = CS_NAME;
+    return 0;
+}
+
+// Get frame: [be64 offset] [be64 length] [be16 name length]. Nothing
+// follows the name.
+static int conn_on_get_header(struct conn *c) {
+    c->src_off = get_be64(c->hdr);
+    c->src_left = get_be64(c->hdr + 8);
+    c->namelen = get_be16(c->hdr + 16);
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    c->filesize = 0;
+    c->mtime_ns = 0;
+    c->bodylen = 0;
+    c->state = CS_NAME;
+    return 0;
+}
+
+static int conn_on_stripe_header(struct conn *c) {
+    c->xfer_id = get_be64(c->hdr);
+    c->filesize = get_be64(c->hdr + 8);
+    c->woff = (loff_t)get_be64(c->hdr + 16);
+    c->bodylen = get_be64(c->hdr + 24);
+    c->nstripes = get_be16(c->hdr + 32);
+    c->namelen = get_be16(c->hdr + 34);
+    c->joined = false;
+    if (c->namelen == 0 || c->namelen > 4096) {
+        fprintf(stderr, "Bad name length: %u\n", c->namelen);
+        return -1;
+    }
+    if (c->nstripes == 0 || c->woff < 0 || (uint64_t)c->woff > c->filesize ||
+        c->bodylen > c->filesize - (uint64_t)c->woff) {
+        fprintf(stderr, "Bad stripe range\n");
+        return -1;
+    }
+    c->state = CS_NAME;
+    return 0;
+}
+
+// Reserve the blocks for len bytes at off up front, so a large upload ends
+// up in a few extents instead of being allocated a write at a time. The
+// size is left alone: a partial file still shows only what arrived.
+// Returns -1 only if the space is not there; filesystems that cannot
+// preallocate just grow the file as it is written.
+static int preallocate(int fd, uint64_t off, uint64_t len) {
+    if (len == 0 || fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0)
+        return 0;
+    return errno == ENOSPC || errno == EDQUOT ? -1 : 0;
+}
+
+// Write the destination with O_DIRECT if -I covers it. Without a buffer or
+// on a filesystem that refuses O_DIRECT it stays buffered.
+static void conn_direct_open(struct conn *c) {
+    if (!g_cfg.direct || c->filesize < DIRECT_MIN_SIZE)
+        return;
+    int fl = fcntl(c->out_fd, F_GETFL);
+    if (fl < 0 || !(c->dbuf = worker_dbuf_get(c->owner)))
+        return;
+    if (fcntl(c->out_fd, F_SETFL, fl | O_DIRECT) < 0)
+        conn_dbuf_put(c);
+}
+
+// Write out the staged bytes. The tail of the file is rarely a multiple of
+// the alignment, so for the last piece O_DIRECT is switched off and it goes
+// through the page cache. A filesystem wanting coarser alignment than ours
+// gets the same treatment for the rest of the file.
+static int conn_direct_flush(struct conn *c, bool tail) {
+    for (;;) {
+        if (tail) {
+            int fl = fcntl(c->out_fd, F_GETFL);
+            if (fl < 0 || fcntl(c->out_fd, F_SETFL, fl & ~O_DIRECT) < 0)
+                return -1;
+        }
+        if (write_full(c->out_fd, c->dbuf, c->dlen) == 0)
+            break;
+        if (errno != EINVAL || tail)
+            return -1;
+        tail = true;
+    }
+    c->dlen = 0;
+    return 0;
+}
+
+// The stripe on this connection is stored. Either it was the last one and
+// we know the outcome, or we park until the owner of the last one posts it.
+static int conn_finish_stripe(struct conn *c, unsigned char st) {
+    conn_set_active(c, false);
+    pthread_mutex_lock(&g_xfer_lock);
+    if (st != LANDROP_ST_OK)
+        c->xfer->fail_status = st;
+    int status = xfer_stripe_end_locked(c->owner, c->xfer, st == LANDROP_ST_OK, c->bodylen);
+    if (status < 0) {
+        c->wait_next = c->xfer->waiters;
+        c->xfer->waiters = c;
+        c->state = CS_STRIPE_WAIT;
+    }
+    pthread_mutex_unlock(&g_xfer_lock);
+    if (status < 0)
+        return 0;
+    conn_xfer_release(c);
+    return conn_file_done(c, (unsigned char)status);
+}
+
+// Move a completed partial file to its final name, honouring -o
+static int conn_commit_part(struct conn *c) {
+    if (conn_may_replace(c)) {
+        if (renameat(c->dfd, c->part, c->dfd, c->path) == 0)
+            return LANDROP_ST_OK;
+    } else {
+        if (renameat2(c->dfd, c->part, c->dfd, c->path, RENAME_NOREPLACE) == 0)
+            return LANDROP_ST_OK;
+        // Filesystems without RENAME_NOREPLACE: link() is exclusive too
+        if (errno == EINVAL && linkat(c->dfd, c->part, c->dfd, c->path, 0) == 0) {
+            unlinkat(c->dfd, c->part, 0);
+            return LANDROP_ST_OK;
+        }
+    }
+    perror("rename partial file");
+    return errno == EEXIST ? LANDROP_ST_OPEN : LANDROP_ST_IO;
+}
+
+// Hidden name ending in suffix: one of the server's own files in progress
+static bool hidden_with_suffix(const char *sname, const char *suffix) {
+    size_t n = strlen(sname), k = strlen(suffix);
+    return sname[0] == '.' && n > k && strcmp(sname + n - k, suffix) == 0;
+}
+
+// Names the server keeps for itself: the dedup index, the partial files of
+// resumable uploads and the files delta and dedup transfers are assembled
+// in (in any directory), which a plain upload must not create or replace
+static bool reserved_name(const char *sname) {
+    if (g_dedup && strncmp(sname, DEDUP_INDEX, sizeof(DEDUP_INDEX) - 1) == 0)
+        return true;
+    const char *leaf = path_basename(sname);
+    return hidden_with_suffix(leaf, ".lpart") || hidden_with_suffix(leaf, ".ldelta") ||
+           hidden_with_suffix(leaf, ".ldedup");
+}
+
+// Directory of sname below dest_dir, created as needed, into *dfd (giving
+// back the one held there) and the file's name in it into path. Returns a
+// status byte value.
+static int dest_resolve(const char *sname, int *dfd, char *path, size_t n) {
+    dircache_put(g_dirs, *dfd);
+    const char *leaf;
+    *dfd = dircache_get(g_dirs, sname, &leaf);
+    if (*dfd < 0) {
+        perror("open dest dir");
+        return LANDROP_ST_OPEN;
+    }
+    if (snprintf(path, n, "%s", leaf) >= (int)n) {
+        fprintf(stderr, "Destination path too long\n");
+        return LANDROP_ST_BADNAME;
+    }
+    return LANDROP_ST_OK;
+}
+
+// Store one file of a batch. Returns a status byte value.
+static unsigned char conn_batch_store(struct conn *c, const unsigned char *data, uint64_t size) {
+    if (sanitize_path(c->name, c->sname, sizeof(c->sname)) != 0 || c->sname[0] == '\0' ||
+        reserved_name(c->sname)) {
+        fprintf(stderr, "Invalid filename in batch\n");
+        return LANDROP_ST_BADNAME;
+    }
+    int st = dest_resolve(c->sname, &c->dfd, c->path, sizeof(c->path));
+    if (st != LANDROP_ST_OK)
+        return (unsigned char)st;
+    int flags = O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (conn_may_replace(c) ? O_TRUNC : O_EXCL);
+    int fd = openat(c->dfd, c->path, flags, 0644);
+    if (fd < 0) {
+        perror("open dest file");
+        return LANDROP_ST_OPEN;
+    }
+    uint64_t t0 = lat_start();
+    if (write_full(fd, data, (size_t)size) < 0) {
+        perror("write file data");
+        close(fd);
+        unlinkat(c->dfd, c->path, 0);
+        return LANDROP_ST_IO;
+    }
+    lat_end(c->owner, STATS_DISK_WRITE, t0);
+    if (close(fd) < 0) {
+        perror("close dest");
+        unlinkat(c->dfd, c->path, 0);
+        return LANDROP_ST_IO;
+    }
+    return LANDROP_ST_OK;
+}
+
+// The whole batch is in the arena: write out its files (unless st says the
+// batch as a whole failed) and ack each of them
+static int conn_batch_unpack(struct conn *c, unsigned char st) {
+    const unsigned char *ix = c->arena;
+    const unsigned char *data = c->arena + c->blen_index;
+    uint64_t bytes = 0;
+    uint32_t stored = 0;
+    c->batch = false;
+    conn_set_active(c, false);
+    for (uint32_t i = 0; i < c->bcount; ++i) {
+        uint64_t size = get_be64(ix);
+        uint16_t namelen = get_be16(ix + 8);
+        memcpy(c->name, ix + 10, namelen);
+        c->name[namelen] = '\0';
+        ix += 10 + namelen;
+        unsigned char fst = st == LANDROP_ST_OK ? conn_batch_store(c, data, size) : st;
+        data += size;
+        if (fst == LANDROP_ST_OK) {
+            stored++;
+            bytes += size;
+        }
+        if (conn_file_done(c, fst) < 0)
+            return -1;
+    }
+    char bb[32];
+    human_bytes((double)bytes, bb, sizeof(bb));
+    fprintf(stderr, "\nReceived %u of %u files in a batch (%s)\n", (unsigned)stored, (unsigned)c->bcount, bb);
+    return 0;
+}
+
+static int conn_finish_body(struct conn *c) {
+    if (c->batch)
+        return conn_batch_unpack(c, LANDROP_ST_OK);
+    if (c->xfer)
+        return conn_finish_stripe(c, LANDROP_ST_OK);
+    if (c->dbuf) {
+        int rc = conn_direct_flush(c, true);
+        conn_dbuf_put(c);
+        if (rc < 0) {
+            perror("write file data");
+            close(c->out_fd);
+            c->out_fd = -1;
+            unlinkat(c->dfd, c->path, 0);
+            conn_set_active(c, false);
+            return conn_file_done(c, LANDROP_ST_IO);
+        }
+    }
+    if (close(c->out_fd) < 0) {
+        perror("close dest");
+    }
+    c->out_fd = -1;
+    conn_set_active(c, false);
+    if (c->resumable) {
+        c->resumable = false;
+        int st = conn_commit_part(c);
+        if (st != LANDROP_ST_OK)
+            return conn_file_done(c, (unsigned char)st);
+    }
+    if (c->zip) {
+        char wb[32];
+        human_bytes((double)c->wire, wb, sizeof(wb));
+        fprintf(stderr, "\nReceived %s (%lu bytes, %s on the wire)\n", c->sname, (unsigned long)c->filesize, wb);
+    } else {
+        fprintf(stderr, "\nReceived %s (%lu bytes)\n", c->sname, (unsigned long)c->filesize);
+    }
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+// All content is in: verify the trailer first if there is one
+static int conn_end_body(struct conn *c) {
+    if (!c->csum)
+        return conn_finish_body(c);
+    c->state = CS_TRAILER;
+    return 0;
+}
+
+static int conn_on_trailer(struct conn *c) {
+    uint32_t want = get_be32(c->hdr);
+    if (want == c->crc)
+        return conn_finish_body(c);
+    fprintf(stderr, "\nChecksum mismatch for %s (got %08x, sender has %08x)\n", c->sname,
+            (unsigned)c->crc, (unsigned)want);
+    if (c->batch)
+        return conn_batch_unpack(c, LANDROP_ST_CHECKSUM);
+    if (c->xfer)
+        return conn_finish_stripe(c, LANDROP_ST_CHECKSUM);
+    // Corrupt data is worth nothing, a resumable partial included
+    conn_dbuf_put(c);
+    close(c->out_fd);
+    c->out_fd = -1;
+    unlinkat(c->dfd, c->resumable ? c->part : c->path, 0);
+    c->resumable = false;
+    conn_set_active(c, false);
+    return conn_file_done(c, LANDROP_ST_CHECKSUM);
+}
+
+// Bytes that follow the body of the current frame
+static uint64_t conn_trailer_len(const struct conn *c) {
+    if (!(c->features & LFT2_F_CHECKSUM) || !LFT2_FRAME_HAS_CONTENT(c->frame))
+        return 0;
+    return LFT2_TRAILER_LEN;
+}
+
+// Whether the body of the current frame comes in compression chunks
+static bool conn_zipped(const struct conn *c) {
+    return c->proto == 2 && (c->features & LFT2_F_COMPRESS) && LFT2_FRAME_HAS_CONTENT(c->frame);
+}
+
+// Refuse the current file. LFT1 can only hang up; an LFT2 session skips
+// over the body and stays usable for the next file.
+static int conn_reject(struct conn *c, unsigned char status) {
+    if (c->proto == 1)
+        return conn_file_done(c, status);
+    c->status = status;
+    if (c->frame == LFT2_FRAME_DELTA) {
+        // Ops have no length up front: read them all, apply none
+        c->state = CS_DELTA_OP;
+        return 0;
+    }
+    if (c->frame == LFT2_FRAME_DEDUP) {
+        // Only the chunk list tells how much content follows, and a frame
+        // we refuse by name never had one accepted
+        fprintf(stderr, "Cannot skip a dedup frame\n");
+        return -1;
+    }
+    // Chunked content has no known wire size: walk the chunks first
+    c->zip = conn_zipped(c);
+    c->zpayload = false;
+    c->left = c->zip ? c->bodylen : c->bodylen + conn_trailer_len(c);
+    c->state = CS_DISCARD;
+    return 0;
+}
+
+// Join (or start) the transfer this stripe belongs to. The first stripe
+// creates the destination and preallocates the full size so the others can
+// pwrite their ranges in any order. Returns a status byte value.
+static int conn_stripe_attach(struct conn *c) {
+    pthread_mutex_lock(&g_xfer_lock);
+    struct xfer *t = g_xfers;
+    while (t && t->id != c->xfer_id)
+        t = t->next;
+    if (!t) {
+        t = (struct xfer *)calloc(1, sizeof(*t));
+        if (!t) {
+            pthread_mutex_unlock(&g_xfer_lock);
+            perror("calloc xfer");
+            return LANDROP_ST_IO;
+        }
+        int flags = O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (conn_may_replace(c) ? O_TRUNC : O_EXCL);
+        t->fd = openat(c->dfd, c->path, flags, 0644);
+        if (t->fd < 0) {
+            pthread_mutex_unlock(&g_xfer_lock);
+            perror("open dest file");
+            free(t);
+            return LANDROP_ST_OPEN;
+        }
+        if (c->filesize > 0 && fallocate(t->fd, 0, 0, (off_t)c->filesize) < 0 &&
+            ftruncate(t->fd, (off_t)c->filesize) < 0) {
+            perror("preallocate");
+            close(t->fd);
+            unlinkat(c->dfd, c->path, 0);
+            pthread_mutex_unlock(&g_xfer_lock);
+            free(t);
+            return LANDROP_ST_IO;
+        }
+        // The transfer holds the directory itself: stripes may end on
+        // connections that have since moved on to other files
+        const char *leaf;
+        t->dfd = dircache_get(g_dirs, c->sname, &leaf);
+        t->id = c->xfer_id;
+        t->filesize = c->filesize;
+        t->nstripes = c->nstripes;
+        memcpy(t->sname, c->sname, sizeof(t->sname));
+        memcpy(t->path, c->path, sizeof(t->path));
+        t->next = g_xfers;
+        g_xfers = t;
+    } else if (t->filesize != c->filesize || t->nstripes != c->nstripes ||
+               strcmp(t->sname, c->sname) != 0 || t->ended + t->receiving >= t->nstripes) {
+        pthread_mutex_unlock(&g_xfer_lock);
+        fprintf(stderr, "Stripe does not match transfer %016llx\n", (unsigned long long)c->xfer_id);
+        return LANDROP_ST_BADNAME;
+    }
+    t->refs++;
+    t->receiving++;
+    t->last_activity = now_sec();
+    c->xfer = t;
+    c->out_fd = t->fd;
+    c->joined = true;
+    pthread_mutex_unlock(&g_xfer_lock);
+    return LANDROP_ST_OK;
+}
+
+// Offloading: run fn on a helper thread while the connection is out of the
+// epoll set, then call done back on the owning worker. Used for work that
+// would stall every other connection of the worker, like hashing a
+// multi-gigabyte partial file.
+static void *offload_main(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    c->offload_fn(c);
+    mailbox_post(c, 0);
+    return NULL;
+}
+
+static int conn_offload(struct worker *w, struct conn *c, void (*fn)(struct conn *), int (*done)(struct conn *)) {
+    c->offload_fn = fn;
+    c->offload_done = done;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL) < 0) {
+        perror("epoll_ctl del");
+        return -1;
+    }
+    c->events = 0;
+    c->state = CS_OFFLOAD;
+    c->offloaded = true;
+    w->offloads++;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t th;
+    int rc = pthread_create(&th, &attr, offload_main, c);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        // No thread: do it inline, slower for the neighbours but correct
+        fn(c);
+        mailbox_post(c, 0);
+    }
+    return 0;
+}
+
+// Back on the owner after an offload: re-register the fd and continue
+static int conn_offload_finish(struct worker *w, struct conn *c) {
+    c->offloaded = false;
+    w->offloads--;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        return -1;
+    }
+    c->events = EPOLLIN;
+    return c->offload_done(c);
+}
+
+// Helper thread: how much of this file do we hold, and what does it hash to
+static void resume_scan(struct conn *c) {
+    c->offer_have = 0;
+    c->offer_crc = 0;
+    int fd = openat(c->dfd, c->part, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size <= c->filesize &&
+        crc32c_fd_prefix(fd, (uint64_t)st.st_size, &c->offer_crc, &g_stop) == 0)
+        c->offer_have = (uint64_t)st.st_size;
+    close(fd);
+}
+
+static int conn_send_offer(struct conn *c) {
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+static int conn_on_query(struct worker *w, struct conn *c) {
+    if (!conn_may_replace(c) && faccessat(c->dfd, c->path, F_OK, 0) == 0) {
+        // It would fail at the rename anyway: say so before any data moves
+        return conn_file_done(c, LANDROP_ST_OPEN);
+    }
+    return conn_offload(w, c, resume_scan, conn_send_offer);
+}
+
+// Helper thread: signatures of the file the delta will be against. No
+// usable file (missing, not regular, shorter than a block) leaves fd at -1
+// and the client falls back to sending it whole.
+static void delta_scan(struct conn *c) {
+    struct delta_base *b = c->base;
+    int fd = openat(c->dfd, c->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    b->mode = st.st_mode & 07777;
+    b->block = delta_block_size((uint64_t)st.st_size);
+    b->count = (uint64_t)st.st_size / b->block;
+    if (b->count == 0) {
+        close(fd);
+        return;
+    }
+    b->sigs = (unsigned char *)malloc(b->count * DELTA_SIG_LEN);
+    b->crcs = (uint32_t *)malloc(b->count * sizeof(uint32_t));
+    if (!b->sigs || !b->crcs || delta_signatures(fd, b->block, b->count, b->sigs, b->crcs, &g_stop) < 0) {
+        perror("delta signatures");
+        free(b->sigs);
+        free(b->crcs);
+        b->sigs = NULL;
+        b->crcs = NULL;
+        close(fd);
+        return;
+    }
+    crc32c_shift_init(&b->shift, b->block);
+    b->fd = fd;
+}
+
+static int conn_send_sigs(struct conn *c) {
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+static int conn_on_sigreq(struct worker *w, struct conn *c) {
+    // Without -o the delta feature is only on for a sync, and only for the
+    // files its manifest asked for
+    if (!conn_may_replace(c))
+        return conn_file_done(c, LANDROP_ST_OPEN);
+    delta_base_free(c->base);
+    c->base = (struct delta_base *)calloc(1, sizeof(*c->base));
+    if (!c->base) {
+        perror("calloc");
+        return conn_file_done(c, LANDROP_ST_IO);
+    }
+    c->base->fd = -1;
+    memcpy(c->base->sname, c->sname, sizeof(c->sname));
+    return conn_offload(w, c, delta_scan, conn_send_sigs);
+}
+
+// Start rebuilding the file from the ops that follow, into a temporary
+// next to the old copy. Problems are reported in the ack once the ops have
+// been read.
+static int conn_on_delta(struct conn *c) {
+    struct delta_base *b = c->base;
+    c->status = LANDROP_ST_OK;
+    c->crc = 0;
+    c->csum = true;
+    c->zip = false;
+    c->dlit = 0;
+    c->t0 = now_sec();
+    c->state = CS_DELTA_OP;
+    if (!b || b->fd < 0 || b->block != c->dblock || strcmp(b->sname, c->sname) != 0) {
+        fprintf(stderr, "Delta for %s without matching signatures\n", c->sname);
+        c->status = LANDROP_ST_IO;
+        return 0;
+    }
+    if (snprintf(c->part, sizeof(c->part), ".%s.ldelta", c->path) >= (int)sizeof(c->part)) {
+        fprintf(stderr, "Destination path too long\n");
+        c->status = LANDROP_ST_BADNAME;
+        return 0;
+    }
+    int fd = openat(c->dfd, c->part, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open delta file");
+        c->status = LANDROP_ST_OPEN;
+        return 0;
+    }
+    // The new version replaces the old one, permissions included
+    if (fchmod(fd, b->mode) < 0)
+        perror("chmod delta file");
+    if (preallocate(fd, 0, c->filesize) < 0) {
+        perror("preallocate");
+        close(fd);
+        unlinkat(c->dfd, c->part, 0);
+        c->status = LANDROP_ST_IO;
+        return 0;
+    }
+    c->out_fd = fd;
+    return 0;
+}
+
+// Argument bytes of each delta op
+static size_t delta_arg_len(unsigned char op) {
+    switch (op) {
+        case LFT2_DOP_LIT:
+        case LFT2_DOP_END:
+            return 4;
+        case LFT2_DOP_COPY:
+            return 8 + 4;
+    }
+    return 0;
+}
+
+// Last op: check what we rebuilt against the sender's CRC and swap it in
+static int conn_delta_end(struct conn *c) {
+    uint32_t want = get_be32(c->hdr + 1);
+    unsigned char st = c->status;
+    if (c->out_fd >= 0) {
+        if (c->crc != want) {
+            fprintf(stderr, "Checksum mismatch for %s after delta (got %08x, sender has %08x)\n", c->sname,
+                    (unsigned)c->crc, (unsigned)want);
+            st = LANDROP_ST_CHECKSUM;
+        } else if (close(c->out_fd) < 0) {
+            perror("close delta file");
+            st = LANDROP_ST_IO;
+        } else if (renameat(c->dfd, c->part, c->dfd, c->path) < 0) {
+            perror("rename delta file");
+            st = LANDROP_ST_IO;
+        }
+        if (st != LANDROP_ST_OK) {
+            if (st == LANDROP_ST_CHECKSUM)
+                close(c->out_fd);
+            unlinkat(c->dfd, c->part, 0);
+        } else {
+            char lb[32];
+            human_bytes((double)c->dlit, lb, sizeof(lb));
+            fprintf(stderr, "Updated %s (%lu bytes, %s of literals, %.2fs)\n", c->sname,
+                    (unsigned long)c->filesize, lb, now_sec() - c->t0);
+        }
+        c->out_fd = -1;
+    }
+    delta_base_free(c->base);
+    c->base = NULL;
+    return conn_file_done(c, st);
+}
+
+static int conn_on_delta_op(struct conn *c) {
+    c->dop = c->hdr[0];
+    if (delta_arg_len(c->dop) == 0) {
+        fprintf(stderr, "Unknown delta op 0x%02x\n", c->dop);
+        return -1;
+    }
+    c->state = CS_DELTA_ARG;
+    return 0;
+}
+
+static int conn_on_delta_arg(struct conn *c) {
+    if (c->dop == LFT2_DOP_END)
+        return conn_delta_end(c);
+    if (c->dop == LFT2_DOP_LIT) {
+        c->left = get_be32(c->hdr + 1);
+        c->bodylen = c->left;
+        c->dlit += c->left;
+        c->state = CS_DELTA_LIT;
+        return 0;
+    }
+    c->state = CS_DELTA_OP;
+    if (c->out_fd < 0)
+        return 0;
+    struct delta_base *b = c->base;
+    uint64_t first = get_be64(c->hdr + 1);
+    uint32_t n = get_be32(c->hdr + 9);
+    if (n == 0 || first >= b->count || n > b->count - first) {
+        fprintf(stderr, "Bad block reference in delta\n");
+        return -1;
+    }
+    // The blocks' CRCs are known: extend the running CRC without reading them
+    for (uint32_t i = 0; i < n; ++i)
+        c->crc = crc32c_combine(&b->shift, c->crc, b->crcs[first + i]);
+    c->copy_fd = b->fd;
+    c->copy_off = first * b->block;
+    c->copy_left = (uint64_t)n * b->block;
+    c->state = CS_LOCAL_COPY;
+    return 0;
+}
+
+// Old blocks (delta) or known chunks (dedup) into the new file, in the
+// kernel where the filesystem can (copy_file_range may even share the
+// extents). Returns 1 when done, 0 when the budget is spent, -1 on error.
+static int conn_local_copy(struct worker *w, struct conn *c) {
+    size_t budget = LOCAL_COPY_BUDGET;
+    while (c->copy_left > 0 && budget > 0) {
+        size_t n = c->copy_left > budget ? budget : (size_t)c->copy_left;
+        loff_t off = (loff_t)c->copy_off;
+        ssize_t r = copy_file_range(c->copy_fd, &off, c->out_fd, NULL, n, 0);
+        if (r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            r = pread(c->copy_fd, w->buf, n > g_cfg.chunk ? g_cfg.chunk : n, (off_t)c->copy_off);
+            if (r > 0 && write_full(c->out_fd, w->buf, (size_t)r) < 0) {
+                perror("write file data");
+                return -1;
+            }
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("copy local data");
+            return -1;
+        }
+        if (r == 0) {
+            fprintf(stderr, "Source of %s shrank while copying from it\n", c->sname);
+            return -1;
+        }
+        c->copy_off += (uint64_t)r;
+        c->copy_left -= (uint64_t)r;
+        budget -= (size_t)r;
+    }
+    if (c->copy_left == 0) {
+        c->state = CS_DELTA_OP;
+        return 1;
+    }
+    // Nothing on the socket has to arrive for us to go on: come back
+    // through the mailbox after the other connections had their turn
+    if (!c->noted) {
+        c->yielded = true;
+        mailbox_post(c, 0);
+    }
+    return 0;
+}
+
+// Chunks frame with an acceptable name: take the list. Without -o a file
+// that exists is refused before any content moves, unless a sync asked for it.
+static int conn_on_chunks(struct conn *c) {
+    if (!conn_may_replace(c) && faccessat(c->dfd, c->path, F_OK, 0) == 0)
+        return conn_reject(c, LANDROP_ST_OPEN);
+    dedup_plan_free(c->plan);
+    struct dedup_plan *p = (struct dedup_plan *)calloc(1, sizeof(*p));
+    c->plan = p;
+    if (p) {
+        p->filesize = c->filesize;
+        p->count = c->dcount;
+        memcpy(p->sname, c->sname, sizeof(p->sname));
+        p->list = (unsigned char *)malloc(c->bodylen ? c->bodylen : 1);
+        p->locs = (struct dedup_loc *)calloc(p->count + 1, sizeof(*p->locs));
+        p->src = (int8_t *)malloc(p->count + 1);
+        p->bits = (unsigned char *)calloc((p->count + 7) / 8 + 1, 1);
+    }
+    if (!p || !p->list || !p->locs || !p->src || !p->bits) {
+        perror("chunk list");
+        dedup_plan_free(c->plan);
+        c->plan = NULL;
+        return conn_reject(c, LANDROP_ST_IO);
+    }
+    c->state = CS_CHUNK_LIST;
+    return 0;
+}
+
+// Where the chunks of file come from: an index into srcfd, opening the file
+// on first use. -1 if it changed since it was indexed or too many files
+// are in use already.
+static int dedup_source(struct dedup_plan *p, uint32_t file) {
+    for (int k = 0; k < p->nsrc; ++k) {
+        if (p->srcid[k] == file)
+            return p->srcfd[k] >= 0 ? k : -1;
+    }
+    if (p->nsrc == DEDUP_MAX_SOURCES)
+        return -1;
+    int k = p->nsrc++;
+    p->srcid[k] = file;
+    p->srcfd[k] = dedup_file_open(g_dedup, file);
+    return p->srcfd[k] >= 0 ? k : -1;
+}
+
+// Helper thread: which chunks of the list we hold. A chunk only counts if
+// its length and CRC agree with the sender's too, and the file it is in is
+// still the version that was indexed. Those files stay open until the dedup
+// frame, but may still be rewritten in place meanwhile (an upload with -o
+// truncates, other programs do as they like), so every chunk is checked
+// again when it is copied (conn_dedup_copy()).
+static void dedup_scan(struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    dedup_lookup(g_dedup, p->list, LFT2_CHUNK_ENTRY_LEN, p->count, p->locs);
+    for (uint32_t i = 0; i < p->count; ++i) {
+        const unsigned char *e = p->list + (size_t)i * LFT2_CHUNK_ENTRY_LEN;
+        const struct dedup_loc *l = &p->locs[i];
+        p->src[i] = -1;
+        if (!l->file || l->len != get_be32(e + DEDUP_HASH_LEN) || l->crc != get_be32(e + DEDUP_HASH_LEN + 4))
+            continue;
+        int k = dedup_source(p, l->file);
+        if (k < 0)
+            continue;
+        p->src[i] = (int8_t)k;
+        p->bits[i / 8] |= (unsigned char)(1u << (i % 8));
+        p->have++;
+    }
+}
+
+static int conn_send_have(struct conn *c) {
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+// The list is in: check that it adds up to the file, then look it up
+static int conn_on_chunk_list(struct worker *w, struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < p->count; ++i) {
+        uint32_t len = get_be32(p->list + (size_t)i * LFT2_CHUNK_ENTRY_LEN + DEDUP_HASH_LEN);
+        if (len == 0 || len > LFT2_DEDUP_MAX_CHUNK) {
+            total = UINT64_MAX;
+            break;
+        }
+        total += len;
+    }
+    if (total != p->filesize) {
+        fprintf(stderr, "Bad chunk list for %s\n", c->sname);
+        return -1;
+    }
+    return conn_offload(w, c, dedup_scan, conn_send_have);
+}
+
+// Start assembling the file announced by the last chunks frame, into a
+// temporary next to the destination. Problems are reported in the ack once
+// the content has been read.
+static int conn_on_dedup(struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    if (!p || p->count != c->dcount || p->filesize != c->filesize || strcmp(p->sname, c->sname) != 0) {
+        // Which chunks follow is only known from the list
+        fprintf(stderr, "Dedup frame for %s without a matching chunk list\n", c->sname);
+        return -1;
+    }
+    c->status = LANDROP_ST_OK;
+    c->zip = false;
+    c->dchunk = 0;
+    c->dreused = 0;
+    c->t0 = now_sec();
+    c->state = CS_DEDUP_NEXT;
+    if (snprintf(c->part, sizeof(c->part), ".%s.ldedup", c->path) >= (int)sizeof(c->part)) {
+        fprintf(stderr, "Destination path too long\n");
+        c->status = LANDROP_ST_BADNAME;
+        return 0;
+    }
+    int fd = openat(c->dfd, c->part, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open dedup file");
+        c->status = LANDROP_ST_OPEN;
+        return 0;
+    }
+    // Replacing a file (-o) keeps its permissions, as writing over it would
+    struct stat old;
+    if (fstatat(c->dfd, c->path, &old, 0) == 0 && S_ISREG(old.st_mode) && fchmod(fd, old.st_mode & 07777) < 0)
+        perror("chmod dedup file");
+    if (preallocate(fd, 0, c->filesize) < 0) {
+        perror("preallocate");
+        close(fd);
+        unlinkat(c->dfd, c->part, 0);
+        c->status = LANDROP_ST_IO;
+        return 0;
+    }
+    c->out_fd = fd;
+    return 0;
+}
+
+// Every chunk is in place: move the file into its name and index it
+static int conn_dedup_end(struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    unsigned char st = c->status;
+    if (c->out_fd >= 0) {
+        struct stat sb;
+        // Closed whether or not the stat for the index worked
+        int rc = fstat(c->out_fd, &sb);
+        if (close(c->out_fd) < 0)
+            rc = -1;
+        if (rc < 0) {
+            perror("close dedup file");
+            st = LANDROP_ST_IO;
+        } else {
+            st = (unsigned char)conn_commit_part(c);
+        }
+        c->out_fd = -1;
+        if (st != LANDROP_ST_OK) {
+            unlinkat(c->dfd, c->part, 0);
+        } else {
+            if (dedup_add(g_dedup, c->sname, &sb, p->list, p->count) < 0)
+                fprintf(stderr, "Dedup index full, %s not indexed\n", c->sname);
+            char rb[32];
+            human_bytes((double)c->dreused, rb, sizeof(rb));
+            fprintf(stderr, "Received %s (%lu bytes, %s from %u of %u chunks already here, %.2fs)\n", c->sname,
+                    (unsigned long)c->filesize, rb, (unsigned)p->have, (unsigned)p->count, now_sec() - c->t0);
+            stat_add(&c->owner->st.dedup, c->dreused);
+        }
+    }
+    dedup_plan_free(c->plan);
+    c->plan = NULL;
+    return conn_file_done(c, st);
+}
+
+// Copy the chunks dchunk..dcopy_end - 1 from where they are here. Each one
+// is read into the worker buffer and must still have the CRC it was
+// indexed with before it is written; otherwise the file fails with
+// LANDROP_ST_STALE and the client sends it again in full. Yields like
+// conn_local_copy().
+static int conn_dedup_copy(struct worker *w, struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    size_t budget = LOCAL_COPY_BUDGET;
+    while (c->dchunk < c->dcopy_end && budget > 0) {
+        const struct dedup_loc *l = &p->locs[c->dchunk];
+        if (c->out_fd >= 0) {
+            int src = p->srcfd[p->src[c->dchunk]];
+            if (pread_full(src, w->buf, l->len, (int64_t)l->off) < 0 || crc32c(0, w->buf, l->len) != l->crc) {
+                fprintf(stderr, "Chunk %u of %s changed here since it was indexed, asking for the file again\n",
+                        (unsigned)c->dchunk, c->sname);
+                dedup_forget(g_dedup, l->file);
+                close(c->out_fd);
+                c->out_fd = -1;
+                unlinkat(c->dfd, c->part, 0);
+                c->status = LANDROP_ST_STALE;
+            } else if (write_full(c->out_fd, w->buf, l->len) < 0) {
+                perror("write file data");
+                return -1;
+            }
+        }
+        c->dreused += l->len;
+        budget -= budget < l->len ? budget : l->len;
+        c->dchunk++;
+    }
+    if (c->dchunk == c->dcopy_end) {
+        c->state = CS_DEDUP_NEXT;
+        return 1;
+    }
+    if (!c->noted) {
+        c->yielded = true;
+        mailbox_post(c, 0);
+    }
+    return 0;
+}
+
+// Place the next chunk: receive it if we lacked it, otherwise copy it from
+// where it is, together with the chunks after it that we hold too
+static int conn_dedup_next(struct conn *c) {
+    struct dedup_plan *p = c->plan;
+    if (c->dchunk == p->count)
+        return conn_dedup_end(c);
+    int src = p->src[c->dchunk];
+    if (src < 0) {
+        c->left = get_be32(p->list + (size_t)c->dchunk * LFT2_CHUNK_ENTRY_LEN + DEDUP_HASH_LEN);
+        c->bodylen = c->left;
+        c->crc = 0;
+        c->csum = true;
+        c->state = CS_DEDUP_LIT;
+        return 0;
+    }
+    c->dcopy_end = c->dchunk + 1;
+    while (c->dcopy_end < p->count && p->src[c->dcopy_end] >= 0)
+        c->dcopy_end++;
+    c->state = CS_DEDUP_COPY;
+    return 0;
+}
+
+// A chunk we lacked has arrived: it must be what the list said
+static int conn_on_dedup_lit(struct conn *c) {
+    const unsigned char *e = c->plan->list + (size_t)c->dchunk * LFT2_CHUNK_ENTRY_LEN;
+    uint32_t want = get_be32(e + DEDUP_HASH_LEN + 4);
+    if (c->out_fd >= 0 && c->crc != want) {
+        fprintf(stderr, "Checksum mismatch for %s in chunk %u (got %08x, sender has %08x)\n", c->sname,
+                (unsigned)c->dchunk, (unsigned)c->crc, (unsigned)want);
+        close(c->out_fd);
+        c->out_fd = -1;
+        unlinkat(c->dfd, c->part, 0);
+        c->status = LANDROP_ST_CHECKSUM;
+    }
+    c->dchunk++;
+    c->state = CS_DEDUP_NEXT;
+    return 0;
+}
+
+// Open the partial file of a resumable upload at the client's offset.
+// Returns a status byte value.
+static int conn_open_part(struct conn *c) {
+    int fd = openat(c->dfd, c->part, O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open partial file");
+        return LANDROP_ST_OPEN;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < c->roff) {
+        fprintf(stderr, "Partial file of %s is shorter than the resume offset\n", c->sname);
+        close(fd);
+        return LANDROP_ST_IO;
+    }
+    // Anything past the offset is dropped and sent again
+    if (ftruncate(fd, (off_t)c->roff) < 0 || lseek(fd, (off_t)c->roff, SEEK_SET) < 0) {
+        perror("truncate partial file");
+        close(fd);
+        return LANDROP_ST_IO;
+    }
+    if (preallocate(fd, c->roff, c->filesize - c->roff) < 0) {
+        perror("preallocate");
+        close(fd);
+        return LANDROP_ST_IO;
+    }
+    if (c->roff > 0)
+        fprintf(stderr, "Resuming %s at %lu bytes\n", c->sname, (unsigned long)c->roff);
+    c->out_fd = fd;
+    c->resumable = true;
+    return LANDROP_ST_OK;
+}
+
+// Get frame with an acceptable name: the file from g_files and the part of
+// the range it has
+static int conn_on_get(struct conn *c) {
+    struct stat st;
+    bool hit;
+    int fd = fdcache_get(g_files, c->sname, &st, &hit);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Cannot serve %s: %s\n", c->sname, strerror(errno));
+        return conn_file_done(c, LANDROP_ST_OPEN);
+    }
+    if (!hit)
+        stat_add(&c->owner->st.file_opens, 1);
+    c->src_fd = fd;
+    c->filesize = (uint64_t)st.st_size;
+    c->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+    if (c->src_off > c->filesize)
+        return conn_file_done(c, LANDROP_ST_RANGE);
+    if (c->src_left > c->filesize - c->src_off)
+        c->src_left = c->filesize - c->src_off;
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+static int conn_on_name(struct worker *w, struct conn *c) {
+    c->name[c->namelen] = '\0';
+    if (sanitize_path(c->name, c->sname, sizeof(c->sname)) != 0 || c->sname[0] == '\0' ||
+        reserved_name(c->sname)) {
+        fprintf(stderr, "Invalid filename\n");
+        return c->proto == 1 ? -1 : conn_reject(c, LANDROP_ST_BADNAME);
+    }
+    // A download creates nothing here, not even the directories on the way
+    if (c->proto == 2 && c->frame == LFT2_FRAME_GET)
+        return conn_on_get(c);
+    int dst = dest_resolve(c->sname, &c->dfd, c->path, sizeof(c->path));
+    if (dst != LANDROP_ST_OK)
+        return conn_reject(c, (unsigned char)dst);
+
+    if (c->proto == 2 && (c->frame == LFT2_FRAME_QUERY || c->frame == LFT2_FRAME_RFILE)) {
+        if (snprintf(c->part, sizeof(c->part), ".%s.%llu-%llu.lpart", c->path,
+                     (unsigned long long)c->filesize, (unsigned long long)c->mtime_ns) >= (int)sizeof(c->part)) {
+            fprintf(stderr, "Destination path too long\n");
+            return conn_reject(c, LANDROP_ST_BADNAME);
+        }
+        if (c->frame == LFT2_FRAME_QUERY)
+            return conn_on_query(w, c);
+        int st = conn_open_part(c);
+        if (st != LANDROP_ST_OK)
+            return conn_reject(c, (unsigned char)st);
+    } else if (c->proto == 2 && c->frame == LFT2_FRAME_SIGREQ) {
+        return conn_on_sigreq(w, c);
+    } else if (c->proto == 2 && c->frame == LFT2_FRAME_DELTA) {
+        return conn_on_delta(c);
+    } else if (c->proto == 2 && c->frame == LFT2_FRAME_CHUNKS) {
+        return conn_on_chunks(c);
+    } else if (c->proto == 2 && c->frame == LFT2_FRAME_DEDUP) {
+        return conn_on_dedup(c);
+    } else if (c->proto == 2 && c->frame == LFT2_FRAME_STRIPE) {
+        int st = conn_stripe_attach(c);
+        if (st != LANDROP_ST_OK)
+            return conn_reject(c, (unsigned char)st);
+    } else {
+        int flags = O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (conn_may_replace(c) ? O_TRUNC : O_EXCL);
+        int fd = openat(c->dfd, c->path, flags, 0644);
+        if (fd < 0) {
+            perror("open dest file");
+            return conn_reject(c, LANDROP_ST_OPEN);
+        }
+        if (preallocate(fd, 0, c->filesize) < 0) {
+            perror("preallocate");
+            close(fd);
+            unlinkat(c->dfd, c->path, 0);
+            return conn_reject(c, LANDROP_ST_IO);
+        }
+        c->out_fd = fd;
+        conn_direct_open(c);
+    }
+    c->left = c->bodylen;
+    c->t0 = now_sec();
+    c->state = CS_BODY;
+    c->splice = g_cfg.use_splice && w->pipe[0] >= 0 && conn_raw_rx(c);
+    // The checksum needs every byte in userspace anyway; hashing it in the
+    // read buffer while it is still in cache beats splicing and reading back.
+    c->csum = conn_trailer_len(c) > 0;
+    c->crc = 0;
+    c->zip = conn_zipped(c);
+    c->zpayload = false;
+    c->wire = 0;
+    if (c->csum || c->zip || c->dbuf)
+        c->splice = false;
+    conn_set_active(c, true);
+    if (c->left == 0)
+        return conn_end_body(c);
+    return 0;
+}
+
+// Manifest frame: [be32 count] [be32 length] [1 byte flags]. Each manifest
+// replaces the last one's list: the client sends the files it asked for
+// before the next manifest. The entries go to the arena, like a batch.
+static int conn_on_manifest_header(struct conn *c) {
+    uint32_t count = get_be32(c->hdr);
+    uint32_t len = get_be32(c->hdr + 4);
+    unsigned char flags = c->hdr[8];
+    size_t entry = 2 + 2 + 8 + 8 + (flags & LFT2_MANIFEST_F_CRC ? 4 : 0);
+    if (count == 0 || count > LFT2_MANIFEST_MAX_ENTRIES || len > LFT2_MANIFEST_MAX_LEN ||
+        len < count * entry || (flags & ~LFT2_MANIFEST_F_CRC)) {
+        fprintf(stderr, "Bad manifest header\n");
+        return -1;
+    }
+    sync_list_free(c->sync);
+    struct sync_list *l = (struct sync_list *)calloc(1, sizeof(*l));
+    c->sync = l;
+    uint32_t n = 16;
+    while (n < 2 * count)
+        n *= 2;
+    if (l) {
+        l->count = count;
+        l->len = len;
+        l->flags = flags;
+        l->mask = n - 1;
+        l->bits = (unsigned char *)calloc((count + 7) / 8, 1);
+        l->want = (struct sync_want *)calloc(n, sizeof(*l->want));
+    }
+    if (!l || !l->bits || !l->want) {
+        perror("calloc manifest");
+        return -1;
+    }
+    if (len > c->arena_cap) {
+        unsigned char *a = (unsigned char *)realloc(c->arena, len);
+        if (!a) {
+            perror("realloc arena");
+            return -1;
+        }
+        c->arena = a;
+        c->arena_cap = len;
+    }
+    c->state = CS_MANIFEST;
+    return 0;
+}
+
+// Whether we hold sname in the version listed. If not, it goes on the list
+// of files to take, allowed to replace what is there if that is a regular
+// file (never a symlink or anything else).
+static bool sync_check(struct sync_list *l, const char *sname, uint64_t size, uint64_t mtime_ns, uint32_t crc) {
+    const char *leaf;
+    int dfd = dircache_get(g_dirs, sname, &leaf);
+    struct stat st;
+    bool have = dfd >= 0 && fstatat(dfd, leaf, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    bool replace = have ? S_ISREG(st.st_mode) : dfd >= 0 && errno == ENOENT;
+    bool same = have && S_ISREG(st.st_mode) && (uint64_t)st.st_size == size;
+    uint64_t ours = have ? (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec : 0;
+    if (same && (l->flags & LFT2_MANIFEST_F_CRC)) {
+        // Same content counts whatever the mtime; take the sender's then
+        int fd = openat(dfd, leaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        uint32_t got = 0;
+        same = fd >= 0 && crc32c_fd_prefix(fd, size, &got, &g_stop) == 0 && got == crc;
+        if (same && ours != mtime_ns) {
+            struct timespec ts[2] = {
+                { 0, UTIME_OMIT },
+                { (time_t)(mtime_ns / 1000000000u), (long)(mtime_ns % 1000000000u) },
+            };
+            if (futimens(fd, ts) < 0)
+                perror("set mtime");
+        }
+        if (fd >= 0)
+            close(fd);
+    } else if (same) {
+        same = ours == mtime_ns;
+    }
+    dircache_put(g_dirs, dfd);
+    if (same)
+        return true;
+    uint32_t i = crc32c(0, sname, strlen(sname)) & l->mask;
+    while (l->want[i].sname && strcmp(l->want[i].sname, sname) != 0)
+        i = (i + 1) & l->mask;
+    struct sync_want *e = &l->want[i];
+    if (!e->sname && !(e->sname = strdup(sname)))
+        return false; // then it cannot replace anything
+    e->mtime_ns = mtime_ns;
+    e->replace = replace;
+    return false;
+}
+
+// Helper thread: decode the manifest and compare every entry with what we
+// hold. Entries with names we would refuse are never up to date; their
+// files are refused when they come.
+static void manifest_scan(struct conn *c) {
+    struct sync_list *l = c->sync;
+    const unsigned char *p = c->arena;
+    const unsigned char *end = c->arena + l->len;
+    size_t tail = 8 + 8 + (l->flags & LFT2_MANIFEST_F_CRC ? 4 : 0);
+    char path[4096 + 1];
+    char sname[4096];
+    size_t plen = 0;
+    for (uint32_t i = 0; i < l->count; ++i) {
+        if (end - p < 4) {
+            l->bad = true;
+            return;
+        }
+        uint16_t keep = get_be16(p);
+        uint16_t n = get_be16(p + 2);
+        p += 4;
+        if (keep > plen || keep + n > 4096 || keep + n == 0 || (size_t)(end - p) < n + tail) {
+            l->bad = true;
+            return;
+        }
+        memcpy(path + keep, p, n);
+        plen = keep + n;
+        path[plen] = '\0';
+        p += n;
+        uint64_t size = get_be64(p);
+        uint64_t mtime_ns = get_be64(p + 8);
+        uint32_t crc = (l->flags & LFT2_MANIFEST_F_CRC) ? get_be32(p + 16) : 0;
+        p += tail;
+        if (g_stop || sanitize_path(path, sname, sizeof(sname)) != 0 || sname[0] == '\0' || reserved_name(sname))
+            continue;
+        if (sync_check(l, sname, size, mtime_ns, crc)) {
+            l->bits[i / 8] |= (unsigned char)(1u << (i % 8));
+            l->fresh++;
+        }
+    }
+    l->bad = p != end;
+}
+
+static int conn_on_manifest(struct conn *c) {
+    struct sync_list *l = c->sync;
+    if (l->bad) {
+        fprintf(stderr, "Bad manifest\n");
+        return -1;
+    }
+    fprintf(stderr, "\nSync: %u of %u files up to date\n", (unsigned)l->fresh, (unsigned)l->count);
+    return conn_file_done(c, LANDROP_ST_OK);
+}
+
+// Batch frame: [be32 count] [be32 index length] [be64 data length]. The
+// arena grows to the largest batch seen on the connection and stays.
+static int conn_on_batch_header(struct conn *c) {
+    c->bcount = get_be32(c->hdr);
+    c->blen_index = get_be32(c->hdr + 4);
+    c->bodylen = get_be64(c->hdr + 8);
+    if (c->bcount == 0 || c->bcount > LFT2_BATCH_MAX_FILES || c->blen_index < c->bcount * (8u + 2 + 1) ||
+        c->blen_index > LFT2_BATCH_MAX_INDEX || c->bodylen > LFT2_BATCH_MAX_DATA) {
+        fprintf(stderr, "Bad batch header\n");
+        return -1;
+    }
+    size_t need = c->blen_index + (size_t)c->bodylen;
+    if (need > c->arena_cap) {
+        unsigned char *a = (unsigned char *)realloc(c->arena, need);
+        if (!a) {
+            perror("realloc arena");
+            return -1;
+        }
+        c->arena = a;
+        c->arena_cap = need;
+    }
+    c->state = CS_BATCH_INDEX;
+    return 0;
+}
+
+// Index complete: check that it adds up, then receive the content
+static int conn_on_batch_index(struct conn *c) {
+    const unsigned char *p = c->arena;
+    const unsigned char *end = c->arena + c->blen_index;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < c->bcount; ++i) {
+        if (end - p < 8 + 2)
+            break;
+        uint64_t size = get_be64(p);
+        uint16_t namelen = get_be16(p + 8);
+        p += 8 + 2;
+        if (namelen == 0 || namelen > 4096 || end - p < namelen || size > c->bodylen - total) {
+            p = NULL;
+            break;
+        }
+        p += namelen;
+        total += size;
+    }
+    if (p != end || total != c->bodylen) {
+        fprintf(stderr, "Bad batch index\n");
+        return -1;
+    }
+    c->batch = true;
+    c->arena_len = c->blen_index;
+    c->left = c->bodylen;
+    c->t0 = now_sec();
+    c->state = CS_BODY;
+    c->splice = false;
+    c->csum = conn_trailer_len(c) > 0;
+    c->crc = 0;
+    c->zip = conn_zipped(c);
+    c->zpayload = false;
+    c->wire = 0;
+    conn_set_active(c, true);
+    if (c->left == 0)
+        return conn_end_body(c);
+    return 0;
+}
+
+// Content of the current frame goes to the destination file, or to the
+// arena for a batch
+static int conn_sink(struct conn *c, const void *p, size_t n) {
+    if (c->batch) {
+        memcpy(c->arena + c->arena_len, p, n);
+        c->arena_len += n;
+        return 0;
+    }
+    if (c->dbuf) {
+        const unsigned char *in = (const unsigned char *)p;
+        while (n > 0) {
+            size_t k = DIRECT_BUF - c->dlen < n ? DIRECT_BUF - c->dlen : n;
+            memcpy(c->dbuf + c->dlen, in, k);
+            c->dlen += k;
+            in += k;
+            n -= k;
+            if (c->dlen == DIRECT_BUF) {
+                uint64_t t0 = lat_start();
+                if (conn_direct_flush(c, false) < 0)
+                    return -1;
+                lat_end(c->owner, STATS_DISK_WRITE, t0);
+            }
+        }
+        return 0;
+    }
+    uint64_t t0 = lat_start();
+    int rc = c->xfer ? pwrite_full(c->out_fd, p, n, (off_t)c->woff) : write_full(c->out_fd, p, n);
+    if (rc == 0)
+        lat_end(c->owner, STATS_DISK_WRITE, t0);
+    return rc;
+}
+
+// Account the body bytes that arrived since the last call and publish the
+// position for the progress line. Runs per chunk: no clock, no output.
+static void conn_body_progress(struct conn *c) {
+    if (!c->active)
+        return;
+    struct worker *w = c->owner;
+    uint64_t done = c->bodylen - c->left;
+    uint64_t wire = c->zip ? c->wire : done;
+    stat_add(&w->st.bytes, done - c->pdone);
+    stat_add(&w->st.wire, wire - c->pwire);
+    c->pdone = done;
+    c->pwire = wire;
+    __atomic_store_n(&w->prog_done, done, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->prog_wire, wire, __ATOMIC_RELAXED);
+}
+
+// Body through the worker's buffer: read() from the socket, write() to disk.
+static int conn_copy_body(struct worker *w, struct conn *c) {
+    size_t budget = BODY_BUDGET;
+    while (c->left > 0 && budget > 0) {
+        size_t chunk = c->left > g_cfg.chunk ? g_cfg.chunk : (size_t)c->left;
+        uint64_t t0 = lat_start();
+        ssize_t r = conn_read(c, w->buf, chunk);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("read file data");
+            return -1;
+        }
+        if (r == 0) {
+            errno = EPIPE;
+            perror("read file data");
+            return -1;
+        }
+        lat_end(w, STATS_SOCK_READ, t0);
+        if (c->csum)
+            c->crc = crc32c(c->crc, w->buf, (size_t)r);
+        if (conn_sink(c, w->buf, (size_t)r) < 0) {
+            perror("write file data");
+            return -1;
+        }
+        c->woff += r;
+        c->left -= (uint64_t)r;
+        budget -= (size_t)r < budget ? (size_t)r : budget;
+        conn_body_progress(c);
+    }
+    return c->left == 0 ? 1 : 0;
 }
 
-static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s -p <port> -d <dest_dir> [-o]\n", prog);
-    fprintf(stderr, "  -p: TCP port to listen on\n");
-    fprintf(stderr, "  -d: destination directory to save files\n");
-    fprintf(stderr, "  -o: overwrite existing files (default: fail if exists)\n");
+// Move everything sitting in the worker pipe into the destination file.
+// The pipe is shared by all connections of the worker, so it must be empty
+// again before we return; on failure it is replaced.
+static int worker_pipe_drain(struct worker *w, struct conn *c, size_t n) {
+    while (n > 0) {
+        uint64_t t0 = lat_start();
+        ssize_t r = splice(w->pipe[0], NULL, c->out_fd, c->xfer ? &c->woff : NULL, n, SPLICE_F_MOVE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            if (r == 0)
+                errno = EIO;
+            perror("splice to file");
+            worker_pipe_reset(w);
+            return -1;
+        }
+        lat_end(w, STATS_DISK_WRITE, t0);
+        n -= (size_t)r;
+    }
+    return 0;
 }
 
-static int ensure_dir(const char *path) {
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        return S_ISDIR(st.st_mode) ? 0 : -1;
+// Body through splice(2): socket -> pipe -> file, the payload pages never
+// reach userspace. Accounting is identical to the copy path: c->left only
+// drops by what actually landed in the file, so a short upload still ends
+// in conn_close() unlinking the partial file.
+static int conn_splice_body(struct worker *w, struct conn *c) {
+    size_t budget = BODY_BUDGET;
+    while (c->left > 0 && budget > 0) {
+        size_t chunk = c->left > w->pipe_sz ? w->pipe_sz : (size_t)c->left;
+        if (g_shaping && (chunk = conn_allow(c, chunk)) == 0)
+            return 0;
+        uint64_t t0 = lat_start();
+        ssize_t r = splice(c->fd, NULL, w->pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (g_shaping)
+            conn_refund(c, r > 0 ? chunk - (size_t)r : chunk);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINVAL && c->left == c->bodylen) {
+                // Not spliceable (e.g. the destination filesystem): copy instead
+                c->splice = false;
+                return conn_copy_body(w, c);
+            }
+            perror("splice from socket");
+            return -1;
+        }
+        if (r == 0) {
+            errno = EPIPE;
+            perror("read file data");
+            return -1;
+        }
+        lat_end(w, STATS_SOCK_READ, t0);
+        if (worker_pipe_drain(w, c, (size_t)r) < 0)
+            return -1;
+        c->left -= (uint64_t)r;
+        budget -= (size_t)r < budget ? (size_t)r : budget;
+        conn_body_progress(c);
     }
-    if (errno != ENOENT) 
-        return -1;
-    return mkdir(path, 0755);
+    return c->left == 0 ? 1 : 0;
 }
 
-static int handle_client(int cfd, const char *dest_dir, bool overwrite) {
-    char magic[LANDROP_MAGIC_LEN];
-    if (read_full(cfd, magic, LANDROP_MAGIC_LEN) < 0) {
-        perror("read magic");
-        return -1;
+// Body as LFT2_F_COMPRESS chunks, each decoded into the worker buffer and
+// written out. Without a destination (a rejected frame) the chunks are
+// only skipped.
+static int conn_zip_body(struct worker *w, struct conn *c) {
+    size_t budget = BODY_BUDGET;
+    if (!c->zbuf) {
+        c->zbuf = (unsigned char *)malloc(LFT2_ZHDR_LEN + LZ_BOUND(LFT2_ZCHUNK));
+        if (!c->zbuf) {
+            perror("malloc");
+            return -1;
+        }
     }
-    if (memcmp(magic, LANDROP_MAGIC, LANDROP_MAGIC_LEN) != 0) {
-        fprintf(stderr, "Invalid magic from client\n");
-        return -1;
+    while (c->left > 0 && budget > 0) {
+        size_t want = c->left > LFT2_ZCHUNK ? LFT2_ZCHUNK : (size_t)c->left;
+        int rc;
+        if (!c->zpayload) {
+            rc = conn_fill(c, c->zbuf, LFT2_ZHDR_LEN, "read chunk header");
+            if (rc <= 0)
+                return rc;
+            uint32_t h = get_be32(c->zbuf);
+            c->zlen = h & ~LFT2_Z_COMPRESSED;
+            if ((h & LFT2_Z_COMPRESSED) ? (c->zlen == 0 || c->zlen > LZ_BOUND(want)) : c->zlen != want) {
+                fprintf(stderr, "Bad chunk header\n");
+                return -1;
+            }
+            c->zpayload = true;
+        }
+        rc = conn_fill(c, c->zbuf + LFT2_ZHDR_LEN, c->zlen, "read file data");
+        if (rc <= 0)
+            return rc;
+        c->zpayload = false;
+        if (c->out_fd >= 0 || c->batch) {
+            const char *data = (const char *)c->zbuf + LFT2_ZHDR_LEN;
+            if (get_be32(c->zbuf) & LFT2_Z_COMPRESSED) {
+                if (lz_decompress(data, c->zlen, w->buf, want) < 0) {
+                    fprintf(stderr, "Corrupt compressed chunk\n");
+                    return -1;
+                }
+                data = w->buf;
+            }
+            if (c->csum)
+                c->crc = crc32c(c->crc, data, want);
+            if (conn_sink(c, data, want) < 0) {
+                perror("write file data");
+                return -1;
+            }
+        }
+        c->woff += (loff_t)want;
+        c->left -= want;
+        c->wire += LFT2_ZHDR_LEN + c->zlen;
+        budget -= LFT2_ZHDR_LEN + c->zlen < budget ? LFT2_ZHDR_LEN + c->zlen : budget;
+        if (c->out_fd >= 0 || c->batch)
+            conn_body_progress(c);
     }
-    uint64_t be_size;
-    uint16_t be_namelen;
-    if (read_full(cfd, &be_size, sizeof(be_size)) < 0) { 
-        perror("read size"); 
-        return -1; 
+    return c->left == 0 ? 1 : 0;
+}
+
+// Queue the next round of the body once the last one has completed: up to
+// URING_CHAIN receive -> write pairs through the slot's buffer, all linked,
+// so each receive waits for the write before it and the data lands in
+// order. Handed to the kernel by the next uring_submit().
+static void conn_uring_fill(struct worker *w, struct conn *c) {
+    if (c->uerr || c->uinflight > 0 || c->urecv_left == 0)
+        return;
+    unsigned char *buf = w->ubufs + (size_t)c->uslot * URING_BUF;
+    unsigned pairs = 0;
+    c->uchain_len = 0;
+    while (pairs < URING_CHAIN && c->urecv_left > 0) {
+        uint32_t n = c->urecv_left > URING_BUF ? URING_BUF : (uint32_t)c->urecv_left;
+        c->urecv_left -= n;
+        bool last = pairs == URING_CHAIN - 1 || c->urecv_left == 0;
+
+        struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = (int)(2 * c->uslot);
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = n;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->user_data = UTAG(c, 2 * pairs);
+
+        sqe = uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = (int)(2 * c->uslot + 1);
+        sqe->flags = IOSQE_FIXED_FILE | (last ? 0 : IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = n;
+        sqe->off = c->uoff;
+        sqe->buf_index = (uint16_t)c->uslot;
+        sqe->user_data = UTAG(c, 2 * pairs + 1);
+
+        c->uoff += n;
+        c->uchain_len += n;
+        c->ulast = n;
+        pairs++;
     }
-    if (read_full(cfd, &be_namelen, sizeof(be_namelen)) < 0) { 
-        perror("read name len"); 
-        return -1; 
+    c->uops = 2 * pairs;
+    c->uinflight = c->uops;
+}
+
+// Hand the rest of a plain body to the ring. Returns 1 if it took it, 0 if
+// the body stays on the epoll path (not worth it, no free slot, or content
+// that has to pass through our own buffers).
+static int conn_uring_start(struct worker *w, struct conn *c) {
+    if (!w->uring || g_shaping || c->csum || c->zip || c->batch || c->dbuf || !conn_raw_rx(c) || c->out_fd < 0 ||
+        c->left < URING_MIN_BODY || w->uslots == 0)
+        return 0;
+    unsigned slot = (unsigned)__builtin_ctz(w->uslots);
+    int fds[2] = { c->fd, c->out_fd };
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = 2 * slot;
+    up.fds = (uint64_t)(uintptr_t)fds;
+    if (uring_register(&w->ring, IORING_REGISTER_FILES_UPDATE, &up, 2) < 0) {
+        perror("io_uring register files");
+        return 0;
     }
-    uint64_t filesize = be64_to_host(be_size);
-    uint16_t namelen = ntohs(be_namelen);
-    if (namelen == 0 || namelen > 4096) {
-        fprintf(stderr, "Bad name length: %u\n", namelen);
-        return -1;
+    // Receives wait in the ring, not on EAGAIN
+    int fl = fcntl(c->fd, F_GETFL);
+    if (fl >= 0)
+        (void)fcntl(c->fd, F_SETFL, fl & ~O_NONBLOCK);
+    w->uslots &= ~(1u << slot);
+    c->uslot = slot;
+    c->uinflight = 0;
+    c->urecv_left = c->left;
+    c->uoff = c->xfer ? (uint64_t)c->woff : c->resumable ? c->roff : 0;
+    c->uerr = 0;
+    c->state = CS_URING;
+    // Submitted with the others at the end of the worker's event batch
+    conn_uring_fill(w, c);
+    return 1;
+}
+
+// Returns 1 when the body is complete, 0 if the socket would block or the
+// per-event budget is spent, -1 on error.
+static int conn_read_body(struct worker *w, struct conn *c) {
+    if (c->left == c->bodylen && conn_uring_start(w, c))
+        return 0;
+    if (c->zip)
+        return conn_zip_body(w, c);
+    return c->splice ? conn_splice_body(w, c) : conn_copy_body(w, c);
+}
+
+// Skip the body of a rejected file. Returns like conn_read_body().
+static int conn_discard_body(struct worker *w, struct conn *c) {
+    if (c->zip) {
+        int rc = conn_zip_body(w, c);
+        if (rc <= 0)
+            return rc;
+        c->zip = false;
+        c->left = conn_trailer_len(c);
     }
-    char *name = (char *)malloc((size_t)namelen + 1);
-    if (!name) { perror("malloc name"); 
-        return -1; 
+    size_t budget = BODY_BUDGET;
+    while (c->left > 0 && budget > 0) {
+        size_t chunk = c->left > g_cfg.chunk ? g_cfg.chunk : (size_t)c->left;
+        ssize_t r = conn_read(c, w->buf, chunk);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("read file data");
+            return -1;
+        }
+        if (r == 0) {
+            errno = EPIPE;
+            perror("read file data");
+            return -1;
+        }
+        c->left -= (uint64_t)r;
+        budget -= (size_t)r < budget ? (size_t)r : budget;
     }
-    if (read_full(cfd, name, namelen) < 0) {
-        perror("read name");
-        free(name);
+    return c->left == 0 ? 1 : 0;
+}
+
+// The range of a get frame to the client, once its header is out: the
+// kernel copies it from the page cache with sendfile() where it can, and
+// records OpenSSL has to encrypt go through the worker buffer. A chunk
+// retried after EAGAIN is read again from the same offset, which is what
+// OpenSSL wants to see when a write is repeated. Returns 1 when done, 0
+// when the socket is full or the budget is spent (EPOLLOUT brings us back
+// after the other connections had their turn), -1 on error.
+static int conn_send_range(struct worker *w, struct conn *c) {
+    // The header shares a segment with the start of the content instead of
+    // going out alone, which Nagle would hold the content back behind
+    if (conn_flush_more(c, true) < 0)
         return -1;
+    if (conn_pending(c) > 0)
+        return 0;
+    bool raw = !c->tls || tls_kernel_tx(c->tls);
+    size_t budget = BODY_BUDGET;
+    while (c->src_left > 0 && budget > 0) {
+        size_t n = c->src_left > budget ? budget : (size_t)c->src_left;
+        ssize_t r;
+        if (raw) {
+            off_t off = (off_t)c->src_off;
+            r = sendfile(c->fd, c->src_fd, &off, n);
+        } else {
+            if (n > g_cfg.chunk)
+                n = g_cfg.chunk;
+            r = pread(c->src_fd, w->buf, n, (off_t)c->src_off);
+            if (r > 0)
+                r = tls_write(c->tls, w->buf, (size_t)r, c->src_left > (uint64_t)r);
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("send file data");
+            return -1;
+        }
+        if (r == 0) {
+            // The client was promised more than there is now: all we can
+            // do is hang up
+            fprintf(stderr, "%s shrank while sending it\n", c->sname);
+            return -1;
+        }
+        c->src_off += (uint64_t)r;
+        c->src_left -= (uint64_t)r;
+        budget -= (size_t)r;
+        stat_add(&w->st.served, (uint64_t)r);
     }
-    name[namelen] = '\0';
+    if (c->src_left > 0)
+        return 0;
+    fdcache_put(g_files, c->src_fd);
+    c->src_fd = -1;
+    c->state = CS_FRAME;
+    return 1;
+}
 
-    char sname[4096];
-    if (sanitize_filename(name, sname, sizeof(sname)) != 0) {
-        fprintf(stderr, "Invalid filename\n");
-        free(name);
-        return -1;
+// Advance the state machine by one step. Returns 1 if it made progress,
+// 0 if the socket has nothing more for now, -1 if the connection must close.
+static int conn_step(struct worker *w, struct conn *c) {
+    int rc;
+    switch (c->state) {
+        case CS_TLS:
+            rc = tls_handshake(c->tls);
+            if (rc <= 0)
+                return rc;
+            c->state = CS_MAGIC;
+            return 1;
+        case CS_MAGIC:
+            rc = conn_fill(c, c->hdr, LANDROP_MAGIC_LEN, "read magic");
+            if (rc <= 0)
+                return rc;
+            return conn_on_magic(c) < 0 ? -1 : 1;
+        case CS_HEADER:
+        case CS_FILE_HDR:
+            rc = conn_fill(c, c->hdr, 8 + 2, "read header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_file_header(c) < 0 ? -1 : 1;
+        case CS_STRIPE_HDR:
+            rc = conn_fill(c, c->hdr, 4 * 8 + 2 + 2, "read stripe header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_stripe_header(c) < 0 ? -1 : 1;
+        case CS_QUERY_HDR:
+        case CS_RFILE_HDR:
+            rc = conn_fill(c, c->hdr, c->state == CS_RFILE_HDR ? 8 + 8 + 8 + 2 : 8 + 8 + 2, "read header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_resume_header(c) < 0 ? -1 : 1;
+        case CS_BATCH_HDR:
+            rc = conn_fill(c, c->hdr, 4 + 4 + 8, "read batch header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_batch_header(c) < 0 ? -1 : 1;
+        case CS_BATCH_INDEX:
+            rc = conn_fill(c, c->arena, c->blen_index, "read batch index");
+            if (rc <= 0)
+                return rc;
+            return conn_on_batch_index(c) < 0 ? -1 : 1;
+        case CS_PROBE_HDR:
+            rc = conn_fill(c, c->hdr, 8, "read probe header");
+            if (rc <= 0)
+                return rc;
+            // Filler only: read and drop it, then ack
+            c->left = get_be64(c->hdr);
+            c->status = LANDROP_ST_OK;
+            c->zip = false;
+            c->state = CS_DISCARD;
+            return 1;
+        case CS_CHUNKS_HDR:
+            rc = conn_fill(c, c->hdr, 8 + 4 + 2, "read header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_chunks_header(c) < 0 ? -1 : 1;
+        case CS_CHUNK_LIST:
+            rc = conn_fill(c, c->plan->list, c->bodylen, "read chunk list");
+            if (rc <= 0)
+                return rc;
+            return conn_on_chunk_list(w, c) < 0 ? -1 : 1;
+        case CS_MANIFEST_HDR:
+            rc = conn_fill(c, c->hdr, 4 + 4 + 1, "read manifest header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_manifest_header(c) < 0 ? -1 : 1;
+        case CS_MANIFEST:
+            rc = conn_fill(c, c->arena, c->sync->len, "read manifest");
+            if (rc <= 0)
+                return rc;
+            return conn_offload(w, c, manifest_scan, conn_on_manifest) < 0 ? -1 : 1;
+        case CS_GET_HDR:
+            rc = conn_fill(c, c->hdr, 8 + 8 + 2, "read get header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_get_header(c) < 0 ? -1 : 1;
+        case CS_DELTA_HDR:
+            rc = conn_fill(c, c->hdr, c->frame == LFT2_FRAME_DELTA ? 8 + 4 + 2 : 8 + 2, "read header");
+            if (rc <= 0)
+                return rc;
+            return conn_on_delta_header(c) < 0 ? -1 : 1;
+        case CS_HELLO:
+            rc = conn_fill(c, c->hdr, 4, "read hello");
+            if (rc <= 0)
+                return rc;
+            return conn_on_hello(c) < 0 ? -1 : 1;
+        case CS_FRAME:
+            rc = conn_fill(c, c->hdr, 1, "read frame");
+            if (rc <= 0)
+                return rc;
+            return conn_on_frame(c) < 0 ? -1 : 1;
+        case CS_NAME:
+            rc = conn_fill(c, c->name, c->namelen, "read name");
+            if (rc <= 0)
+                return rc;
+            return conn_on_name(w, c) < 0 ? -1 : 1;
+        case CS_BODY:
+            rc = conn_read_body(w, c);
+            if (rc <= 0)
+                return rc;
+            return conn_end_body(c) < 0 ? -1 : 1;
+        case CS_TRAILER:
+            rc = conn_fill(c, c->hdr, LFT2_TRAILER_LEN, "read checksum");
+            if (rc <= 0)
+                return rc;
+            return conn_on_trailer(c) < 0 ? -1 : 1;
+        case CS_DISCARD:
+            rc = conn_discard_body(w, c);
+            if (rc <= 0)
+                return rc;
+            return conn_file_done(c, c->status) < 0 ? -1 : 1;
+        case CS_SEND:
+            return conn_send_range(w, c);
+        case CS_DELTA_OP:
+            rc = conn_fill(c, c->hdr, 1, "read delta op");
+            if (rc <= 0)
+                return rc;
+            return conn_on_delta_op(c) < 0 ? -1 : 1;
+        case CS_DELTA_ARG:
+            rc = conn_fill(c, c->hdr + 1, delta_arg_len(c->dop), "read delta op");
+            if (rc <= 0)
+                return rc;
+            return conn_on_delta_arg(c) < 0 ? -1 : 1;
+        case CS_DELTA_LIT:
+            rc = c->out_fd >= 0 ? conn_copy_body(w, c) : conn_discard_body(w, c);
+            if (rc <= 0)
+                return rc;
+            c->state = CS_DELTA_OP;
+            return 1;
+        case CS_DEDUP_NEXT:
+            return conn_dedup_next(c) < 0 ? -1 : 1;
+        case CS_DEDUP_LIT:
+            rc = c->out_fd >= 0 ? conn_copy_body(w, c) : conn_discard_body(w, c);
+            if (rc <= 0)
+                return rc;
+            return conn_on_dedup_lit(c) < 0 ? -1 : 1;
+        case CS_LOCAL_COPY:
+            return conn_local_copy(w, c);
+        case CS_DEDUP_COPY:
+            return conn_dedup_copy(w, c);
+        case CS_STRIPE_WAIT:
+        case CS_OFFLOAD:
+        case CS_URING:
+        case CS_CLOSING:
+            return 0;
     }
-    free(name);
+    return -1;
+}
 
-    char path[8192];
-    if (snprintf(path, sizeof(path), "%s/%s", dest_dir, sname) >= (int)sizeof(path)) {
-        fprintf(stderr, "Destination path too long\n");
+// Drive the state machine as far as the socket allows. Replies are queued
+// and flushed in one write once the input runs dry, so a stream of small
+// LFT2 files gets its acks batched. Returns -1 when the connection is
+// finished (successfully or not) and must be closed.
+static int conn_drive(struct worker *w, struct conn *c) {
+    while (c->state != CS_CLOSING && c->state != CS_STRIPE_WAIT && c->state != CS_OFFLOAD &&
+           c->state != CS_URING) {
+        if (conn_pending(c) > OUT_HIGH) {
+            if (conn_flush(c) < 0)
+                return -1;
+            if (conn_pending(c) > OUT_HIGH)
+                break;
+        }
+        if (relay_backlog(c) > RELAY_HIGH) {
+            relay_flush(c);
+            if (relay_backlog(c) > RELAY_HIGH)
+                break;
+        }
+        int rc = conn_step(w, c);
+        if (rc < 0)
+            return -1;
+        if (rc == 0)
+            break;
+    }
+    if (conn_flush(c) < 0)
         return -1;
+    if (c->state == CS_CLOSING && conn_pending(c) == 0 && relay_idle(c))
+        return -1;
+    if (relay_watch(w, c) < 0)
+        return -1;
+    if (c->state == CS_OFFLOAD)
+        return 0; // not in the epoll set until the helper is done
+
+    // A client sending its next frames while a range goes out waits for it
+    uint32_t want = 0;
+    if (c->state != CS_CLOSING && c->state != CS_STRIPE_WAIT && c->state != CS_URING && c->state != CS_SEND &&
+        !c->queued && conn_pending(c) <= OUT_HIGH && relay_backlog(c) <= RELAY_HIGH)
+        want |= EPOLLIN;
+    if (conn_pending(c) > 0 || c->state == CS_SEND || (c->state == CS_TLS && tls_want_write(c->tls)))
+        want |= EPOLLOUT;
+    // Records OpenSSL decrypted already are not on the socket any more:
+    // nothing would wake us for them
+    if ((want & EPOLLIN) && c->tls && tls_pending(c->tls) > 0 && !c->noted) {
+        c->yielded = true;
+        mailbox_post(c, 0);
     }
+    return conn_watch(w, c, want);
+}
 
-    int flags = O_CREAT | O_WRONLY | (overwrite ? O_TRUNC : O_EXCL);
-    int fd = open(path, flags, 0644);
-    if (fd < 0) {
-        perror("open dest file");
-        unsigned char status = 2; // cannot open / exists
-        (void)write_full(cfd, &status, 1);
+// Start the connection to the next hop for a client that just arrived.
+// Failing to reach it is not fatal here: the client's files are still
+// stored, and reported as failed with LANDROP_ST_IO (relay_merge()).
+static int relay_open(struct worker *w, struct conn *c) {
+    struct relay *r = (struct relay *)calloc(1, sizeof(*r));
+    if (!r) {
+        perror("calloc relay");
         return -1;
     }
+    c->relay = r;
+    r->fd = socket(g_relay_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (r->fd < 0) {
+        relay_fail(r, "socket");
+        return 0;
+    }
+    // Acks and the ends of frames should not wait for more data
+    int one = 1;
+    (void)setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(r->fd, (struct sockaddr *)&g_relay_addr, g_relay_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            relay_fail(r, "connect");
+            return 0;
+        }
+        r->connecting = true;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = r->events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = RELAY_TAG(c);
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, r->fd, &ev) < 0)
+        relay_fail(r, "epoll_ctl add");
+    return 0;
+}
 
-    const size_t BUF_SZ = 64 * 1024;
-    char *buf = (char *)malloc(BUF_SZ);
-    if (!buf) { perror("malloc buf"); close(fd); return -1; }
+// The socket to the next hop is ready: finish connecting, send what is
+// queued, collect replies, and let the client side carry on
+static void relay_ready(struct worker *w, struct conn *c, uint32_t events) {
+    struct relay *r = c->relay;
+    if (r->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        r->connecting = false;
+        if (err) {
+            errno = err;
+            relay_fail(r, "connect");
+        }
+    }
+    relay_flush(c);
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        relay_recv(r);
+    if (relay_merge(c) < 0 || (c->state != CS_OFFLOAD && conn_drive(w, c) < 0))
+        conn_close(w, c);
+}
 
-    uint64_t left = filesize;
-    uint64_t received = 0;
-    struct timespec ts0, ts_last; clock_gettime(CLOCK_MONOTONIC, &ts0); 
-    ts_last = ts0;
-    while (left > 0) {
-        size_t chunk = left > BUF_SZ ? BUF_SZ : (size_t)left;
-        if (read_full(cfd, buf, chunk) < 0) {
-            perror("read file data");
-            free(buf); close(fd);
-            unlink(path);
-            return -1;
+static void accept_ready(struct worker *w) {
+    for (;;) {
+        struct sockaddr_in caddr; socklen_t clen = sizeof(caddr);
+        int cfd = accept4(w->lfd, (struct sockaddr *)&caddr, &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN: another worker took it, or the backlog is drained
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
         }
-        if (write_full(fd, buf, chunk) < 0) {
-            perror("write file data");
-            free(buf); close(fd);
-            unlink(path);
-            return -1;
+        struct conn *c = (struct conn *)calloc(1, sizeof(*c));
+        if (!c) {
+            perror("calloc conn");
+            close(cfd);
+            continue;
         }
-        left -= chunk;
-        received += chunk;
-        struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
-        double elapsed = (ts.tv_sec - ts0.tv_sec) + (ts.tv_nsec - ts0.tv_nsec)/1e9;
-        double since_last = (ts.tv_sec - ts_last.tv_sec) + (ts.tv_nsec - ts_last.tv_nsec)/1e9;
-        if (since_last >= 0.2 || left == 0) {
-            double pct = filesize ? (100.0 * (double)received / (double)filesize) : 100.0;
-            int barw = 40; 
-            int fill = (int)(pct/100.0*barw + 0.5); 
-            if (fill>barw) 
-                fill=barw;
-
-            char bar[41]; 
-            for (int i=0;i<barw;++i) 
-                bar[i] = i<fill ? '=' : ' '; 
-            
-            bar[barw]='\0';
-            double bps = elapsed>0 ? (double)received/elapsed : 0.0;
-            const char *u[] = {"B","KiB","MiB","GiB","TiB"};
-            char spd[32]; 
-            double v=bps; 
-            int ui=0; 
-            while(v>=1024.0 && ui<4){
-                v/=1024.0;
-                ui++;
+        c->fd = cfd;
+        c->out_fd = -1;
+        c->dfd = -1;
+        c->src_fd = -1;
+        c->state = CS_MAGIC;
+        c->events = EPOLLIN;
+        c->owner = w;
+        if (g_tls) {
+            c->tls = tls_conn_new(g_tls, cfd);
+            if (!c->tls) {
+                close(cfd);
+                free(c);
+                continue;
             }
+            c->state = CS_TLS;
+        }
+        bucket_init(&c->rate, g_cfg.rate_conn);
+        c->ip = ip_rate_get(caddr.sin_addr);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            perror("epoll_ctl add");
+            ip_rate_put(c->ip);
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->next = w->conns;
+        if (w->conns)
+            w->conns->prev = c;
+        w->conns = c;
+        stat_add(&w->st.conns, 1);
+        stat_add(&w->st.open, 1);
+        if (g_cfg.relay && relay_open(w, c) < 0)
+            conn_close(w, c);
+    }
+}
+
+// Resume connections whose stripes were settled by another connection,
+// whose offloaded work is done, or that yielded in the middle of a copy
+static void mailbox_drain(struct worker *w) {
+    uint64_t cnt;
+    if (read(w->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+    pthread_mutex_lock(&w->mbox_lock);
+    struct conn *list = w->mbox;
+    w->mbox = NULL;
+    for (struct conn *c = list; c; c = c->note_next)
+        c->noted = false;
+    pthread_mutex_unlock(&w->mbox_lock);
+    while (list) {
+        struct conn *c = list;
+        list = c->note_next;
+        int rc;
+        if (c->yielded) {
+            c->yielded = false;
+            rc = 0;
+        } else if (c->state == CS_OFFLOAD) {
+            rc = conn_offload_finish(w, c);
+        } else {
+            conn_xfer_release(c);
+            rc = conn_file_done(c, c->note_status);
+        }
+        if (rc < 0 || conn_drive(w, c) < 0)
+            conn_close(w, c);
+    }
+}
+
+// The ring is done with this body: release the slot and carry on in the
+// state machine
+static void conn_uring_finish(struct worker *w, struct conn *c) {
+    int fds[2] = { -1, -1 };
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = 2 * c->uslot;
+    up.fds = (uint64_t)(uintptr_t)fds;
+    // Drops the ring's references, or the files would outlive our close()
+    if (uring_register(&w->ring, IORING_REGISTER_FILES_UPDATE, &up, 2) < 0)
+        perror("io_uring unregister files");
+    w->uslots |= 1u << c->uslot;
+    int fl = fcntl(c->fd, F_GETFL);
+    if (fl >= 0)
+        (void)fcntl(c->fd, F_SETFL, fl | O_NONBLOCK);
+    c->state = CS_BODY;
+    conn_body_progress(c);
+    if (c->uerr) {
+        errno = c->uerr;
+        perror(c->uerr == EPIPE ? "read file data" : "io_uring body");
+        conn_close(w, c);
+        return;
+    }
+    if (conn_end_body(c) < 0 || conn_drive(w, c) < 0)
+        conn_close(w, c);
+}
+
+// Completions: account what reached the file, queue the next rounds. A
+// chain that went through posts only its last write, one that failed only
+// the operation that failed: the ones before it succeeded silently, and the
+// kernel cancels the ones after it without a completion, since their
+// failure was not asked to be skipped but the success of the failed one was.
+static void worker_uring_reap(struct worker *w) {
+    uint64_t cnt;
+    if (read(w->ring_evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+    struct conn *touched = NULL;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(&w->ring)) != NULL) {
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        uring_cqe_seen(&w->ring);
+        // Kernels that do post the cancelled rest of a chain do so after
+        // the failure, when the connection may be gone already
+        if (res == -ECANCELED)
+            continue;
+        struct conn *c = (struct conn *)(uintptr_t)(ud & ~(uint64_t)7);
+        unsigned i = (unsigned)(ud & 7);
+        if (i + 1 == c->uops && res == (int)c->ulast) {
+            // The last write: the whole chain is in the file
+            c->left -= c->uchain_len;
+        } else if (!c->uerr) {
+            // A short receive (EOF), short write or error
+            c->uerr = res < 0 ? -res : (i & 1) ? EIO : EPIPE;
+        }
+        c->uinflight = 0;
+        if (!c->utouched) {
+            c->utouched = true;
+            c->unext = touched;
+            touched = c;
+        }
+    }
+    while (touched) {
+        struct conn *c = touched;
+        touched = c->unext;
+        c->utouched = false;
+        if (c->uinflight == 0 && (c->uerr || c->left == 0)) {
+            conn_uring_finish(w, c);
+        } else {
+            conn_uring_fill(w, c);
+            conn_body_progress(c);
+        }
+    }
+    if (uring_submit(&w->ring) < 0)
+        perror("io_uring_enter");
+}
+
+// Hand the connections waiting under the rate limits their next turn, in
+// the order they queued. One that gets nothing yet (not due, or the
+// buckets still empty) keeps its place at the front; one that read goes
+// to the back, so that connections sharing a bucket take it in turns.
+static void worker_shape_run(struct worker *w) {
+    uint64_t now = shape_now();
+    struct conn *held = NULL, *hlast = NULL;
+    for (unsigned n = w->qlen; n > 0 && w->qhead; --n) {
+        struct conn *c = w->qhead;
+        uint64_t since = c->qsince;
+        shape_unqueue(c);
+        if (c->wake <= now) {
+            if (c->turn == 0)
+                c->turn = g_quantum;
+            size_t turn = c->turn;
+            if (conn_drive(w, c) < 0) {
+                conn_close(w, c);
+                continue;
+            }
+            if (!c->queued || c->turn != turn) {
+                stat_add(&w->st.shaped_ns, now - since);
+                continue;
+            }
+            shape_unqueue(c);
+        }
+        c->queued = true;
+        c->qsince = since;
+        c->qnext = NULL;
+        if (hlast)
+            hlast->qnext = c;
+        else
+            held = c;
+        hlast = c;
+        w->qlen++;
+    }
+    if (held) {
+        hlast->qnext = w->qhead;
+        if (!w->qhead)
+            w->qtail = hlast;
+        w->qhead = held;
+    }
+}
+
+// Milliseconds until the first queued connection is due, at most 250
+static int worker_shape_timeout(struct worker *w) {
+    uint64_t now = shape_now(), next = UINT64_MAX;
+    for (struct conn *c = w->qhead; c; c = c->qnext) {
+        if (c->wake < next)
+            next = c->wake;
+    }
+    if (next <= now)
+        return 0;
+    uint64_t ms = (next - now + 999999) / 1000000;
+    return ms < 250 ? (int)ms : 250;
+}
 
-            snprintf(spd, sizeof(spd), "%.1f %s/s", v, u[ui]);
-            // Minimal human sizes for received/total
-            char rstr[32], tstr[32];
-            double vr=(double)received; 
-            int ur=0; 
-            while(vr>=1024.0 && ur<4){
-                vr/=1024.0;
-                ur++;
+static void *worker_main(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct epoll_event evs[MAX_EVENTS];
+    while (!g_stop) {
+        // Timeout only so that SIGINT delivered to another thread is
+        // noticed, or for the next connection waiting under the rate limits
+        int n = epoll_wait(w->epfd, evs, MAX_EVENTS, w->qhead ? worker_shape_timeout(w) : 250);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        w->evs = evs;
+        w->nevs = n;
+        for (int i = 0; i < n; ++i) {
+            if (!evs[i].data.ptr)
+                continue; // its connection was closed earlier in this batch
+            if (evs[i].data.ptr == &g_listener_tag) {
+                accept_ready(w);
+                continue;
             }
-            snprintf(rstr,sizeof(rstr),"%.1f %s",vr,u[ur]);
-            double vt=(double)filesize; 
-            int ut=0; 
-            while(vt>=1024.0 && ut<4){
-                vt/=1024.0;
-                ut++;
+            if (evs[i].data.ptr == &g_mailbox_tag) {
+                mailbox_drain(w);
+                continue;
             }
-            snprintf(tstr,sizeof(tstr),"%.1f %s",vt,u[ut]);
-            fprintf(stderr, "\r[%-40s] %6.2f%%  %s  %s/%s", bar, pct, spd, rstr, tstr);
-            fflush(stderr);
-            ts_last = ts;
+            if (evs[i].data.ptr == &g_ring_tag) {
+                worker_uring_reap(w);
+                continue;
+            }
+            if ((uintptr_t)evs[i].data.ptr & 1) {
+                relay_ready(w, (struct conn *)((uintptr_t)evs[i].data.ptr & ~(uintptr_t)1), evs[i].events);
+                continue;
+            }
+            struct conn *c = (struct conn *)evs[i].data.ptr;
+            if (c->queued && (evs[i].events & (EPOLLHUP | EPOLLERR))) {
+                // Reported even while its input is not watched: whatever
+                // is left is read at once rather than polled for
+                shape_unqueue(c);
+                c->hup = true;
+            }
+            if (conn_drive(w, c) < 0)
+                conn_close(w, c);
+        }
+        w->nevs = 0;
+        if (w->qhead)
+            worker_shape_run(w);
+        // Bodies handed to the ring in this batch, in one system call
+        if (w->uring && uring_submit(&w->ring) < 0)
+            perror("io_uring_enter");
+        if (w->id == 0) {
+            double now = now_sec();
+            if (now - w->last_sweep >= 1.0) {
+                xfer_sweep(w);
+                w->last_sweep = now;
+            }
+        }
+    }
+    // Helper threads still hold their connections; collect them first
+    while (w->offloads > 0) {
+        struct timespec ts = { 0, 10 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+        mailbox_drain(w);
+    }
+    // Closing the ring cancels whatever it still has in flight
+    if (w->uring) {
+        uring_exit(&w->ring);
+        w->uring = false;
+        for (struct conn *c = w->conns; c; c = c->next) {
+            if (c->state == CS_URING) {
+                c->state = CS_BODY;
+                c->uinflight = 0;
+            }
+        }
+    }
+    while (w->conns)
+        conn_close(w, w->conns);
+    return NULL;
+}
+
+// Ring with the buffer pool and a fixed file table of one socket and one
+// destination per slot registered, its completions signalled through an
+// eventfd in the worker's epoll set. Returns 0, or -1 with errno set and
+// nothing left allocated.
+static int worker_uring_init(struct worker *w) {
+    w->ring_evfd = -1;
+    if (uring_init(&w->ring, URING_ENTRIES) < 0)
+        return -1;
+    // Chains rely on successful operations staying quiet (Linux 5.17)
+    if (!(w->ring.features & IORING_FEAT_CQE_SKIP)) {
+        uring_exit(&w->ring);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t nbuf = URING_SLOTS;
+    struct iovec iov[URING_SLOTS];
+    int fds[2 * URING_SLOTS];
+    void *pool = NULL;
+    int e = posix_memalign(&pool, 4096, nbuf * URING_BUF);
+    if (e != 0) {
+        errno = e;
+        goto fail;
+    }
+    w->ubufs = (unsigned char *)pool;
+    for (size_t i = 0; i < nbuf; ++i) {
+        iov[i].iov_base = w->ubufs + i * URING_BUF;
+        iov[i].iov_len = URING_BUF;
+    }
+    for (size_t i = 0; i < 2 * URING_SLOTS; ++i)
+        fds[i] = -1;
+    if (uring_register(&w->ring, IORING_REGISTER_BUFFERS, iov, (unsigned)nbuf) < 0 ||
+        uring_register(&w->ring, IORING_REGISTER_FILES, fds, 2 * URING_SLOTS) < 0)
+        goto fail;
+    w->ring_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->ring_evfd < 0 || uring_register(&w->ring, IORING_REGISTER_EVENTFD, &w->ring_evfd, 1) < 0)
+        goto fail;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_ring_tag;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->ring_evfd, &ev) < 0)
+        goto fail;
+    w->uslots = (uint32_t)((1ull << URING_SLOTS) - 1);
+    w->uring = true;
+    return 0;
+fail:
+    e = errno;
+    uring_exit(&w->ring);
+    if (w->ring_evfd >= 0)
+        close(w->ring_evfd);
+    w->ring_evfd = -1;
+    free(w->ubufs);
+    w->ubufs = NULL;
+    errno = e;
+    return -1;
+}
+
+static int worker_init(struct worker *w, int id, int lfd) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->lfd = lfd;
+    w->buf = (char *)malloc(g_cfg.chunk);
+    if (!w->buf) {
+        perror("malloc buf");
+        return -1;
+    }
+    // Without a pipe the worker just uses the copy path
+    w->pipe[0] = w->pipe[1] = -1;
+    if (g_cfg.use_splice && worker_pipe_open(w) < 0)
+        perror("pipe");
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) {
+        perror("epoll_create1");
+        worker_pipe_close(w);
+        free(w->buf);
+        return -1;
+    }
+    // Every worker watches the listener; EPOLLEXCLUSIVE wakes only one of
+    // them per incoming connection instead of the whole herd.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &g_listener_tag;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+        perror("epoll_ctl listener");
+        close(w->epfd);
+        worker_pipe_close(w);
+        free(w->buf);
+        return -1;
+    }
+    w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_mailbox_tag;
+    if (w->evfd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0) {
+        perror("eventfd");
+        if (w->evfd >= 0)
+            close(w->evfd);
+        close(w->epfd);
+        worker_pipe_close(w);
+        free(w->buf);
+        return -1;
+    }
+    pthread_mutex_init(&w->mbox_lock, NULL);
+    w->ring_evfd = -1;
+    if (g_cfg.use_uring && worker_uring_init(w) < 0 && id == 0)
+        fprintf(stderr, "io_uring unavailable (%s), using the epoll loop\n", strerror(errno));
+    return 0;
+}
+
+static void worker_destroy(struct worker *w) {
+    if (w->uring)
+        uring_exit(&w->ring);
+    if (w->ring_evfd >= 0)
+        close(w->ring_evfd);
+    free(w->ubufs);
+    while (w->ndpool > 0)
+        free(w->dpool[--w->ndpool]);
+    close(w->evfd);
+    pthread_mutex_destroy(&w->mbox_lock);
+    close(w->epfd);
+    worker_pipe_close(w);
+    free(w->buf);
+}
+
+// Progress line of the only upload in progress, if there is exactly one
+static void report_progress(struct worker *workers, int n) {
+    if (atomic_load(&g_active) != 1)
+        return;
+    for (int i = 0; i < n; ++i) {
+        struct worker *w = &workers[i];
+        if (__atomic_load_n(&w->nactive, __ATOMIC_RELAXED) == 0)
+            continue;
+        uint64_t total = __atomic_load_n(&w->prog_total, __ATOMIC_RELAXED);
+        uint64_t done = __atomic_load_n(&w->prog_done, __ATOMIC_RELAXED);
+        uint64_t wire = __atomic_load_n(&w->prog_wire, __ATOMIC_RELAXED);
+        double t0 = (double)__atomic_load_n(&w->prog_t0_us, __ATOMIC_RELAXED) / 1e6;
+        if (done <= total)
+            print_progress(done, total, wire, now_sec() - t0, g_shape_limit);
+        return;
+    }
+}
+
+// Replace the stats file in one rename, so readers never see half of it
+static void report_stats(struct worker *workers, int n) {
+    static int failed;
+    char tmp[8192];
+    struct stats *sets[MAX_WORKERS];
+    for (int i = 0; i < n; ++i)
+        sets[i] = &workers[i].st;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", g_cfg.stats_path) >= (int)sizeof(tmp)) {
+        if (!failed++)
+            fprintf(stderr, "Stats path too long\n");
+        return;
+    }
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        stats_write(f, sets, n, atomic_load(&g_active));
+        if (fclose(f) == 0 && rename(tmp, g_cfg.stats_path) == 0) {
+            failed = 0;
+            return;
         }
+        unlink(tmp);
     }
+    if (!failed++)
+        perror(g_cfg.stats_path);
+}
 
-    free(buf);
-    if (close(fd) < 0) { 
-        perror("close dest"); 
+// The main thread's job while the workers run: the progress line every
+// 200 ms, the stats file every second and the dedup index when it changed.
+// The data path only updates counters, so none of it costs the workers
+// anything (saving the index holds up lookups while it is written).
+static void report_loop(struct worker *workers, int n) {
+    int tick = 0;
+    while (!g_stop) {
+        struct timespec ts = { 0, 200 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+        ++tick;
+        if (!g_cfg.quiet)
+            report_progress(workers, n);
+        if (g_cfg.stats_path && tick % 5 == 0)
+            report_stats(workers, n);
+        if (g_dedup && tick % (5 * DEDUP_SAVE_INTERVAL) == 0)
+            dedup_save(g_dedup);
     }
+}
 
-    unsigned char status = 0;
-    if (write_full(cfd, &status, 1) < 0) {
-        perror("send status");
+// Look up the next hop of -R ("host:port", [v6]:port) once, at startup
+static int relay_resolve(const char *spec) {
+    char host[256];
+    const char *colon = strrchr(spec, ':');
+    size_t hl = colon ? (size_t)(colon - spec) : 0;
+    if (hl >= 2 && spec[0] == '[' && spec[hl - 1] == ']') {
+        spec++;
+        hl -= 2;
+    }
+    if (!colon || hl == 0 || hl >= sizeof(host) || !colon[1]) {
+        fprintf(stderr, "-R wants host:port, got %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, hl);
+    host[hl] = '\0';
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    struct addrinfo *res = NULL;
+    int rc = getaddrinfo(host, colon + 1, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo %s: %s\n", host, gai_strerror(rc));
         return -1;
     }
-    fprintf(stderr, "\nReceived %s (%lu bytes)\n", sname, (unsigned long)filesize);
+    memcpy(&g_relay_addr, res->ai_addr, res->ai_addrlen);
+    g_relay_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
     return 0;
 }
 
+// -M: files streamed to a multicast group (mcast.h), taken in by a thread
+// of their own next to the workers. Blocks are written where they belong
+// as they come, a bitmap tracks which are there, and gaps are asked for
+// again with NACKs.
+#define MCAST_SESSIONS 8
+#define MCAST_RX_BATCH 64
+// A gap this many blocks behind the newest block is taken as a loss
+#define MCAST_REORDER 64
+// NACKs go out at most this often per file before the sender's end
+#define MCAST_NACK_EVERY 0.05
+// A file not heard of for this long is given up (and removed)
+#define MCAST_IDLE 30.0
+
+struct msess {
+    bool used, named, ended, done;
+    uint32_t sid;
+    struct sockaddr_in from;    // the sender, where NACKs and the status go
+    uint64_t size;
+    uint32_t nblocks, have, hi; // blocks in the file, here, one past the newest seen
+    uint32_t low;               // first block still missing
+    uint32_t crc;               // the sender's, from the final meta
+    uint64_t *bits;
+    int fd;
+    unsigned char status;
+    char sname[4096];
+    char path[8192];            // name in dfd
+    int dfd;                    // held from g_dirs, -1 if none
+    double t0, last, last_nack;
+};
+
+static int g_mcast_fd = -1;             // joined to the group
+static int g_mcast_reply = -1;          // NACKs and statuses go out of this one
+static struct sockaddr_in g_mcast_group;
+static struct in_addr g_mcast_if;
+
+static void msess_reply(struct msess *s, const unsigned char *m, size_t len) {
+    if (sendto(g_mcast_reply, m, len, 0, (const struct sockaddr *)&s->from, sizeof(s->from)) < 0)
+        perror("multicast reply");
+}
+
+static void msess_send_status(struct msess *s) {
+    unsigned char m[MCAST_HDR_LEN + 1];
+    mcast_put_hdr(m, MCAST_MSG_STATUS, s->sid);
+    m[MCAST_HDR_LEN] = s->status;
+    msess_reply(s, m, sizeof(m));
+}
+
+// Ask for the missing blocks below limit, as many ranges as one datagram holds
+static void msess_nack(struct msess *s, uint32_t limit) {
+    unsigned char m[MCAST_DGRAM_MAX];
+    unsigned count = 0;
+    for (uint32_t b = s->low; b < limit && count < MCAST_NACK_MAX;) {
+        uint64_t word = ~s->bits[b / 64] >> (b % 64);
+        if (word == 0) {
+            b = (b / 64 + 1) * 64;
+            continue;
+        }
+        b += (uint32_t)__builtin_ctzll(word);
+        if (b >= limit)
+            break;
+        uint32_t first = b;
+        while (b < limit && !(s->bits[b / 64] & (1ull << (b % 64))))
+            b++;
+        put_be32(m + MCAST_HDR_LEN + 2 + count * 8, first);
+        put_be32(m + MCAST_HDR_LEN + 6 + count * 8, b - first);
+        count++;
+    }
+    if (count == 0)
+        return;
+    mcast_put_hdr(m, MCAST_MSG_NACK, s->sid);
+    put_be16(m + MCAST_HDR_LEN, (uint16_t)count);
+    msess_reply(s, m, MCAST_HDR_LEN + 2 + count * 8);
+    s->last_nack = now_sec();
+}
+
+// The file is settled with status: stored, refused or failed (and removed)
+static void msess_settle(struct msess *s, unsigned char status) {
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+        if (status != LANDROP_ST_OK)
+            unlinkat(s->dfd, s->path, 0);
+    }
+    dircache_put(g_dirs, s->dfd);
+    s->dfd = -1;
+    free(s->bits);
+    s->bits = NULL;
+    s->status = status;
+    s->done = true;
+    if (status == LANDROP_ST_OK && !g_cfg.quiet)
+        fprintf(stderr, "\nReceived %s (%llu bytes) by multicast in %.2f s\n", s->sname,
+                (unsigned long long)s->size, now_sec() - s->t0);
+    if (s->ended)
+        msess_send_status(s);
+}
+
+// All blocks are in: check them against the sender's checksum
+static void msess_finish(struct msess *s) {
+    uint32_t crc;
+    if (crc32c_fd_prefix(s->fd, s->size, &crc, &g_stop) < 0) {
+        perror("read back multicast file");
+        msess_settle(s, LANDROP_ST_IO);
+    } else if (crc != s->crc) {
+        fprintf(stderr, "\nChecksum mismatch for %s (got %08x, sender has %08x)\n", s->sname, (unsigned)crc,
+                (unsigned)s->crc);
+        msess_settle(s, LANDROP_ST_CHECKSUM);
+    } else {
+        msess_settle(s, LANDROP_ST_OK);
+    }
+}
+
+static void msess_free(struct msess *s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+        unlinkat(s->dfd, s->path, 0);
+        fprintf(stderr, "\nGave up on %s by multicast: %u of %u blocks arrived\n", s->sname, s->have, s->nblocks);
+    }
+    dircache_put(g_dirs, s->dfd);
+    free(s->bits);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->dfd = -1;
+}
+
+// Consecutive blocks of one file from a batch of datagrams, written at once
+struct mrun {
+    struct msess *s;
+    uint32_t first, next;
+    struct iovec iov[MCAST_RX_BATCH];
+    int n;
+};
+
+static void mrun_flush(struct mrun *r) {
+    struct msess *s = r->s;
+    if (!s || r->n == 0)
+        return;
+    r->s = NULL;
+    off_t off = (off_t)r->first * MCAST_BLOCK;
+    struct iovec *iov = r->iov;
+    int n = r->n;
+    r->n = 0;
+    while (n > 0) {
+        ssize_t w = pwritev(s->fd, iov, n, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            perror("write multicast file");
+            msess_settle(s, LANDROP_ST_IO);
+            return;
+        }
+        off += w;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    if (s->ended && s->have == s->nblocks)
+        msess_finish(s);
+}
+
+// The session a datagram belongs to; a new one takes a free slot or else
+// the one heard of least recently. The blocks of an evicted session still
+// in r are written first, to that session's file.
+static struct msess *msess_get(struct msess *ss, struct mrun *r, uint32_t sid, const struct sockaddr_in *from) {
+    struct msess *old = NULL;
+    for (int i = 0; i < MCAST_SESSIONS; ++i) {
+        struct msess *s = &ss[i];
+        if (s->used && s->sid == sid && s->from.sin_addr.s_addr == from->sin_addr.s_addr &&
+            s->from.sin_port == from->sin_port)
+            return s;
+        if (!old || (old->used && (!s->used || s->last < old->last)))
+            old = s;
+    }
+    if (old->used) {
+        if (r->s == old)
+            mrun_flush(r);
+        msess_free(old);
+    }
+    old->used = true;
+    old->sid = sid;
+    old->from = *from;
+    old->t0 = old->last = now_sec();
+    return old;
+}
+
+static void msess_on_meta(struct msess *s, const unsigned char *m, size_t len) {
+    if (len < MCAST_META_LEN || len < MCAST_META_LEN + (size_t)get_be16(m + MCAST_HDR_LEN + 13))
+        return;
+    if (!s->named) {
+        char name[MCAST_DGRAM_MAX];
+        size_t nlen = get_be16(m + MCAST_HDR_LEN + 13);
+        memcpy(name, m + MCAST_META_LEN, nlen);
+        name[nlen] = '\0';
+        s->named = true;
+        s->size = get_be64(m + MCAST_HDR_LEN);
+        s->nblocks = (uint32_t)((s->size + MCAST_BLOCK - 1) / MCAST_BLOCK);
+        unsigned char st = LANDROP_ST_OK;
+        if (s->size / MCAST_BLOCK >= UINT32_MAX || sanitize_path(name, s->sname, sizeof(s->sname)) != 0 ||
+            s->sname[0] == '\0' || reserved_name(s->sname)) {
+            fprintf(stderr, "Invalid filename by multicast\n");
+            st = LANDROP_ST_BADNAME;
+        } else if ((st = (unsigned char)dest_resolve(s->sname, &s->dfd, s->path, sizeof(s->path))) !=
+                   LANDROP_ST_OK) {
+            // Reported there
+        } else if ((s->fd = openat(s->dfd, s->path,
+                                   O_CREAT | O_RDWR | O_NOFOLLOW | O_CLOEXEC | (g_cfg.overwrite ? O_TRUNC : O_EXCL),
+                                   0644)) < 0) {
+            perror("open dest file");
+            st = LANDROP_ST_OPEN;
+        } else if (preallocate(s->fd, 0, s->size) < 0) {
+            perror("preallocate");
+            st = LANDROP_ST_IO;
+        } else if (!(s->bits = (uint64_t *)calloc(s->nblocks / 64 + 1, sizeof(uint64_t)))) {
+            perror("calloc");
+            st = LANDROP_ST_IO;
+        }
+        if (st != LANDROP_ST_OK)
+            msess_settle(s, st);
+    }
+    if (!(m[MCAST_HDR_LEN + 8] & MCAST_F_END))
+        return;
+    s->ended = true;
+    s->crc = get_be32(m + MCAST_HDR_LEN + 9);
+    if (s->done)
+        msess_send_status(s);
+    else if (s->have == s->nblocks)
+        msess_finish(s);
+    else
+        msess_nack(s, s->nblocks);
+}
+
+static void msess_on_data(struct mrun *r, struct msess *s, const unsigned char *m, size_t len) {
+    if (!s->named || s->done || len < MCAST_DATA_LEN)
+        return;
+    uint32_t b = get_be32(m + MCAST_HDR_LEN);
+    size_t want = b + 1 < s->nblocks ? MCAST_BLOCK : (size_t)(s->size - (uint64_t)b * MCAST_BLOCK);
+    if (b >= s->nblocks || len - MCAST_DATA_LEN != want || (s->bits[b / 64] & (1ull << (b % 64))))
+        return;
+    // The run so far goes out first: it may be what completes the file
+    if (r->s != s || r->next != b) {
+        mrun_flush(r);
+        if (s->done)
+            return;
+        r->s = s;
+        r->first = r->next = b;
+    }
+    s->bits[b / 64] |= 1ull << (b % 64);
+    s->have++;
+    if (b >= s->hi)
+        s->hi = b + 1;
+    while (s->low < s->nblocks && (s->bits[s->low / 64] & (1ull << (s->low % 64))))
+        s->low++;
+    r->iov[r->n].iov_base = (void *)(m + MCAST_DATA_LEN);
+    r->iov[r->n].iov_len = want;
+    r->n++;
+    r->next++;
+}
+
+static void *mcast_main(void *arg) {
+    (void)arg;
+    struct msess *ss = (struct msess *)calloc(MCAST_SESSIONS, sizeof(*ss));
+    unsigned char *bufs = (unsigned char *)malloc((size_t)MCAST_RX_BATCH * MCAST_DGRAM_MAX);
+    if (!ss || !bufs) {
+        perror("malloc");
+        free(ss);
+        free(bufs);
+        return NULL;
+    }
+    for (int i = 0; i < MCAST_SESSIONS; ++i)
+        ss[i].fd = ss[i].dfd = -1;
+    struct mmsghdr msgs[MCAST_RX_BATCH];
+    struct iovec iov[MCAST_RX_BATCH];
+    struct sockaddr_in from[MCAST_RX_BATCH];
+    struct mrun run;
+    memset(&run, 0, sizeof(run));
+    while (!g_stop) {
+        struct pollfd pfd = { g_mcast_fd, POLLIN, 0 };
+        int n = poll(&pfd, 1, (int)(MCAST_NACK_EVERY * 1000));
+        if (n > 0) {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < MCAST_RX_BATCH; ++i) {
+                iov[i].iov_base = bufs + (size_t)i * MCAST_DGRAM_MAX;
+                iov[i].iov_len = MCAST_DGRAM_MAX;
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &from[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            }
+            n = recvmmsg(g_mcast_fd, msgs, MCAST_RX_BATCH, MSG_DONTWAIT, NULL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                perror("recvmmsg");
+        }
+        double now = now_sec();
+        for (int i = 0; i < n; ++i) {
+            const unsigned char *m = bufs + (size_t)i * MCAST_DGRAM_MAX;
+            size_t len = msgs[i].msg_len;
+            if (len < MCAST_HDR_LEN || memcmp(m, MCAST_MAGIC, 4) != 0 ||
+                (m[4] != MCAST_MSG_DATA && m[4] != MCAST_MSG_META))
+                continue;
+            struct msess *s = msess_get(ss, &run, get_be32(m + 5), &from[i]);
+            s->last = now;
+            if (m[4] == MCAST_MSG_DATA) {
+                msess_on_data(&run, s, m, len);
+            } else {
+                mrun_flush(&run);
+                msess_on_meta(s, m, len);
+            }
+        }
+        mrun_flush(&run);
+        for (int i = 0; i < MCAST_SESSIONS; ++i) {
+            struct msess *s = &ss[i];
+            if (!s->used)
+                continue;
+            if (now - s->last >= MCAST_IDLE) {
+                msess_free(s);
+                continue;
+            }
+            // Before the end, only gaps the stream has clearly moved past
+            if (!s->done && s->named && s->low + MCAST_REORDER < s->hi && now - s->last_nack >= MCAST_NACK_EVERY)
+                msess_nack(s, s->hi - MCAST_REORDER);
+        }
+    }
+    for (int i = 0; i < MCAST_SESSIONS; ++i) {
+        if (ss[i].used)
+            msess_free(&ss[i]);
+    }
+    free(ss);
+    free(bufs);
+    return NULL;
+}
+
+// Buckets and turn size for the rate limits. A turn is a twentieth of a
+// second at the lowest limit, so connections sharing it alternate that
+// often, within the sizes a body read works with.
+static void shape_setup(void) {
+    g_shaping = true;
+    bucket_init(&g_rate, g_cfg.rate);
+    uint64_t lo = UINT64_MAX;
+    const uint64_t rates[3] = { g_cfg.rate, g_cfg.rate_conn, g_cfg.rate_ip };
+    for (int i = 0; i < 3; ++i) {
+        if (rates[i] && rates[i] < lo)
+            lo = rates[i];
+    }
+    g_shape_limit = lo;
+    g_quantum = (size_t)(lo / 20 < BUF_SZ ? BUF_SZ : lo / 20 > BODY_BUDGET ? BODY_BUDGET : lo / 20);
+    char r[3][32];
+    for (int i = 0; i < 3; ++i) {
+        if (rates[i])
+            human_bytes((double)rates[i], r[i], sizeof(r[i]));
+        else
+            snprintf(r[i], sizeof(r[i]), "none");
+    }
+    fprintf(stderr, "Rate limits: %s%s in total, %s%s per connection, %s%s per address\n", r[0],
+            g_cfg.rate ? "/s" : "", r[1], g_cfg.rate_conn ? "/s" : "", r[2], g_cfg.rate_ip ? "/s" : "");
+}
+
 int main(int argc, char **argv) {
     int port = -1;
-    const char *dest_dir = NULL;
-    bool overwrite = false;
+    g_cfg.nworkers = 1;
+    g_cfg.use_splice = true;
+    g_cfg.chunk = BUF_SZ;
+    enum { OPT_RCVBUF = 256, OPT_CHUNK, OPT_RATE, OPT_RATE_CONN, OPT_RATE_IP, OPT_MCAST_IF, OPT_TLS_CERT, OPT_TLS_KEY,
+           OPT_TLS_CA, OPT_PSK };
+    struct tls_opts tls;
+    memset(&tls, 0, sizeof(tls));
+    static const struct option longopts[] = {
+        { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+        { "chunk", required_argument, NULL, OPT_CHUNK },
+        { "rate", required_argument, NULL, OPT_RATE },
+        { "rate-conn", required_argument, NULL, OPT_RATE_CONN },
+        { "rate-ip", required_argument, NULL, OPT_RATE_IP },
+        { "mcast-if", required_argument, NULL, OPT_MCAST_IF },
+        { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+        { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+        { "tls-ca", required_argument, NULL, OPT_TLS_CA },
+        { "psk", required_argument, NULL, OPT_PSK },
+        { NULL, 0, NULL, 0 },
+    };
+    uint64_t size;
     int opt;
-    while ((opt = getopt(argc, argv, "p:d:oh")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:d:ow:CUIXGqS:R:M:h", longopts, NULL)) != -1) {
         switch (opt) {
             case 'p': port = atoi(optarg); break;
-            case 'd': dest_dir = optarg; break;
-            case 'o': overwrite = true; break;
+            case 'd': g_cfg.dest_dir = optarg; break;
+            case 'o': g_cfg.overwrite = true; break;
+            case 'w': g_cfg.nworkers = atoi(optarg); break;
+            case 'C': g_cfg.use_splice = false; break;
+            case 'U': g_cfg.use_uring = true; break;
+            case 'I': g_cfg.direct = true; break;
+            case 'X': g_cfg.dedup = true; break;
+            case 'G': g_cfg.serve = true; break;
+            case 'q': g_cfg.quiet = true; break;
+            case 'S': g_cfg.stats_path = optarg; break;
+            case 'R': g_cfg.relay = optarg; break;
+            case 'M':
+                if (mcast_parse(optarg, &g_mcast_group) < 0) {
+                    fprintf(stderr, "-M takes a multicast group and port, e.g. 239.1.2.3:9100\n");
+                    return 1;
+                }
+                g_cfg.mcast = true;
+                break;
+            case OPT_MCAST_IF:
+                if (mcast_parse_if(optarg, &g_mcast_if) < 0) {
+                    fprintf(stderr, "Bad interface address: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_RCVBUF:
+                if (parse_size(optarg, &size) < 0 || size == 0 || size > TUNE_MAX_BUF) {
+                    fprintf(stderr, "Bad --rcvbuf: %s\n", optarg);
+                    return 1;
+                }
+                g_cfg.tune.rcvbuf = (int)size;
+                break;
+            case OPT_CHUNK:
+                if (parse_size(optarg, &size) < 0 || size < BUF_SZ || size > BUF_SZ_MAX) {
+                    fprintf(stderr, "--chunk must be between 64k and 16M\n");
+                    return 1;
+                }
+                g_cfg.chunk = (size_t)size;
+                break;
+            case OPT_RATE:
+            case OPT_RATE_CONN:
+            case OPT_RATE_IP:
+                if (parse_size(optarg, &size) < 0 || size == 0) {
+                    fprintf(stderr, "Bad --%s: %s\n", longopts[opt - OPT_RCVBUF].name, optarg);
+                    return 1;
+                }
+                *(opt == OPT_RATE ? &g_cfg.rate : opt == OPT_RATE_CONN ? &g_cfg.rate_conn : &g_cfg.rate_ip) = size;
+                break;
+            case OPT_TLS_CERT: tls.cert = optarg; break;
+            case OPT_TLS_KEY: tls.key = optarg; break;
+            case OPT_TLS_CA: tls.ca = optarg; break;
+            case OPT_PSK: tls.psk = optarg; break;
             case 'h': default: usage(argv[0]); return opt=='h'?0:1;
         }
     }
-    if (port <= 0 || port > 65535 || !dest_dir) {
+    if (port <= 0 || port > 65535 || !g_cfg.dest_dir) {
         usage(argv[0]);
         return 1;
     }
+    if (g_cfg.nworkers < 1 || g_cfg.nworkers > MAX_WORKERS) {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
 
-    if (ensure_dir(dest_dir) != 0) {
+    if (tls.cert || tls.key || tls.ca || tls.psk) {
+        // Neither would be encrypted: the next hop gets plain LFT2, and
+        // multicast datagrams are open to the whole segment
+        if (g_cfg.relay || g_cfg.mcast) {
+            fprintf(stderr, "TLS does not go with -R or -M\n");
+            return 1;
+        }
+        g_tls = tls_ctx_new(true, &tls);
+        if (!g_tls)
+            return 1;
+    }
+    if (g_cfg.relay) {
+        if (relay_resolve(g_cfg.relay) < 0)
+            return 1;
+        // Every byte passes through our buffers to be sent on
+        g_cfg.use_splice = false;
+        if (g_cfg.use_uring)
+            fprintf(stderr, "-U does not apply to a relay, receiving through the epoll loop\n");
+        g_cfg.use_uring = false;
+    }
+    if (ensure_dir(g_cfg.dest_dir) != 0) {
         perror("ensure dest dir");
         return 1;
     }
+    g_dirs = dircache_open(g_cfg.dest_dir, DIR_CACHE);
+    if (!g_dirs) {
+        perror("open dest dir");
+        return 1;
+    }
+    if (g_cfg.serve) {
+        g_files = fdcache_open(g_dirs, FILE_CACHE);
+        if (!g_files) {
+            perror("file cache");
+            return 1;
+        }
+    }
+    if (g_cfg.rate || g_cfg.rate_conn || g_cfg.rate_ip) {
+        shape_setup();
+        if (g_cfg.use_uring)
+            fprintf(stderr, "-U does not apply under rate limits, receiving through the epoll loop\n");
+        g_cfg.use_uring = false;
+    }
+    if (g_cfg.dedup) {
+        g_dedup = dedup_open(g_cfg.dest_dir, DEDUP_INDEX);
+        if (!g_dedup) {
+            perror("dedup index");
+            return 1;
+        }
+        uint64_t chunks;
+        uint32_t files;
+        dedup_size(g_dedup, &chunks, &files);
+        fprintf(stderr, "Dedup index: %llu chunks in %u files\n", (unsigned long long)chunks, (unsigned)files);
+    }
 
     signal(SIGINT, on_sigint);
+    // A client vanishing must fail that connection's write, not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
 
-    int sfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sfd < 0) { 
-        perror("socket"); 
-        return 1; 
+    int sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        perror("socket");
+        return 1;
     }
 
     int yes = 1;
     if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
         perror("setsockopt REUSEADDR");
     }
+    // Accepted sockets inherit the buffer size, and it has to be set before
+    // the handshake to get a window scale that can use it
+    tune_apply(sfd, &g_cfg.tune);
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -233,27 +4507,84 @@ int main(int argc, char **argv) {
         close(sfd);
         return 1;
     }
-    if (listen(sfd, 16) < 0) {
+    if (listen(sfd, SOMAXCONN) < 0) {
         perror("listen");
         close(sfd);
         return 1;
     }
 
-    fprintf(stderr, "landropd listening on port %d, saving to %s\n", port, dest_dir);
+    if (g_cfg.mcast) {
+        g_mcast_fd = mcast_open_rx(&g_mcast_group, g_mcast_if);
+        g_mcast_reply = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (g_mcast_fd < 0 || g_mcast_reply < 0) {
+            if (g_mcast_reply < 0)
+                perror("socket");
+            close(sfd);
+            return 1;
+        }
+    }
 
-    while (!g_stop) {
-        struct sockaddr_in caddr; socklen_t clen = sizeof(caddr);
-        int cfd = accept(sfd, (struct sockaddr *)&caddr, &clen);
-        if (cfd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
+    struct worker *workers = (struct worker *)calloc((size_t)g_cfg.nworkers, sizeof(*workers));
+    if (!workers) {
+        perror("calloc workers");
+        close(sfd);
+        return 1;
+    }
+    int started = 0;
+    for (; started < g_cfg.nworkers; ++started) {
+        if (worker_init(&workers[started], started, sfd) < 0)
+            break;
+        int rc = pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            worker_destroy(&workers[started]);
             break;
         }
-        handle_client(cfd, dest_dir, overwrite);
-        close(cfd);
+    }
+    if (started < g_cfg.nworkers)
+        g_stop = 1;
+    else
+        fprintf(stderr, "landropd listening on port %d, %s %s%s%s (%d worker%s%s%s)\n",
+                port, g_files ? "saving to and serving" : "saving to", g_cfg.dest_dir,
+                g_cfg.relay ? " and relaying to " : "", g_cfg.relay ? g_cfg.relay : "",
+                g_cfg.nworkers, g_cfg.nworkers == 1 ? "" : "s", workers[0].uring ? ", io_uring" : "",
+                !g_tls ? "" : tls.psk ? ", TLS with a pre-shared key" : ", TLS");
+    pthread_t mcast_thread;
+    bool mcast_started = false;
+    if (g_cfg.mcast && !g_stop) {
+        int rc = pthread_create(&mcast_thread, NULL, mcast_main, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            g_stop = 1;
+        } else {
+            char a[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &g_mcast_group.sin_addr, a, sizeof(a));
+            fprintf(stderr, "Receiving multicast on %s:%u\n", a, (unsigned)ntohs(g_mcast_group.sin_port));
+            mcast_started = true;
+        }
     }
 
+    report_loop(workers, started);
+    if (mcast_started)
+        pthread_join(mcast_thread, NULL);
+    if (g_cfg.mcast) {
+        close(g_mcast_fd);
+        close(g_mcast_reply);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        worker_destroy(&workers[i]);
+    }
+    if (g_cfg.stats_path && started > 0)
+        report_stats(workers, started);
+    free(workers);
+    if (g_dedup)
+        dedup_close(g_dedup);
+    fdcache_close(g_files);
+    dircache_close(g_dirs);
+    tls_ctx_free(g_tls);
+
     close(sfd);
     fprintf(stderr, "landropd stopped\n");
-    return 0;
+    return started == g_cfg.nworkers ? 0 : 1;
 }
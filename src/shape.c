@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "shape.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Grants are at least a hundredth of a second of the rate, within these
+#define SHAPE_MIN_GRANT 1024
+#define SHAPE_MAX_GRANT (64 * 1024)
+
+void bucket_init(struct bucket *b, uint64_t rate) {
+    b->rate = rate;
+    b->min = rate / 100;
+    if (b->min < SHAPE_MIN_GRANT)
+        b->min = SHAPE_MIN_GRANT;
+    if (b->min > SHAPE_MAX_GRANT)
+        b->min = SHAPE_MAX_GRANT;
+    b->burst_ns = SHAPE_BURST_NS;
+    // A slow bucket must still be able to hold one grant
+    if (rate > 0 && b->min * 1000000000ull / rate > b->burst_ns)
+        b->burst_ns = b->min * 1000000000ull / rate;
+    b->tat = 0;
+}
+
+uint64_t shape_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t ns_for(const struct bucket *b, uint64_t bytes) {
+    return (uint64_t)(((unsigned __int128)bytes * 1000000000u + b->rate - 1) / b->rate);
+}
+
+size_t bucket_take(struct bucket *const *b, int n, size_t want, uint64_t now, uint64_t *wait_ns) {
+    size_t grant = want;
+    uint64_t wait = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!b[i] || b[i]->rate == 0)
+            continue;
+        uint64_t tat = __atomic_load_n(&b[i]->tat, __ATOMIC_RELAXED);
+        uint64_t from = tat > now ? tat : now;
+        uint64_t ahead = now + b[i]->burst_ns > from ? now + b[i]->burst_ns - from : 0;
+        uint64_t avail = (uint64_t)((unsigned __int128)ahead * b[i]->rate / 1000000000u);
+        uint64_t need = want < b[i]->min ? want : b[i]->min;
+        if (avail < need) {
+            uint64_t w = ns_for(b[i], need - avail);
+            if (w > wait)
+                wait = w;
+            grant = 0;
+        } else if (avail < grant) {
+            grant = (size_t)avail;
+        }
+    }
+    if (grant == 0) {
+        *wait_ns = wait;
+        return 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (!b[i] || b[i]->rate == 0)
+            continue;
+        uint64_t cost = ns_for(b[i], grant);
+        uint64_t tat = __atomic_load_n(&b[i]->tat, __ATOMIC_RELAXED), next;
+        do {
+            next = (tat > now ? tat : now) + cost;
+        } while (!__atomic_compare_exchange_n(&b[i]->tat, &tat, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    return grant;
+}
+
+void bucket_give(struct bucket *const *b, int n, size_t bytes) {
+    for (int i = 0; i < n; ++i) {
+        if (!b[i] || b[i]->rate == 0)
+            continue;
+        uint64_t cost = ns_for(b[i], bytes);
+        uint64_t tat = __atomic_load_n(&b[i]->tat, __ATOMIC_RELAXED), next;
+        do {
+            next = tat > cost ? tat - cost : 0;
+        } while (!__atomic_compare_exchange_n(&b[i]->tat, &tat, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+size_t bucket_wait(struct bucket *const *b, int n, size_t want) {
+    for (;;) {
+        uint64_t wait;
+        size_t grant = bucket_take(b, n, want, shape_now(), &wait);
+        if (grant > 0)
+            return grant;
+        struct timespec ts = { (time_t)(wait / 1000000000u), (long)(wait % 1000000000u) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef LANDROP_SHAPE_H
+#define LANDROP_SHAPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Token buckets for the rate limits (--rate and friends). A bucket is kept
+// as the time by which everything granted from it is paid for at its rate
+// (GCRA), one word that threads advance with compare-and-swap, so a limit
+// can be shared without a lock. Drawing ahead of that time is allowed for
+// SHAPE_BURST_NS, which smooths the rate over a twentieth of a second.
+
+#define SHAPE_BURST_NS (50 * 1000 * 1000ull)
+
+struct bucket {
+    uint64_t rate;              // bytes per second, 0: no limit
+    uint64_t burst_ns;          // how far ahead of its rate the bucket may be drawn
+    uint64_t min;               // smallest grant worth waiting for
+    uint64_t tat;               // everything granted is paid for at this time (ns)
+};
+
+void bucket_init(struct bucket *b, uint64_t rate);
+
+// Monotonic clock in nanoseconds, the time base of the buckets
+uint64_t shape_now(void);
+
+// Up to want bytes that all of the n buckets allow at now (NULL and
+// unlimited ones do not count), charged to each. 0 if that is less than
+// the smallest useful grant, with *wait_ns set to how long until there is
+// one.
+size_t bucket_take(struct bucket *const *b, int n, size_t want, uint64_t now, uint64_t *wait_ns);
+
+// Hand back bytes of a grant that were not used (a short read)
+void bucket_give(struct bucket *const *b, int n, size_t bytes);
+
+// bucket_take() for blocking senders: sleeps until something is granted
+size_t bucket_wait(struct bucket *const *b, int n, size_t want);
+
+#endif // LANDROP_SHAPE_H
@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+
+#define load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void hist_add(struct hist *h, uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;
+    unsigned i = us <= 1 ? 0 : 64 - (unsigned)__builtin_clzll(us - 1);
+    if (i >= STATS_BUCKETS)
+        i = STATS_BUCKETS - 1;
+    stat_add(&h->bucket[i], 1);
+    stat_add(&h->sum_ns, ns);
+}
+
+static void put_counter(FILE *f, const char *name, const char *type, const char *help, uint64_t v) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, (unsigned long long)v);
+}
+
+static void put_hist(FILE *f, const char *name, const char *help, struct stats *const *sets, int n, int which) {
+    uint64_t bucket[STATS_BUCKETS], sum = 0;
+    memset(bucket, 0, sizeof(bucket));
+    for (int s = 0; s < n; ++s) {
+        const struct hist *h = &sets[s]->hist[which];
+        for (int i = 0; i < STATS_BUCKETS; ++i)
+            bucket[i] += load(&h->bucket[i]);
+        sum += load(&h->sum_ns);
+    }
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    // Buckets are cumulative and the +Inf one is the count; taking the
+    // count from the buckets keeps that true while updates race with us
+    uint64_t cum = 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        cum += bucket[i];
+        if (i < STATS_BUCKETS - 1)
+            fprintf(f, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ull << i) / 1e6, (unsigned long long)cum);
+        else
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cum);
+    }
+    fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name, (double)sum / 1e9, name, (unsigned long long)cum);
+}
+
+void stats_write(FILE *f, struct stats *const *sets, int n, int active) {
+    uint64_t bytes = 0, wire = 0, ok = 0, failed = 0, stripes = 0, dedup = 0, relayed = 0, missed = 0;
+    uint64_t conns = 0, open = 0, shaped = 0, served = 0, gets = 0, opens = 0;
+    for (int s = 0; s < n; ++s) {
+        bytes += load(&sets[s]->bytes);
+        wire += load(&sets[s]->wire);
+        ok += load(&sets[s]->files_ok);
+        failed += load(&sets[s]->files_failed);
+        stripes += load(&sets[s]->stripes);
+        dedup += load(&sets[s]->dedup);
+        relayed += load(&sets[s]->relayed);
+        missed += load(&sets[s]->relay_missed);
+        shaped += load(&sets[s]->shaped_ns);
+        served += load(&sets[s]->served);
+        gets += load(&sets[s]->gets);
+        opens += load(&sets[s]->file_opens);
+        conns += load(&sets[s]->conns);
+        open += load(&sets[s]->open);
+    }
+    put_counter(f, "landropd_received_bytes_total", "counter", "File content bytes stored.", bytes);
+    put_counter(f, "landropd_wire_bytes_total", "counter",
+                "File content bytes read from clients, as sent (compressed or not).", wire);
+    fprintf(f, "# HELP landropd_files_total Files acknowledged, by outcome.\n"
+               "# TYPE landropd_files_total counter\n"
+               "landropd_files_total{status=\"ok\"} %llu\n"
+               "landropd_files_total{status=\"failed\"} %llu\n",
+            (unsigned long long)ok, (unsigned long long)failed);
+    put_counter(f, "landropd_stripes_total", "counter", "Stripes of striped uploads received.", stripes);
+    put_counter(f, "landropd_dedup_reused_bytes_total", "counter",
+                "File content taken from chunks already stored instead of the wire.", dedup);
+    put_counter(f, "landropd_relayed_bytes_total", "counter", "Bytes from clients passed on to the next hop.",
+                relayed);
+    put_counter(f, "landropd_relay_missed_files_total", "counter",
+                "Files stored here that the next hop did not acknowledge.", missed);
+    put_counter(f, "landropd_served_bytes_total", "counter", "File content bytes sent to downloads.", served);
+    put_counter(f, "landropd_get_requests_total", "counter", "Ranges of files requested by downloads and found.",
+                gets);
+    put_counter(f, "landropd_served_file_opens_total", "counter",
+                "Files opened to serve a download; the other requests found theirs open already.", opens);
+    fprintf(f, "# HELP landropd_rate_limited_seconds_total Time connections waited for their turn under the rate limits.\n"
+               "# TYPE landropd_rate_limited_seconds_total counter\n"
+               "landropd_rate_limited_seconds_total %.6f\n",
+            (double)shaped / 1e9);
+    put_counter(f, "landropd_connections_total", "counter", "Connections accepted.", conns);
+    put_counter(f, "landropd_connections", "gauge", "Connections open.", open);
+    put_counter(f, "landropd_active_uploads", "gauge", "Files being received.", (uint64_t)(active > 0 ? active : 0));
+    put_hist(f, "landropd_socket_read_seconds", "Duration of one read of file data from a socket.", sets, n,
+             STATS_SOCK_READ);
+    put_hist(f, "landropd_disk_write_seconds", "Duration of one write of file data to disk.", sets, n,
+             STATS_DISK_WRITE);
+    put_hist(f, "landropd_transfer_seconds", "Time from the first content byte to the acknowledgement of a file.",
+             sets, n, STATS_TRANSFER);
+}
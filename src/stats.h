@@ -0,0 +1,59 @@
+#ifndef LANDROP_STATS_H
+#define LANDROP_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Server counters and latency histograms, one set per worker thread. Only
+// the owning thread writes its set, with plain relaxed stores (no locked
+// read-modify-write); the reporter sums all sets with relaxed loads. A
+// snapshot may be a few updates behind, never torn.
+
+// Histogram buckets: upper bounds of 1 us, 2 us, 4 us ... 2^30 us (~18 min),
+// then everything above
+#define STATS_BUCKETS 32
+
+struct hist {
+    uint64_t sum_ns;
+    uint64_t bucket[STATS_BUCKETS];
+};
+
+enum {
+    STATS_SOCK_READ,    // one read/splice of body data from a socket
+    STATS_DISK_WRITE,   // one write/splice of body data to a file
+    STATS_TRANSFER,     // body start to acknowledgement, per stored file
+    STATS_NHIST
+};
+
+struct stats {
+    _Alignas(64) uint64_t bytes;    // file content stored
+    uint64_t wire;                  // body bytes off the wire (compressed size)
+    uint64_t files_ok;
+    uint64_t files_failed;
+    uint64_t stripes;               // stripes received (their file counts once, when it is finalized)
+    uint64_t dedup;                 // content copied from files here instead (-X)
+    uint64_t relayed;               // bytes passed on to the next hop (-R)
+    uint64_t relay_missed;          // files stored here that the next hop never acknowledged
+    uint64_t served;                // file content sent to downloads (-G)
+    uint64_t gets;                  // ranges requested by downloads and found
+    uint64_t file_opens;            // files opened for downloads (not found open in the cache)
+    uint64_t shaped_ns;             // time connections waited for their turn under the rate limits
+    uint64_t conns;                 // connections accepted
+    uint64_t open;                  // connections open now
+    struct hist hist[STATS_NHIST];
+};
+
+static inline void stat_add(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now_ns(void);
+
+void hist_add(struct hist *h, uint64_t ns);
+
+// Sum of n sets as Prometheus text exposition format; active is the number
+// of uploads in progress
+void stats_write(FILE *f, struct stats *const *sets, int n, int active);
+
+#endif // LANDROP_STATS_H
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include "tls.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef LANDROP_TLS
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+// The suites the kernel can take over, AES-GCM first: OpenSSL and the
+// kernel both use AES-NI (or the ARMv8 crypto extensions) for it
+#define TLS_SUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS_PSK_IDENTITY "landrop"
+#define TLS_PSK_MIN 16
+#define TLS_PSK_MAX 256
+
+struct tls_ctx {
+    SSL_CTX *ssl;
+    bool server;
+    unsigned char psk[TLS_PSK_MAX];
+    size_t psk_len;             // 0 unless --psk
+    char *host;
+};
+
+struct tls_conn {
+    SSL *ssl;
+    int fd;
+    bool done;                  // handshake finished
+    bool want_write;
+    bool ktx, krx;              // the kernel has the records of that direction
+    bool psk;
+    // Application traffic secrets from the key log, client's then server's,
+    // kept until the handshake is over
+    unsigned char secret[2][EVP_MAX_MD_SIZE];
+    size_t secret_len[2];
+};
+
+static void tls_error(const char *what) {
+    unsigned long e = ERR_get_error();
+    if (e) {
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        fprintf(stderr, "%s: %s\n", what, buf);
+    } else {
+        fprintf(stderr, "%s\n", what);
+    }
+    ERR_clear_error();
+}
+
+// OpenSSL has no call for the traffic secrets of TLS 1.3; it does hand them
+// to a key log, which is where the kernel's keys come from
+static void keylog(const SSL *ssl, const char *line) {
+    struct tls_conn *t = (struct tls_conn *)SSL_get_app_data(ssl);
+    int which;
+    if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0)
+        which = 0;
+    else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0)
+        which = 1;
+    else
+        return;
+    const char *hex = strrchr(line, ' ') + 1;
+    size_t n = strlen(hex) / 2;
+    if (!t || n > sizeof(t->secret[0]))
+        return;
+    for (size_t i = 0; i < n; i++) {
+        unsigned v;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+            return;
+        t->secret[which][i] = (unsigned char)v;
+    }
+    t->secret_len[which] = n;
+}
+
+static unsigned int psk_client(SSL *ssl, const char *hint, char *identity, unsigned int max_identity,
+                               unsigned char *psk, unsigned int max_psk) {
+    (void)hint;
+    const struct tls_ctx *ctx = (const struct tls_ctx *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (max_identity < sizeof(TLS_PSK_IDENTITY) || ctx->psk_len > max_psk)
+        return 0;
+    memcpy(identity, TLS_PSK_IDENTITY, sizeof(TLS_PSK_IDENTITY));
+    memcpy(psk, ctx->psk, ctx->psk_len);
+    return (unsigned int)ctx->psk_len;
+}
+
+static unsigned int psk_server(SSL *ssl, const char *identity, unsigned char *psk, unsigned int max_psk) {
+    const struct tls_ctx *ctx = (const struct tls_ctx *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (!identity || strcmp(identity, TLS_PSK_IDENTITY) != 0 || ctx->psk_len > max_psk)
+        return 0;
+    memcpy(psk, ctx->psk, ctx->psk_len);
+    return (unsigned int)ctx->psk_len;
+}
+
+// The key file's bytes, trailing whitespace (a newline from echo) cut off
+static bool load_psk(struct tls_ctx *ctx, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t n = fread(ctx->psk, 1, sizeof(ctx->psk), f);
+    bool more = fgetc(f) != EOF;
+    fclose(f);
+    while (n > 0 && (ctx->psk[n - 1] == '\n' || ctx->psk[n - 1] == '\r' || ctx->psk[n - 1] == ' ' ||
+                     ctx->psk[n - 1] == '\t'))
+        n--;
+    if (more || n < TLS_PSK_MIN) {
+        fprintf(stderr, "%s: a key needs %d to %d bytes\n", path, TLS_PSK_MIN, TLS_PSK_MAX);
+        OPENSSL_cleanse(ctx->psk, sizeof(ctx->psk));
+        return false;
+    }
+    ctx->psk_len = n;
+    return true;
+}
+
+struct tls_ctx *tls_ctx_new(bool server, const struct tls_opts *o) {
+    if (o->psk && (o->cert || o->key || o->ca)) {
+        fprintf(stderr, "A pre-shared key replaces certificates, give one or the other\n");
+        return NULL;
+    }
+    if (server && !o->psk && (!o->cert || !o->key)) {
+        fprintf(stderr, "TLS needs a certificate and its key (or a pre-shared key)\n");
+        return NULL;
+    }
+    if (!o->cert != !o->key) {
+        fprintf(stderr, "A certificate goes with its key, give both\n");
+        return NULL;
+    }
+    struct tls_ctx *ctx = (struct tls_ctx *)calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    ctx->server = server;
+    if (o->psk && !load_psk(ctx, o->psk)) {
+        free(ctx);
+        return NULL;
+    }
+    SSL_CTX *s = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    ctx->ssl = s;
+    if (!s || !SSL_CTX_set_min_proto_version(s, TLS1_3_VERSION) || !SSL_CTX_set_ciphersuites(s, TLS_SUITES)) {
+        tls_error("Cannot set up TLS");
+        tls_ctx_free(ctx);
+        return NULL;
+    }
+    // No tickets or resumption: every connection does a full handshake,
+    // and nothing but our own data follows it
+    SSL_CTX_set_num_tickets(s, 0);
+    SSL_CTX_set_session_cache_mode(s, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(s, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(s, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    SSL_CTX_set_mode(s, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_keylog_callback(s, keylog);
+    SSL_CTX_set_app_data(s, ctx);
+    if (o->psk) {
+        if (server)
+            SSL_CTX_set_psk_server_callback(s, psk_server);
+        else
+            SSL_CTX_set_psk_client_callback(s, psk_client);
+        SSL_CTX_set_verify(s, SSL_VERIFY_NONE, NULL);
+        return ctx;
+    }
+    if (o->cert && (SSL_CTX_use_certificate_chain_file(s, o->cert) != 1 ||
+                    SSL_CTX_use_PrivateKey_file(s, o->key, SSL_FILETYPE_PEM) != 1 ||
+                    SSL_CTX_check_private_key(s) != 1)) {
+        tls_error(o->cert);
+        tls_ctx_free(ctx);
+        return NULL;
+    }
+    if (server) {
+        // With CAs, clients have to show a certificate from one of them
+        if (o->ca) {
+            STACK_OF(X509_NAME) *names = SSL_load_client_CA_file(o->ca);
+            if (!names || SSL_CTX_load_verify_locations(s, o->ca, NULL) != 1) {
+                tls_error(o->ca);
+                tls_ctx_free(ctx);
+                return NULL;
+            }
+            SSL_CTX_set_client_CA_list(s, names);
+            SSL_CTX_set_verify(s, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+        }
+    } else {
+        if ((o->ca ? SSL_CTX_load_verify_locations(s, o->ca, NULL) : SSL_CTX_set_default_verify_paths(s)) != 1) {
+            tls_error(o->ca ? o->ca : "Cannot load the system's CAs");
+            tls_ctx_free(ctx);
+            return NULL;
+        }
+        SSL_CTX_set_verify(s, SSL_VERIFY_PEER, NULL);
+        if (o->host && !(ctx->host = strdup(o->host))) {
+            tls_ctx_free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+void tls_ctx_free(struct tls_ctx *ctx) {
+    if (!ctx)
+        return;
+    SSL_CTX_free(ctx->ssl);
+    OPENSSL_cleanse(ctx->psk, sizeof(ctx->psk));
+    free(ctx->host);
+    free(ctx);
+}
+
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd) {
+    struct tls_conn *t = (struct tls_conn *)calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->fd = fd;
+    t->psk = ctx->psk_len > 0;
+    t->ssl = SSL_new(ctx->ssl);
+    if (!t->ssl || !SSL_set_fd(t->ssl, fd)) {
+        tls_error("Cannot set up TLS");
+        tls_conn_free(t);
+        return NULL;
+    }
+    SSL_set_app_data(t->ssl, t);
+    if (ctx->server) {
+        SSL_set_accept_state(t->ssl);
+    } else {
+        SSL_set_connect_state(t->ssl);
+        if (ctx->host) {
+            // An address is checked against the certificate's IP entries, a
+            // name against its DNS names (and sent as SNI)
+            unsigned char addr[16];
+            bool ip = inet_pton(AF_INET, ctx->host, addr) == 1 || inet_pton(AF_INET6, ctx->host, addr) == 1;
+            int ok = ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), ctx->host)
+                        : SSL_set1_host(t->ssl, ctx->host) && SSL_set_tlsext_host_name(t->ssl, ctx->host);
+            if (!ok) {
+                tls_error(ctx->host);
+                tls_conn_free(t);
+                return NULL;
+            }
+        }
+    }
+    return t;
+}
+
+void tls_conn_free(struct tls_conn *t) {
+    if (!t)
+        return;
+    // No close_notify: the LFT protocols end their sessions themselves, and
+    // a kernel that has the records would not know what to do with one
+    SSL_free(t->ssl);
+    OPENSSL_cleanse(t->secret, sizeof(t->secret));
+    free(t);
+}
+
+// HKDF-Expand-Label(secret, label, "", n) of RFC 8446 7.1, for n no longer
+// than the hash: a single HMAC block
+static bool expand_label(const EVP_MD *md, const unsigned char *secret, size_t len, const char *label,
+                         unsigned char *out, size_t n) {
+    unsigned char info[64];
+    size_t ll = strlen("tls13 ") + strlen(label);
+    info[0] = 0;
+    info[1] = (unsigned char)n;
+    info[2] = (unsigned char)ll;
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, strlen(label));
+    info[3 + ll] = 0;           // no context
+    info[4 + ll] = 1;           // block counter
+    unsigned char block[EVP_MAX_MD_SIZE];
+    unsigned int bl = 0;
+    if (!HMAC(md, secret, (int)len, info, 5 + ll, block, &bl) || bl < n)
+        return false;
+    memcpy(out, block, n);
+    OPENSSL_cleanse(block, sizeof(block));
+    return true;
+}
+
+// Hand one direction's records to the kernel: dir is TLS_TX or TLS_RX,
+// secret the traffic secret of whoever sends in that direction
+static bool ktls_dir(struct tls_conn *t, int dir, const unsigned char *secret, size_t len) {
+    const SSL_CIPHER *c = SSL_get_current_cipher(t->ssl);
+    uint16_t suite = c ? SSL_CIPHER_get_protocol_id(c) : 0;
+    const EVP_MD *md = suite == 0x1302 ? EVP_sha384() : EVP_sha256();
+    size_t keylen = suite == 0x1301 ? 16 : 32;
+    unsigned char key[32], iv[12];
+    if (len == 0 || !expand_label(md, secret, len, "key", key, keylen) || !expand_label(md, secret, len, "iv", iv, 12))
+        return false;
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } ci;
+    memset(&ci, 0, sizeof(ci));
+    socklen_t size;
+    // The record sequence starts over at 0 with the traffic keys; AES-GCM
+    // splits the 12 byte IV into a fixed salt and the part XORed with it
+    switch (suite) {
+    case 0x1301:
+        ci.gcm128.info.version = TLS_1_3_VERSION;
+        ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci.gcm128.key, key, 16);
+        memcpy(ci.gcm128.salt, iv, 4);
+        memcpy(ci.gcm128.iv, iv + 4, 8);
+        size = sizeof(ci.gcm128);
+        break;
+    case 0x1302:
+        ci.gcm256.info.version = TLS_1_3_VERSION;
+        ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci.gcm256.key, key, 32);
+        memcpy(ci.gcm256.salt, iv, 4);
+        memcpy(ci.gcm256.iv, iv + 4, 8);
+        size = sizeof(ci.gcm256);
+        break;
+    case 0x1303:
+        ci.chacha.info.version = TLS_1_3_VERSION;
+        ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(ci.chacha.key, key, 32);
+        memcpy(ci.chacha.iv, iv, 12);
+        size = sizeof(ci.chacha);
+        break;
+    default:
+        return false;
+    }
+    bool ok = setsockopt(t->fd, SOL_TLS, dir, &ci, size) == 0;
+    OPENSSL_cleanse(&ci, sizeof(ci));
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return ok;
+}
+
+// Right after the handshake, before either side has sent a record with the
+// traffic keys. A socket with the tls ULP but no keys for a direction just
+// passes that direction through, so each one is tried on its own.
+static void ktls_start(struct tls_conn *t) {
+    if (setsockopt(t->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+        return;
+    bool server = SSL_is_server(t->ssl);
+    t->ktx = ktls_dir(t, TLS_TX, t->secret[server], t->secret_len[server]);
+    // Records OpenSSL read ahead of the kernel would be lost to it
+    if (!SSL_has_pending(t->ssl))
+        t->krx = ktls_dir(t, TLS_RX, t->secret[!server], t->secret_len[!server]);
+}
+
+int tls_handshake(struct tls_conn *t) {
+    if (t->done)
+        return 1;
+    ERR_clear_error();
+    int r = SSL_do_handshake(t->ssl);
+    if (r == 1) {
+        t->done = true;
+        t->want_write = false;
+        ktls_start(t);
+        OPENSSL_cleanse(t->secret, sizeof(t->secret));
+        return 1;
+    }
+    int e = SSL_get_error(t->ssl, r);
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE) {
+        t->want_write = e == SSL_ERROR_WANT_WRITE;
+        return 0;
+    }
+    long v = SSL_get_verify_result(t->ssl);
+    if (v != X509_V_OK) {
+        fprintf(stderr, "TLS handshake failed: %s\n", X509_verify_cert_error_string(v));
+        ERR_clear_error();
+    } else if (e == SSL_ERROR_SYSCALL && ERR_peek_error() == 0) {
+        fprintf(stderr, "TLS handshake failed: %s\n", errno ? strerror(errno) : "connection closed");
+    } else {
+        tls_error("TLS handshake failed");
+    }
+    return -1;
+}
+
+bool tls_want_write(const struct tls_conn *t) {
+    return t->want_write;
+}
+
+// Map an OpenSSL failure on the records to what read() and send() say
+static ssize_t tls_fail(struct tls_conn *t, int r) {
+    int e = SSL_get_error(t->ssl, r);
+    switch (e) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (ERR_peek_error() == 0) {
+            if (errno == 0)
+                return 0;
+            return -1;
+        }
+        // fall through
+    default:
+        ERR_clear_error();
+        errno = EBADMSG;
+        return -1;
+    }
+}
+
+ssize_t tls_read(struct tls_conn *t, void *buf, size_t n) {
+    if (t->krx)
+        return read(t->fd, buf, n);
+    if (n == 0)
+        return 0;
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_read(t->ssl, buf, n > INT_MAX ? INT_MAX : (int)n);
+    return r > 0 ? r : tls_fail(t, r);
+}
+
+ssize_t tls_write(struct tls_conn *t, const void *buf, size_t n, bool more) {
+    if (t->ktx)
+        return send(t->fd, buf, n, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (n == 0)
+        return 0;
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_write(t->ssl, buf, n > INT_MAX ? INT_MAX : (int)n);
+    return r > 0 ? r : tls_fail(t, r);
+}
+
+size_t tls_pending(const struct tls_conn *t) {
+    if (t->krx)
+        return 0;
+    int n = SSL_pending(t->ssl);
+    return n > 0 ? (size_t)n : 0;
+}
+
+bool tls_kernel_tx(const struct tls_conn *t) {
+    return t->ktx;
+}
+
+bool tls_kernel_rx(const struct tls_conn *t) {
+    return t->krx;
+}
+
+void tls_describe(const struct tls_conn *t, char *out, size_t n) {
+    const char *where = t->ktx && t->krx ? "kernel TLS"
+                        : t->ktx         ? "kernel TLS for sending"
+                        : t->krx         ? "kernel TLS for receiving"
+                                         : "records in userspace";
+    snprintf(out, n, "%s %s%s, %s", SSL_get_version(t->ssl), SSL_get_cipher_name(t->ssl),
+             t->psk ? " with a pre-shared key" : "", where);
+}
+
+#else // !LANDROP_TLS
+
+struct tls_ctx *tls_ctx_new(bool server, const struct tls_opts *o) {
+    (void)server;
+    (void)o;
+    fprintf(stderr, "This landrop was built without TLS (make TLS=1)\n");
+    return NULL;
+}
+
+void tls_ctx_free(struct tls_ctx *ctx) {
+    (void)ctx;
+}
+
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd) {
+    (void)ctx;
+    (void)fd;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void tls_conn_free(struct tls_conn *t) {
+    (void)t;
+}
+
+int tls_handshake(struct tls_conn *t) {
+    (void)t;
+    return -1;
+}
+
+bool tls_want_write(const struct tls_conn *t) {
+    (void)t;
+    return false;
+}
+
+ssize_t tls_read(struct tls_conn *t, void *buf, size_t n) {
+    (void)t;
+    (void)buf;
+    (void)n;
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t tls_write(struct tls_conn *t, const void *buf, size_t n, bool more) {
+    (void)t;
+    (void)buf;
+    (void)n;
+    (void)more;
+    errno = ENOSYS;
+    return -1;
+}
+
+size_t tls_pending(const struct tls_conn *t) {
+    (void)t;
+    return 0;
+}
+
+bool tls_kernel_tx(const struct tls_conn *t) {
+    (void)t;
+    return false;
+}
+
+bool tls_kernel_rx(const struct tls_conn *t) {
+    (void)t;
+    return false;
+}
+
+void tls_describe(const struct tls_conn *t, char *out, size_t n) {
+    (void)t;
+    snprintf(out, n, "no TLS");
+}
+
+#endif // LANDROP_TLS
@@ -0,0 +1,67 @@
+#ifndef LANDROP_TLS_H
+#define LANDROP_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// TLS around the LFT connections (--tls, --psk). OpenSSL does the TLS 1.3
+// handshake in userspace; the record layer then goes to the kernel (kTLS)
+// wherever it can take it, with the traffic keys derived from the
+// handshake's secrets. The socket then carries plaintext for us as before:
+// sendfile(), splice() and io_uring keep working, and the kernel encrypts
+// with AES-GCM on the CPU's AES instructions. A kernel without kTLS (or
+// without it for one direction) leaves those records to OpenSSL, which
+// costs a copy through userspace.
+// Built without OpenSSL (make TLS=0), tls_ctx_new() fails with a message.
+
+struct tls_ctx;
+struct tls_conn;
+
+struct tls_opts {
+    const char *cert;           // PEM certificate chain of this side
+    const char *key;            // its private key
+    const char *ca;             // PEM CAs the peer's certificate must chain to
+                                // (client: NULL for the system's)
+    const char *psk;            // file with a key shared by both sides, instead
+                                // of certificates
+    const char *host;           // client: name (or address) the server's
+                                // certificate must be for
+};
+
+// Settings for every connection of one side. NULL (message on stderr) if
+// the files cannot be loaded.
+struct tls_ctx *tls_ctx_new(bool server, const struct tls_opts *o);
+void tls_ctx_free(struct tls_ctx *ctx);
+
+// TLS state for the connected socket fd, blocking or not. The fd stays the
+// caller's to close. NULL if memory runs out.
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd);
+void tls_conn_free(struct tls_conn *t);
+
+// Take the handshake as far as the socket allows: 1 once it is done (and
+// the records handed to the kernel if it can take them), 0 if it has to
+// wait for the socket (for writing if tls_want_write()), -1 if it failed
+// (message on stderr). A blocking socket never gets 0.
+int tls_handshake(struct tls_conn *t);
+bool tls_want_write(const struct tls_conn *t);
+
+// read() and send() through the connection, errno EAGAIN where the socket
+// would block. With more, the kernel may hold the data back to fill a
+// record (MSG_MORE).
+ssize_t tls_read(struct tls_conn *t, void *buf, size_t n);
+ssize_t tls_write(struct tls_conn *t, const void *buf, size_t n, bool more);
+
+// Plaintext OpenSSL decrypted already and tls_read() has not returned yet:
+// the socket may have nothing left to wake anybody up for it
+size_t tls_pending(const struct tls_conn *t);
+
+// Whether the kernel has the records of each direction, so the socket can
+// be written to (sendfile) or read from (splice, io_uring) directly
+bool tls_kernel_tx(const struct tls_conn *t);
+bool tls_kernel_rx(const struct tls_conn *t);
+
+// "TLS 1.3 TLS_AES_128_GCM_SHA256, kernel TLS" and the like
+void tls_describe(const struct tls_conn *t, char *out, size_t n);
+
+#endif // LANDROP_TLS_H
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include "tune.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>  // the full struct tcp_info; netinet/tcp.h lags behind
+#include <netinet/in.h>
+
+#include "common.h"
+
+// Set a buffer size, above net.core.[rw]mem_max if we are allowed to
+static void set_buf(int fd, int opt, int force_opt, int bytes, const char *what) {
+    if (setsockopt(fd, SOL_SOCKET, force_opt, &bytes, sizeof(bytes)) == 0)
+        return;
+    if (setsockopt(fd, SOL_SOCKET, opt, &bytes, sizeof(bytes)) < 0) {
+        perror(what);
+        return;
+    }
+    int got = 0;
+    socklen_t len = sizeof(got);
+    // The kernel reports twice what it grants (bookkeeping overhead)
+    if (getsockopt(fd, SOL_SOCKET, opt, &got, &len) == 0 && got / 2 < bytes) {
+        char want[32], have[32];
+        human_bytes((double)bytes, want, sizeof(want));
+        human_bytes((double)got / 2, have, sizeof(have));
+        fprintf(stderr, "%s: asked for %s, the kernel capped it at %s (raise net.core.%s)\n", what, want, have,
+                opt == SO_SNDBUF ? "wmem_max" : "rmem_max");
+    }
+}
+
+void tune_apply(int fd, const struct sock_tune *t) {
+    if (t->sndbuf > 0)
+        set_buf(fd, SO_SNDBUF, SO_SNDBUFFORCE, t->sndbuf, "SO_SNDBUF");
+    if (t->rcvbuf > 0)
+        set_buf(fd, SO_RCVBUF, SO_RCVBUFFORCE, t->rcvbuf, "SO_RCVBUF");
+    if (t->lowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->lowat, sizeof(t->lowat)) < 0)
+        perror("TCP_NOTSENT_LOWAT");
+    if (t->cc[0] && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->cc, (socklen_t)strlen(t->cc)) < 0) {
+        int e = errno;
+        fprintf(stderr, "TCP_CONGESTION %s: %s\n", t->cc, strerror(e));
+    }
+}
+
+int tune_measure(int fd, struct tune_probe *p) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+        return -1;
+    // min_rtt and the limit times are newer than the rest of the struct;
+    // on kernels without them len stops short and they read as zero
+    p->rtt = (double)(ti.tcpi_min_rtt ? ti.tcpi_min_rtt : ti.tcpi_rtt) / 1e6;
+    p->sndbuf_limited = ti.tcpi_busy_time ? (double)ti.tcpi_sndbuf_limited / (double)ti.tcpi_busy_time : 0;
+    p->rwnd_limited = ti.tcpi_busy_time ? (double)ti.tcpi_rwnd_limited / (double)ti.tcpi_busy_time : 0;
+    int sb = 0;
+    len = sizeof(sb);
+    p->sndbuf = getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sb, &len) == 0 ? sb / 2 : 0;
+    return 0;
+}
+
+// Third field of a "min default max" sysctl such as net.ipv4.tcp_wmem
+static long sysctl_max(const char *path) {
+    FILE *f = fopen(path, "r");
+    long lo = 0, def = 0, hi = 0;
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld %ld", &lo, &def, &hi) != 3)
+        hi = 0;
+    fclose(f);
+    return hi;
+}
+
+static int cc_available(const char *name) {
+    char line[512];
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_available_congestion_control", "r");
+    if (!f)
+        return 0;
+    int found = 0;
+    if (fgets(line, sizeof(line), f)) {
+        for (char *tok = strtok(line, " \n"); tok; tok = strtok(NULL, " \n"))
+            found |= strcmp(tok, name) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+static size_t clamp_size(double v, size_t lo, size_t hi) {
+    return v < (double)lo ? lo : v > (double)hi ? hi : (size_t)v;
+}
+
+// The send buffer has to hold what is in flight (one bandwidth-delay
+// product) plus room for the window to grow and for retransmissions: twice
+// the BDP. The kernel autotunes it up to the tcp_wmem maximum, so a size is
+// only set when that is not enough, or when the buffer visibly was the limit
+// during the probe. Unsent data is capped at about 10 ms worth, which is
+// plenty to cover the sender's scheduling gaps without queueing seconds of
+// data behind the acks. Long paths get BBR where the kernel has it: it does
+// not mistake random loss for congestion. The copy loop moves a quarter of a
+// BDP per call, between 64 KiB and 1 MiB.
+void tune_choose(const struct tune_probe *p, struct sock_tune *t, size_t *chunk) {
+    double bdp = p->rate * p->rtt;
+    if (t->sndbuf == 0 && p->rate > 0) {
+        long autotune = sysctl_max("/proc/sys/net/ipv4/tcp_wmem");
+        if (2 * bdp > (double)autotune)
+            t->sndbuf = (int)clamp_size(2 * bdp, 64 * 1024, TUNE_MAX_BUF);
+        else if (p->sndbuf_limited > 0.2 && p->sndbuf > 0)
+            t->sndbuf = (int)clamp_size(4.0 * p->sndbuf, 64 * 1024, TUNE_MAX_BUF);
+    }
+    if (t->lowat == 0 && p->rate > 0)
+        t->lowat = (int)clamp_size(p->rate * 0.010, 128 * 1024, 16 * 1024 * 1024);
+    if (t->cc[0] == '\0' && p->rtt >= 0.010 && cc_available("bbr"))
+        strcpy(t->cc, "bbr");
+    if (chunk && p->rate > 0) {
+        size_t c = 64 * 1024;
+        while (c < 1024 * 1024 && (double)c * 4 < bdp)
+            c *= 2;
+        *chunk = c;
+    }
+}
+
+void tune_describe(int fd, char *out, size_t n) {
+    int sb = 0, rb = 0, lowat = 0;
+    char cc[16] = "?", sbs[32], rbs[32], lws[32] = "off";
+    socklen_t len = sizeof(sb);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sb, &len);
+    len = sizeof(rb);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rb, &len);
+    len = sizeof(lowat);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &len) == 0 && lowat > 0 && lowat != -1)
+        human_bytes((double)lowat, lws, sizeof(lws));
+    len = sizeof(cc) - 1;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc, &len) == 0)
+        cc[len < sizeof(cc) ? len : sizeof(cc) - 1] = '\0';
+    cc[strcspn(cc, "\n")] = '\0';
+    human_bytes((double)sb / 2, sbs, sizeof(sbs));
+    human_bytes((double)rb / 2, rbs, sizeof(rbs));
+    snprintf(out, n, "sndbuf %s, rcvbuf %s, notsent_lowat %s, cc %s", sbs, rbs, lws, cc);
+}
+
+int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s || errno != 0)
+        return -1;
+    unsigned shift = 0;
+    if (*end) {
+        switch (*end) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+            default: return -1;
+        }
+        if (end[1] != '\0' && strcasecmp(end + 1, "ib") != 0 && strcasecmp(end + 1, "b") != 0)
+            return -1;
+    }
+    if (v > (UINT64_MAX >> shift))
+        return -1;
+    *out = (uint64_t)v << shift;
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef LANDROP_TUNE_H
+#define LANDROP_TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Socket tuning. Zero or empty fields keep the kernel's choice; note that
+// setting a buffer size turns off the kernel's autotuning of that buffer.
+struct sock_tune {
+    int sndbuf;             // SO_SNDBUF bytes
+    int rcvbuf;             // SO_RCVBUF bytes
+    int lowat;              // TCP_NOTSENT_LOWAT: unsent bytes the kernel may queue
+    char cc[16];            // TCP_CONGESTION algorithm
+};
+
+// Largest buffer tune_choose() asks for
+#define TUNE_MAX_BUF (256 * 1024 * 1024)
+
+// Apply t to a socket, before connect() or listen() so that the buffer
+// sizes shape the window scale. Sizes above the sysctl limits are forced
+// where the process may (CAP_NET_ADMIN); whatever the kernel refuses is
+// reported and left as it was.
+void tune_apply(int fd, const struct sock_tune *t);
+
+// What is known about a connection's path
+struct tune_probe {
+    double rtt;             // smallest RTT seen, seconds
+    double rate;            // measured goodput, bytes/s; 0 if not measured
+    double sndbuf_limited;  // share of the time sending that the send buffer,
+    double rwnd_limited;    // or the receiver's window, was the limit
+    int sndbuf;             // send buffer the socket has now
+};
+
+// Fill in everything but rate from TCP_INFO. Returns 0 or -1.
+int tune_measure(int fd, struct tune_probe *p);
+
+// Settings for a measured path, sized from its bandwidth-delay product;
+// also the copy buffer size for *chunk. Fields already set in t are kept.
+void tune_choose(const struct tune_probe *p, struct sock_tune *t, size_t *chunk);
+
+// The socket's current settings, e.g. "sndbuf 4.0 MiB, notsent_lowat off, cc cubic"
+void tune_describe(int fd, char *out, size_t n);
+
+// "65536", "256k", "4M", "1G". Returns 0, or -1 if s is not a size.
+int parse_size(const char *s, uint64_t *out);
+
+#endif // LANDROP_TUNE_H
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The kernel reads the SQ tail and writes the CQ tail concurrently with us:
+// acquire what it published, release what we publish
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = -1;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return -1;
+    r->fd = fd;
+    r->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // Older kernels map the two rings separately
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_sz > r->sq_map_sz)
+            r->sq_map_sz = r->cq_map_sz;
+        r->cq_map_sz = 0;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    r->cq_map = r->sq_map;
+    if (r->cq_map_sz) {
+        r->cq_map = mmap(NULL, r->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+    char *sq = (char *)r->sq_map;
+    char *cq = (char *)r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->features = p.features;
+    return 0;
+fail:
+    {
+        int e = errno;
+        uring_exit(r);
+        errno = e;
+    }
+    return -1;
+}
+
+void uring_exit(struct uring *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_sz);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_sz);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_sz);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    unsigned tail = *r->sq_tail + r->pending;
+    if (tail - load_acquire(r->sq_head) >= r->sq_entries)
+        return NULL;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->pending++;
+    return sqe;
+}
+
+unsigned uring_sq_space(const struct uring *r) {
+    return r->sq_entries - (*r->sq_tail + r->pending - load_acquire(r->sq_head));
+}
+
+int uring_submit(struct uring *r) {
+    unsigned n = r->pending;
+    if (n == 0)
+        return 0;
+    store_release(r->sq_tail, *r->sq_tail + n);
+    r->pending = 0;
+    while (n > 0) {
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, n, 0, 0, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        n -= (unsigned)rc;
+    }
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == load_acquire(r->cq_tail))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+    store_release(r->cq_head, *r->cq_head + 1);
+}
+
+int uring_register(struct uring *r, unsigned opcode, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, r->fd, opcode, arg, nr);
+}
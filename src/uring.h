@@ -0,0 +1,43 @@
+#ifndef LANDROP_URING_H
+#define LANDROP_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// Minimal io_uring ring on the raw syscalls (no liburing): one submission
+// and one completion queue, filled and reaped by a single thread.
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_sz, cq_map_sz, sqes_sz;
+    unsigned sq_entries;
+    unsigned features;          // IORING_FEAT_* the kernel reported
+    unsigned pending;           // sqes handed out since the last submit
+};
+
+// Set up a ring with room for entries submissions. Returns 0, or -1 with
+// errno set (ENOSYS on kernels without io_uring, EPERM where it is disabled).
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+// Next free submission entry, zeroed, or NULL if the queue is full
+struct io_uring_sqe *uring_sqe(struct uring *r);
+
+// Submission entries uring_sqe() can still hand out
+unsigned uring_sq_space(const struct uring *r);
+
+// Hand the entries from uring_sqe() to the kernel. Returns 0 or -1.
+int uring_submit(struct uring *r);
+
+// Oldest unseen completion, or NULL; uring_cqe_seen() releases it
+struct io_uring_cqe *uring_peek(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+// io_uring_register(2)
+int uring_register(struct uring *r, unsigned opcode, const void *arg, unsigned nr);
+
+#endif // LANDROP_URING_H
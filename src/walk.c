@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "walk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Directories waiting to be listed, by path relative to the root rather
+// than as open fds: a wide tree would otherwise hold thousands of
+// descriptors while they wait. Each one is opened with openat() on the root
+// when its turn comes; its entries are then examined relative to its own fd.
+struct dir_item {
+    struct dir_item *next;
+    char path[];
+};
+
+struct walk {
+    int rootfd;
+    pthread_mutex_t lock;
+    pthread_cond_t dirs_cv;     // a directory was queued, or the walk ended
+    pthread_cond_t files_cv;    // a file was queued, or the walk ended
+    pthread_cond_t space_cv;    // room in the file queue, or cancelled
+    struct dir_item *dirs;      // a stack, so the walk goes depth first
+    int busy;                   // walkers listing a directory right now
+    bool finished;              // no directory left and no walker busy
+    bool cancelled;
+    char **files;               // ring of cap paths
+    size_t cap, head, count;
+    _Atomic uint64_t found;
+    _Atomic int errors;
+    int nthreads;
+    pthread_t *threads;
+};
+
+static void walk_error(struct walk *w, const char *path, const char *what) {
+    int e = errno;
+    fprintf(stderr, "%s %s: %s\n", what, path[0] ? path : ".", strerror(e));
+    atomic_fetch_add(&w->errors, 1);
+}
+
+// Called with the lock held
+static int push_dir(struct walk *w, const char *path, size_t len) {
+    struct dir_item *d = (struct dir_item *)malloc(sizeof(*d) + len + 1);
+    if (!d)
+        return -1;
+    memcpy(d->path, path, len + 1);
+    d->next = w->dirs;
+    w->dirs = d;
+    pthread_cond_signal(&w->dirs_cv);
+    return 0;
+}
+
+// Returns -1 if the walk was cancelled while waiting for room
+static int push_file(struct walk *w, const char *path, size_t len) {
+    char *p = strndup(path, len);
+    if (!p) {
+        walk_error(w, path, "queue");
+        return 0;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->cap && !w->cancelled)
+        pthread_cond_wait(&w->space_cv, &w->lock);
+    if (w->cancelled) {
+        pthread_mutex_unlock(&w->lock);
+        free(p);
+        return -1;
+    }
+    w->files[(w->head + w->count) % w->cap] = p;
+    w->count++;
+    atomic_fetch_add(&w->found, 1);
+    pthread_cond_signal(&w->files_cv);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static void list_dir(struct walk *w, const char *rel) {
+    int fd = openat(w->rootfd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        walk_error(w, rel, "open directory");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    size_t rlen = strlen(rel);
+    char path[PATH_MAX];
+    memcpy(path, rel, rlen);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            // Not every filesystem fills in d_type, and symlinks are followed
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, 0) != 0) {
+                walk_error(w, name, "stat");
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG)
+            continue;
+        size_t nlen = strlen(name);
+        size_t len = rlen ? rlen + 1 + nlen : nlen;
+        if (len >= sizeof(path)) {
+            errno = ENAMETOOLONG;
+            walk_error(w, name, "skip");
+            continue;
+        }
+        if (rlen)
+            path[rlen] = '/';
+        memcpy(path + (rlen ? rlen + 1 : 0), name, nlen + 1);
+        if (type == DT_REG) {
+            if (push_file(w, path, len) < 0)
+                break;
+            continue;
+        }
+        pthread_mutex_lock(&w->lock);
+        int rc = push_dir(w, path, len);
+        pthread_mutex_unlock(&w->lock);
+        if (rc < 0)
+            walk_error(w, path, "queue");
+    }
+    closedir(dir);
+}
+
+static void *walker_main(void *arg) {
+    struct walk *w = (struct walk *)arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->dirs && !w->finished && !w->cancelled)
+            pthread_cond_wait(&w->dirs_cv, &w->lock);
+        if (!w->dirs || w->cancelled)
+            break;
+        struct dir_item *d = w->dirs;
+        w->dirs = d->next;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+        list_dir(w, d->path);
+        free(d);
+        pthread_mutex_lock(&w->lock);
+        // The last busy walker finding nothing queued ends the walk
+        if (--w->busy == 0 && !w->dirs) {
+            w->finished = true;
+            pthread_cond_broadcast(&w->dirs_cv);
+            pthread_cond_broadcast(&w->files_cv);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+struct walk *walk_start(const char *root, int nthreads, size_t queue_len) {
+    struct walk *w = (struct walk *)calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+    w->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    w->cap = queue_len;
+    w->files = (char **)calloc(queue_len, sizeof(char *));
+    w->threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+    if (w->rootfd < 0 || !w->files || !w->threads) {
+        int e = errno;
+        if (w->rootfd >= 0)
+            close(w->rootfd);
+        free(w->files);
+        free(w->threads);
+        free(w);
+        errno = e;
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->dirs_cv, NULL);
+    pthread_cond_init(&w->files_cv, NULL);
+    pthread_cond_init(&w->space_cv, NULL);
+    atomic_init(&w->found, 0);
+    atomic_init(&w->errors, 0);
+    if (push_dir(w, "", 0) < 0) {
+        walk_finish(w);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (; w->nthreads < nthreads; ++w->nthreads) {
+        int rc = pthread_create(&w->threads[w->nthreads], NULL, walker_main, w);
+        if (rc != 0) {
+            if (w->nthreads > 0)
+                break;
+            walk_finish(w);
+            errno = rc;
+            return NULL;
+        }
+    }
+    return w;
+}
+
+char *walk_next(struct walk *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->count == 0 && !w->finished && !w->cancelled)
+        pthread_cond_wait(&w->files_cv, &w->lock);
+    char *p = NULL;
+    if (w->count > 0 && !w->cancelled) {
+        p = w->files[w->head];
+        w->head = (w->head + 1) % w->cap;
+        w->count--;
+        pthread_cond_signal(&w->space_cv);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return p;
+}
+
+int walk_rootfd(const struct walk *w) {
+    return w->rootfd;
+}
+
+uint64_t walk_found(struct walk *w) {
+    return atomic_load(&w->found);
+}
+
+bool walk_done(struct walk *w) {
+    pthread_mutex_lock(&w->lock);
+    bool done = w->finished;
+    pthread_mutex_unlock(&w->lock);
+    return done;
+}
+
+void walk_cancel(struct walk *w) {
+    pthread_mutex_lock(&w->lock);
+    w->cancelled = true;
+    pthread_cond_broadcast(&w->dirs_cv);
+    pthread_cond_broadcast(&w->files_cv);
+    pthread_cond_broadcast(&w->space_cv);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int walk_finish(struct walk *w) {
+    walk_cancel(w);
+    for (int i = 0; i < w->nthreads; ++i)
+        pthread_join(w->threads[i], NULL);
+    while (w->dirs) {
+        struct dir_item *d = w->dirs;
+        w->dirs = d->next;
+        free(d);
+    }
+    for (; w->count > 0; w->count--, w->head = (w->head + 1) % w->cap)
+        free(w->files[w->head]);
+    int errors = atomic_load(&w->errors);
+    pthread_cond_destroy(&w->dirs_cv);
+    pthread_cond_destroy(&w->files_cv);
+    pthread_cond_destroy(&w->space_cv);
+    pthread_mutex_destroy(&w->lock);
+    close(w->rootfd);
+    free(w->files);
+    free(w->threads);
+    free(w);
+    return errors;
+}
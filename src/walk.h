@@ -0,0 +1,37 @@
+#ifndef LANDROP_WALK_H
+#define LANDROP_WALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Parallel directory walk. A few threads list the directories of a tree
+// at once and queue the regular files they find, as paths relative to the
+// root, for any number of consumers. The file queue is bounded, so the
+// walk runs at most that far ahead of whoever consumes it.
+
+struct walk;
+
+// Start walking root with nthreads threads and a queue of queue_len files.
+// Returns NULL (errno set) if root cannot be opened or threads not started.
+struct walk *walk_start(const char *root, int nthreads, size_t queue_len);
+
+// The next file (malloc'd relative path, caller frees), blocking while the
+// queue is empty. NULL once the walk is finished and the queue drained.
+char *walk_next(struct walk *w);
+
+// Directory the relative paths are relative to, for openat()
+int walk_rootfd(const struct walk *w);
+
+// Files found so far, and whether that is all of them
+uint64_t walk_found(struct walk *w);
+bool walk_done(struct walk *w);
+
+// Stop early: the walkers quit and walk_next() returns NULL
+void walk_cancel(struct walk *w);
+
+// Wait for the walkers and free everything. Returns how many entries could
+// not be read (they were reported on stderr and skipped).
+int walk_finish(struct walk *w);
+
+#endif // LANDROP_WALK_H